@@ -1,16 +1,18 @@
 import random
 from pathlib import Path
 from contextlib import contextmanager
-from typing import Callable, Any, List, Type, cast
+from typing import Callable, Any, BinaryIO, List, Type, cast
 from functools import wraps
 from backup_client.server_info import ServerInfo
 from backup_client.connection_manager import AbstractConnectionManager
 from backup_client.protocol import (
     ResponseParser, ProtocolRequest, ProtocolResponse,
     ListFilesRequest, ListFilesResponse,
-    BackupFileRequest, SuccessfulBackupOrDeleteResponse,
+    BackupFileRequest, ChunkedBackupFileRequest, SuccessfulBackupOrDeleteResponse,
     RestoreFileRequest, SuccessfulRestoreResponse,
+    RestoreFileCompressedRequest, SuccessfulCompressedRestoreResponse,
     DeleteFileRequest,
+    PROTOCOL_REVISIONS, version_has_request_id,
 )
 from backup_client.response_reader import ResponseReader
 
@@ -41,12 +43,17 @@ class Client:
 
     VERSION = 1
 
-    def __init__(self, server_info: ServerInfo, connection_manager: AbstractConnectionManager) -> None:
+    def __init__(self, server_info: ServerInfo, connection_manager: AbstractConnectionManager,
+                 version: int = VERSION) -> None:
+        if version not in PROTOCOL_REVISIONS:
+            raise ValueError(f"Unknown protocol version {version}")
         self.user_id = random.randint(self.MIN_USER_ID, self.MAX_USER_ID)
         self.server_info = server_info
         self.connection_manager = connection_manager
         self.response_reader = ResponseReader(self.connection_manager)
         self.is_connected = False
+        self.version = version
+        self.next_request_id = 1
 
     def connect(self) -> None:
         self.connection_manager.connect(self.server_info.to_tuple())
@@ -72,15 +79,20 @@ class Client:
             raise UnexpectedResponseException(response)
 
     def send_recv_message(self, request: ProtocolRequest, expected_response_type: Type[ProtocolResponse]) -> ProtocolResponse:
-        self.connection_manager.send(request.pack())
+        request.request_id = self.next_request_id
+        self.next_request_id += 1
+        for part in request.pack_parts():
+            self.connection_manager.send(part)
         response = ResponseParser.parse_message(self.response_reader)
         self.raise_if_unexpected_response(response, expected_response_type)
+        if version_has_request_id(self.version) and response.request_id != request.request_id:
+            raise UnexpectedResponseException(f"Response to request {response.request_id} instead of {request.request_id}")
         return response
 
     @ensure_connected
     def get_available_backup_files(self) -> List[str]:
         print(f"Getting available backup files")
-        request = ListFilesRequest(self.user_id, self.VERSION)
+        request = ListFilesRequest(self.user_id, self.version)
         response = self.send_recv_message(request, ListFilesResponse)
 
         # Just for type hints to work correctly
@@ -91,7 +103,7 @@ class Client:
     def backup_file(self, filepath: Path) -> str:
         print(f"Backup file {filepath}")
         request = BackupFileRequest(
-            self.user_id, self.VERSION, filepath.name, filepath.read_bytes())
+            self.user_id, self.version, filepath.name, filepath.read_bytes())
         response = self.send_recv_message(
             request, SuccessfulBackupOrDeleteResponse)
 
@@ -99,10 +111,37 @@ class Client:
         return response.filename
 
     @ensure_connected
-    def restore_file(self, filename: str) -> bytes:
+    def backup_stream(self, filename: str, stream: BinaryIO) -> str:
+        """
+        Back up everything that's read from the stream until it ends, without knowing its size up front.
+        Needs version 3, which sends the stream in frames
+        """
+        print(f"Backup stream as {filename}")
+        request = ChunkedBackupFileRequest(self.user_id, self.version, filename, stream)
+        response = self.send_recv_message(request, SuccessfulBackupOrDeleteResponse)
+
+        response = cast(SuccessfulBackupOrDeleteResponse, response)
+        return response.filename
+
+    @ensure_connected
+    def restore_file(self, filename: str, compressed: bool = False) -> bytes:
+        """
+        With compressed, the server sends the file as it stores it, and it's decompressed here.
+        The server only has compressed restores from version 2
+        """
         print(f"Restoring file {filename}")
+        if compressed:
+            compressed_request = RestoreFileCompressedRequest(self.user_id,
+                                                              self.version,
+                                                              filename)
+            compressed_response = self.send_recv_message(compressed_request, SuccessfulCompressedRestoreResponse)
+
+            compressed_response = cast(SuccessfulCompressedRestoreResponse, compressed_response)
+            print(f"Successfully restored {compressed_response.filename}")
+            return compressed_response.decompress()
+
         request = RestoreFileRequest(self.user_id,
-                                     self.VERSION,
+                                     self.version,
                                      filename)
         response = self.send_recv_message(request, SuccessfulRestoreResponse)
 
@@ -114,7 +153,7 @@ class Client:
     def delete_file(self, filename: str):
         print(f"Deleting {filename}")
         request = DeleteFileRequest(self.user_id,
-                                    self.VERSION, filename)
+                                    self.version, filename)
         response = self.send_recv_message(request,
                                           SuccessfulBackupOrDeleteResponse)
         response = cast(SuccessfulBackupOrDeleteResponse, response)
@@ -32,10 +32,17 @@ class NetworkConnectionManager(AbstractConnectionManager):
         self.socket.connect((str(dst[0]), dst[1]))
 
     def send(self, data: bytes) -> None:
-        self.socket.send(data)
-
-    def recv(self, len: int) -> bytes:
-        return self.socket.recv(len)
+        self.socket.sendall(data)
+
+    def recv(self, size: int) -> bytes:
+        # A single recv may return less than asked for, payloads span many segments
+        data = bytearray()
+        while len(data) < size:
+            received = self.socket.recv(size - len(data))
+            if not received:
+                break
+            data += received
+        return bytes(data)
 
     def close(self) -> None:
         print(f"Closing connection")
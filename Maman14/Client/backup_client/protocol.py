@@ -1,11 +1,45 @@
 import struct
+import zlib
 from abc import ABC, abstractmethod
 from enum import Enum
 from dataclasses import dataclass
-from typing import Any, Tuple
+from typing import Any, BinaryIO, Iterator, Tuple
 
 from backup_client.response_reader import ResponseReader
 
+VERSION_1 = 1
+# Version 2 sends a request ID with every request, that's echoed in its response
+VERSION_2 = 2
+# Version 3 also sends the sizes of payloads as uint64s, so files of 4 GiB and up can be backed up and restored
+VERSION_3 = 3
+# The payload size of a version 3 backup whose payload is chunked, i.e sent in frames of
+# a uint32 size and that many bytes, and an empty frame ends the payload
+CHUNKED_PAYLOAD_SIZE = 2**64 - 1
+
+
+@dataclass(frozen=True)
+class ProtocolRevision:
+    has_request_id: bool
+    has_u64_sizes: bool
+
+
+# How each version lays out its messages, like PROTOCOL_REVISIONS in the server
+PROTOCOL_REVISIONS = {
+    VERSION_1: ProtocolRevision(has_request_id=False, has_u64_sizes=False),
+    VERSION_2: ProtocolRevision(has_request_id=True, has_u64_sizes=False),
+    VERSION_3: ProtocolRevision(has_request_id=True, has_u64_sizes=True),
+}
+
+
+def version_has_request_id(version: int) -> bool:
+    revision = PROTOCOL_REVISIONS.get(version)
+    return revision is not None and revision.has_request_id
+
+
+def version_has_u64_sizes(version: int) -> bool:
+    revision = PROTOCOL_REVISIONS.get(version)
+    return revision is not None and revision.has_u64_sizes
+
 
 @dataclass(frozen=True)
 class FilePayload:
@@ -19,6 +53,7 @@ class RequestOP(Enum):
     RESTORE_FILE = 200
     DELETE_FILE = 201
     LIST_FILES = 202
+    RESTORE_FILE_COMPRESSED = 204
 
 
 class ProtocolRequest(ABC):
@@ -30,21 +65,32 @@ class ProtocolRequest(ABC):
         self.request_op = request_op
         self.user_id = user_id
         self.version = version
+        # Only sent from version 2
+        self.request_id = 0
 
     @abstractmethod
     def pack(self) -> bytes:
         raise NotImplementedError
 
+    def pack_parts(self) -> Iterator[bytes]:
+        """
+        The request in parts that are sent one after the other, so a big request isn't held in memory whole
+        """
+        yield self.pack()
+
     def pack_header(self) -> bytes:
-        return struct.pack(self.COMMON_HEADER, self.user_id, self.version, self.request_op.value)
+        header = struct.pack(self.COMMON_HEADER, self.user_id, self.version, self.request_op.value)
+        if version_has_request_id(self.version):
+            header += struct.pack("<I", self.request_id)
+        return header
 
     def pack_filename(self, filename: str) -> bytes:
         fmt = "<H{}s".format(len(filename))
         return struct.pack(fmt, len(filename), filename.encode())
 
     def pack_payload(self, payload: bytes) -> bytes:
-        fmt = "<I{}s".format(len(payload.decode()))
-        return struct.pack(fmt, len(payload.decode()), payload)
+        fmt = "<{}{}s".format("Q" if version_has_u64_sizes(self.version) else "I", len(payload))
+        return struct.pack(fmt, len(payload), payload)
 
     def pack_filename_request(self, filename: str) -> bytes:
         return self.pack_header() + self.pack_filename(filename)
@@ -71,6 +117,33 @@ class BackupFileRequest(ProtocolRequest):
         return self.pack_payload_request(self.filename, self.payload)
 
 
+class ChunkedBackupFileRequest(ProtocolRequest):
+    """
+    A backup of a stream whose size isn't known up front, e.g stdin, which is sent a frame at a time
+    """
+    FRAME_SIZE = 1024 * 1024
+
+    def __init__(self, user_id: int, version: int, filename: str, stream: BinaryIO, frame_size: int = FRAME_SIZE) -> None:
+        if not version_has_u64_sizes(version):
+            raise ValueError(f"Version {version} can't send a chunked payload")
+        super().__init__(RequestOP.BACKUP_FILE, user_id, version)
+        self.filename = filename
+        self.stream = stream
+        self.frame_size = frame_size
+
+    def pack(self) -> bytes:
+        return b"".join(self.pack_parts())
+
+    def pack_parts(self) -> Iterator[bytes]:
+        yield self.pack_filename_request(self.filename) + struct.pack("<Q", CHUNKED_PAYLOAD_SIZE)
+        while True:
+            frame = self.stream.read(self.frame_size)
+            if not frame:
+                break
+            yield struct.pack("<I", len(frame)) + frame
+        yield struct.pack("<I", 0)
+
+
 class RestoreFileRequest(ProtocolRequest):
     def __init__(self, user_id: int, version: int, filename: str) -> None:
         super().__init__(RequestOP.RESTORE_FILE, user_id, version)
@@ -80,6 +153,15 @@ class RestoreFileRequest(ProtocolRequest):
         return self.pack_filename_request(self.filename)
 
 
+class RestoreFileCompressedRequest(ProtocolRequest):
+    def __init__(self, user_id: int, version: int, filename: str) -> None:
+        super().__init__(RequestOP.RESTORE_FILE_COMPRESSED, user_id, version)
+        self.filename = filename
+
+    def pack(self) -> bytes:
+        return self.pack_filename_request(self.filename)
+
+
 class DeleteFileRequest(ProtocolRequest):
     def __init__(self, user_id: int, version: int, filename: str) -> None:
         super().__init__(RequestOP.DELETE_FILE, user_id, version)
@@ -93,6 +175,7 @@ class ResponseOP(Enum):
     SUCCESSFUL_RESTORE = 210
     SUCCESSFUL_LIST_FILES = 211
     SUCCESSFUL_BACKUP_OR_DELETE = 212
+    SUCCESSFUL_COMPRESSED_RESTORE = 214
 
     FILE_NOT_FOUND = 1001
     NO_BACKUP_FILES_FOR_CLIENT = 1002
@@ -103,6 +186,7 @@ class ResponseOP(Enum):
 class VersionedResponse:
     version: int
     response: ResponseOP
+    request_id: int = 0
 
 
 class ProtocolResponse(ABC):
@@ -112,12 +196,16 @@ class ProtocolResponse(ABC):
     def __init__(self, response_op: ResponseOP, version: int) -> None:
         self.response_op = response_op
         self.version = version
+        self.request_id = 0
 
     @staticmethod
     def unpack_ver_op(reader: ResponseReader) -> VersionedResponse:
         version, response_op = ProtocolResponse.read_fmt_from_reader(
             ProtocolResponse.COMMON_HEADER, reader)
-        return VersionedResponse(version, ResponseOP(response_op))
+        response = VersionedResponse(version, ResponseOP(response_op))
+        if version_has_request_id(version):
+            response.request_id = ProtocolResponse.read_fmt_from_reader("<I", reader)[0]
+        return response
 
     @classmethod
     @abstractmethod
@@ -139,8 +227,8 @@ class ProtocolResponse(ABC):
         return filename.decode()
 
     @classmethod
-    def unpack_payload(cls, reader: ResponseReader) -> bytes:
-        size = cls.read_fmt_from_reader("<I", reader)[0]
+    def unpack_payload(cls, version: int, reader: ResponseReader) -> bytes:
+        size = cls.read_fmt_from_reader("<Q" if version_has_u64_sizes(version) else "<I", reader)[0]
         payload = cls.read_fmt_from_reader(f"<{size}s", reader)[0]
         return payload
 
@@ -168,10 +256,71 @@ class SuccessfulRestoreResponse(ProtocolResponse):
     @classmethod
     def unpack(cls, version: int, reader: ResponseReader) -> 'SuccessfulRestoreResponse':
         filename = cls.unpack_filename(reader)
-        payload = cls.unpack_payload(reader)
+        payload = cls.unpack_payload(version, reader)
         return cls(version, filename, payload)
 
 
+class ChunkEncoding(Enum):
+    RAW = 0
+    DEFLATE = 1
+
+
+class InvalidCompressedPayloadException(Exception):
+    pass
+
+
+class SuccessfulCompressedRestoreResponse(ProtocolResponse):
+    # encoding - size - stored size
+    FRAME_HEADER = "<BII"
+
+    def __init__(self, version: int, filename: str, payload: bytes) -> None:
+        super().__init__(ResponseOP.SUCCESSFUL_COMPRESSED_RESTORE, version)
+        self.filename = filename
+        # The file as the server stores it, in frames
+        self.payload = payload
+
+    def is_error(self) -> bool:
+        return False
+
+    @classmethod
+    def unpack(cls, version: int, reader: ResponseReader) -> 'SuccessfulCompressedRestoreResponse':
+        filename = cls.unpack_filename(reader)
+        payload = cls.unpack_payload(version, reader)
+        return cls(version, filename, payload)
+
+    def decompress(self) -> bytes:
+        header_size = struct.calcsize(self.FRAME_HEADER)
+        pieces = []
+        offset = 0
+        while offset < len(self.payload):
+            if offset + header_size > len(self.payload):
+                raise InvalidCompressedPayloadException("Truncated frame header")
+            encoding, size, stored_size = struct.unpack_from(self.FRAME_HEADER, self.payload, offset)
+            offset += header_size
+            stored = self.payload[offset:offset + stored_size]
+            offset += stored_size
+            if len(stored) != stored_size:
+                raise InvalidCompressedPayloadException("Truncated frame")
+
+            if ChunkEncoding(encoding) == ChunkEncoding.DEFLATE:
+                stored = zlib.decompress(stored)
+            if len(stored) != size:
+                raise InvalidCompressedPayloadException(f"Frame decoded to {len(stored)} bytes instead of {size}")
+            pieces.append(stored)
+        return b"".join(pieces)
+
+    def __eq__(self, other: object) -> bool:
+        if not super().__eq__(other):
+            return False
+
+        if not isinstance(other, SuccessfulCompressedRestoreResponse):
+            return False
+        return self.filename == other.filename and self.payload == other.payload
+
+    def __ne__(self, other: object) -> bool:
+        return not self == other
+
+
 class SuccessfulBackupOrDeleteResponse(ProtocolResponse):
     def __init__(self, version: int, filename: str) -> None:
         super().__init__(ResponseOP.SUCCESSFUL_BACKUP_OR_DELETE, version)
@@ -197,7 +346,7 @@ class ListFilesResponse(ProtocolResponse):
     @classmethod
     def unpack(cls, version: int, reader: ResponseReader) -> 'ListFilesResponse':
         filename = cls.unpack_filename(reader)
-        payload = cls.unpack_payload(reader)
+        payload = cls.unpack_payload(version, reader)
         return cls(version, filename, payload)
 
     def is_error(self) -> bool:
@@ -262,6 +411,7 @@ class ResponseParser:
         ResponseOP.SUCCESSFUL_RESTORE: SuccessfulRestoreResponse,
         ResponseOP.SUCCESSFUL_LIST_FILES: ListFilesResponse,
         ResponseOP.SUCCESSFUL_BACKUP_OR_DELETE: SuccessfulBackupOrDeleteResponse,
+        ResponseOP.SUCCESSFUL_COMPRESSED_RESTORE: SuccessfulCompressedRestoreResponse,
 
         ResponseOP.FILE_NOT_FOUND: FileNotFoundResponse,
         ResponseOP.NO_BACKUP_FILES_FOR_CLIENT: NoBackupFilesForClientResponse,
@@ -271,7 +421,9 @@ class ResponseParser:
     @staticmethod
     def parse_message(reader: ResponseReader) -> ProtocolResponse:
         try:
-            response = ProtocolResponse.unpack_ver_op(reader)
-            return ResponseParser.RESPONSE_OP_TO_CLS[response.response].unpack(response.version, reader)
+            versioned = ProtocolResponse.unpack_ver_op(reader)
+            response = ResponseParser.RESPONSE_OP_TO_CLS[versioned.response].unpack(versioned.version, reader)
+            response.request_id = versioned.request_id
+            return response
         except Exception as e:
             raise FailedToParseMessageException(str(e)) from e
@@ -1,14 +1,17 @@
 import unittest
 import struct
+import tempfile
+import zlib
 from pathlib import Path
 from typing import cast
 from ipaddress import IPv4Address
+from io import BytesIO
 from unittest.mock import MagicMock
 from backup_client.connection_manager import AbstractConnectionManager
 from backup_client.server_info import ServerInfo
-from backup_client.client import Client, ErrorResponseException
+from backup_client.client import Client, ErrorResponseException, UnexpectedResponseException
 from backup_client.protocol import (
-    ResponseOP,
+    ResponseOP, VERSION_2, VERSION_3,
     NoBackupFilesForClientResponse, FailedToParseMessageException,
     SuccessfulBackupOrDeleteResponse, SuccessfulRestoreResponse,
 )
@@ -96,8 +99,10 @@ class ClientTest(unittest.TestCase):
 
     def test_backup_file(self):
         filename = "coolfile.txt"
-        with open(filename, "w") as f:
-            f.write("thisisthepayload\n")
+        directory = tempfile.TemporaryDirectory()
+        self.addCleanup(directory.cleanup)
+        filepath = Path(directory.name) / filename
+        filepath.write_text("thisisthepayload\n")
 
         response = SuccessfulBackupOrDeleteResponse(112, filename)
         side_effects = [
@@ -107,7 +112,7 @@ class ClientTest(unittest.TestCase):
             struct.pack(f"<{len(filename)}s", filename.encode())
         ]
         cast(MagicMock, self.mock_connection.recv).side_effect = side_effects
-        filename = self.client.backup_file(Path(filename))
+        filename = self.client.backup_file(filepath)
         self.assertEqual(response.filename, filename)
 
     def test_restore_file(self):
@@ -126,6 +131,58 @@ class ClientTest(unittest.TestCase):
         restored_payload = self.client.restore_file(filename)
         self.assertEqual(response.payload, restored_payload)
 
+    def test_restore_file_compressed(self):
+        filename = "torestore.log"
+        content = b"line of the log\n" * 200
+        compressed = zlib.compress(content)
+        payload = struct.pack("<BII", 1, len(content), len(compressed)) + compressed
+        # The server only has compressed restores from version 2
+        client = Client(ServerInfo(IPv4Address("1.2.3.4"), 1337), self.mock_connection, VERSION_2)
+
+        side_effects = [
+            struct.pack("<BH", VERSION_2, ResponseOP.SUCCESSFUL_COMPRESSED_RESTORE.value),
+            struct.pack("<I", 1),
+            struct.pack("<H", len(filename)),
+            struct.pack(f"<{len(filename)}s", filename.encode()),
+            struct.pack("<I", len(payload)),
+            struct.pack(f"<{len(payload)}s", payload)
+        ]
+        cast(MagicMock, self.mock_connection.recv).side_effect = side_effects
+        restored_payload = client.restore_file(filename, compressed=True)
+        self.assertEqual(content, restored_payload)
+
+    def test_unknown_version(self):
+        with self.assertRaises(ValueError):
+            Client(ServerInfo(IPv4Address("1.2.3.4"), 1337), self.mock_connection, 4)
+
+    def test_backup_stream(self):
+        filename = "dump.sql"
+        client = Client(ServerInfo(IPv4Address("1.2.3.4"), 1337), self.mock_connection, VERSION_3)
+        send_fn = cast(MagicMock, self.mock_connection.send)
+        send_fn.reset_mock()
+
+        side_effects = [
+            struct.pack("<BH", VERSION_3, ResponseOP.SUCCESSFUL_BACKUP_OR_DELETE.value),
+            struct.pack("<I", 1),
+            struct.pack("<H", len(filename)),
+            struct.pack(f"<{len(filename)}s", filename.encode())
+        ]
+        cast(MagicMock, self.mock_connection.recv).side_effect = side_effects
+        self.assertEqual(filename, client.backup_stream(filename, BytesIO(b"select 1;\n")))
+
+        # The header, a frame with the whole stream, and the empty frame that ends it
+        self.assertEqual(3, send_fn.call_count)
+        self.assertEqual(struct.pack("<I", 0), send_fn.call_args_list[-1].args[0])
+
+        # The response must be to the request that was sent, which is request 2
+        cast(MagicMock, self.mock_connection.recv).side_effect = side_effects
+        with self.assertRaises(UnexpectedResponseException):
+            client.backup_stream(filename, BytesIO(b"select 2;\n"))
+
+        # Only version 3 can send a stream
+        with self.assertRaises(ValueError):
+            self.client.backup_stream(filename, BytesIO(b"select 3;\n"))
+
     def delete_file(self):
         filename = "deletethis.out"
         response = SuccessfulBackupOrDeleteResponse(111, filename)
@@ -1,5 +1,6 @@
 import unittest
 import struct
+import zlib
 from io import BytesIO
 
 from backup_client.response_reader import ResponseReader
@@ -8,11 +9,14 @@ from backup_client.protocol import (
     ResponseParser,
     RequestOP, ResponseOP,
     ListFilesRequest, ListFilesResponse,
-    BackupFileRequest, SuccessfulBackupOrDeleteResponse,
+    BackupFileRequest, ChunkedBackupFileRequest, SuccessfulBackupOrDeleteResponse,
     RestoreFileRequest, SuccessfulRestoreResponse,
+    RestoreFileCompressedRequest, SuccessfulCompressedRestoreResponse,
+    InvalidCompressedPayloadException,
     DeleteFileRequest,
     NoBackupFilesForClientResponse, FileNotFoundResponse, ServerErrorResponse,
-    FailedToParseMessageException
+    FailedToParseMessageException,
+    VERSION_2, VERSION_3, CHUNKED_PAYLOAD_SIZE,
 )
 
 
@@ -37,7 +41,7 @@ def get_packed_filename(filename: str) -> bytes:
 
 
 def get_packed_payload(payload: bytes) -> bytes:
-    fmt = f"<I{len(payload.decode())}s"
+    fmt = f"<I{len(payload)}s"
     return struct.pack(fmt, len(payload), payload)
 
 
@@ -168,6 +172,84 @@ class ProtocolTest(unittest.TestCase):
                                                payload)
         self.common_response_test(5, False, expected, actual)
 
+    def test_restore_file_compressed_request(self):
+        user_id = 7
+        filename = "compressme.log"
+        request = RestoreFileCompressedRequest(user_id, VERSION_2, filename)
+        request.request_id = 5
+
+        expected = (get_request_header(user_id, VERSION_2, RequestOP.RESTORE_FILE_COMPRESSED) + struct.pack("<I", 5) +
+                    get_packed_filename(filename))
+        self.assertEqual(expected, request.pack())
+
+    def test_successful_compressed_restore_response(self):
+        version = VERSION_2
+        filename = "compressed.txt"
+        raw = b"stored as is"
+        deflated = b"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa" * 100
+        compressed = zlib.compress(deflated)
+        payload = (struct.pack("<BII", 0, len(raw), len(raw)) + raw +
+                   struct.pack("<BII", 1, len(deflated), len(compressed)) + compressed)
+        expected = SuccessfulCompressedRestoreResponse(version, filename, payload)
+
+        actual = (get_response_header(version, ResponseOP.SUCCESSFUL_COMPRESSED_RESTORE) + struct.pack("<I", 3) +
+                  get_packed_filename(filename) + get_packed_payload(payload))
+        self.common_response_test(6, False, expected, actual)
+        self.assertEqual(raw + deflated, expected.decompress())
+
+        truncated = SuccessfulCompressedRestoreResponse(version, filename, payload[:-1])
+        with self.assertRaises(InvalidCompressedPayloadException):
+            truncated.decompress()
+
+    def test_version_3_backup_file_request(self):
+        user_id = 421
+        filename = "myfile"
+        payload = b"supercoolpayload"
+        request = BackupFileRequest(user_id, VERSION_3, filename, payload)
+        request.request_id = 77
+
+        # The request ID follows the header, and the payload size is a uint64
+        expected = (get_request_header(user_id, VERSION_3, RequestOP.BACKUP_FILE) + struct.pack("<I", 77) +
+                    get_packed_filename(filename) + struct.pack("<Q", len(payload)) + payload)
+        self.assertEqual(expected, request.pack())
+
+    def test_version_2_backup_file_request(self):
+        user_id = 421
+        filename = "myfile"
+        payload = b"supercoolpayload"
+        request = BackupFileRequest(user_id, VERSION_2, filename, payload)
+        request.request_id = 78
+
+        # Version 2 has the request ID, but its payload size is still a uint32
+        expected = (get_request_header(user_id, VERSION_2, RequestOP.BACKUP_FILE) + struct.pack("<I", 78) +
+                    get_packed_filename(filename) + struct.pack("<I", len(payload)) + payload)
+        self.assertEqual(expected, request.pack())
+
+    def test_chunked_backup_file_request(self):
+        user_id = 421
+        filename = "dump.sql"
+        payload = b"0123456789"
+        request = ChunkedBackupFileRequest(user_id, VERSION_3, filename, BytesIO(payload), frame_size=4)
+
+        header = (get_request_header(user_id, VERSION_3, RequestOP.BACKUP_FILE) + struct.pack("<I", 0) +
+                  get_packed_filename(filename) + struct.pack("<Q", CHUNKED_PAYLOAD_SIZE))
+        frames = [struct.pack("<I", 4) + b"0123", struct.pack("<I", 4) + b"4567", struct.pack("<I", 2) + b"89",
+                  struct.pack("<I", 0)]
+        self.assertEqual([header] + frames, list(request.pack_parts()))
+
+        with self.assertRaises(ValueError):
+            ChunkedBackupFileRequest(user_id, 1, filename, BytesIO(payload))
+
+    def test_version_3_restore_response(self):
+        filename = "disk.img"
+        payload = b"thisisthepayload"
+        expected = SuccessfulRestoreResponse(VERSION_3, filename, payload)
+
+        actual = (get_response_header(VERSION_3, ResponseOP.SUCCESSFUL_RESTORE) + struct.pack("<I", 12) +
+                  get_packed_filename(filename) + struct.pack("<Q", len(payload)) + payload)
+        self.common_response_test(6, False, expected, actual)
+        self.assertEqual(12, ResponseParser.parse_message(MockResponseReader(actual)).request_id)
+
     def test_delete_file_request(self):
         version = 21
         user_id = 2222111
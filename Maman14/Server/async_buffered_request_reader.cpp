@@ -0,0 +1,55 @@
+#include "async_buffered_request_reader.h"
+
+#include <algorithm>
+
+AsyncBufferedRequestReader::AsyncBufferedRequestReader(shared_ptr<AbstractAsyncConnectionManager> connection, size_t buffer_size)
+    : connection_(std::move(connection)), buffer_(buffer_size) {}
+
+awaitable<void> AsyncBufferedRequestReader::fill(size_t size) {
+    while (buffer_.size() < size) {
+        std::span<uint8_t> free_space{buffer_.writable()};
+        buffer_.commit(co_await connection_->async_recv_some(free_space.data(), free_space.size()));
+    }
+}
+
+awaitable<uint32_t> AsyncBufferedRequestReader::read_uint32() {
+    co_await fill(4);
+    co_return buffer_.read_u32();
+}
+
+awaitable<uint16_t> AsyncBufferedRequestReader::read_uint16() {
+    co_await fill(2);
+    co_return buffer_.read_u16();
+}
+
+awaitable<uint8_t> AsyncBufferedRequestReader::read_uint8() {
+    co_await fill(1);
+    co_return buffer_.read_u8();
+}
+
+awaitable<vector<uint8_t>> AsyncBufferedRequestReader::read_bytes(size_t size) {
+    vector<uint8_t> bytes(size);
+    size_t done = std::min(size, buffer_.size());
+    buffer_.read(bytes.data(), done);
+    while (done < size) {
+        size_t remaining = size - done;
+        if (remaining >= buffer_.capacity()) {
+            // No point in going through the buffer
+            done += co_await connection_->async_recv_some(bytes.data() + done, remaining);
+        } else {
+            co_await fill(remaining);
+            buffer_.read(bytes.data() + done, remaining);
+            done = size;
+        }
+    }
+    co_return bytes;
+}
+
+awaitable<std::span<const uint8_t>> AsyncBufferedRequestReader::read_span(size_t max_size) {
+    co_await fill(1);
+    std::span<const uint8_t> span{buffer_.readable()};
+    span = span.first(std::min(span.size(), max_size));
+    // The bytes stay where they are until the next receive
+    buffer_.consume(span.size());
+    co_return span;
+}
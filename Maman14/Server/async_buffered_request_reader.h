@@ -0,0 +1,40 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "async_connection_manager.h"
+#include "async_request_reader.h"
+#include "ring_buffer.h"
+
+using boost::asio::awaitable;
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * @brief The awaitable counterpart of BufferedRequestReader
+ *
+ */
+class AsyncBufferedRequestReader : public AbstractAsyncRequestReader {
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    AsyncBufferedRequestReader(shared_ptr<AbstractAsyncConnectionManager> connection, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    virtual awaitable<uint32_t> read_uint32() override;
+    virtual awaitable<uint16_t> read_uint16() override;
+    virtual awaitable<uint8_t> read_uint8() override;
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t size) override;
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t max_size) override;
+
+private:
+    // Receive until at least size bytes are buffered. size must fit in the buffer
+    awaitable<void> fill(size_t size);
+
+    // We want the connection to live for as long as the request reader
+    shared_ptr<AbstractAsyncConnectionManager> connection_;
+    utils::RingBuffer buffer_;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <cstdint>
+#include <vector>
+
+using boost::asio::awaitable;
+using std::vector;
+
+/**
+ * @brief The awaitable counterpart of AbstractConnectionManager,
+ * so sessions can be written as coroutines that suspend instead of blocking a thread
+ *
+ */
+class AbstractAsyncConnectionManager {
+public:
+    virtual awaitable<void> async_send(const vector<uint8_t>& to_send) = 0;
+    virtual awaitable<vector<uint8_t>> async_recv(size_t size) = 0;
+    // See AbstractConnectionManager::recv_some
+    virtual awaitable<size_t> async_recv_some(uint8_t* data, size_t max_size) = 0;
+    virtual ~AbstractAsyncConnectionManager() = default;
+};
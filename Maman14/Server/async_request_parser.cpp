@@ -0,0 +1,236 @@
+#include "async_request_parser.h"
+
+static void check_batch_size(uint64_t batch_size) {
+    if (batch_size > BatchRequest::MAX_PAYLOADS_SIZE) {
+        throw InvalidBatchException("The filenames and payloads of a batch are bigger than: " +
+                                    std::to_string(BatchRequest::MAX_PAYLOADS_SIZE));
+    }
+}
+
+AsyncRequestParser::AsyncRequestParser(unique_ptr<AbstractAsyncRequestReader> reader, bool stream_payloads, MemoryBudget* payload_budget)
+    : reader_(std::move(reader)), stream_payloads_(stream_payloads), payload_budget_(payload_budget) {}
+
+awaitable<unique_ptr<ProtocolRequest>> AsyncRequestParser::parse_message(ProtocolVersion expected_version) {
+    co_return co_await parse_message(expected_version, expected_version);
+}
+
+awaitable<unique_ptr<ProtocolRequest>> AsyncRequestParser::parse_message(ProtocolVersion min_version, ProtocolVersion max_version) {
+    // Whatever a message that failed to parse reserved is given back
+    reservation_.reset();
+    uint32_t user_id{co_await reader_->read_uint32()};
+    ProtocolVersion version{co_await reader_->read_uint8()};
+    if (version < min_version || version > max_version) {
+        if (min_version == max_version) {
+            throw VersionMismatchException{min_version, version};
+        }
+        throw VersionMismatchException{min_version, max_version, version};
+    }
+    RequestOP request_op = static_cast<RequestOP>(co_await reader_->read_uint8());
+    RequestID request_id{0};
+    if (version_has_request_id(version)) {
+        request_id = co_await reader_->read_uint32();
+    }
+
+    string filename;
+    vector<uint8_t> payload;
+    unique_ptr<ProtocolRequest> request;
+
+    switch (request_op) {
+        case RequestOP::BACKUP_FILE:
+            filename = co_await read_filename();
+            if (stream_payloads_) {
+                uint64_t payload_size{co_await read_payload_size(version)};
+                request = unique_ptr<BackupFileRequest>(new BackupFileRequest(user_id, version, filename, payload_size));
+                break;
+            }
+            payload = co_await read_payload(version);
+            request = unique_ptr<BackupFileRequest>(new BackupFileRequest(user_id, version, filename, payload));
+            break;
+        case RequestOP::BACKUP_DELTA:
+            filename = co_await read_filename();
+            payload = co_await read_payload(version, BackupDeltaRequest::MAX_DELTA_SIZE);
+            request = unique_ptr<BackupDeltaRequest>(new BackupDeltaRequest(user_id, version, filename, payload));
+            break;
+        case RequestOP::RESTORE_FILE:
+            filename = co_await read_filename();
+            request = unique_ptr<RestoreFileRequest>(new RestoreFileRequest(user_id, version, filename));
+            break;
+        case RequestOP::RESTORE_FILE_COMPRESSED:
+            filename = co_await read_filename();
+            request = unique_ptr<RestoreFileCompressedRequest>(new RestoreFileCompressedRequest(user_id, version, filename));
+            break;
+        case RequestOP::DELETE_FILE:
+            filename = co_await read_filename();
+            request = unique_ptr<DeleteFileRequest>(new DeleteFileRequest(user_id, version, filename));
+            break;
+        case RequestOP::GET_SIGNATURES:
+            filename = co_await read_filename();
+            request = unique_ptr<GetSignaturesRequest>(new GetSignaturesRequest(user_id, version, filename));
+            break;
+        case RequestOP::BACKUP_BATCH:
+        case RequestOP::RESTORE_BATCH:
+        case RequestOP::DELETE_BATCH:
+            request = co_await read_batch(user_id, version, request_op);
+            break;
+        case RequestOP::RESTORE_RANGE: {
+            filename = co_await read_filename();
+            uint64_t offset{co_await read_uint64()};
+            uint32_t size{co_await reader_->read_uint32()};
+            request = unique_ptr<RestoreRangeRequest>(new RestoreRangeRequest(user_id, version, filename, offset, size));
+            break;
+        }
+        case RequestOP::BEGIN_UPLOAD: {
+            filename = co_await read_filename();
+            uint64_t size{co_await read_uint64()};
+            request = unique_ptr<BeginUploadRequest>(new BeginUploadRequest(user_id, version, filename, size));
+            break;
+        }
+        case RequestOP::UPLOAD_PART:
+        case RequestOP::GET_UPLOAD_STATUS:
+        case RequestOP::FINISH_UPLOAD:
+            request = co_await read_upload(user_id, version, request_op);
+            break;
+        case RequestOP::LIST_FILES:
+            request = unique_ptr<ListFilesRequest>(new ListFilesRequest(user_id, version));
+            break;
+        default:
+            throw InvalidRequestException(static_cast<uint8_t>(request_op));
+    }
+
+    request->set_request_id(request_id);
+    if (reservation_) {
+        request->add_payload_reservation(std::move(*reservation_));
+        reservation_.reset();
+    }
+    co_return request;
+}
+
+awaitable<string> AsyncRequestParser::read_filename() {
+    uint16_t length{co_await reader_->read_uint16()};
+    vector<uint8_t> payload{co_await reader_->read_bytes(length)};
+    co_return string(payload.begin(), payload.end());
+}
+
+awaitable<void> AsyncRequestParser::reserve_payload(size_t size) {
+    if (payload_budget_ == nullptr || size == 0) {
+        co_return;
+    }
+    reservation_.emplace(co_await payload_budget_->acquire(size));
+}
+
+void AsyncRequestParser::shrink_reservation(size_t size) {
+    if (reservation_) {
+        reservation_->shrink(size);
+    }
+}
+
+awaitable<uint64_t> AsyncRequestParser::read_payload_size(ProtocolVersion version) {
+    if (version_has_u64_sizes(version)) {
+        co_return co_await read_uint64();
+    }
+    co_return co_await reader_->read_uint32();
+}
+
+awaitable<vector<uint8_t>> AsyncRequestParser::read_payload(ProtocolVersion version, uint64_t max_size) {
+    uint64_t length{co_await read_payload_size(version)};
+    if (length != CHUNKED_PAYLOAD_SIZE) {
+        if (length > max_size) {
+            throw PayloadTooBigException(max_size);
+        }
+        co_await reserve_payload(length);
+        co_return co_await reader_->read_bytes(length);
+    }
+    // The total isn't known in advance, so the most the payload may take is reserved before any frame is read,
+    // instead of a frame at a time while holding the frames before it, and what's left over is given back at the end
+    co_await reserve_payload(static_cast<size_t>(std::min<uint64_t>(max_size, std::numeric_limits<size_t>::max())));
+    vector<uint8_t> payload;
+    for (;;) {
+        uint32_t frame_size{co_await read_payload_frame_size()};
+        if (frame_size == 0) {
+            break;
+        }
+        // The frames are checked as they come, since the total isn't known in advance
+        if (frame_size > max_size - payload.size()) {
+            throw PayloadTooBigException(max_size);
+        }
+        vector<uint8_t> frame{co_await reader_->read_bytes(frame_size)};
+        payload.insert(payload.end(), frame.begin(), frame.end());
+    }
+    shrink_reservation(payload.size());
+    co_return payload;
+}
+
+awaitable<uint32_t> AsyncRequestParser::read_payload_frame_size() {
+    co_return co_await reader_->read_uint32();
+}
+
+awaitable<std::span<const uint8_t>> AsyncRequestParser::read_payload_chunk(size_t max_size) {
+    co_return co_await reader_->read_span(max_size);
+}
+
+awaitable<unique_ptr<ProtocolRequest>> AsyncRequestParser::read_batch(uint32_t user_id, ProtocolVersion version, RequestOP op) {
+    uint32_t num_entries{co_await reader_->read_uint32()};
+    if (num_entries > BatchRequest::MAX_ENTRIES) {
+        throw InvalidBatchException("Too many files in a batch: " + std::to_string(num_entries));
+    }
+    vector<string> filenames;
+    filenames.reserve(num_entries);
+    vector<vector<uint8_t>> payloads;
+    if (op == RequestOP::BACKUP_BATCH) {
+        // The payloads' sizes only come with their entries, so like a chunked payload, the most that the batch
+        // may take is reserved before any of them is read
+        co_await reserve_payload(BatchRequest::MAX_PAYLOADS_SIZE);
+    }
+    // The filenames count too, or a batch of long names would be as big as the entries allow
+    uint64_t batch_size = 0;
+    uint64_t payloads_size = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        filenames.push_back(co_await read_filename());
+        batch_size += filenames.back().size();
+        check_batch_size(batch_size);
+        if (op != RequestOP::BACKUP_BATCH) {
+            continue;
+        }
+        uint32_t length{co_await reader_->read_uint32()};
+        batch_size += length;
+        check_batch_size(batch_size);
+        payloads_size += length;
+        payloads.push_back(co_await reader_->read_bytes(length));
+    }
+    shrink_reservation(payloads_size);
+
+    switch (op) {
+        case RequestOP::BACKUP_BATCH:
+            co_return unique_ptr<BackupBatchRequest>(new BackupBatchRequest(user_id, version, std::move(filenames), std::move(payloads)));
+        case RequestOP::RESTORE_BATCH:
+            co_return unique_ptr<RestoreBatchRequest>(new RestoreBatchRequest(user_id, version, std::move(filenames)));
+        default:
+            co_return unique_ptr<DeleteBatchRequest>(new DeleteBatchRequest(user_id, version, std::move(filenames)));
+    }
+}
+
+awaitable<uint64_t> AsyncRequestParser::read_uint64() {
+    uint64_t low{co_await reader_->read_uint32()};
+    uint64_t high{co_await reader_->read_uint32()};
+    co_return (high << 32) | low;
+}
+
+awaitable<unique_ptr<ProtocolRequest>> AsyncRequestParser::read_upload(uint32_t user_id, ProtocolVersion version, RequestOP op) {
+    uint64_t token{co_await read_uint64()};
+    switch (op) {
+        case RequestOP::UPLOAD_PART: {
+            uint64_t offset{co_await read_uint64()};
+            uint32_t length{co_await reader_->read_uint32()};
+            if (length > UploadPartRequest::MAX_PART_SIZE) {
+                throw InvalidUploadPartException("An upload part is bigger than: " + std::to_string(UploadPartRequest::MAX_PART_SIZE));
+            }
+            co_await reserve_payload(length);
+            vector<uint8_t> payload{co_await reader_->read_bytes(length)};
+            co_return unique_ptr<UploadPartRequest>(new UploadPartRequest(user_id, version, token, offset, std::move(payload)));
+        }
+        case RequestOP::GET_UPLOAD_STATUS:
+            co_return unique_ptr<GetUploadStatusRequest>(new GetUploadStatusRequest(user_id, version, token));
+        default:
+            co_return unique_ptr<FinishUploadRequest>(new FinishUploadRequest(user_id, version, token));
+    }
+}
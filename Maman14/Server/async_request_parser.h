@@ -0,0 +1,86 @@
+#pragma once
+#include <algorithm>
+#include <boost/asio/awaitable.hpp>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "async_request_reader.h"
+#include "memory_budget.h"
+#include "protocol/request.h"
+
+using boost::asio::awaitable;
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+
+class VersionMismatchException : public runtime_error {
+public:
+    VersionMismatchException(ProtocolVersion expected, ProtocolVersion real)
+        : runtime_error("Expected version: " + std::to_string(expected) + " Got: " + std::to_string(real)) {}
+
+    VersionMismatchException(ProtocolVersion min_version, ProtocolVersion max_version, ProtocolVersion real)
+        : runtime_error("Expected version between: " + std::to_string(min_version) + " and " + std::to_string(max_version) +
+                        " Got: " + std::to_string(real)) {}
+};
+
+/**
+ * @brief Class to parse incoming messages. It's the only place requests are decoded,
+ * and suspends on every read instead of blocking. RequestParser runs it over a blocking reader
+ *
+ */
+class AsyncRequestParser {
+public:
+    /**
+     * @brief Construct a new Async Request Parser
+     *
+     * @param reader The reader to parse from
+     * @param stream_payloads If true, the payload of BACKUP_FILE requests is left on the connection,
+     * and must be consumed with read_payload_chunk (and read_payload_frame_size if it's chunked) before the next
+     * message is parsed
+     * @param payload_budget If set, the payloads that are read into the requests are reserved from it before they're read,
+     * and the requests hold the reservations
+     */
+    AsyncRequestParser(unique_ptr<AbstractAsyncRequestReader> reader, bool stream_payloads = false, MemoryBudget* payload_budget = nullptr);
+    awaitable<unique_ptr<ProtocolRequest>> parse_message(ProtocolVersion expected_version);
+    awaitable<unique_ptr<ProtocolRequest>> parse_message(ProtocolVersion min_version, ProtocolVersion max_version);
+
+    /**
+     * @brief Read the next part of a streamed payload, without copying it if the reader is buffered
+     *
+     * @param max_size At most what's left of the payload
+     * @return awaitable<std::span<const uint8_t>> At least one byte. Only valid until the next read
+     */
+    awaitable<std::span<const uint8_t>> read_payload_chunk(size_t max_size);
+
+    /**
+     * @brief Read the size of the next frame of a streamed payload that's chunked (see CHUNKED_PAYLOAD_SIZE),
+     * whose bytes are then read with read_payload_chunk
+     *
+     * @return awaitable<uint32_t> 0 after the last frame
+     */
+    awaitable<uint32_t> read_payload_frame_size();
+
+private:
+    awaitable<string> read_filename();
+    // Reserve the bytes of the message's payloads from the budget before they're read, for the request that's being parsed.
+    // A message reserves once, for the most that its payloads may take, so it never waits for the budget while it holds some
+    awaitable<void> reserve_payload(size_t size);
+    // Give back what was reserved beyond what the message's payloads turned out to take
+    void shrink_reservation(size_t size);
+    awaitable<uint64_t> read_payload_size(ProtocolVersion version);
+    // A chunked payload's frames are joined. Throws PayloadTooBigException if it's bigger than max_size
+    awaitable<vector<uint8_t>> read_payload(ProtocolVersion version, uint64_t max_size = std::numeric_limits<uint64_t>::max());
+    awaitable<unique_ptr<ProtocolRequest>> read_batch(uint32_t user_id, ProtocolVersion version, RequestOP op);
+    awaitable<unique_ptr<ProtocolRequest>> read_upload(uint32_t user_id, ProtocolVersion version, RequestOP op);
+    // Sent as two uint32s, the low one first, which is the uint64 in little endian
+    awaitable<uint64_t> read_uint64();
+    unique_ptr<AbstractAsyncRequestReader> reader_;
+    bool stream_payloads_;
+    MemoryBudget* payload_budget_;
+    // What was reserved for the request that's being parsed, which it's given once it's made
+    std::optional<MemoryBudget::Reservation> reservation_;
+};
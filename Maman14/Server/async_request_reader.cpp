@@ -0,0 +1,28 @@
+#include "async_request_reader.h"
+
+AsyncRequestReader::AsyncRequestReader(shared_ptr<AbstractAsyncConnectionManager> connection)
+    : connection_(connection) {}
+
+awaitable<uint32_t> AsyncRequestReader::read_uint32() {
+    vector<uint8_t> buffer{co_await connection_->async_recv(4)};
+    co_return buffer.at(3) << 24 | buffer.at(2) << 16 | buffer.at(1) << 8 | buffer.at(0);
+}
+
+awaitable<uint16_t> AsyncRequestReader::read_uint16() {
+    vector<uint8_t> buffer{co_await connection_->async_recv(2)};
+    co_return buffer.at(1) << 8 | buffer.at(0);
+}
+
+awaitable<uint8_t> AsyncRequestReader::read_uint8() {
+    vector<uint8_t> buffer{co_await connection_->async_recv(1)};
+    co_return buffer.at(0);
+}
+
+awaitable<vector<uint8_t>> AsyncRequestReader::read_bytes(size_t size) {
+    co_return co_await connection_->async_recv(size);
+}
+
+awaitable<std::span<const uint8_t>> AsyncRequestReader::read_span(size_t max_size) {
+    last_span_ = co_await connection_->async_recv(max_size);
+    co_return std::span<const uint8_t>(last_span_);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "async_connection_manager.h"
+
+using boost::asio::awaitable;
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * @brief The awaitable counterpart of AbstractRequestReader.
+ * Reads values that are sent in little endian from an interface that implements async_recv
+ *
+ */
+class AbstractAsyncRequestReader {
+public:
+    virtual awaitable<uint32_t> read_uint32() = 0;
+    virtual awaitable<uint16_t> read_uint16() = 0;
+    virtual awaitable<uint8_t> read_uint8() = 0;
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t size) = 0;
+
+    /**
+     * @brief Read at least one and at most max_size bytes, without copying them if the reader can.
+     * The span is only valid until the next read
+     *
+     */
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t max_size) = 0;
+
+    virtual ~AbstractAsyncRequestReader() = default;
+
+protected:
+    AbstractAsyncRequestReader() = default;
+};
+
+class AsyncRequestReader : public AbstractAsyncRequestReader {
+public:
+    AsyncRequestReader(shared_ptr<AbstractAsyncConnectionManager> connection);
+
+    virtual awaitable<uint32_t> read_uint32() override;
+    virtual awaitable<uint16_t> read_uint16() override;
+    virtual awaitable<uint8_t> read_uint8() override;
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t size) override;
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t max_size) override;
+
+private:
+    // We want the connection to live for as long as the request reader
+    shared_ptr<AbstractAsyncConnectionManager> connection_;
+    // Holds the bytes of the last read_span
+    vector<uint8_t> last_span_;
+};
@@ -1,67 +1,465 @@
 #include "backup_directory_manager.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/log/trivial.hpp>
+#include <charconv>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
-using std::lock_guard;
+using std::shared_lock;
+using std::unique_lock;
 
 BackupDirectoryForUserNotFound::BackupDirectoryForUserNotFound(user_id_t user_id)
     : runtime_error("Backup directory for user ID: " + std::to_string(user_id) + " Not found"), user_id(user_id) {
 }
 
-BackupDirectoryManager::BackupDirectoryManager(bfs::path root_backup_directory)
-    : root_backup_directory_(std::move(root_backup_directory)) {
+string IndexStatistics::to_string() const {
+    return "entries: " + std::to_string(num_entries) +
+           " memory (bytes): " + std::to_string(memory_usage) +
+           " bytes per entry: " + std::to_string(num_entries ? memory_usage / num_entries : 0);
+}
+
+string StartupReport::to_string() const {
+    return "users: " + std::to_string(num_users) +
+           " files: " + std::to_string(num_files) +
+           " users from snapshot: " + std::to_string(num_users_from_snapshot) +
+           " time to ready (ms): " + std::to_string(time_to_ready.count());
+}
+
+BackupDirectoryManager::BackupDirectoryManager(bfs::path root_backup_directory, size_t num_shards,
+                                               std::optional<ChunkStoreOptions> deduplication,
+                                               std::optional<PackStoreOptions> packing,
+                                               std::optional<RestoreCacheOptions> restore_cache,
+                                               std::optional<MembershipFilterOptions> lookup_filter,
+                                               std::optional<GroupCommitOptions> group_commit)
+    : root_backup_directory_(std::move(root_backup_directory)),
+      packing_(packing),
+      shards_(new Shard[std::max<size_t>(num_shards, 1)]),
+      num_shards_(std::max<size_t>(num_shards, 1)) {
     bfs::create_directory(root_backup_directory_);
+    if (deduplication) {
+        chunk_store_ = std::make_unique<ChunkStore>(root_backup_directory_ / ".chunks", *deduplication);
+    }
+    if (restore_cache) {
+        restore_cache_ = std::make_unique<RestoreCache>(*restore_cache);
+    }
+    if (lookup_filter) {
+        lookup_filter_ = std::make_unique<MembershipFilter>(*lookup_filter);
+    }
+    if (group_commit) {
+        group_committer_ = std::make_unique<GroupCommitter>(*group_commit);
+    }
+}
+
+// A new user's directory has to be durable before the backups in it are
+static void sync_directory(const bfs::path& directory) {
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw bfs::filesystem_error("Failed to open", directory, boost::system::error_code(errno, boost::system::system_category()));
+    }
+    if (::fsync(fd) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw bfs::filesystem_error("Failed to sync", directory, boost::system::error_code(error, boost::system::system_category()));
+    }
+    ::close(fd);
+}
+
+// Returns -1 if the directory can't be stat-ed, which never matches a snapshot
+static int64_t get_directory_mtime_ns(const bfs::path& directory) {
+    struct stat directory_stat;
+    if (::stat(directory.c_str(), &directory_stat) != 0) {
+        return -1;
+    }
+    int64_t mtime_ns = FileIndexEntry::from_stat(directory_stat).mtime_ns;
+    // The manifests are in a directory of their own, whose changes don't change the user's directory
+    if (::stat((directory / UserBackupDirectory::MANIFEST_DIRECTORY_NAME).c_str(), &directory_stat) == 0) {
+        mtime_ns = std::max(mtime_ns, FileIndexEntry::from_stat(directory_stat).mtime_ns);
+    }
+    return mtime_ns;
+}
+
+StartupReport BackupDirectoryManager::load_existing_users(size_t num_threads, const bfs::path& snapshot_path) {
+    auto start = std::chrono::steady_clock::now();
+    std::unordered_map<user_id_t, const UserIndexSnapshot*> snapshot_users;
+    IndexSnapshot snapshot;
+    if (!snapshot_path.empty()) {
+        try {
+            snapshot = read_index_snapshot(snapshot_path);
+            boost::system::error_code ignored;
+            bfs::remove(snapshot_path, ignored);
+        } catch (const IndexSnapshotException& e) {
+            BOOST_LOG_TRIVIAL(info) << "Not using the index snapshot: " << e.what();
+        }
+        for (const auto& user : snapshot.users) {
+            snapshot_users.emplace(user.user_id, &user);
+        }
+    }
+
+    vector<user_id_t> user_ids = find_existing_user_ids();
+    std::atomic<size_t> next_user{0};
+    std::atomic<size_t> num_files{0};
+    std::atomic<size_t> num_users_from_snapshot{0};
+    // Each thread sets only the users it loaded
+    vector<UserBackupDirectory*> loaded_from_snapshot(user_ids.size(), nullptr);
+    // Each thread takes the next user that no one loaded yet
+    auto load = [&]() {
+        for (size_t i = next_user++; i < user_ids.size(); i = next_user++) {
+            bfs::path directory = root_backup_directory_ / std::to_string(user_ids[i]);
+            unique_ptr<UserBackupDirectory> user_directory;
+            auto it = snapshot_users.find(user_ids[i]);
+            if (it != snapshot_users.end() && it->second->directory_mtime_ns == get_directory_mtime_ns(directory)) {
+                user_directory = make_user_directory(user_ids[i], &it->second->files);
+                loaded_from_snapshot[i] = user_directory.get();
+                num_users_from_snapshot++;
+            } else {
+                user_directory = make_user_directory(user_ids[i], nullptr);
+            }
+            num_files += user_directory->get_index().size();
+            add_loaded_user(user_ids[i], std::move(user_directory));
+        }
+    };
+    vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(std::max<size_t>(num_threads, 1), user_ids.size()); i++) {
+        threads.emplace_back(load);
+    }
+    load();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (chunk_store_) {
+        loaded_from_snapshot.erase(std::remove(loaded_from_snapshot.begin(), loaded_from_snapshot.end(), nullptr),
+                                   loaded_from_snapshot.end());
+        load_chunk_references(snapshot, loaded_from_snapshot, user_ids.size());
+    }
+
+    auto time_to_ready = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    return StartupReport{user_ids.size(), num_files, num_users_from_snapshot, time_to_ready};
+}
+
+void BackupDirectoryManager::load_chunk_references(const IndexSnapshot& snapshot, const vector<UserBackupDirectory*>& users_from_snapshot,
+                                                   size_t num_users) {
+    // The chunks' counts are only right if no user changed since the snapshot was saved
+    if (snapshot.chunks && users_from_snapshot.size() == num_users && snapshot.users.size() == num_users) {
+        chunk_store_->load(*snapshot.chunks);
+    } else {
+        // The scanned users counted their references while scanning, the rest count them from their manifests
+        for (const auto* user_directory : users_from_snapshot) {
+            user_directory->restore_chunk_references();
+        }
+    }
+    size_t removed = chunk_store_->collect_garbage();
+    BOOST_LOG_TRIVIAL(info) << "Chunk store loaded: " << chunk_store_->get_statistics().to_string()
+                            << " unreferenced files removed: " << removed;
+}
+
+vector<user_id_t> BackupDirectoryManager::find_existing_user_ids() const {
+    vector<user_id_t> user_ids;
+    for (const auto& entry : bfs::directory_iterator(root_backup_directory_)) {
+        string name = entry.path().filename().string();
+        user_id_t user_id;
+        auto [end, error] = std::from_chars(name.data(), name.data() + name.size(), user_id);
+        // Users' directories are named after their IDs, anything else isn't ours
+        if (error != std::errc() || end != name.data() + name.size() || !bfs::is_directory(entry.status())) {
+            continue;
+        }
+        user_ids.push_back(user_id);
+    }
+    return user_ids;
+}
+
+void BackupDirectoryManager::add_loaded_user(user_id_t user_id, unique_ptr<UserBackupDirectory> user_directory) {
+    Shard& shard = get_shard(user_id);
+    unique_lock<shared_mutex> lock(shard.mutex, std::defer_lock);
+    lock_and_measure(lock, lock_statistics_);
+    shard.user_directories.insert_or_assign(user_id, std::move(user_directory));
+}
+
+void BackupDirectoryManager::save_snapshot(const bfs::path& snapshot_path) const {
+    vector<UserIndexSnapshot> users;
+    for (size_t i = 0; i < num_shards_; i++) {
+        shared_lock<shared_mutex> lock(shards_[i].mutex, std::defer_lock);
+        lock_and_measure(lock, lock_statistics_);
+        for (const auto& [user_id, user_directory] : shards_[i].user_directories) {
+            // The mtime is taken before the entries, so if anything changes in between the mtimes won't match
+            int64_t directory_mtime_ns = get_directory_mtime_ns(root_backup_directory_ / std::to_string(user_id));
+            users.push_back(UserIndexSnapshot{user_id, directory_mtime_ns, user_directory->get_index().get_entries()});
+        }
+    }
+    write_index_snapshot(snapshot_path, users, chunk_store_ ? std::make_optional(chunk_store_->get_records()) : std::nullopt);
 }
 
 void BackupDirectoryManager::backup_file_for_user_id(user_id_t user_id, const string& filename, const vector<uint8_t>& payload) {
-    lock_guard<mutex> lock(mutex_);
     auto& user_dir = get_or_add_user(user_id);
     user_dir.backup_file(filename, payload);
 }
 
+vector<BatchResult> BackupDirectoryManager::backup_files_for_user_id(user_id_t user_id, const vector<string>& filenames,
+                                                                     const vector<vector<uint8_t>>& payloads) {
+    auto& user_dir = get_or_add_user(user_id);
+    return user_dir.backup_files(filenames, payloads);
+}
+
+unique_ptr<BackupFileWriter> BackupDirectoryManager::begin_backup_for_user_id(user_id_t user_id, const string& filename) {
+    auto& user_dir = get_or_add_user(user_id);
+    return user_dir.begin_backup(filename);
+}
+
+unique_ptr<BackupFileWriter> BackupDirectoryManager::begin_replace_for_user(user_id_t user_id, const string& filename) {
+    auto& user_dir = get_user_directory(user_id);
+    return user_dir.begin_replace(filename);
+}
+
+UploadStatus BackupDirectoryManager::begin_upload_for_user(user_id_t user_id, const string& filename, uint64_t size) {
+    auto& user_dir = get_or_add_user(user_id);
+    return user_dir.begin_upload(filename, size);
+}
+
+UploadStatus BackupDirectoryManager::write_upload_part_for_user(user_id_t user_id, UploadToken token, uint64_t offset,
+                                                                const uint8_t* data, size_t size) {
+    auto& user_dir = get_user_directory(user_id);
+    return user_dir.write_upload_part(token, offset, data, size);
+}
+
+UploadStatus BackupDirectoryManager::get_upload_status_for_user(user_id_t user_id, UploadToken token) const {
+    const auto& user_dir = get_user_directory(user_id);
+    return user_dir.get_upload_status(token);
+}
+
+UploadStatus BackupDirectoryManager::finish_upload_for_user(user_id_t user_id, UploadToken token) {
+    auto& user_dir = get_user_directory(user_id);
+    return user_dir.finish_upload(token);
+}
+
+size_t BackupDirectoryManager::get_num_backup_directories() const {
+    size_t num_directories = 0;
+    for (size_t i = 0; i < num_shards_; i++) {
+        shared_lock<shared_mutex> lock(shards_[i].mutex, std::defer_lock);
+        lock_and_measure(lock, lock_statistics_);
+        num_directories += shards_[i].user_directories.size();
+    }
+    return num_directories;
+}
+
+IndexStatistics BackupDirectoryManager::get_index_statistics() const {
+    IndexStatistics statistics{0, 0};
+    for (size_t i = 0; i < num_shards_; i++) {
+        shared_lock<shared_mutex> lock(shards_[i].mutex, std::defer_lock);
+        lock_and_measure(lock, lock_statistics_);
+        for (const auto& [user_id, user_directory] : shards_[i].user_directories) {
+            statistics.num_entries += user_directory->get_index().size();
+            statistics.memory_usage += user_directory->get_index().get_memory_usage();
+        }
+    }
+    return statistics;
+}
+
+vector<UserBackupDirectory*> BackupDirectoryManager::get_user_directories() const {
+    vector<UserBackupDirectory*> user_directories;
+    for (size_t i = 0; i < num_shards_; i++) {
+        shared_lock<shared_mutex> lock(shards_[i].mutex, std::defer_lock);
+        lock_and_measure(lock, lock_statistics_);
+        for (const auto& [user_id, user_directory] : shards_[i].user_directories) {
+            user_directories.push_back(user_directory.get());
+        }
+    }
+    return user_directories;
+}
+
+size_t BackupDirectoryManager::compact_packs() {
+    // The shard locks aren't held while compacting, so new users can be added meanwhile
+    size_t num_compacted = 0;
+    for (auto* user_directory : get_user_directories()) {
+        num_compacted += user_directory->compact_packs();
+    }
+    return num_compacted;
+}
+
+std::optional<PackStoreStatistics> BackupDirectoryManager::get_pack_statistics() const {
+    if (!packing_) {
+        return std::nullopt;
+    }
+    PackStoreStatistics statistics{0, 0, 0, 0, 0, 0};
+    for (const auto* user_directory : get_user_directories()) {
+        const PackStore* pack_store = user_directory->get_pack_store();
+        PackStoreStatistics user_statistics = pack_store->get_statistics();
+        statistics.num_files += user_statistics.num_files;
+        statistics.num_segments += user_statistics.num_segments;
+        statistics.live_bytes += user_statistics.live_bytes;
+        statistics.dead_bytes += user_statistics.dead_bytes;
+        statistics.num_compactions += user_statistics.num_compactions;
+        statistics.reclaimed_bytes += user_statistics.reclaimed_bytes;
+    }
+    return statistics;
+}
+
+std::optional<GroupCommitStatistics> BackupDirectoryManager::get_group_commit_statistics() const {
+    if (!group_committer_) {
+        return std::nullopt;
+    }
+    return group_committer_->get_statistics();
+}
+
 const vector<string> BackupDirectoryManager::get_backup_filenames_for_user(user_id_t user_id) const {
-    lock_guard<mutex> lock(mutex_);
     const auto& user_dir = get_user_directory(user_id);
     return user_dir.get_backup_filenames();
 }
 
 const vector<uint8_t> BackupDirectoryManager::get_file_content_for_user(user_id_t user_id, const string& filename) const {
-    lock_guard<mutex> lock(mutex_);
+    if (restore_cache_) {
+        return open_file_for_restore(user_id, filename)->read_all();
+    }
     const auto& user_dir = get_user_directory(user_id);
     return user_dir.get_backup_file_content(filename);
 }
 
+unique_ptr<BackupFileReader> BackupDirectoryManager::open_file_for_user(user_id_t user_id, const string& filename) const {
+    const auto& user_dir = get_user_directory(user_id);
+    return user_dir.open_backup_file(filename);
+}
+
+unique_ptr<BackupFileReader> BackupDirectoryManager::open_file_for_restore(user_id_t user_id, const string& filename) const {
+    return open_for_restore(get_user_directory(user_id), user_id, filename);
+}
+
+unique_ptr<BackupFileReader> BackupDirectoryManager::open_for_restore(const UserBackupDirectory& user_dir, user_id_t user_id,
+                                                                      const string& filename) const {
+    std::optional<FileIndexEntry> version;
+    if (restore_cache_) {
+        version = user_dir.get_index().find(filename);
+    }
+    if (!version) {
+        // Opening it throws if it isn't backed up
+        return user_dir.open_backup_file(filename);
+    }
+    if (auto cached = restore_cache_->find(user_id, filename, *version)) {
+        return std::make_unique<CachedBackupFileReader>(root_backup_directory_ / std::to_string(user_id) / filename, std::move(cached));
+    }
+
+    unique_ptr<BackupFileReader> file = user_dir.open_backup_file(filename);
+    if (!restore_cache_->should_insert(user_id, filename, file->size())) {
+        return file;
+    }
+    auto cached = std::make_shared<CachedFile>(CachedFile{file->read_all(), *version});
+    restore_cache_->insert(user_id, filename, cached);
+    return std::make_unique<CachedBackupFileReader>(file->get_path(), std::move(cached));
+}
+
 void BackupDirectoryManager::delete_file_for_user(user_id_t user_id, const string& filename) {
-    lock_guard<mutex> lock(mutex_);
-    auto& user_dir = get_mutable_user_directory(user_id);
+    auto& user_dir = get_user_directory(user_id);
     user_dir.delete_file(filename);
+    if (restore_cache_) {
+        restore_cache_->invalidate(user_id, filename);
+    }
 }
 
-UserBackupDirectory& BackupDirectoryManager::get_or_add_user(user_id_t user_id) {
-    auto it = user_directories_.find(user_id);
-    if (it != user_directories_.end()) {
-        return it->second;
+vector<RestoredFile> BackupDirectoryManager::restore_files_for_user(user_id_t user_id, const vector<string>& filenames,
+                                                                    uint64_t max_size) const {
+    const auto& user_dir = get_user_directory(user_id);
+    vector<RestoredFile> files(filenames.size(), RestoredFile{BatchResult::FAILED, {}});
+    uint64_t size = 0;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        if (!might_have_file(user_id, filenames[i])) {
+            files[i].result = BatchResult::NOT_FOUND;
+            continue;
+        }
+        try {
+            unique_ptr<BackupFileReader> file = open_for_restore(user_dir, user_id, filenames[i]);
+            if (size + file->size() > max_size) {
+                files[i].result = BatchResult::TOO_BIG;
+                continue;
+            }
+            files[i].content = file->read_all();
+            size += files[i].content.size();
+            files[i].result = BatchResult::DONE;
+        } catch (const FileNotFoundException& e) {
+            files[i].result = BatchResult::NOT_FOUND;
+        } catch (const std::exception& e) {
+            files[i].result = BatchResult::FAILED;
+        }
+    }
+    return files;
+}
+
+vector<BatchResult> BackupDirectoryManager::delete_files_for_user(user_id_t user_id, const vector<string>& filenames) {
+    auto& user_dir = get_user_directory(user_id);
+    vector<BatchResult> results = user_dir.delete_files(filenames);
+    if (restore_cache_) {
+        for (size_t i = 0; i < filenames.size(); i++) {
+            if (results[i] == BatchResult::DONE) {
+                restore_cache_->invalidate(user_id, filenames[i]);
+            }
+        }
     }
+    return results;
+}
 
-    auto user_directory = root_backup_directory_ / std::to_string(user_id);
-    bfs::create_directory(user_directory);
-    user_directories_.emplace(user_id, user_directory);
-    return user_directories_.find(user_id)->second;
+bool BackupDirectoryManager::might_have_file(user_id_t user_id, const string& filename) const {
+    return lookup_filter_ == nullptr || lookup_filter_->might_contain(MembershipFilter::hash(user_id, filename));
 }
 
-const UserBackupDirectory& BackupDirectoryManager::get_user_directory(user_id_t user_id) const {
-    auto it = user_directories_.find(user_id);
-    if (it == user_directories_.end()) {
-        throw BackupDirectoryForUserNotFound(user_id);
+unique_ptr<UserBackupDirectory> BackupDirectoryManager::make_user_directory(user_id_t user_id,
+                                                                            const vector<std::pair<string, FileIndexEntry>>* index_entries) {
+    bfs::path directory = root_backup_directory_ / std::to_string(user_id);
+    unique_ptr<UserBackupDirectory> user_directory;
+    if (index_entries != nullptr) {
+        user_directory = std::make_unique<UserBackupDirectory>(directory, *index_entries, chunk_store_.get(), packing_,
+                                                               group_committer_.get());
+    } else {
+        user_directory = std::make_unique<UserBackupDirectory>(directory, chunk_store_.get(), packing_, group_committer_.get());
+    }
+    if (lookup_filter_) {
+        // The user's ID is the seed, so the same filename of different users are different keys
+        user_directory->set_lookup_filter(lookup_filter_.get(), user_id);
     }
-    return it->second;
+    return user_directory;
+}
+
+BackupDirectoryManager::Shard& BackupDirectoryManager::get_shard(user_id_t user_id) const {
+    // User IDs are often sequential, so spread neighbours over different shards
+    uint64_t hash = static_cast<uint64_t>(user_id) * 0x9e3779b97f4a7c15ull;
+    return shards_[(hash >> 32) % num_shards_];
+}
+
+UserBackupDirectory& BackupDirectoryManager::get_or_add_user(user_id_t user_id) {
+    Shard& shard = get_shard(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.mutex, std::defer_lock);
+        lock_and_measure(lock, lock_statistics_);
+        auto it = shard.user_directories.find(user_id);
+        if (it != shard.user_directories.end()) {
+            return *it->second;
+        }
+    }
+
+    // Create the directory without holding the lock. If another thread adds the same user
+    // meanwhile, creating the directory again does nothing and its UserBackupDirectory is kept
+    if (bfs::create_directory(root_backup_directory_ / std::to_string(user_id))) {
+        sync_directory(root_backup_directory_);
+    }
+    auto new_user = make_user_directory(user_id, nullptr);
+
+    unique_lock<shared_mutex> lock(shard.mutex, std::defer_lock);
+    lock_and_measure(lock, lock_statistics_);
+    auto it = shard.user_directories.try_emplace(user_id, std::move(new_user)).first;
+    return *it->second;
 }
 
-UserBackupDirectory& BackupDirectoryManager::get_mutable_user_directory(user_id_t user_id) {
-    auto it = user_directories_.find(user_id);
-    if (it == user_directories_.end()) {
+UserBackupDirectory& BackupDirectoryManager::get_user_directory(user_id_t user_id) const {
+    Shard& shard = get_shard(user_id);
+    shared_lock<shared_mutex> lock(shard.mutex, std::defer_lock);
+    lock_and_measure(lock, lock_statistics_);
+    auto it = shard.user_directories.find(user_id);
+    if (it == shard.user_directories.end()) {
         throw BackupDirectoryForUserNotFound(user_id);
     }
-    return it->second;
+    return *it->second;
 }
@@ -1,21 +1,39 @@
 #pragma once
 
 #include <boost/filesystem.hpp>
+#include <chrono>
 #include <exception>
 #include <map>
-#include <mutex>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <vector>
 
+#include "chunk_store.h"
+#include "index_snapshot.h"
+#include "lock_statistics.h"
+#include "membership_filter.h"
+#include "restore_cache.h"
 #include "user_backup_directory.h"
 
 namespace bfs = boost::filesystem;
 using std::map;
-using std::mutex;
 using std::runtime_error;
+using std::shared_mutex;
 using std::string;
 
 typedef uint32_t user_id_t;
 
+/**
+ * @brief A file of a batch of restores, and its content if it was restored
+ *
+ */
+struct RestoredFile {
+    BatchResult result;
+    vector<uint8_t> content;
+};
+
 class BackupDirectoryForUserNotFound : public runtime_error {
 public:
     BackupDirectoryForUserNotFound(user_id_t user_id);
@@ -23,32 +41,234 @@ public:
     user_id_t user_id;
 };
 
+/**
+ * @brief How big the in-memory file indexes of all of the users are
+ *
+ */
+struct IndexStatistics {
+    size_t num_entries;
+    size_t memory_usage;
+
+    string to_string() const;
+};
+
+/**
+ * @brief What loading the existing backups on startup found, and how long it took until we were ready to serve them
+ *
+ */
+struct StartupReport {
+    size_t num_users;
+    size_t num_files;
+    // Users whose index was loaded from the snapshot, the rest were scanned
+    size_t num_users_from_snapshot;
+    std::chrono::milliseconds time_to_ready;
+
+    string to_string() const;
+};
+
+/**
+ * @brief Manages the backup directories of all of the users.
+ * The users are spread over shards, each with its own lock, so requests of different users rarely wait
+ * for each other. The shard locks only guard finding and adding users, and are never held during file I/O.
+ * With deduplication, the backups of all of the users share one chunk store, under the .chunks directory of the root.
+ * With packing, each user's small files are packed in a pack store of their own, under the user's directory.
+ * With a restore cache, the files that are restored over and over are served from memory.
+ * With a lookup filter, the filenames of all of the users are kept in a membership filter, so requests for files
+ * that were never backed up are told apart without taking any lock.
+ * With group commit, the syncs of concurrent backups of all of the users are flushed together.
+ *
+ */
 class BackupDirectoryManager {
 public:
-    BackupDirectoryManager(bfs::path root_backup_directory = bfs::temp_directory_path());
+    static const size_t DEFAULT_NUM_SHARDS = 64;
+
+    /**
+     * @param deduplication How to deduplicate new backups, or nothing to store them as they are
+     * @param packing How to pack small files, or nothing to store each of them in a file of its own
+     * @param restore_cache How to cache the content of popular files for restores, or nothing to always read them
+     * @param lookup_filter How big the filter of the users' filenames is, or nothing to always look files up in the indexes
+     * @param group_commit How to batch the syncs of backups, or nothing to sync each backup on its own
+     */
+    BackupDirectoryManager(bfs::path root_backup_directory = bfs::temp_directory_path(), size_t num_shards = DEFAULT_NUM_SHARDS,
+                           std::optional<ChunkStoreOptions> deduplication = std::nullopt,
+                           std::optional<PackStoreOptions> packing = std::nullopt,
+                           std::optional<RestoreCacheOptions> restore_cache = std::nullopt,
+                           std::optional<MembershipFilterOptions> lookup_filter = std::nullopt,
+                           std::optional<GroupCommitOptions> group_commit = std::nullopt);
+
+    /**
+     * @brief Find the backups that are already in the root directory, from a previous run.
+     * The users' directories are handled in parallel. If a snapshot path is given and a valid snapshot is there,
+     * the index of each user whose directory didn't change since the snapshot is loaded from it,
+     * and only the rest are scanned. The snapshot is removed once it's loaded, so a crash before
+     * the next save_snapshot falls back to a scan.
+     * With deduplication, the chunk store's reference counts are rebuilt as well, and the chunks
+     * that nothing references anymore are removed.
+     * Should be called once, before serving any requests.
+     *
+     * @param num_threads How many threads scan the users' directories
+     * @param snapshot_path Where save_snapshot saved the indexes, or empty to always scan
+     */
+    StartupReport load_existing_users(size_t num_threads, const bfs::path& snapshot_path = bfs::path());
+
+    /**
+     * @brief Save the indexes of all of the users, for load_existing_users of the next run.
+     * Should be called once no more requests are served
+     *
+     */
+    void save_snapshot(const bfs::path& snapshot_path) const;
 
     void backup_file_for_user_id(user_id_t user_id, const string& filename, const vector<uint8_t>& payload);
 
+    /**
+     * @brief Back up many files for the user, which is looked up once for all of them.
+     * See UserBackupDirectory::backup_files
+     *
+     */
+    vector<BatchResult> backup_files_for_user_id(user_id_t user_id, const vector<string>& filenames,
+                                                 const vector<vector<uint8_t>>& payloads);
+
+    /**
+     * @brief Start backing up a file for the user, whose content is written in chunks.
+     * See UserBackupDirectory::begin_backup
+     *
+     */
+    unique_ptr<BackupFileWriter> begin_backup_for_user_id(user_id_t user_id, const string& filename);
+
+    /**
+     * @brief Start writing a new version of a user's backup file. See UserBackupDirectory::begin_replace
+     *
+     */
+    unique_ptr<BackupFileWriter> begin_replace_for_user(user_id_t user_id, const string& filename);
+
+    /**
+     * @brief Start an upload in parts of a file for the user, see UserBackupDirectory::begin_upload.
+     * The other upload methods throw UploadNotFoundException for tokens of other users
+     *
+     */
+    UploadStatus begin_upload_for_user(user_id_t user_id, const string& filename, uint64_t size);
+    UploadStatus write_upload_part_for_user(user_id_t user_id, UploadToken token, uint64_t offset, const uint8_t* data, size_t size);
+    UploadStatus get_upload_status_for_user(user_id_t user_id, UploadToken token) const;
+    UploadStatus finish_upload_for_user(user_id_t user_id, UploadToken token);
+
     /**
      * @brief Get the number of backup directories. This should equal the number of user ID's seens o far
      *
      * @return size_t Number of backup directories
      */
-    size_t get_num_backup_directories() const { return user_directories_.size(); };
+    size_t get_num_backup_directories() const;
 
     const vector<string> get_backup_filenames_for_user(user_id_t user_id) const;
 
+    /**
+     * @brief Get the content of a user's backup file, from the restore cache if it's there
+     *
+     */
     const vector<uint8_t> get_file_content_for_user(user_id_t user_id, const string& filename) const;
 
+    /**
+     * @brief Open a user's backup file for reading it. See UserBackupDirectory::open_backup_file
+     *
+     */
+    unique_ptr<BackupFileReader> open_file_for_user(user_id_t user_id, const string& filename) const;
+
+    /**
+     * @brief Open a user's backup file for restoring it to the client. A file that's in the restore cache
+     * is read from memory, and a file that was missed is read into the cache if it's restored often enough.
+     * A cached file is checked against the user's index, so a file that was replaced is read again
+     *
+     */
+    unique_ptr<BackupFileReader> open_file_for_restore(user_id_t user_id, const string& filename) const;
+
+    /**
+     * @brief Read many of the user's files, like open_file_for_restore, with the user looked up once for all of them
+     *
+     * @param max_size How much content the whole batch may hold. The files that don't fit are left out as TOO_BIG
+     * @return vector<RestoredFile> Each of the files, in order
+     */
+    vector<RestoredFile> restore_files_for_user(user_id_t user_id, const vector<string>& filenames, uint64_t max_size) const;
+
     void delete_file_for_user(user_id_t user_id, const string& filename);
 
+    /**
+     * @brief Delete many of the user's files, which is looked up once for all of them.
+     * See UserBackupDirectory::delete_files
+     *
+     */
+    vector<BatchResult> delete_files_for_user(user_id_t user_id, const vector<string>& filenames);
+
+    /**
+     * @brief Whether the user may have backed up the file, from the lookup filter. Takes no lock and never
+     * touches the disk. False means the user definitely has no such file, or no backups at all,
+     * true means the file should be looked up. Always true without a lookup filter
+     *
+     */
+    bool might_have_file(user_id_t user_id, const string& filename) const;
+
     const bfs::path& get_root_backup_directory() const { return root_backup_directory_; };
 
+    /**
+     * @brief How long requests waited for the shard locks
+     *
+     */
+    const LockStatistics& get_lock_statistics() const { return lock_statistics_; };
+
+    IndexStatistics get_index_statistics() const;
+
+    /**
+     * @brief The chunk store of the deduplicated backups, or nullptr without deduplication
+     *
+     */
+    const ChunkStore* get_chunk_store() const { return chunk_store_.get(); };
+
+    /**
+     * @brief Compact the pack stores of all of the users. Requests are served meanwhile
+     *
+     * @return size_t How many segments were compacted
+     */
+    size_t compact_packs();
+
+    /**
+     * @brief The pack stores of all of the users together, or nothing without packing
+     *
+     */
+    std::optional<PackStoreStatistics> get_pack_statistics() const;
+
+    /**
+     * @brief The cache of restored files, or nullptr without one
+     *
+     */
+    const RestoreCache* get_restore_cache() const { return restore_cache_.get(); };
+
+    /**
+     * @brief The filter of the users' filenames, or nullptr without one
+     *
+     */
+    const MembershipFilter* get_lookup_filter() const { return lookup_filter_.get(); };
+
+    /**
+     * @brief What the group committer flushed, or nothing without group commit
+     *
+     */
+    std::optional<GroupCommitStatistics> get_group_commit_statistics() const;
+
 private:
+    struct Shard {
+        map<user_id_t, unique_ptr<UserBackupDirectory>> user_directories;
+        mutable shared_mutex mutex;
+    };
+
+    Shard& get_shard(user_id_t user_id) const;
+    unique_ptr<BackupFileReader> open_for_restore(const UserBackupDirectory& user_dir, user_id_t user_id, const string& filename) const;
+    unique_ptr<UserBackupDirectory> make_user_directory(user_id_t user_id, const vector<std::pair<string, FileIndexEntry>>* index_entries);
+    void add_loaded_user(user_id_t user_id, unique_ptr<UserBackupDirectory> user_directory);
+    vector<user_id_t> find_existing_user_ids() const;
+    void load_chunk_references(const IndexSnapshot& snapshot, const vector<UserBackupDirectory*>& users_from_snapshot, size_t num_users);
+
     /**
-     * @brief Get or add a UserBackupDirectory to the user_directories_ map.
-     * It's ok to return a reference here since the function is private and the objects lifetime
-     * will be less than or equal to the lifetime of this containing object
+     * @brief Get or add a UserBackupDirectory to the user's shard.
+     * It's ok to return a reference here since the function is private, and users are never removed,
+     * so the objects lifetime will be less than or equal to the lifetime of this containing object
      *
      * @param user_id - The user's ID
      * @return UserBackupDirectory& - The user's backup directory
@@ -63,11 +283,23 @@ private:
      * @param user_id - The user's ID
      * @return UserBackupDirectory& - The user's backup directory
      */
-    const UserBackupDirectory& get_user_directory(user_id_t user_id) const;
+    UserBackupDirectory& get_user_directory(user_id_t user_id) const;
 
-    UserBackupDirectory& get_mutable_user_directory(user_id_t user_id);
+    /**
+     * @brief Get all of the users' directories. Users are never removed, so the pointers stay valid
+     *
+     */
+    vector<UserBackupDirectory*> get_user_directories() const;
 
-    map<user_id_t, UserBackupDirectory> user_directories_;
     bfs::path root_backup_directory_;
-    mutable mutex mutex_;
+    unique_ptr<ChunkStore> chunk_store_;
+    std::optional<PackStoreOptions> packing_;
+    unique_ptr<RestoreCache> restore_cache_;
+    // Before the shards, since the users' indexes remove their files from it when they're destroyed
+    unique_ptr<MembershipFilter> lookup_filter_;
+    unique_ptr<GroupCommitter> group_committer_;
+    // Never resized, so the shards can be used without a lock of their own
+    unique_ptr<Shard[]> shards_;
+    size_t num_shards_;
+    mutable LockStatistics lock_statistics_;
 };
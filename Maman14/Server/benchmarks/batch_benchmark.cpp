@@ -0,0 +1,170 @@
+/**
+ * @brief Backs up, restores and deletes many small files on a running server, first a file per request
+ * and then in batches, over a single keep-alive connection, and reports the ops/sec of each, e.g:
+ *   batch_benchmark 127.0.0.1 1337 10000 2 256
+ * The size is in KiB, and defaults to 10000 files of 2 KiB in batches of 256.
+ *
+ */
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using std::chrono::steady_clock;
+
+// Version 2 keeps the connection open for the next request
+static const uint8_t PROTOCOL_VERSION = 2;
+static const uint8_t BACKUP_FILE_OP = 100;
+static const uint8_t BACKUP_BATCH_OP = 102;
+static const uint8_t RESTORE_FILE_OP = 200;
+static const uint8_t DELETE_FILE_OP = 201;
+static const uint8_t RESTORE_BATCH_OP = 205;
+static const uint8_t DELETE_BATCH_OP = 206;
+static const uint16_t SUCCESSFUL_RESTORE = 210;
+static const uint16_t SUCCESSFUL_BACKUP_OR_DELETE = 212;
+static const uint16_t SUCCESSFUL_BATCH = 215;
+static const uint32_t USER_ID = 0xba7c4;
+static const uint32_t REQUEST_ID = 1;
+
+static void push_le(std::vector<uint8_t>& buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void push_filename(std::vector<uint8_t>& buffer, const std::string& filename) {
+    push_le(buffer, filename.size(), 2);
+    buffer.insert(buffer.end(), filename.begin(), filename.end());
+}
+
+static std::vector<uint8_t> request_header(uint8_t op) {
+    std::vector<uint8_t> header;
+    push_le(header, USER_ID, 4);
+    push_le(header, PROTOCOL_VERSION, 1);
+    push_le(header, op, 1);
+    // The requests of a connection are sent one at a time, so they can share an ID
+    push_le(header, REQUEST_ID, 4);
+    return header;
+}
+
+static uint64_t read_le(tcp::socket& socket, size_t size) {
+    std::vector<uint8_t> buffer(size);
+    boost::asio::read(socket, boost::asio::buffer(buffer));
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+    }
+    return value;
+}
+
+static std::vector<uint8_t> read_bytes(tcp::socket& socket, size_t size) {
+    std::vector<uint8_t> buffer(size);
+    boost::asio::read(socket, boost::asio::buffer(buffer));
+    return buffer;
+}
+
+static void expect_op(tcp::socket& socket, uint16_t expected) {
+    read_le(socket, 1);
+    uint16_t op = static_cast<uint16_t>(read_le(socket, 2));
+    if (op != expected) {
+        throw std::runtime_error("Unexpected response op: " + std::to_string(op));
+    }
+    if (read_le(socket, 4) != REQUEST_ID) {
+        throw std::runtime_error("Unexpected request ID");
+    }
+}
+
+static std::string get_filename(size_t i) {
+    return "small" + std::to_string(i);
+}
+
+static void single_request(tcp::socket& socket, uint8_t op, const std::string& filename, const std::vector<uint8_t>* payload) {
+    std::vector<uint8_t> request = request_header(op);
+    push_filename(request, filename);
+    if (payload != nullptr) {
+        push_le(request, payload->size(), 4);
+        request.insert(request.end(), payload->begin(), payload->end());
+    }
+    boost::asio::write(socket, boost::asio::buffer(request));
+
+    expect_op(socket, op == RESTORE_FILE_OP ? SUCCESSFUL_RESTORE : SUCCESSFUL_BACKUP_OR_DELETE);
+    read_bytes(socket, read_le(socket, 2));
+    if (op == RESTORE_FILE_OP) {
+        read_bytes(socket, read_le(socket, 4));
+    }
+}
+
+static void batch_request(tcp::socket& socket, uint8_t op, size_t first, size_t count, const std::vector<uint8_t>& payload) {
+    std::vector<uint8_t> request = request_header(op);
+    push_le(request, count, 4);
+    for (size_t i = first; i < first + count; i++) {
+        push_filename(request, get_filename(i));
+        if (op == BACKUP_BATCH_OP) {
+            push_le(request, payload.size(), 4);
+            request.insert(request.end(), payload.begin(), payload.end());
+        }
+    }
+    boost::asio::write(socket, boost::asio::buffer(request));
+
+    expect_op(socket, SUCCESSFUL_BATCH);
+    std::vector<uint8_t> statuses = read_bytes(socket, read_le(socket, 4));
+    if (statuses.size() != count || std::any_of(statuses.begin(), statuses.end(), [](uint8_t status) { return status != 0; })) {
+        throw std::runtime_error("A file of the batch failed");
+    }
+    read_bytes(socket, read_le(socket, 4));
+}
+
+static double run_single(tcp::socket& socket, uint8_t op, size_t num_files, const std::vector<uint8_t>& payload) {
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < num_files; i++) {
+        single_request(socket, op, get_filename(i), op == BACKUP_FILE_OP ? &payload : nullptr);
+    }
+    return num_files / std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+static double run_batches(tcp::socket& socket, uint8_t op, size_t num_files, size_t batch_size, const std::vector<uint8_t>& payload) {
+    auto start = steady_clock::now();
+    for (size_t first = 0; first < num_files; first += batch_size) {
+        batch_request(socket, op, first, std::min(batch_size, num_files - first), payload);
+    }
+    return num_files / std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> [num_files] [size_kib] [batch_size]" << std::endl;
+        return 1;
+    }
+    size_t num_files = argc > 3 ? std::stoul(argv[3]) : 10000;
+    size_t file_size = (argc > 4 ? std::stoul(argv[4]) : 2) * 1024;
+    size_t batch_size = argc > 5 ? std::stoul(argv[5]) : 256;
+
+    boost::asio::io_context io;
+    tcp::resolver resolver(io);
+    tcp::socket socket(io);
+    boost::asio::connect(socket, resolver.resolve(argv[1], argv[2]));
+    std::vector<uint8_t> payload(file_size, 'b');
+    std::cout << "files: " << num_files << " size (KiB): " << file_size / 1024 << " batch: " << batch_size << "\n" << std::endl;
+
+    double backup = run_single(socket, BACKUP_FILE_OP, num_files, payload);
+    double restore = run_single(socket, RESTORE_FILE_OP, num_files, payload);
+    double remove = run_single(socket, DELETE_FILE_OP, num_files, payload);
+    std::cout << "file per request\n"
+              << "  backup (ops/s): " << backup << "\n"
+              << "  restore (ops/s): " << restore << "\n"
+              << "  delete (ops/s): " << remove << std::endl;
+
+    backup = run_batches(socket, BACKUP_BATCH_OP, num_files, batch_size, payload);
+    restore = run_batches(socket, RESTORE_BATCH_OP, num_files, batch_size, payload);
+    remove = run_batches(socket, DELETE_BATCH_OP, num_files, batch_size, payload);
+    std::cout << "batches\n"
+              << "  backup (ops/s): " << backup << "\n"
+              << "  restore (ops/s): " << restore << "\n"
+              << "  delete (ops/s): " << remove << std::endl;
+    return 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * @brief Splits random data into chunks with the fixed size and the content-defined chunkers, and reports
+ * the chunking throughput of each. Then bytes are inserted at random offsets of the data, and it's chunked again
+ * to see how many of the chunks are still found, which is how much a backup of the changed file deduplicates, e.g:
+ *   chunker_benchmark 256 1024 10
+ * Sizes are in MiB and KiB, and default to 256 MiB of data, 1024 KiB average chunks and 10 inserts.
+ * The content-defined chunks are between a quarter and 4 times the average size.
+ *
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/chunker.h"
+#include "Maman14/Server/sha256.h"
+
+using std::chrono::steady_clock;
+
+static const size_t PIECE_SIZE = 64 * 1024;
+
+static std::vector<uint8_t> random_data(size_t size, std::mt19937_64& generator) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t value = generator();
+        std::copy(reinterpret_cast<uint8_t*>(&value), reinterpret_cast<uint8_t*>(&value + 1), data.begin() + i);
+    }
+    return data;
+}
+
+// Feed the data in pieces, like a streamed backup does, and return where the chunks end
+static std::vector<size_t> find_cuts(Chunker& chunker, const std::vector<uint8_t>& data) {
+    std::vector<size_t> cuts;
+    for (size_t offset = 0; offset < data.size();) {
+        size_t size = std::min(PIECE_SIZE, data.size() - offset);
+        size_t cut = chunker.find_cut(data.data() + offset, size);
+        offset += cut ? cut : size;
+        if (cut) {
+            cuts.push_back(offset);
+        }
+    }
+    if (cuts.empty() || cuts.back() != data.size()) {
+        cuts.push_back(data.size());
+    }
+    return cuts;
+}
+
+static std::set<utils::Sha256::Digest> hash_chunks(const std::vector<uint8_t>& data, const std::vector<size_t>& cuts) {
+    std::set<utils::Sha256::Digest> hashes;
+    size_t start = 0;
+    for (size_t cut : cuts) {
+        hashes.insert(utils::Sha256::hash(data.data() + start, cut - start));
+        start = cut;
+    }
+    return hashes;
+}
+
+template <typename MakeChunker>
+static void run(const std::string& name, MakeChunker make_chunker, const std::vector<uint8_t>& data,
+                const std::vector<uint8_t>& changed) {
+    std::unique_ptr<Chunker> chunker = make_chunker();
+    auto start = steady_clock::now();
+    std::vector<size_t> cuts = find_cuts(*chunker, data);
+    double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    // Bytes of the changed data that are in chunks the original data doesn't have, and must be stored again
+    std::set<utils::Sha256::Digest> original = hash_chunks(data, cuts);
+    chunker = make_chunker();
+    std::vector<size_t> changed_cuts = find_cuts(*chunker, changed);
+    uint64_t new_bytes = 0;
+    size_t new_chunks = 0;
+    size_t chunk_start = 0;
+    for (size_t cut : changed_cuts) {
+        if (original.count(utils::Sha256::hash(changed.data() + chunk_start, cut - chunk_start)) == 0) {
+            new_bytes += cut - chunk_start;
+            new_chunks++;
+        }
+        chunk_start = cut;
+    }
+
+    std::cout << name << "\n"
+              << "  throughput (MiB/s): " << data.size() / seconds / (1024 * 1024) << "\n"
+              << "  chunks: " << cuts.size() << " average size (KiB): " << data.size() / cuts.size() / 1024.0 << "\n"
+              << "  after inserts, chunks found again: " << changed_cuts.size() - new_chunks << " of " << changed_cuts.size() << "\n"
+              << "  after inserts, bytes stored again (MiB): " << new_bytes / (1024.0 * 1024) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size_mib = argc > 1 ? std::stoul(argv[1]) : 256;
+    size_t average_kib = argc > 2 ? std::stoul(argv[2]) : 1024;
+    size_t num_inserts = argc > 3 ? std::stoul(argv[3]) : 10;
+    size_t average = average_kib * 1024;
+
+    std::mt19937_64 generator(42);
+    std::vector<uint8_t> data = random_data(size_mib * 1024 * 1024, generator);
+    std::vector<uint8_t> changed = data;
+    for (size_t i = 0; i < num_inserts; i++) {
+        size_t offset = generator() % changed.size();
+        changed.insert(changed.begin() + offset, 1 + generator() % 100, static_cast<uint8_t>(generator()));
+    }
+    std::cout << "data (MiB): " << size_mib << " inserts: " << num_inserts << "\n" << std::endl;
+
+    run("fixed size", [&]() { return std::make_unique<FixedSizeChunker>(average); }, data, changed);
+    run("content defined", [&]() { return std::make_unique<ContentDefinedChunker>(average / 4, average, average * 4); }, data, changed);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/**
+ * @brief Backs up log-like and random data to a chunk store with compression off and on, and reports the
+ * disk usage, the CPU time the backup takes per GiB and the restore throughput of both kinds of clients:
+ * legacy ones, which get the file decompressed, and ones that ask for the chunks as they're stored, e.g:
+ *   compression_benchmark 256
+ * The size is in MiB and defaults to 256.
+ *
+ */
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "Maman14/Server/chunk_store.h"
+#include "Maman14/Server/user_backup_directory.h"
+
+namespace bfs = boost::filesystem;
+using std::chrono::steady_clock;
+
+static const size_t PIECE_SIZE = 1024 * 1024;
+static const double MIB = 1024 * 1024;
+
+static std::vector<uint8_t> log_data(size_t size, std::mt19937_64& generator) {
+    static const std::vector<std::string> levels = {"INFO", "DEBUG", "WARNING", "ERROR"};
+    std::vector<uint8_t> data;
+    data.reserve(size + 256);
+    while (data.size() < size) {
+        std::string line = "2022-06-0" + std::to_string(generator() % 10) + " " + levels[generator() % levels.size()] +
+                           " request " + std::to_string(generator() % 100000) + " took " +
+                           std::to_string(generator() % 1000) + "ms\n";
+        data.insert(data.end(), line.begin(), line.end());
+    }
+    data.resize(size);
+    return data;
+}
+
+static std::vector<uint8_t> random_data(size_t size, std::mt19937_64& generator) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t value = generator();
+        std::copy(reinterpret_cast<uint8_t*>(&value), reinterpret_cast<uint8_t*>(&value + 1), data.begin() + i);
+    }
+    return data;
+}
+
+static double cpu_seconds() {
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+}
+
+// Reads the segments like a restore sends them, and returns how many bytes were sent
+template <typename GetSegment>
+static uint64_t read_segments(size_t num_segments, GetSegment get_segment) {
+    std::vector<uint8_t> buffer;
+    uint64_t sent = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        FileSegment segment = get_segment(i);
+        if (!segment.data) {
+            buffer.resize(segment.size);
+            if (pread(segment.fd, buffer.data(), segment.size, segment.offset) != static_cast<ssize_t>(segment.size)) {
+                throw std::runtime_error("Failed to read a segment");
+            }
+        }
+        sent += segment.size;
+    }
+    return sent;
+}
+
+static void run(const std::string& name, const std::vector<uint8_t>& data, bool compression) {
+    bfs::path root = bfs::temp_directory_path() / "compression_benchmark";
+    bfs::remove_all(root);
+    bfs::create_directories(root / "user");
+    ChunkStoreOptions options;
+    options.compression = compression;
+    ChunkStore chunk_store(root / "chunks", options);
+    UserBackupDirectory directory(root / "user", &chunk_store);
+
+    double start_cpu = cpu_seconds();
+    std::unique_ptr<BackupFileWriter> writer{directory.begin_backup("file")};
+    for (size_t offset = 0; offset < data.size(); offset += PIECE_SIZE) {
+        writer->write(data.data() + offset, std::min(PIECE_SIZE, data.size() - offset));
+    }
+    writer->commit();
+    double backup_cpu = cpu_seconds() - start_cpu;
+    ChunkStoreStatistics statistics = chunk_store.get_statistics();
+
+    std::unique_ptr<BackupFileReader> reader{directory.open_backup_file("file")};
+    // The legacy restore walks the file by offset, decompressing a window at a time
+    auto start = steady_clock::now();
+    uint64_t offset = 0;
+    while (offset < data.size()) {
+        offset += read_segments(1, [&](size_t) { return reader->get_segment(offset); });
+    }
+    double decoded_seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    start = steady_clock::now();
+    uint64_t stored_sent = read_segments(reader->get_num_stored_segments(),
+                                         [&](size_t i) { return reader->get_stored_segment(i).stored; });
+    double stored_seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    std::cout << name << (compression ? ", compressed" : ", raw") << "\n"
+              << "  disk (MiB): " << statistics.disk_bytes / MIB << " of " << statistics.stored_bytes / MIB
+              << " ratio: " << statistics.get_compression_ratio() << "\n"
+              << "  backup CPU (s/GiB): " << backup_cpu / (data.size() / (1024 * MIB)) << "\n"
+              << "  legacy restore (MiB/s): " << data.size() / decoded_seconds / MIB << "\n"
+              << "  stored restore (MiB/s of file): " << data.size() / stored_seconds / MIB
+              << " sent (MiB): " << stored_sent / MIB << std::endl;
+    bfs::remove_all(root);
+}
+
+int main(int argc, char* argv[]) {
+    size_t size_mib = argc > 1 ? std::stoul(argv[1]) : 256;
+    std::mt19937_64 generator(42);
+    std::vector<uint8_t> logs = log_data(size_mib * 1024 * 1024, generator);
+    std::vector<uint8_t> random = random_data(size_mib * 1024 * 1024, generator);
+    std::cout << "data (MiB): " << size_mib << "\n" << std::endl;
+
+    run("logs", logs, false);
+    run("logs", logs, true);
+    run("random", random, false);
+    run("random", random, true);
+    return 0;
+}
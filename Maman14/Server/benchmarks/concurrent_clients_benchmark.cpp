@@ -0,0 +1,244 @@
+/**
+ * @brief Opens num_clients connections to a running server at the same time,
+ * sends a LIST_FILES request on each of them and waits for all of the responses, e.g:
+ *   ulimit -n 65536 && concurrent_clients_benchmark 127.0.0.1 1337 10000
+ * With --compare it starts the server in this process instead, once with a thread per connection like it
+ * used to be and once on the io_context pool, on the port and the one after it, and reports both, e.g:
+ *   ulimit -n 65536 && concurrent_clients_benchmark --compare 1337 10000
+ *
+ */
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/log/core.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Maman14/Server/boost_connection_manager.h"
+#include "Maman14/Server/request_parser.h"
+#include "Maman14/Server/request_reader.h"
+#include "Maman14/Server/server.h"
+
+namespace bfs = boost::filesystem;
+using boost::asio::ip::tcp;
+using boost::system::error_code;
+using std::chrono::steady_clock;
+
+static const uint8_t LIST_FILES_OP = 202;
+static const uint8_t PROTOCOL_VERSION = 1;
+// version (1) + op (2)
+static const size_t RESPONSE_HEADER_SIZE = 3;
+
+struct BenchmarkClient {
+    BenchmarkClient(boost::asio::io_context& io, uint32_t user_id) : socket(io), request{}, response{} {
+        request[0] = user_id & 0xff;
+        request[1] = (user_id >> 8) & 0xff;
+        request[2] = (user_id >> 16) & 0xff;
+        request[3] = (user_id >> 24) & 0xff;
+        request[4] = PROTOCOL_VERSION;
+        request[5] = LIST_FILES_OP;
+    }
+
+    tcp::socket socket;
+    // A client that failed to connect was already counted as a failure, and sends nothing
+    bool connected = false;
+    std::array<uint8_t, 6> request;
+    std::array<uint8_t, RESPONSE_HEADER_SIZE> response;
+};
+
+struct BenchmarkResults {
+    size_t connected = 0;
+    size_t responses = 0;
+    size_t failures = 0;
+    std::chrono::milliseconds connect_time{0};
+    std::chrono::milliseconds total_time{0};
+};
+
+static BenchmarkResults run_clients(const std::string& host, const std::string& port, size_t num_clients) {
+    boost::asio::io_context io;
+    tcp::resolver resolver(io);
+    auto endpoints = resolver.resolve(host, port);
+
+    std::vector<std::unique_ptr<BenchmarkClient>> clients;
+    BenchmarkResults results;
+    auto start = steady_clock::now();
+    steady_clock::time_point all_connected;
+
+    // Every client connects first, and only once all of them are connected do we send the requests,
+    // so the server really has num_clients concurrent sessions
+    auto send_requests = [&]() {
+        all_connected = steady_clock::now();
+        for (auto& client : clients) {
+            BenchmarkClient* c = client.get();
+            if (!c->connected) {
+                continue;
+            }
+            boost::asio::async_write(c->socket, boost::asio::buffer(c->request), [&, c](const error_code& error, size_t) {
+                if (error) {
+                    results.failures++;
+                    return;
+                }
+                boost::asio::async_read(c->socket, boost::asio::buffer(c->response), [&, c](const error_code& error, size_t) {
+                    if (error) {
+                        results.failures++;
+                        return;
+                    }
+                    results.responses++;
+                    c->socket.close();
+                });
+            });
+        }
+    };
+
+    for (size_t i = 0; i < num_clients; i++) {
+        clients.push_back(std::make_unique<BenchmarkClient>(io, static_cast<uint32_t>(i + 1)));
+        BenchmarkClient* c = clients.back().get();
+        boost::asio::async_connect(c->socket, endpoints, [&, c](const error_code& error, const tcp::endpoint&) {
+            if (error) {
+                results.failures++;
+            } else {
+                c->connected = true;
+                results.connected++;
+            }
+            if (results.connected + results.failures == num_clients) {
+                send_requests();
+            }
+        });
+    }
+
+    io.run();
+    auto end = steady_clock::now();
+    results.connect_time = std::chrono::duration_cast<std::chrono::milliseconds>(all_connected - start);
+    results.total_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    return results;
+}
+
+static void print_results(const std::string& name, const BenchmarkResults& results) {
+    auto total_ms = results.total_time.count();
+    std::cout << name << "\n"
+              << "  connected: " << results.connected << "\n"
+              << "  responses: " << results.responses << "\n"
+              << "  failures: " << results.failures << "\n"
+              << "  time to connect all (ms): " << results.connect_time.count() << "\n"
+              << "  total time (ms): " << total_ms << "\n"
+              << "  requests/sec: " << (total_ms ? results.responses * 1000 / total_ms : results.responses) << std::endl;
+}
+
+// Wait until the server listens, the probe's session just ends without a request
+static void wait_for_server(const std::string& port) {
+    boost::asio::io_context io;
+    tcp::resolver resolver(io);
+    auto endpoints = resolver.resolve("127.0.0.1", port);
+    for (;;) {
+        tcp::socket socket(io);
+        error_code error;
+        boost::asio::connect(socket, endpoints, error);
+        if (!error) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+/**
+ * @brief Serve connections like the server used to: each on a thread of its own, which blocks on its
+ * connection and handles the request itself. The requests are handled by the same Server as the pool's,
+ * so only the way the connections are served differs. Returns once stopping is set and accept wakes up
+ *
+ */
+static void serve_thread_per_connection(shared_ptr<Server> server, tcp::acceptor& acceptor, const std::atomic<bool>& stopping) {
+    for (;;) {
+        auto client_socket = std::make_unique<tcp::socket>(acceptor.get_executor());
+        error_code error;
+        acceptor.accept(*client_socket, error);
+        if (stopping) {
+            return;
+        }
+        if (error) {
+            continue;
+        }
+        client_socket->set_option(tcp::no_delay(true));
+        std::thread([server, client_socket = std::move(client_socket)]() mutable {
+            try {
+                auto connection = std::make_shared<BoostConnectionManager>(std::move(client_socket));
+                RequestParser parser(std::make_unique<RequestReader>(connection));
+                Reply reply{server->handleRequest(parser.parse_message(PROTOCOL_VERSION))};
+                ResponseBuffers buffers{*reply.response};
+                connection->send(buffers.buffers());
+            } catch (const std::exception&) {
+                // The client went away, like the probe of wait_for_server does before sending a request
+            }
+        }).detach();
+    }
+}
+
+static BenchmarkResults run_thread_per_connection(shared_ptr<Server> server, unsigned short port, size_t num_clients) {
+    boost::asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+    std::atomic<bool> stopping{false};
+    std::thread serving([&]() { serve_thread_per_connection(server, acceptor, stopping); });
+
+    BenchmarkResults results = run_clients("127.0.0.1", std::to_string(port), num_clients);
+    // A blocked accept doesn't notice the acceptor closing, so wake it up with one more connection
+    stopping = true;
+    tcp::socket wake_up(io);
+    wake_up.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+    serving.join();
+    return results;
+}
+
+// Serve the clients from a server in this process, with a fresh backup directory
+static BenchmarkResults run_in_process(unsigned short port, size_t num_clients, bool thread_per_connection) {
+    bfs::path directory = bfs::temp_directory_path() / bfs::unique_path("concurrent_clients_%%%%%%%%");
+    ServerOptions options;
+    options.index_snapshot = false;
+    shared_ptr<Server> server = Server::get_server(port, directory, options);
+    BenchmarkResults results;
+    if (thread_per_connection) {
+        results = run_thread_per_connection(server, port, num_clients);
+    } else {
+        std::thread serving([server]() { server->serve_requests(); });
+        wait_for_server(std::to_string(port));
+        results = run_clients("127.0.0.1", std::to_string(port), num_clients);
+        server->stop();
+        serving.join();
+    }
+    bfs::remove_all(directory);
+    return results;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> <num_clients>\n"
+                  << "       " << argv[0] << " --compare <port> <num_clients>" << std::endl;
+        return 1;
+    }
+
+    size_t num_clients = std::stoul(argv[3]);
+    std::cout << "clients: " << num_clients << std::endl;
+    if (std::strcmp(argv[1], "--compare") != 0) {
+        BenchmarkResults results = run_clients(argv[1], argv[2], num_clients);
+        print_results("server at " + std::string(argv[1]) + ":" + argv[2], results);
+        return results.failures == 0 ? 0 : 1;
+    }
+
+    // Every session would log, which is slower than the sessions themselves
+    boost::log::core::get()->set_logging_enabled(false);
+    unsigned short port = static_cast<unsigned short>(std::stoul(argv[2]));
+    BenchmarkResults baseline = run_in_process(port, num_clients, true);
+    print_results("thread per connection", baseline);
+    BenchmarkResults pool = run_in_process(port + 1, num_clients, false);
+    print_results("io_context pool", pool);
+    if (baseline.total_time.count() > 0 && pool.total_time.count() > 0) {
+        std::cout << "speedup of the pool: " << static_cast<double>(baseline.total_time.count()) / pool.total_time.count()
+                  << "x" << std::endl;
+    }
+    return baseline.failures == 0 && pool.failures == 0 ? 0 : 1;
+}
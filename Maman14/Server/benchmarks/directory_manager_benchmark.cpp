@@ -0,0 +1,71 @@
+/**
+ * @brief Runs backups, restores, listings and deletes of many users from several threads at once
+ * against a BackupDirectoryManager, and reports the throughput and how long the threads waited
+ * for the manager's locks. Run it with a single shard to see how a single lock does, e.g:
+ *   directory_manager_benchmark 8 1000 4096 64
+ *   directory_manager_benchmark 8 1000 4096 1
+ *
+ */
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Maman14/Server/backup_directory_manager.h"
+
+using std::chrono::steady_clock;
+
+static const size_t USERS_PER_THREAD = 16;
+
+static void run_thread(BackupDirectoryManager& manager, size_t thread_index, size_t iterations, const vector<uint8_t>& payload) {
+    for (size_t i = 0; i < iterations; i++) {
+        user_id_t user_id = static_cast<user_id_t>(thread_index * USERS_PER_THREAD + i % USERS_PER_THREAD);
+        string filename = "file_" + std::to_string(i);
+        manager.backup_file_for_user_id(user_id, filename, payload);
+        manager.get_file_content_for_user(user_id, filename);
+        manager.get_backup_filenames_for_user(user_id);
+        manager.delete_file_for_user(user_id, filename);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <num_threads> <iterations_per_thread> <payload_size> <num_shards>" << std::endl;
+        return 1;
+    }
+
+    size_t num_threads = std::stoul(argv[1]);
+    size_t iterations = std::stoul(argv[2]);
+    vector<uint8_t> payload(std::stoul(argv[3]), 'p');
+    size_t num_shards = std::stoul(argv[4]);
+
+    bfs::path root = bfs::temp_directory_path() / bfs::unique_path("directory_manager_benchmark_%%%%%%%%");
+    {
+        BackupDirectoryManager manager(root, num_shards);
+        auto start = steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(run_thread, std::ref(manager), i, iterations, std::cref(payload));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+        // Every iteration does 4 operations
+        size_t operations = num_threads * iterations * 4;
+        const LockStatistics& statistics = manager.get_lock_statistics();
+        std::cout << "threads: " << num_threads << " shards: " << num_shards << "\n"
+                  << "operations/sec: " << operations / seconds << "\n"
+                  << "lock acquisitions: " << statistics.get_acquisitions() << "\n"
+                  << "contended acquisitions: " << statistics.get_contended_acquisitions() << "\n"
+                  << "total lock wait (ms): " << std::chrono::duration<double, std::milli>(statistics.get_total_wait_time()).count() << "\n"
+                  << "max lock wait (us): " << std::chrono::duration<double, std::micro>(statistics.get_max_wait_time()).count()
+                  << std::endl;
+    }
+    bfs::remove_all(root);
+    return 0;
+}
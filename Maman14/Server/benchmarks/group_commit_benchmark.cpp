@@ -0,0 +1,95 @@
+/**
+ * @brief Backs up small files from many threads at once, each to a user directory of its own, and reports
+ * the throughput and the latency percentiles of a backup, which returns once it's durable,
+ * with the syncs of each backup on its own and with group commit. Both files of their own and packed files are run, e.g:
+ *   group_commit_benchmark 16 200 4
+ * The arguments are the number of threads, the backups per thread and the size in KiB, and default to 16 threads
+ * of 200 backups of 4 KiB.
+ *
+ */
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Maman14/Server/group_commit.h"
+#include "Maman14/Server/pack_store.h"
+#include "Maman14/Server/user_backup_directory.h"
+
+namespace bfs = boost::filesystem;
+using std::chrono::steady_clock;
+
+static double get_percentile(const std::vector<double>& sorted, double percentile) {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * percentile))];
+}
+
+static void run(const std::string& name, size_t num_threads, size_t num_backups, size_t file_size,
+                std::optional<PackStoreOptions> packing, std::optional<GroupCommitOptions> group_commit) {
+    bfs::path root = bfs::temp_directory_path() / "group_commit_benchmark";
+    bfs::remove_all(root);
+    std::unique_ptr<GroupCommitter> committer;
+    if (group_commit) {
+        committer = std::make_unique<GroupCommitter>(*group_commit);
+    }
+    std::vector<std::unique_ptr<UserBackupDirectory>> directories;
+    for (size_t i = 0; i < num_threads; i++) {
+        bfs::create_directories(root / std::to_string(i));
+        directories.push_back(std::make_unique<UserBackupDirectory>(root / std::to_string(i), nullptr, packing, committer.get()));
+    }
+
+    std::vector<std::vector<double>> latencies(num_threads);
+    auto start = steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; i++) {
+        threads.emplace_back([&, i]() {
+            std::vector<uint8_t> content(file_size, 'x');
+            for (size_t j = 0; j < num_backups; j++) {
+                auto backup_start = steady_clock::now();
+                directories[i]->backup_file("file" + std::to_string(j), content);
+                latencies[i].push_back(std::chrono::duration<double, std::micro>(steady_clock::now() - backup_start).count());
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    std::vector<double> all_latencies;
+    for (const auto& thread_latencies : latencies) {
+        all_latencies.insert(all_latencies.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    std::sort(all_latencies.begin(), all_latencies.end());
+    std::cout << name << "\n"
+              << "  backups/s: " << all_latencies.size() / seconds << "\n"
+              << "  p50 latency (us): " << get_percentile(all_latencies, 0.5) << "\n"
+              << "  p99 latency (us): " << get_percentile(all_latencies, 0.99) << std::endl;
+    if (committer) {
+        std::cout << "  " << committer->get_statistics().to_string() << std::endl;
+    }
+    directories.clear();
+    bfs::remove_all(root);
+}
+
+int main(int argc, char* argv[]) {
+    size_t num_threads = argc > 1 ? std::stoul(argv[1]) : 16;
+    size_t num_backups = argc > 2 ? std::stoul(argv[2]) : 200;
+    size_t file_size = (argc > 3 ? std::stoul(argv[3]) : 4) * 1024;
+    std::cout << "threads: " << num_threads << " backups per thread: " << num_backups
+              << " size (KiB): " << file_size / 1024 << "\n" << std::endl;
+
+    run("file per backup, sync per backup", num_threads, num_backups, file_size, std::nullopt, std::nullopt);
+    run("file per backup, group commit", num_threads, num_backups, file_size, std::nullopt, GroupCommitOptions());
+    GroupCommitOptions sync_filesystem;
+    sync_filesystem.sync_filesystem = true;
+    run("file per backup, group commit with syncfs", num_threads, num_backups, file_size, std::nullopt, sync_filesystem);
+    run("packed, sync per backup", num_threads, num_backups, file_size, PackStoreOptions(), std::nullopt);
+    run("packed, group commit", num_threads, num_backups, file_size, PackStoreOptions(), GroupCommitOptions());
+    return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * @brief Restores and deletes files from several threads at once, where 9 of every 10 requests are for files
+ * that were never backed up (half of them of users that have no backups at all), as a misconfigured agent sends.
+ * The requests are handled as the server does: a miss is caught as FileNotFoundException or BackupDirectoryForUserNotFound,
+ * and with the lookup filter a definite miss is answered before looking the file up at all. Reports the ops/sec
+ * with and without the filter, e.g:
+ *   lookup_filter_benchmark 4 200000
+ *
+ */
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Maman14/Server/backup_directory_manager.h"
+
+using std::chrono::steady_clock;
+
+static const size_t NUM_USERS = 100;
+static const size_t FILES_PER_USER = 100;
+
+struct Counts {
+    size_t found = 0;
+    size_t not_found = 0;
+};
+
+static bool restore(const BackupDirectoryManager& manager, user_id_t user_id, const string& filename) {
+    if (!manager.might_have_file(user_id, filename)) {
+        return false;
+    }
+    try {
+        manager.open_file_for_restore(user_id, filename);
+        return true;
+    } catch (const FileNotFoundException& e) {
+        return false;
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        return false;
+    }
+}
+
+static bool delete_file(BackupDirectoryManager& manager, user_id_t user_id, const string& filename) {
+    if (!manager.might_have_file(user_id, filename)) {
+        return false;
+    }
+    try {
+        manager.delete_file_for_user(user_id, filename);
+        return true;
+    } catch (const FileNotFoundException& e) {
+        return false;
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        return false;
+    }
+}
+
+static void run_thread(BackupDirectoryManager& manager, size_t iterations, Counts& counts) {
+    for (size_t i = 0; i < iterations; i++) {
+        user_id_t user_id = static_cast<user_id_t>(i % NUM_USERS);
+        string filename = "file_" + std::to_string((i / NUM_USERS) % FILES_PER_USER);
+        if (i % 10 == 0) {
+            // The only hits
+            counts.found += restore(manager, user_id, filename);
+            continue;
+        }
+        if (i % 2 == 0) {
+            user_id += NUM_USERS;
+        } else {
+            filename = "missing_" + filename;
+        }
+        if ((i / 10) % 2 == 0) {
+            counts.not_found += !restore(manager, user_id, filename);
+        } else {
+            counts.not_found += !delete_file(manager, user_id, filename);
+        }
+    }
+}
+
+static void run(const string& name, size_t num_threads, size_t iterations, std::optional<MembershipFilterOptions> lookup_filter) {
+    bfs::path root = bfs::temp_directory_path() / bfs::unique_path("lookup_filter_benchmark_%%%%%%%%");
+    {
+        BackupDirectoryManager manager(root, BackupDirectoryManager::DEFAULT_NUM_SHARDS, std::nullopt, std::nullopt, std::nullopt,
+                                       lookup_filter);
+        for (user_id_t user_id = 0; user_id < NUM_USERS; user_id++) {
+            for (size_t i = 0; i < FILES_PER_USER; i++) {
+                manager.backup_file_for_user_id(user_id, "file_" + std::to_string(i), vector<uint8_t>{'x'});
+            }
+        }
+
+        vector<Counts> counts(num_threads);
+        auto start = steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(run_thread, std::ref(manager), iterations, std::ref(counts[i]));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+        Counts total;
+        for (const auto& thread_counts : counts) {
+            total.found += thread_counts.found;
+            total.not_found += thread_counts.not_found;
+        }
+        size_t operations = total.found + total.not_found;
+        std::cout << name << "\n"
+                  << "  ops/s: " << operations / seconds << "\n"
+                  << "  misses: " << static_cast<double>(total.not_found) / operations << std::endl;
+        if (const MembershipFilter* filter = manager.get_lookup_filter()) {
+            std::cout << "  " << filter->get_statistics().to_string() << std::endl;
+        }
+    }
+    bfs::remove_all(root);
+}
+
+int main(int argc, char* argv[]) {
+    size_t num_threads = argc > 1 ? std::stoul(argv[1]) : std::thread::hardware_concurrency();
+    size_t iterations = argc > 2 ? std::stoul(argv[2]) : 200000;
+    std::cout << "threads: " << num_threads << " requests per thread: " << iterations << "\n" << std::endl;
+    run("unfiltered", num_threads, iterations, std::nullopt);
+    run("filtered", num_threads, iterations, MembershipFilterOptions());
+    return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * @brief Backs up many small files to a user's directory, restores and deletes them, and reports the
+ * ops/sec of each with a file per backup, with deduplicated files (a manifest and a chunk each) and with packing.
+ * After packing, most of the files are deleted and the time compaction takes is reported, e.g:
+ *   pack_benchmark 20000 4
+ * The size is in KiB, and defaults to 20000 files of 4 KiB.
+ *
+ */
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/chunk_store.h"
+#include "Maman14/Server/pack_store.h"
+#include "Maman14/Server/user_backup_directory.h"
+
+namespace bfs = boost::filesystem;
+using std::chrono::steady_clock;
+
+static double seconds_since(steady_clock::time_point start) {
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+static size_t count_files(const bfs::path& root) {
+    size_t num_files = 0;
+    for (bfs::recursive_directory_iterator it(root); it != bfs::recursive_directory_iterator(); it++) {
+        num_files++;
+    }
+    return num_files;
+}
+
+static void run(const std::string& name, size_t num_files, size_t file_size, bool deduplication,
+                std::optional<PackStoreOptions> packing) {
+    bfs::path root = bfs::temp_directory_path() / "pack_benchmark";
+    bfs::remove_all(root);
+    bfs::create_directories(root / "user");
+    std::unique_ptr<ChunkStore> chunk_store;
+    if (deduplication) {
+        chunk_store = std::make_unique<ChunkStore>(root / "chunks");
+    }
+    UserBackupDirectory directory(root / "user", chunk_store.get(), packing);
+
+    // Every file has its own content, so nothing is deduplicated
+    std::vector<uint8_t> content(file_size, 'x');
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < num_files; i++) {
+        std::string filename = "config" + std::to_string(i);
+        std::copy(filename.begin(), filename.end(), content.begin());
+        directory.backup_file(filename, content);
+    }
+    double backup_seconds = seconds_since(start);
+    size_t num_inodes = count_files(root);
+
+    start = steady_clock::now();
+    for (size_t i = 0; i < num_files; i++) {
+        directory.get_backup_file_content("config" + std::to_string(i));
+    }
+    double restore_seconds = seconds_since(start);
+
+    // Keep a tenth of the files, so compaction has something to copy
+    start = steady_clock::now();
+    size_t num_deleted = 0;
+    for (size_t i = 0; i < num_files; i++) {
+        if (i % 10 != 0) {
+            directory.delete_file("config" + std::to_string(i));
+            num_deleted++;
+        }
+    }
+    double delete_seconds = seconds_since(start);
+
+    std::cout << name << "\n"
+              << "  backup (ops/s): " << num_files / backup_seconds << "\n"
+              << "  restore (ops/s): " << num_files / restore_seconds << "\n"
+              << "  delete (ops/s): " << num_deleted / delete_seconds << "\n"
+              << "  files and directories on disk: " << num_inodes << std::endl;
+    if (packing) {
+        start = steady_clock::now();
+        size_t num_compacted = directory.compact_packs();
+        std::cout << "  compacted " << num_compacted << " segments in (ms): " << seconds_since(start) * 1000 << "\n"
+                  << "  " << directory.get_pack_store()->get_statistics().to_string() << std::endl;
+    }
+    bfs::remove_all(root);
+}
+
+int main(int argc, char* argv[]) {
+    size_t num_files = argc > 1 ? std::stoul(argv[1]) : 20000;
+    size_t file_size = (argc > 2 ? std::stoul(argv[2]) : 4) * 1024;
+    std::cout << "files: " << num_files << " size (KiB): " << file_size / 1024 << "\n" << std::endl;
+
+    PackStoreOptions packing;
+    // Small segments, so the deletes leave most of them to compact
+    packing.segment_size = 4 * 1024 * 1024;
+    run("file per backup", num_files, file_size, false, std::nullopt);
+    run("deduplicated", num_files, file_size, true, std::nullopt);
+    run("packed", num_files, file_size, true, packing);
+    return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * @brief Backs up a big file on a running server and restores it whole over one connection, and then in ranges
+ * fetched over several connections in parallel. Then uploads it again in parts, resumed after half of them were
+ * sent, and reports the MiB/s of each, e.g:
+ *   range_restore_benchmark 127.0.0.1 1337 256 4 8
+ * The sizes are in MiB, and default to a file of 256 MiB, over 4 connections in parts of 8 MiB.
+ *
+ */
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using std::chrono::steady_clock;
+
+// Ranges and uploads are only in version 3, whose payload sizes are u64
+static const uint8_t PROTOCOL_VERSION = 3;
+static const uint8_t BACKUP_FILE_OP = 100;
+static const uint8_t BEGIN_UPLOAD_OP = 103;
+static const uint8_t UPLOAD_PART_OP = 104;
+static const uint8_t GET_UPLOAD_STATUS_OP = 105;
+static const uint8_t FINISH_UPLOAD_OP = 106;
+static const uint8_t RESTORE_FILE_OP = 200;
+static const uint8_t DELETE_FILE_OP = 201;
+static const uint8_t RESTORE_RANGE_OP = 207;
+static const uint16_t SUCCESSFUL_RESTORE = 210;
+static const uint16_t SUCCESSFUL_BACKUP_OR_DELETE = 212;
+static const uint16_t SUCCESSFUL_RANGE_RESTORE = 216;
+static const uint16_t UPLOAD_STATUS = 217;
+static const uint32_t USER_ID = 0x7a49e;
+static const uint32_t REQUEST_ID = 1;
+static const std::string FILENAME = "big_range_file";
+
+static void push_le(std::vector<uint8_t>& buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void push_filename(std::vector<uint8_t>& buffer, const std::string& filename) {
+    push_le(buffer, filename.size(), 2);
+    buffer.insert(buffer.end(), filename.begin(), filename.end());
+}
+
+static std::vector<uint8_t> request_header(uint8_t op) {
+    std::vector<uint8_t> header;
+    push_le(header, USER_ID, 4);
+    push_le(header, PROTOCOL_VERSION, 1);
+    push_le(header, op, 1);
+    // The requests of a connection are sent one at a time, so they can share an ID
+    push_le(header, REQUEST_ID, 4);
+    return header;
+}
+
+static uint64_t read_le(tcp::socket& socket, size_t size) {
+    std::vector<uint8_t> buffer(size);
+    boost::asio::read(socket, boost::asio::buffer(buffer));
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+    }
+    return value;
+}
+
+static void read_into(tcp::socket& socket, uint8_t* data, size_t size) {
+    boost::asio::read(socket, boost::asio::buffer(data, size));
+}
+
+static void skip(tcp::socket& socket, size_t size) {
+    std::vector<uint8_t> buffer(size);
+    read_into(socket, buffer.data(), buffer.size());
+}
+
+static void expect_op(tcp::socket& socket, uint16_t expected) {
+    read_le(socket, 1);
+    uint16_t op = static_cast<uint16_t>(read_le(socket, 2));
+    if (op != expected) {
+        throw std::runtime_error("Unexpected response op: " + std::to_string(op));
+    }
+    if (read_le(socket, 4) != REQUEST_ID) {
+        throw std::runtime_error("Unexpected request ID");
+    }
+}
+
+static tcp::socket connect(boost::asio::io_context& io, const char* host, const char* port) {
+    tcp::resolver resolver(io);
+    tcp::socket socket(io);
+    boost::asio::connect(socket, resolver.resolve(host, port));
+    socket.set_option(tcp::no_delay(true));
+    return socket;
+}
+
+static void filename_request(tcp::socket& socket, uint8_t op, const std::vector<uint8_t>* payload, uint16_t expected) {
+    std::vector<uint8_t> request = request_header(op);
+    push_filename(request, FILENAME);
+    if (payload != nullptr) {
+        push_le(request, payload->size(), 8);
+    }
+    boost::asio::write(socket, boost::asio::buffer(request));
+    if (payload != nullptr) {
+        boost::asio::write(socket, boost::asio::buffer(*payload));
+    }
+    expect_op(socket, expected);
+    skip(socket, read_le(socket, 2));
+}
+
+static void restore_whole(tcp::socket& socket, std::vector<uint8_t>& content) {
+    filename_request(socket, RESTORE_FILE_OP, nullptr, SUCCESSFUL_RESTORE);
+    if (read_le(socket, 8) != content.size()) {
+        throw std::runtime_error("Unexpected restored size");
+    }
+    read_into(socket, content.data(), content.size());
+}
+
+static void restore_range(tcp::socket& socket, std::vector<uint8_t>& content, uint64_t offset, uint32_t size) {
+    std::vector<uint8_t> request = request_header(RESTORE_RANGE_OP);
+    push_filename(request, FILENAME);
+    push_le(request, offset, 8);
+    push_le(request, size, 4);
+    boost::asio::write(socket, boost::asio::buffer(request));
+
+    expect_op(socket, SUCCESSFUL_RANGE_RESTORE);
+    skip(socket, read_le(socket, 2));
+    read_le(socket, 8);
+    if (read_le(socket, 8) != offset || read_le(socket, 4) != size) {
+        throw std::runtime_error("Unexpected range");
+    }
+    read_into(socket, content.data() + offset, size);
+}
+
+// Returns how many bytes of the upload are committed
+static uint64_t read_upload_status(tcp::socket& socket, uint64_t* token = nullptr) {
+    expect_op(socket, UPLOAD_STATUS);
+    uint64_t read_token = read_le(socket, 8);
+    if (token != nullptr) {
+        *token = read_token;
+    }
+    read_le(socket, 8);
+    uint32_t num_ranges = static_cast<uint32_t>(read_le(socket, 4));
+    uint64_t committed = 0;
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        read_le(socket, 8);
+        committed += read_le(socket, 8);
+    }
+    return committed;
+}
+
+static void upload_request(tcp::socket& socket, uint8_t op, uint64_t token) {
+    std::vector<uint8_t> request = request_header(op);
+    push_le(request, token, 8);
+    boost::asio::write(socket, boost::asio::buffer(request));
+}
+
+static void upload_part(tcp::socket& socket, uint64_t token, const std::vector<uint8_t>& content, uint64_t offset, uint32_t size) {
+    std::vector<uint8_t> request = request_header(UPLOAD_PART_OP);
+    push_le(request, token, 8);
+    push_le(request, offset, 8);
+    push_le(request, size, 4);
+    std::vector<boost::asio::const_buffer> buffers{boost::asio::buffer(request), boost::asio::buffer(content.data() + offset, size)};
+    boost::asio::write(socket, buffers);
+    read_upload_status(socket);
+}
+
+// Every connection takes the next part that no other connection took, until there are none left
+template <typename Function>
+static void on_connections(std::vector<tcp::socket>& sockets, size_t num_parts, const Function& function) {
+    std::atomic<size_t> next_part{0};
+    std::vector<std::thread> threads;
+    for (auto& socket : sockets) {
+        threads.emplace_back([&]() {
+            for (size_t part = next_part++; part < num_parts; part = next_part++) {
+                function(socket, part);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+static double get_rate(size_t size, steady_clock::time_point start) {
+    return size / (1024.0 * 1024.0) / std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> [size_mib] [num_connections] [part_mib]" << std::endl;
+        return 1;
+    }
+    size_t file_size = (argc > 3 ? std::stoul(argv[3]) : 256) * 1024 * 1024;
+    size_t num_connections = std::max<size_t>(argc > 4 ? std::stoul(argv[4]) : 4, 1);
+    size_t part_size = (argc > 5 ? std::stoul(argv[5]) : 8) * 1024 * 1024;
+    size_t num_parts = (file_size + part_size - 1) / part_size;
+
+    boost::asio::io_context io;
+    std::vector<tcp::socket> sockets;
+    for (size_t i = 0; i < num_connections; i++) {
+        sockets.push_back(connect(io, argv[1], argv[2]));
+    }
+    tcp::socket& socket = sockets.front();
+    std::vector<uint8_t> content(file_size);
+    for (size_t i = 0; i < content.size(); i++) {
+        content[i] = static_cast<uint8_t>(i * 31 + i / 4096);
+    }
+    std::cout << "size (MiB): " << file_size / (1024 * 1024) << " connections: " << num_connections
+              << " part (MiB): " << part_size / (1024 * 1024) << "\n"
+              << std::endl;
+
+    auto start = steady_clock::now();
+    filename_request(socket, BACKUP_FILE_OP, &content, SUCCESSFUL_BACKUP_OR_DELETE);
+    double backup = get_rate(file_size, start);
+
+    std::vector<uint8_t> restored(file_size);
+    start = steady_clock::now();
+    restore_whole(socket, restored);
+    double whole = get_rate(file_size, start);
+    if (restored != content) {
+        throw std::runtime_error("The restored file is different");
+    }
+
+    std::fill(restored.begin(), restored.end(), 0);
+    start = steady_clock::now();
+    on_connections(sockets, num_parts, [&](tcp::socket& part_socket, size_t part) {
+        uint64_t offset = part * part_size;
+        restore_range(part_socket, restored, offset, static_cast<uint32_t>(std::min(part_size, file_size - offset)));
+    });
+    double ranges = get_rate(file_size, start);
+    if (restored != content) {
+        throw std::runtime_error("The file restored in ranges is different");
+    }
+    filename_request(socket, DELETE_FILE_OP, nullptr, SUCCESSFUL_BACKUP_OR_DELETE);
+
+    // Send half of the parts, as if the connection was cut, then ask which are there and send the rest
+    start = steady_clock::now();
+    std::vector<uint8_t> begin = request_header(BEGIN_UPLOAD_OP);
+    push_filename(begin, FILENAME);
+    push_le(begin, file_size, 8);
+    boost::asio::write(socket, boost::asio::buffer(begin));
+    uint64_t token = 0;
+    read_upload_status(socket, &token);
+    auto send_part = [&](tcp::socket& part_socket, size_t part) {
+        uint64_t offset = part * part_size;
+        upload_part(part_socket, token, content, offset, static_cast<uint32_t>(std::min(part_size, file_size - offset)));
+    };
+    on_connections(sockets, num_parts / 2, send_part);
+    upload_request(socket, GET_UPLOAD_STATUS_OP, token);
+    uint64_t committed = read_upload_status(socket);
+    on_connections(sockets, num_parts - num_parts / 2,
+                   [&](tcp::socket& part_socket, size_t part) { send_part(part_socket, committed / part_size + part); });
+    upload_request(socket, FINISH_UPLOAD_OP, token);
+    expect_op(socket, SUCCESSFUL_BACKUP_OR_DELETE);
+    skip(socket, read_le(socket, 2));
+    double upload = get_rate(file_size, start);
+
+    restore_whole(socket, restored);
+    if (restored != content) {
+        throw std::runtime_error("The uploaded file is different");
+    }
+    filename_request(socket, DELETE_FILE_OP, nullptr, SUCCESSFUL_BACKUP_OR_DELETE);
+
+    std::cout << "backup in one request (MiB/s): " << backup << "\n"
+              << "restore in one request (MiB/s): " << whole << "\n"
+              << "restore in ranges (MiB/s): " << ranges << "\n"
+              << "resumed upload in parts (MiB/s): " << upload << std::endl;
+    return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * @brief Parses a stream of requests sent over a local socket pair, once with RequestReader
+ * and once with BufferedRequestReader, and reports the time, the recv syscalls and the heap allocations
+ * each of them took, e.g:
+ *   request_reader_benchmark 100000 1024
+ *
+ */
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "Maman14/Server/buffered_request_reader.h"
+#include "Maman14/Server/connection_manager.h"
+#include "Maman14/Server/request_parser.h"
+#include "Maman14/Server/request_reader.h"
+
+using std::chrono::steady_clock;
+
+static std::atomic<size_t> allocations{0};
+
+// Every form of the global operator new and delete is replaced, so each allocation is counted and freed by the
+// counterpart of what made it
+static void* allocate(size_t size, std::align_val_t alignment = std::align_val_t(alignof(std::max_align_t))) {
+    allocations++;
+    size_t align = static_cast<size_t>(alignment);
+    // aligned_alloc wants a size that's a multiple of the alignment, and a zero size may return nullptr
+    size = (std::max<size_t>(size, 1) + align - 1) / align * align;
+    void* p = align <= alignof(std::max_align_t) ? std::malloc(size) : std::aligned_alloc(align, size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static void* allocate_nothrow(size_t size, std::align_val_t alignment = std::align_val_t(alignof(std::max_align_t))) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+// Not inlined into the deletes, or the compiler sees free called on what operator new returned
+[[gnu::noinline]] static void deallocate(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate_nothrow(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate_nothrow(size); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate_nothrow(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate_nothrow(size, alignment); }
+
+void operator delete(void* p) noexcept { deallocate(p); }
+void operator delete[](void* p) noexcept { deallocate(p); }
+void operator delete(void* p, size_t) noexcept { deallocate(p); }
+void operator delete[](void* p, size_t) noexcept { deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { deallocate(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(p); }
+
+/**
+ * @brief Receives from a socket with a recv syscall per call, and counts them
+ *
+ */
+class SocketConnectionManager : public AbstractConnectionManager {
+public:
+    SocketConnectionManager(int fd) : fd_(fd), syscalls_(0) {}
+
+    virtual void send(const vector<uint8_t>&) override {}
+
+    virtual vector<uint8_t> recv(size_t size) override {
+        vector<uint8_t> buffer(size);
+        size_t received = 0;
+        while (received < size) {
+            received += recv_some(buffer.data() + received, size - received);
+        }
+        return buffer;
+    }
+
+    virtual size_t recv_some(uint8_t* data, size_t max_size) override {
+        for (;;) {
+            syscalls_++;
+            ssize_t received = ::recv(fd_, data, max_size, 0);
+            if (received > 0) {
+                return received;
+            }
+            if (received == 0) {
+                throw std::runtime_error("Connection closed");
+            }
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+    }
+
+    size_t get_syscalls() const { return syscalls_; }
+
+private:
+    int fd_;
+    size_t syscalls_;
+};
+
+static vector<uint8_t> make_requests(size_t num_requests, size_t payload_size) {
+    vector<uint8_t> stream;
+    auto push = [&](uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            stream.push_back((value >> (8 * i)) & 0xff);
+        }
+    };
+    std::string filename = "benchmark_file.bin";
+    for (size_t i = 0; i < num_requests; i++) {
+        // Every other request is a BACKUP_FILE with a payload, the rest are RESTORE_FILE
+        bool backup = i % 2 == 0;
+        push(1234, 4);
+        push(1, 1);
+        push(backup ? 100 : 200, 1);
+        push(filename.size(), 2);
+        stream.insert(stream.end(), filename.begin(), filename.end());
+        if (backup) {
+            push(payload_size, 4);
+            stream.insert(stream.end(), payload_size, 'p');
+        }
+    }
+    return stream;
+}
+
+template <typename Reader>
+static void run(const std::string& name, const vector<uint8_t>& stream, size_t num_requests) {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    std::thread writer([&]() {
+        size_t written = 0;
+        while (written < stream.size()) {
+            ssize_t sent = ::send(fds[1], stream.data() + written, stream.size() - written, 0);
+            if (sent <= 0) {
+                break;
+            }
+            written += sent;
+        }
+    });
+
+    auto connection = std::make_shared<SocketConnectionManager>(fds[0]);
+    RequestParser parser(std::make_unique<Reader>(connection));
+    size_t allocations_before = allocations;
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < num_requests; i++) {
+        parser.parse_message(1);
+    }
+    auto end = steady_clock::now();
+    size_t allocations_after = allocations;
+    writer.join();
+    ::close(fds[0]);
+    ::close(fds[1]);
+
+    auto total_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << name << "\n"
+              << "  total time (ms): " << total_us / 1000 << "\n"
+              << "  requests/sec: " << (total_us ? num_requests * 1000000 / total_us : num_requests) << "\n"
+              << "  recv syscalls per request: " << static_cast<double>(connection->get_syscalls()) / num_requests << "\n"
+              << "  allocations per request: " << static_cast<double>(allocations_after - allocations_before) / num_requests
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <num_requests> <payload_size>" << std::endl;
+        return 1;
+    }
+
+    size_t num_requests = std::stoul(argv[1]);
+    size_t payload_size = std::stoul(argv[2]);
+    vector<uint8_t> stream = make_requests(num_requests, payload_size);
+
+    run<RequestReader>("RequestReader", stream, num_requests);
+    run<BufferedRequestReader>("BufferedRequestReader", stream, num_requests);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * @brief Backs up a file of each of the given sizes to a running server, restores it a few times
+ * and reports the restore throughput. When the server's pid is given, the server's peak RSS
+ * while restoring each size is reported as well, e.g:
+ *   restore_benchmark 127.0.0.1 1337 $(pidof server) 1 100 2048
+ * Sizes are in MiB and default to 1, 100 and 2048.
+ *
+ */
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using std::chrono::steady_clock;
+
+static const uint8_t PROTOCOL_VERSION = 1;
+static const uint8_t BACKUP_FILE_OP = 100;
+static const uint8_t RESTORE_FILE_OP = 200;
+static const uint8_t DELETE_FILE_OP = 201;
+static const uint16_t SUCCESSFUL_RESTORE = 210;
+static const uint16_t SUCCESSFUL_BACKUP_OR_DELETE = 212;
+static const uint32_t USER_ID = 0xbe7c4;
+static const size_t IO_CHUNK_SIZE = 1024 * 1024;
+static const size_t RESTORES_PER_SIZE = 3;
+
+static void push_le(std::vector<uint8_t>& buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static std::vector<uint8_t> request_header(uint8_t op, const std::string& filename) {
+    std::vector<uint8_t> header;
+    push_le(header, USER_ID, 4);
+    push_le(header, PROTOCOL_VERSION, 1);
+    push_le(header, op, 1);
+    push_le(header, filename.size(), 2);
+    header.insert(header.end(), filename.begin(), filename.end());
+    return header;
+}
+
+static uint64_t read_le(tcp::socket& socket, size_t size) {
+    std::vector<uint8_t> buffer(size);
+    boost::asio::read(socket, boost::asio::buffer(buffer));
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+    }
+    return value;
+}
+
+// Reads the response up to and including the filename, and returns its op
+static uint16_t read_response_header(tcp::socket& socket) {
+    read_le(socket, 1);
+    uint16_t op = static_cast<uint16_t>(read_le(socket, 2));
+    if (op != SUCCESSFUL_RESTORE && op != SUCCESSFUL_BACKUP_OR_DELETE) {
+        return op;
+    }
+    std::vector<uint8_t> filename(read_le(socket, 2));
+    boost::asio::read(socket, boost::asio::buffer(filename));
+    return op;
+}
+
+static void expect_op(uint16_t op, uint16_t expected) {
+    if (op != expected) {
+        throw std::runtime_error("Unexpected response op: " + std::to_string(op));
+    }
+}
+
+static void backup(const tcp::resolver::results_type& endpoints, const std::string& filename, uint64_t size) {
+    boost::asio::io_context io;
+    tcp::socket socket(io);
+    boost::asio::connect(socket, endpoints);
+
+    std::vector<uint8_t> header = request_header(BACKUP_FILE_OP, filename);
+    push_le(header, size, 4);
+    boost::asio::write(socket, boost::asio::buffer(header));
+
+    std::vector<uint8_t> chunk(IO_CHUNK_SIZE, 'b');
+    for (uint64_t sent = 0; sent < size; sent += chunk.size()) {
+        boost::asio::write(socket, boost::asio::buffer(chunk.data(), std::min<uint64_t>(chunk.size(), size - sent)));
+    }
+    expect_op(read_response_header(socket), SUCCESSFUL_BACKUP_OR_DELETE);
+}
+
+static void restore(const tcp::resolver::results_type& endpoints, const std::string& filename, uint64_t size) {
+    boost::asio::io_context io;
+    tcp::socket socket(io);
+    boost::asio::connect(socket, endpoints);
+    boost::asio::write(socket, boost::asio::buffer(request_header(RESTORE_FILE_OP, filename)));
+
+    expect_op(read_response_header(socket), SUCCESSFUL_RESTORE);
+    uint64_t payload_size = read_le(socket, 4);
+    if (payload_size != size) {
+        throw std::runtime_error("Restored " + std::to_string(payload_size) + " bytes instead of " + std::to_string(size));
+    }
+    std::vector<uint8_t> chunk(IO_CHUNK_SIZE);
+    for (uint64_t received = 0; received < size; received += chunk.size()) {
+        boost::asio::read(socket, boost::asio::buffer(chunk.data(), std::min<uint64_t>(chunk.size(), size - received)));
+    }
+}
+
+static void delete_file(const tcp::resolver::results_type& endpoints, const std::string& filename) {
+    boost::asio::io_context io;
+    tcp::socket socket(io);
+    boost::asio::connect(socket, endpoints);
+    boost::asio::write(socket, boost::asio::buffer(request_header(DELETE_FILE_OP, filename)));
+    expect_op(read_response_header(socket), SUCCESSFUL_BACKUP_OR_DELETE);
+}
+
+// Returns the value of a field of /proc/<pid>/status, like "VmHWM: 1234 kB"
+static std::string read_proc_status(const std::string& pid, const std::string& field) {
+    std::ifstream status("/proc/" + pid + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind(field + ":", 0) == 0) {
+            return line.substr(field.size() + 1);
+        }
+    }
+    return " unknown";
+}
+
+// Resets the server's peak RSS, so VmHWM only covers the restores that follow
+static void reset_peak_rss(const std::string& pid) {
+    std::ofstream clear_refs("/proc/" + pid + "/clear_refs");
+    clear_refs << "5";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> [server_pid] [size_mib...]" << std::endl;
+        return 1;
+    }
+
+    std::string server_pid = argc > 3 ? argv[3] : "";
+    std::vector<uint64_t> sizes_mib;
+    for (int i = 4; i < argc; i++) {
+        sizes_mib.push_back(std::stoull(argv[i]));
+    }
+    if (sizes_mib.empty()) {
+        sizes_mib = {1, 100, 2048};
+    }
+
+    boost::asio::io_context io;
+    tcp::resolver resolver(io);
+    auto endpoints = resolver.resolve(argv[1], argv[2]);
+
+    for (uint64_t size_mib : sizes_mib) {
+        uint64_t size = size_mib * 1024 * 1024;
+        std::string filename = "restore_benchmark_" + std::to_string(size_mib);
+        backup(endpoints, filename, size);
+        if (!server_pid.empty()) {
+            reset_peak_rss(server_pid);
+        }
+
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < RESTORES_PER_SIZE; i++) {
+            restore(endpoints, filename, size);
+        }
+        auto end = steady_clock::now();
+        delete_file(endpoints, filename);
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "size (MiB): " << size_mib << "\n"
+                  << "restores: " << RESTORES_PER_SIZE << "\n"
+                  << "time per restore (ms): " << seconds * 1000 / RESTORES_PER_SIZE << "\n"
+                  << "throughput (MiB/s): " << size_mib * RESTORES_PER_SIZE / seconds << "\n";
+        if (!server_pid.empty()) {
+            std::cout << "server peak RSS while restoring:" << read_proc_status(server_pid, "VmHWM") << "\n"
+                      << "server RSS after restoring:" << read_proc_status(server_pid, "VmRSS") << "\n";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * @brief Restores files with a skewed (Zipf) popularity, interleaved with a scan that restores every file once,
+ * and reports the restores/sec and the hit rate with and without the restore cache, e.g:
+ *   restore_cache_benchmark 5000 16 8
+ * The file size is in KiB, the cache capacity in MiB, and they default to 5000 files of 16 KiB in 8 MiB,
+ * so the cache holds about a tenth of the files.
+ *
+ */
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/backup_directory_manager.h"
+
+namespace bfs = boost::filesystem;
+using std::chrono::steady_clock;
+
+static const uint32_t USER_ID = 1;
+static const size_t NUM_RESTORES = 200000;
+// Every this many restores, one is of the next file of the scan
+static const size_t SCAN_EVERY = 4;
+
+static double seconds_since(steady_clock::time_point start) {
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+static std::vector<size_t> make_workload(size_t num_files) {
+    // Zipf with an exponent of 1, as the popularity of files tends to be
+    std::vector<double> cumulative(num_files);
+    double total = 0;
+    for (size_t i = 0; i < num_files; i++) {
+        total += 1.0 / (i + 1);
+        cumulative[i] = total;
+    }
+    std::mt19937_64 random(42);
+    std::uniform_real_distribution<double> distribution(0, total);
+    std::vector<size_t> workload;
+    size_t next_scanned = 0;
+    for (size_t i = 0; i < NUM_RESTORES; i++) {
+        if (i % SCAN_EVERY == 0) {
+            workload.push_back(next_scanned++ % num_files);
+            continue;
+        }
+        auto it = std::lower_bound(cumulative.begin(), cumulative.end(), distribution(random));
+        workload.push_back(std::min<size_t>(it - cumulative.begin(), num_files - 1));
+    }
+    return workload;
+}
+
+static void run(const std::string& name, size_t num_files, size_t file_size, const std::vector<size_t>& workload,
+                std::optional<RestoreCacheOptions> restore_cache) {
+    bfs::path root = bfs::temp_directory_path() / "restore_cache_benchmark";
+    bfs::remove_all(root);
+    bfs::create_directories(root);
+    BackupDirectoryManager manager(root, BackupDirectoryManager::DEFAULT_NUM_SHARDS, std::nullopt, std::nullopt, restore_cache);
+    std::vector<uint8_t> content(file_size, 'x');
+    for (size_t i = 0; i < num_files; i++) {
+        manager.backup_file_for_user_id(USER_ID, "file" + std::to_string(i), content);
+    }
+
+    std::vector<uint8_t> buffer(file_size);
+    uint64_t bytes_restored = 0;
+    auto start = steady_clock::now();
+    for (size_t index : workload) {
+        unique_ptr<BackupFileReader> reader = manager.open_file_for_restore(USER_ID, "file" + std::to_string(index));
+        bytes_restored += reader->read(0, buffer.data(), buffer.size());
+    }
+    double seconds = seconds_since(start);
+
+    std::cout << name << "\n"
+              << "  restores (ops/s): " << workload.size() / seconds << "\n"
+              << "  throughput (MiB/s): " << bytes_restored / seconds / (1024 * 1024) << std::endl;
+    if (manager.get_restore_cache()) {
+        std::cout << "  " << manager.get_restore_cache()->get_statistics().to_string() << std::endl;
+    }
+    bfs::remove_all(root);
+}
+
+int main(int argc, char* argv[]) {
+    size_t num_files = argc > 1 ? std::stoul(argv[1]) : 5000;
+    size_t file_size = (argc > 2 ? std::stoul(argv[2]) : 16) * 1024;
+    size_t capacity = (argc > 3 ? std::stoul(argv[3]) : 8) * 1024 * 1024;
+    std::cout << "files: " << num_files << " size (KiB): " << file_size / 1024
+              << " cache (MiB): " << capacity / (1024 * 1024) << "\n" << std::endl;
+
+    std::vector<size_t> workload = make_workload(num_files);
+    RestoreCacheOptions restore_cache;
+    restore_cache.capacity = capacity;
+    run("uncached", num_files, file_size, workload, std::nullopt);
+    run("cached", num_files, file_size, workload, restore_cache);
+    return 0;
+}
@@ -1,14 +1,143 @@
 #include "boost_connection_manager.h"
 
-BoostConnectionManager::BoostConnectionManager(unique_ptr<tcp::socket> client_socket)
-    : client_socket_(std::move(client_socket)) {}
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+
+using boost::system::error_code;
+using boost::system::system_error;
+
+// sendfile transfers at most this much in a single call anyway
+static const uint64_t MAX_SENDFILE_SIZE = 0x7ffff000;
+
+BoostConnectionManager::BoostConnectionManager(unique_ptr<tcp::socket> client_socket,
+                                               std::chrono::steady_clock::duration idle_timeout)
+    : client_socket_(std::move(client_socket)),
+      idle_timeout_(idle_timeout),
+      read_timer_(client_socket_->get_executor()),
+      write_timer_(client_socket_->get_executor()),
+      timed_out_(false) {}
 
 void BoostConnectionManager::send(const vector<uint8_t>& to_send) {
     boost::asio::write(*client_socket_, boost::asio::buffer(to_send));
 }
 
+void BoostConnectionManager::send(std::span<const boost::asio::const_buffer> buffers) {
+    boost::asio::write(*client_socket_, buffers);
+}
+
 vector<uint8_t> BoostConnectionManager::recv(size_t size) {
     vector<uint8_t> recv_buf(size);
     boost::asio::read(*client_socket_, boost::asio::buffer(recv_buf));
     return recv_buf;
 }
+
+size_t BoostConnectionManager::recv_some(uint8_t* data, size_t max_size) {
+    return client_socket_->read_some(boost::asio::buffer(data, max_size));
+}
+
+void BoostConnectionManager::arm_idle_timer(boost::asio::steady_timer& timer) {
+    if (idle_timeout_ == std::chrono::steady_clock::duration::zero()) {
+        return;
+    }
+
+    // The timer shares the socket's executor, which is a strand, so this never races the pending operation
+    timer.expires_after(idle_timeout_);
+    timer.async_wait([weak_self = weak_from_this()](const error_code& error) {
+        auto self = weak_self.lock();
+        if (error || self == nullptr) {
+            return;
+        }
+        self->timed_out_ = true;
+        error_code ignored;
+        self->client_socket_->close(ignored);
+    });
+}
+
+awaitable<void> BoostConnectionManager::async_send(const vector<uint8_t>& to_send) {
+    boost::asio::const_buffer buffer{boost::asio::buffer(to_send)};
+    co_await async_send(std::span<const boost::asio::const_buffer>(&buffer, 1));
+}
+
+awaitable<void> BoostConnectionManager::async_send(std::span<const boost::asio::const_buffer> buffers) {
+    // A big response to a slow client takes long to write, but it isn't idle while its bytes are still moving,
+    // so it's written a piece at a time and each piece that's written pushes the deadline back
+    vector<boost::asio::const_buffer> remaining(buffers.begin(), buffers.end());
+    auto first = remaining.begin();
+    for (;;) {
+        while (first != remaining.end() && first->size() == 0) {
+            ++first;
+        }
+        if (first == remaining.end()) {
+            break;
+        }
+        arm_idle_timer(write_timer_);
+        size_t written = co_await client_socket_->async_write_some(std::span<const boost::asio::const_buffer>(first, remaining.end()),
+                                                                   boost::asio::use_awaitable);
+        for (; written > 0 && written >= first->size(); ++first) {
+            written -= first->size();
+        }
+        if (written > 0) {
+            *first += written;
+        }
+    }
+    write_timer_.cancel();
+}
+
+awaitable<vector<uint8_t>> BoostConnectionManager::async_recv(size_t size) {
+    vector<uint8_t> recv_buf(size);
+    // Like a write, a big read only times out if no bytes come for the whole timeout
+    size_t received = 0;
+    while (received < size) {
+        received += co_await async_recv_some(recv_buf.data() + received, size - received);
+    }
+    co_return recv_buf;
+}
+
+awaitable<size_t> BoostConnectionManager::async_recv_some(uint8_t* data, size_t max_size) {
+    arm_idle_timer(read_timer_);
+    size_t received = co_await client_socket_->async_read_some(boost::asio::buffer(data, max_size), boost::asio::use_awaitable);
+    read_timer_.cancel();
+    co_return received;
+}
+
+awaitable<uint64_t> BoostConnectionManager::async_sendfile(int file_fd, uint64_t start, uint64_t size) {
+    off_t offset = static_cast<off_t>(start);
+    uint64_t end = start + size;
+#ifdef __linux__
+    // sendfile must not block the io_context thread, so when the socket buffer is full we wait for it asynchronously
+    client_socket_->native_non_blocking(true);
+    while (static_cast<uint64_t>(offset) < end) {
+        size_t to_send = static_cast<size_t>(std::min(end - offset, MAX_SENDFILE_SIZE));
+        ssize_t sent = ::sendfile(client_socket_->native_handle(), file_fd, &offset, to_send);
+        if (sent > 0) {
+            continue;
+        }
+        if (sent == 0) {
+            // The file is shorter than we were told
+            throw system_error(boost::asio::error::eof);
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            arm_idle_timer(write_timer_);
+            co_await client_socket_->async_wait(tcp::socket::wait_write, boost::asio::use_awaitable);
+            write_timer_.cancel();
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            // This file can't be sent with sendfile, the rest is sent by the caller
+            break;
+        }
+        throw system_error(error_code(errno, boost::system::system_category()));
+    }
+#else
+    (void)file_fd;
+    (void)end;
+#endif
+    co_return static_cast<uint64_t>(offset) - start;
+}
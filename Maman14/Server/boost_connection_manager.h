@@ -1,18 +1,66 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <span>
 
+#include "async_connection_manager.h"
 #include "connection_manager.h"
 
 using boost::asio::ip::tcp;
 using std::unique_ptr;
-class BoostConnectionManager : public AbstractConnectionManager {
+class BoostConnectionManager : public AbstractConnectionManager,
+                               public AbstractAsyncConnectionManager,
+                               public std::enable_shared_from_this<BoostConnectionManager> {
 public:
-    BoostConnectionManager(unique_ptr<tcp::socket> client_socket);
+    /**
+     * @brief Construct a new Boost Connection Manager
+     *
+     * @param client_socket The connected socket
+     * @param idle_timeout If an async operation makes no progress for this long the socket is closed.
+     * A long read or write that keeps moving bytes doesn't time out. Zero means wait forever
+     */
+    BoostConnectionManager(unique_ptr<tcp::socket> client_socket,
+                           std::chrono::steady_clock::duration idle_timeout = std::chrono::steady_clock::duration::zero());
     virtual void send(const vector<uint8_t>& to_send) override;
     virtual vector<uint8_t> recv(size_t size) override;
+    virtual awaitable<void> async_send(const vector<uint8_t>& to_send) override;
+    virtual awaitable<vector<uint8_t>> async_recv(size_t size) override;
+    virtual size_t recv_some(uint8_t* data, size_t max_size) override;
+    virtual awaitable<size_t> async_recv_some(uint8_t* data, size_t max_size) override;
+
+    /**
+     * @brief Send all of the buffers with a single vectored write, without concatenating them first
+     *
+     */
+    void send(std::span<const boost::asio::const_buffer> buffers);
+    awaitable<void> async_send(std::span<const boost::asio::const_buffer> buffers);
+
+    /**
+     * @brief Send size bytes from the offset of an open file to the client with sendfile,
+     * so the kernel copies them straight from the page cache to the socket.
+     * Stops early if the file can't be sent that way, and the caller should send the rest itself
+     *
+     * @return uint64_t How many bytes were sent
+     */
+    awaitable<uint64_t> async_sendfile(int file_fd, uint64_t offset, uint64_t size);
+
+    /**
+     * @brief Whether the socket was closed because the idle timeout expired
+     *
+     */
+    bool timed_out() const { return timed_out_; };
 
 private:
+    void arm_idle_timer(boost::asio::steady_timer& timer);
+
     unique_ptr<tcp::socket> client_socket_;
+    std::chrono::steady_clock::duration idle_timeout_;
+    // A pipelined session reads the next request while it writes a response, so each direction has its own
+    // deadline, and a finished write doesn't disarm the timeout of the read that's still waiting
+    boost::asio::steady_timer read_timer_;
+    boost::asio::steady_timer write_timer_;
+    bool timed_out_;
 };
@@ -0,0 +1,55 @@
+#include "buffered_request_reader.h"
+
+#include <algorithm>
+
+BufferedRequestReader::BufferedRequestReader(shared_ptr<AbstractConnectionManager> connection, size_t buffer_size)
+    : connection_(std::move(connection)), buffer_(buffer_size) {}
+
+void BufferedRequestReader::fill(size_t size) {
+    while (buffer_.size() < size) {
+        std::span<uint8_t> free_space{buffer_.writable()};
+        buffer_.commit(connection_->recv_some(free_space.data(), free_space.size()));
+    }
+}
+
+uint32_t BufferedRequestReader::read_uint32() {
+    fill(4);
+    return buffer_.read_u32();
+}
+
+uint16_t BufferedRequestReader::read_uint16() {
+    fill(2);
+    return buffer_.read_u16();
+}
+
+uint8_t BufferedRequestReader::read_uint8() {
+    fill(1);
+    return buffer_.read_u8();
+}
+
+vector<uint8_t> BufferedRequestReader::read_bytes(size_t size) {
+    vector<uint8_t> bytes(size);
+    size_t done = std::min(size, buffer_.size());
+    buffer_.read(bytes.data(), done);
+    while (done < size) {
+        size_t remaining = size - done;
+        if (remaining >= buffer_.capacity()) {
+            // No point in going through the buffer
+            done += connection_->recv_some(bytes.data() + done, remaining);
+        } else {
+            fill(remaining);
+            buffer_.read(bytes.data() + done, remaining);
+            done = size;
+        }
+    }
+    return bytes;
+}
+
+std::span<const uint8_t> BufferedRequestReader::read_span(size_t max_size) {
+    fill(1);
+    std::span<const uint8_t> span{buffer_.readable()};
+    span = span.first(std::min(span.size(), max_size));
+    // The bytes stay where they are until the next receive
+    buffer_.consume(span.size());
+    return span;
+}
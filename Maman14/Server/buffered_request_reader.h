@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "connection_manager.h"
+#include "request_reader.h"
+#include "ring_buffer.h"
+
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * @brief A RequestReader that receives as much as is available into a ring buffer,
+ * and decodes the fields from there, so a whole request header usually costs a single recv
+ * instead of one recv and one allocation per field
+ *
+ */
+class BufferedRequestReader : public AbstractRequestReader {
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    BufferedRequestReader(shared_ptr<AbstractConnectionManager> connection, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    virtual uint32_t read_uint32() override;
+    virtual uint16_t read_uint16() override;
+    virtual uint8_t read_uint8() override;
+    virtual vector<uint8_t> read_bytes(size_t size) override;
+
+    /**
+     * @brief Read at least one and at most max_size bytes, without copying them out of the buffer.
+     * The span is only valid until the next read
+     *
+     */
+    std::span<const uint8_t> read_span(size_t max_size);
+
+private:
+    // Receive until at least size bytes are buffered. size must fit in the buffer
+    void fill(size_t size);
+
+    // We want the connection to live for as long as the request reader
+    shared_ptr<AbstractConnectionManager> connection_;
+    utils::RingBuffer buffer_;
+};
@@ -21,17 +21,24 @@ void Bytearray::push_u32(uint32_t value) {
     buffer_.push_back((value >> 24) & 0xff);
 }
 
+void Bytearray::push_u64(uint64_t value) {
+    push_u32(static_cast<uint32_t>(value & 0xffffffff));
+    push_u32(static_cast<uint32_t>(value >> 32));
+}
+
 void Bytearray::push_string(const string& value) {
     // Ignore the null terminator
-    for (size_t i = 0; i < value.size(); i++) {
-        buffer_.push_back(value[i]);
-    }
+    buffer_.insert(buffer_.end(), value.begin(), value.end());
 }
 
 void Bytearray::push_bytes(const Bytearray& value) {
     buffer_.insert(buffer_.end(), value.buffer_.begin(), value.buffer_.end());
 }
 
+void Bytearray::push_bytes(const uint8_t* data, size_t size) {
+    buffer_.insert(buffer_.end(), data, data + size);
+}
+
 void Bytearray::push_vector(const vector<uint8_t>& vec) {
     buffer_.insert(buffer_.end(), vec.begin(), vec.end());
 }
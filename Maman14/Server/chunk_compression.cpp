@@ -0,0 +1,128 @@
+#include "chunk_compression.h"
+
+#include <array>
+#include <cmath>
+#include <limits>
+
+// Below this entropy deflate finds long matches, which makes the higher levels both cheap and worth it
+static const double HIGHLY_REDUNDANT_ENTROPY = 3.0;
+// Above this entropy matches rarely pay off, and only the skew of the byte distribution can be compressed
+static const double LOW_REDUNDANCY_ENTROPY = 6.0;
+static const int FAST_LEVEL = 1;
+static const int REDUNDANT_LEVEL = 6;
+// Compressed output is appended in pieces of at least this size
+static const size_t OUTPUT_PIECE_SIZE = 64 * 1024;
+
+double estimate_entropy(const uint8_t* data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    std::array<size_t, 256> counts{};
+    for (size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count > 0) {
+            double probability = static_cast<double>(count) / size;
+            entropy -= probability * std::log2(probability);
+        }
+    }
+    return entropy;
+}
+
+CompressionLevel choose_compression_level(const uint8_t* sample, size_t size, double max_entropy) {
+    double entropy = estimate_entropy(sample, size);
+    if (entropy > max_entropy) {
+        return CompressionLevel{ChunkEncoding::RAW, 0, Z_DEFAULT_STRATEGY};
+    }
+    if (entropy > LOW_REDUNDANCY_ENTROPY) {
+        return CompressionLevel{ChunkEncoding::DEFLATE, FAST_LEVEL, Z_HUFFMAN_ONLY};
+    }
+    if (entropy > HIGHLY_REDUNDANT_ENTROPY) {
+        return CompressionLevel{ChunkEncoding::DEFLATE, FAST_LEVEL, Z_DEFAULT_STRATEGY};
+    }
+    return CompressionLevel{ChunkEncoding::DEFLATE, REDUNDANT_LEVEL, Z_DEFAULT_STRATEGY};
+}
+
+DeflateCompressor::DeflateCompressor(const CompressionLevel& level) : stream_{} {
+    if (deflateInit2(&stream_, level.level, Z_DEFLATED, MAX_WBITS, MAX_MEM_LEVEL, level.strategy) != Z_OK) {
+        throw CompressionException("Failed to initialize deflate");
+    }
+}
+
+DeflateCompressor::~DeflateCompressor() {
+    deflateEnd(&stream_);
+}
+
+void DeflateCompressor::compress(const uint8_t* data, size_t size, vector<uint8_t>& output) {
+    run(data, size, Z_NO_FLUSH, output);
+}
+
+void DeflateCompressor::finish(vector<uint8_t>& output) {
+    run(nullptr, 0, Z_FINISH, output);
+    deflateReset(&stream_);
+}
+
+void DeflateCompressor::run(const uint8_t* data, size_t size, int flush, vector<uint8_t>& output) {
+    // zlib counts in 32 bits, and doesn't change the input
+    stream_.next_in = const_cast<Bytef*>(data);
+    while (true) {
+        uInt input_size = static_cast<uInt>(std::min<size_t>(size, std::numeric_limits<uInt>::max()));
+        stream_.avail_in = input_size;
+        size_t output_start = output.size();
+        // The bound of a big input may not fit in avail_out, deflate is just called again for the rest
+        size_t output_size = std::min<size_t>(std::max<size_t>(OUTPUT_PIECE_SIZE, deflateBound(&stream_, input_size)),
+                                              std::numeric_limits<uInt>::max());
+        output.resize(output_start + output_size);
+        stream_.next_out = output.data() + output_start;
+        stream_.avail_out = static_cast<uInt>(output_size);
+
+        int result = deflate(&stream_, size == input_size ? flush : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) {
+            throw CompressionException("Failed to deflate");
+        }
+        // Drop what deflate didn't fill
+        output.erase(output.end() - stream_.avail_out, output.end());
+        size -= input_size - stream_.avail_in;
+        bool done = flush == Z_FINISH ? result == Z_STREAM_END : (size == 0 && stream_.avail_out > 0);
+        if (done) {
+            return;
+        }
+    }
+}
+
+DeflateDecompressor::DeflateDecompressor() : stream_{}, finished_(false) {
+    if (inflateInit(&stream_) != Z_OK) {
+        throw CompressionException("Failed to initialize inflate");
+    }
+}
+
+DeflateDecompressor::~DeflateDecompressor() {
+    inflateEnd(&stream_);
+}
+
+void DeflateDecompressor::reset() {
+    inflateReset(&stream_);
+    finished_ = false;
+}
+
+size_t DeflateDecompressor::decompress(const uint8_t*& input, size_t& input_size, uint8_t* output, size_t output_size) {
+    stream_.next_in = const_cast<Bytef*>(input);
+    stream_.avail_in = static_cast<uInt>(std::min<size_t>(input_size, std::numeric_limits<uInt>::max()));
+    stream_.next_out = output;
+    stream_.avail_out = static_cast<uInt>(std::min<size_t>(output_size, std::numeric_limits<uInt>::max()));
+    uInt given_input = stream_.avail_in;
+    uInt given_output = stream_.avail_out;
+
+    int result = inflate(&stream_, Z_NO_FLUSH);
+    if (result == Z_STREAM_END) {
+        finished_ = true;
+    } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        throw CompressionException("Corrupt compressed chunk");
+    }
+    size_t consumed = given_input - stream_.avail_in;
+    input += consumed;
+    input_size -= consumed;
+    return given_output - stream_.avail_out;
+}
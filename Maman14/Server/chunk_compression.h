@@ -0,0 +1,116 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+/**
+ * @brief How a chunk is stored on disk. Sent as is to clients that restore files as they are stored
+ *
+ */
+enum class ChunkEncoding : uint8_t {
+    RAW = 0,
+    // A zlib stream
+    DEFLATE = 1,
+};
+
+class CompressionException : public runtime_error {
+public:
+    CompressionException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief How the chunks of a file are compressed
+ *
+ */
+struct CompressionLevel {
+    ChunkEncoding encoding;
+    int level;
+    int strategy;
+};
+
+/**
+ * @brief Estimate how random data is, from how its bytes are distributed
+ *
+ * @return double The entropy in bits per byte, 8 for data that can't be compressed
+ */
+double estimate_entropy(const uint8_t* data, size_t size);
+
+/**
+ * @brief Pick how to compress a file by the entropy of a sample of its start.
+ * Files that look compressed already are stored raw, very redundant ones are compressed harder since
+ * deflate is fast on them anyway, and the ones in between only get their bytes entropy coded
+ * when there is too little redundancy for matches to pay off.
+ *
+ * @param max_entropy Files with more bits per byte than this are stored raw
+ */
+CompressionLevel choose_compression_level(const uint8_t* sample, size_t size, double max_entropy);
+
+/**
+ * @brief Compresses a chunk at a time with deflate, as the chunk is written
+ *
+ */
+class DeflateCompressor {
+public:
+    DeflateCompressor(const CompressionLevel& level);
+    ~DeflateCompressor();
+    DeflateCompressor(const DeflateCompressor&) = delete;
+    DeflateCompressor& operator=(const DeflateCompressor&) = delete;
+
+    /**
+     * @brief Compress more of the chunk, appending whatever is ready to the output
+     *
+     */
+    void compress(const uint8_t* data, size_t size, vector<uint8_t>& output);
+
+    /**
+     * @brief End the chunk, appending the rest of it to the output. The next call to compress starts a new chunk
+     *
+     */
+    void finish(vector<uint8_t>& output);
+
+private:
+    void run(const uint8_t* data, size_t size, int flush, vector<uint8_t>& output);
+
+    z_stream stream_;
+};
+
+/**
+ * @brief Decompresses a deflated chunk a piece at a time, so a chunk is never held whole in memory
+ *
+ */
+class DeflateDecompressor {
+public:
+    DeflateDecompressor();
+    ~DeflateDecompressor();
+    DeflateDecompressor(const DeflateDecompressor&) = delete;
+    DeflateDecompressor& operator=(const DeflateDecompressor&) = delete;
+
+    /**
+     * @brief Start decompressing a new chunk
+     *
+     */
+    void reset();
+
+    /**
+     * @brief Decompress as much of the input as fits in the output.
+     * The input pointer and size are advanced past what was consumed
+     *
+     * @return size_t How many bytes were written to the output
+     */
+    size_t decompress(const uint8_t*& input, size_t& input_size, uint8_t* output, size_t output_size);
+
+    bool finished() const { return finished_; };
+
+private:
+    z_stream stream_;
+    bool finished_;
+};
@@ -0,0 +1,251 @@
+#include "chunk_store.h"
+
+#include <unistd.h>
+
+#include <cstring>
+
+#include "sha256.h"
+
+using std::lock_guard;
+using std::mutex;
+
+ChunkNotFoundException::ChunkNotFoundException(const ContentHash& hash)
+    : runtime_error("Chunk: " + utils::Sha256::to_hex(hash) + " not found") {}
+
+double ChunkStoreStatistics::get_dedup_ratio() const {
+    return stored_bytes ? static_cast<double>(referenced_bytes) / stored_bytes : 1;
+}
+
+double ChunkStoreStatistics::get_compression_ratio() const {
+    return disk_bytes ? static_cast<double>(stored_bytes) / disk_bytes : 1;
+}
+
+double ChunkStoreStatistics::get_ingest_throughput() const {
+    double seconds = std::chrono::duration<double>(ingest_time).count();
+    return seconds > 0 ? ingested_bytes / seconds : 0;
+}
+
+string ChunkStoreStatistics::to_string() const {
+    return "chunks: " + std::to_string(num_chunks) +
+           " stored bytes: " + std::to_string(stored_bytes) +
+           " referenced bytes: " + std::to_string(referenced_bytes) +
+           " dedup ratio: " + std::to_string(get_dedup_ratio()) +
+           " disk bytes: " + std::to_string(disk_bytes) +
+           " compression ratio: " + std::to_string(get_compression_ratio()) +
+           " ingested bytes: " + std::to_string(ingested_bytes) +
+           " ingest throughput (MiB/s): " + std::to_string(get_ingest_throughput() / (1024 * 1024));
+}
+
+size_t ChunkStore::ContentHashHasher::operator()(const ContentHash& hash) const {
+    // The hash is already uniformly distributed
+    size_t value;
+    std::memcpy(&value, hash.data() + 1, sizeof(value));
+    return value;
+}
+
+ChunkStore::ChunkStore(bfs::path directory, ChunkStoreOptions options)
+    : directory_(std::move(directory)), incoming_directory_(directory_ / ".incoming"), options_(options) {
+    bfs::create_directories(incoming_directory_);
+}
+
+unique_ptr<Chunker> ChunkStore::make_chunker() const {
+    if (options_.chunking == ChunkingMethod::FIXED_SIZE) {
+        return std::make_unique<FixedSizeChunker>(options_.chunk_size);
+    }
+    return std::make_unique<ContentDefinedChunker>(options_.min_chunk_size, options_.chunk_size, options_.max_chunk_size);
+}
+
+CompressionLevel ChunkStore::choose_compression(const uint8_t* sample, size_t size) const {
+    if (!options_.compression) {
+        return CompressionLevel{ChunkEncoding::RAW, 0, 0};
+    }
+    return choose_compression_level(sample, size, options_.max_compressible_entropy);
+}
+
+bfs::path ChunkStore::make_incoming_path() const {
+    return incoming_directory_ / bfs::unique_path("%%%%-%%%%-%%%%-%%%%.chunk");
+}
+
+bfs::path ChunkStore::get_chunk_path(const ContentHash& hash, ChunkEncoding encoding) const {
+    string hex = utils::Sha256::to_hex(hash);
+    if (encoding == ChunkEncoding::DEFLATE) {
+        hex += DEFLATE_SUFFIX;
+    }
+    // Spread the chunks over subdirectories, so no directory gets too big
+    return directory_ / hex.substr(0, 2) / hex;
+}
+
+StoredChunk ChunkStore::get_stored_chunk(const ContentHash& hash) const {
+    const Shard& shard = get_shard(hash);
+    lock_guard<mutex> lock(shard.mutex);
+    auto it = shard.chunks.find(hash);
+    if (it == shard.chunks.end()) {
+        throw ChunkNotFoundException(hash);
+    }
+    return it->second.stored;
+}
+
+bool ChunkStore::add_reference(const ContentHash& hash) {
+    Shard& shard = get_shard(hash);
+    lock_guard<mutex> lock(shard.mutex);
+    auto it = shard.chunks.find(hash);
+    if (it == shard.chunks.end()) {
+        return false;
+    }
+    it->second.references++;
+    referenced_bytes_ += it->second.size;
+    return true;
+}
+
+vector<bfs::path> ChunkStore::publish(const bfs::path& incoming_path, const ContentHash& hash, uint32_t size,
+                                     std::optional<uint32_t> compressed_size) {
+    Shard& shard = get_shard(hash);
+    lock_guard<mutex> lock(shard.mutex);
+    auto it = shard.chunks.find(hash);
+    if (it != shard.chunks.end()) {
+        it->second.references++;
+        referenced_bytes_ += size;
+        ::unlink(incoming_path.c_str());
+        // Whoever published it may not have synced its rename yet
+        return {get_chunk_path(hash).parent_path()};
+    }
+
+    StoredChunk stored = compressed_size ? StoredChunk{ChunkEncoding::DEFLATE, *compressed_size} : StoredChunk{ChunkEncoding::RAW, size};
+    bfs::path chunk_path = get_chunk_path(hash, stored.encoding);
+    bool created = bfs::create_directory(chunk_path.parent_path());
+    bfs::rename(incoming_path, chunk_path);
+    add_chunk_locked(shard, hash, ChunkInfo{size, 1, stored});
+    if (created) {
+        return {chunk_path.parent_path(), directory_};
+    }
+    return {chunk_path.parent_path()};
+}
+
+void ChunkStore::add_chunk_locked(Shard& shard, const ContentHash& hash, const ChunkInfo& info) {
+    shard.chunks.insert_or_assign(hash, info);
+    num_chunks_++;
+    stored_bytes_ += info.size;
+    disk_bytes_ += info.stored.stored_size;
+    referenced_bytes_ += static_cast<uint64_t>(info.size) * info.references;
+}
+
+void ChunkStore::release(const ContentHash& hash) {
+    Shard& shard = get_shard(hash);
+    lock_guard<mutex> lock(shard.mutex);
+    release_locked(shard, hash);
+}
+
+void ChunkStore::release_locked(Shard& shard, const ContentHash& hash) {
+    auto it = shard.chunks.find(hash);
+    if (it == shard.chunks.end()) {
+        return;
+    }
+    referenced_bytes_ -= it->second.size;
+    if (--it->second.references > 0) {
+        return;
+    }
+    stored_bytes_ -= it->second.size;
+    disk_bytes_ -= it->second.stored.stored_size;
+    num_chunks_--;
+    ::unlink(get_chunk_path(hash, it->second.stored.encoding).c_str());
+    shard.chunks.erase(it);
+}
+
+void ChunkStore::acquire(const Manifest& manifest) {
+    for (size_t i = 0; i < manifest.chunks.size(); i++) {
+        if (!add_reference(manifest.chunks[i].hash)) {
+            for (size_t j = 0; j < i; j++) {
+                release(manifest.chunks[j].hash);
+            }
+            throw ChunkNotFoundException(manifest.chunks[i].hash);
+        }
+    }
+}
+
+void ChunkStore::release(const Manifest& manifest) {
+    for (const auto& chunk : manifest.chunks) {
+        release(chunk.hash);
+    }
+}
+
+void ChunkStore::restore_references(const Manifest& manifest) {
+    for (const auto& chunk : manifest.chunks) {
+        Shard& shard = get_shard(chunk.hash);
+        lock_guard<mutex> lock(shard.mutex);
+        auto it = shard.chunks.find(chunk.hash);
+        if (it == shard.chunks.end()) {
+            add_chunk_locked(shard, chunk.hash, ChunkInfo{chunk.size, 1, StoredChunk{ChunkEncoding::RAW, chunk.size}});
+            continue;
+        }
+        it->second.references++;
+        referenced_bytes_ += chunk.size;
+    }
+}
+
+void ChunkStore::load(const vector<ChunkRecord>& records) {
+    for (const auto& record : records) {
+        Shard& shard = get_shard(record.hash);
+        lock_guard<mutex> lock(shard.mutex);
+        add_chunk_locked(shard, record.hash, ChunkInfo{record.size, record.references, StoredChunk{ChunkEncoding::RAW, record.size}});
+    }
+}
+
+vector<ChunkRecord> ChunkStore::get_records() const {
+    vector<ChunkRecord> records;
+    for (const auto& shard : shards_) {
+        lock_guard<mutex> lock(shard.mutex);
+        for (const auto& [hash, info] : shard.chunks) {
+            records.push_back(ChunkRecord{hash, info.size, info.references});
+        }
+    }
+    return records;
+}
+
+size_t ChunkStore::collect_garbage() {
+    size_t removed = 0;
+    for (const auto& subdirectory : bfs::directory_iterator(directory_)) {
+        if (!bfs::is_directory(subdirectory.status())) {
+            continue;
+        }
+        bool incoming = subdirectory.path() == incoming_directory_;
+        for (const auto& entry : bfs::directory_iterator(subdirectory.path())) {
+            if (!incoming) {
+                ContentHash hash{};
+                string name = entry.path().filename().string();
+                bool compressed = bfs::path(name).extension() == DEFLATE_SUFFIX;
+                bool is_chunk = name.size() == hash.size() * 2 + (compressed ? std::strlen(DEFLATE_SUFFIX) : 0);
+                for (size_t i = 0; is_chunk && i < hash.size(); i++) {
+                    is_chunk = std::sscanf(name.c_str() + 2 * i, "%2hhx", &hash[i]) == 1;
+                }
+                Shard& shard = get_shard(hash);
+                auto it = is_chunk ? shard.chunks.find(hash) : shard.chunks.end();
+                if (it != shard.chunks.end() && !compressed) {
+                    continue;
+                }
+                // Only one copy of a chunk is kept, and a raw one wins over a compressed one
+                if (it != shard.chunks.end() && !bfs::exists(get_chunk_path(hash))) {
+                    uint32_t stored_size = static_cast<uint32_t>(bfs::file_size(entry.path()));
+                    disk_bytes_ += stored_size;
+                    disk_bytes_ -= it->second.stored.stored_size;
+                    it->second.stored = StoredChunk{ChunkEncoding::DEFLATE, stored_size};
+                    continue;
+                }
+            }
+            boost::system::error_code ignored;
+            if (bfs::remove(entry.path(), ignored)) {
+                removed++;
+            }
+        }
+    }
+    return removed;
+}
+
+void ChunkStore::on_ingested(uint64_t bytes, std::chrono::nanoseconds time) {
+    ingested_bytes_ += bytes;
+    ingest_time_ns_ += static_cast<uint64_t>(time.count());
+}
+
+ChunkStoreStatistics ChunkStore::get_statistics() const {
+    return ChunkStoreStatistics{num_chunks_, stored_bytes_, disk_bytes_, referenced_bytes_, ingested_bytes_,
+                                std::chrono::nanoseconds(ingest_time_ns_)};
+}
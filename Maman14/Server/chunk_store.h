@@ -0,0 +1,238 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk_compression.h"
+#include "chunker.h"
+#include "file_index.h"
+#include "manifest.h"
+
+namespace bfs = boost::filesystem;
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+enum class ChunkingMethod {
+    FIXED_SIZE,
+    CONTENT_DEFINED,
+};
+
+struct ChunkStoreOptions {
+    // Content-defined chunks survive bytes being inserted or removed in the middle of a file
+    ChunkingMethod chunking = ChunkingMethod::CONTENT_DEFINED;
+
+    // Fixed size chunks are of this size, and content-defined chunks are of this size on average.
+    // Content-defined chunks average on the power of 2 below it
+    size_t chunk_size = 1024 * 1024;
+
+    // The smallest and biggest content-defined chunks, except for the last chunk of a file which may be smaller.
+    // Chunk sizes must fit in 32 bits
+    size_t min_chunk_size = 256 * 1024;
+    size_t max_chunk_size = 4 * 1024 * 1024;
+
+    // Compress new chunks at rest, at a level picked by how random the start of each file is
+    bool compression = true;
+
+    // Files whose start has more bits of entropy per byte than this are taken to be compressed already,
+    // and their chunks are stored raw
+    double max_compressible_entropy = 7.5;
+};
+
+class ChunkNotFoundException : public runtime_error {
+public:
+    ChunkNotFoundException(const ContentHash& hash);
+};
+
+/**
+ * @brief A chunk and how many references to it there are, as it's saved in the index snapshot
+ *
+ */
+struct ChunkRecord {
+    ContentHash hash;
+    uint32_t size;
+    uint32_t references;
+};
+
+/**
+ * @brief How a chunk is kept on disk
+ *
+ */
+struct StoredChunk {
+    ChunkEncoding encoding;
+    uint32_t stored_size;
+};
+
+struct ChunkStoreStatistics {
+    size_t num_chunks;
+    // The bytes of all of the chunks, each counted once
+    uint64_t stored_bytes;
+    // What the chunks take on disk, after they're compressed
+    uint64_t disk_bytes;
+    // The bytes of all of the backed up files, which are made of the stored chunks
+    uint64_t referenced_bytes;
+    // The bytes that were backed up since the server started, and how long splitting and storing them took
+    uint64_t ingested_bytes;
+    std::chrono::nanoseconds ingest_time;
+
+    double get_dedup_ratio() const;
+    double get_compression_ratio() const;
+    double get_ingest_throughput() const;
+    string to_string() const;
+};
+
+/**
+ * @brief Content-addressed storage of the chunks of all of the users' deduplicated files.
+ * Every chunk is stored once, in a file named after the SHA-256 of its content, and counts how many
+ * references the manifests (and the restores in progress) have to it. A chunk is deleted when its last reference is released.
+ * The reference counts are kept in memory, and rebuilt from the manifests on startup.
+ * The chunks are spread over shards by their hash, each with its own lock, which is held while
+ * a chunk file is renamed into place or deleted, so a chunk is never deleted from under a new reference.
+ * A chunk is stored either raw or compressed, which is told by its file's name, so it can be found
+ * again on startup without reading it.
+ *
+ */
+class ChunkStore {
+public:
+    ChunkStore(bfs::path directory, ChunkStoreOptions options = ChunkStoreOptions());
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    /**
+     * @brief Create a chunker that splits new backups into chunks
+     *
+     */
+    unique_ptr<Chunker> make_chunker() const;
+
+    /**
+     * @brief Pick how to compress the chunks of a new backup from a sample of its start
+     *
+     */
+    CompressionLevel choose_compression(const uint8_t* sample, size_t size) const;
+
+    /**
+     * @brief Get a unique path to write a new chunk to, before it's hashed and published
+     *
+     */
+    bfs::path make_incoming_path() const;
+    bfs::path get_chunk_path(const ContentHash& hash, ChunkEncoding encoding = ChunkEncoding::RAW) const;
+
+    /**
+     * @brief Find how a chunk is stored. Throws ChunkNotFoundException if it isn't
+     *
+     */
+    StoredChunk get_stored_chunk(const ContentHash& hash) const;
+
+    /**
+     * @brief Add a reference to a chunk, if it's already stored
+     *
+     * @return bool Whether the chunk is stored
+     */
+    bool add_reference(const ContentHash& hash);
+
+    /**
+     * @brief Store a new chunk, which was written to a path from make_incoming_path, and add a reference to it.
+     * If someone else stored the same chunk meanwhile, the new copy is removed instead
+     *
+     * @param compressed_size The size of the written file if the chunk was compressed, nothing if it's raw
+     * @return vector<bfs::path> The directories whose entries the publish changed, or that a concurrent publish of the
+     * same chunk may still be changing. They should be synced before anything that references the chunk is
+     */
+    vector<bfs::path> publish(const bfs::path& incoming_path, const ContentHash& hash, uint32_t size,
+                 std::optional<uint32_t> compressed_size = std::nullopt);
+
+    /**
+     * @brief Release a reference to a chunk, and delete it if it was the last one
+     *
+     */
+    void release(const ContentHash& hash);
+
+    /**
+     * @brief Add a reference to every chunk of the manifest, so they can't be deleted while it's restored.
+     * Throws ChunkNotFoundException, without adding any reference, if one of them isn't stored
+     *
+     */
+    void acquire(const Manifest& manifest);
+    void release(const Manifest& manifest);
+
+    /**
+     * @brief Count a reference that a manifest on disk has, while rebuilding the reference counts on startup
+     *
+     */
+    void restore_references(const Manifest& manifest);
+
+    /**
+     * @brief Set the reference counts from a snapshot instead of rebuilding them. Should be called on startup only.
+     * Like restore_references, it leaves finding which chunks are compressed to collect_garbage
+     *
+     */
+    void load(const vector<ChunkRecord>& records);
+    vector<ChunkRecord> get_records() const;
+
+    /**
+     * @brief Delete the chunk files that nothing references, and the leftovers of interrupted uploads,
+     * and learn how the referenced ones are stored.
+     * Should only be called on startup, once every manifest's references were counted
+     *
+     * @return size_t How many files were deleted
+     */
+    size_t collect_garbage();
+
+    /**
+     * @brief Count bytes that were backed up, and how long it took
+     *
+     */
+    void on_ingested(uint64_t bytes, std::chrono::nanoseconds time);
+
+    ChunkStoreStatistics get_statistics() const;
+    const bfs::path& get_directory() const { return directory_; };
+
+private:
+    struct ChunkInfo {
+        uint32_t size;
+        uint32_t references;
+        StoredChunk stored;
+    };
+
+    struct ContentHashHasher {
+        size_t operator()(const ContentHash& hash) const;
+    };
+
+    struct Shard {
+        std::unordered_map<ContentHash, ChunkInfo, ContentHashHasher> chunks;
+        mutable std::mutex mutex;
+    };
+
+    static const size_t NUM_SHARDS = 64;
+
+    Shard& get_shard(const ContentHash& hash) { return shards_[hash[0] % NUM_SHARDS]; };
+    const Shard& get_shard(const ContentHash& hash) const { return shards_[hash[0] % NUM_SHARDS]; };
+    void release_locked(Shard& shard, const ContentHash& hash);
+    void add_chunk_locked(Shard& shard, const ContentHash& hash, const ChunkInfo& info);
+
+    // The suffix of the files of compressed chunks
+    static constexpr const char* DEFLATE_SUFFIX = ".z";
+
+    bfs::path directory_;
+    bfs::path incoming_directory_;
+    ChunkStoreOptions options_;
+    std::array<Shard, NUM_SHARDS> shards_;
+
+    std::atomic<size_t> num_chunks_{0};
+    std::atomic<uint64_t> stored_bytes_{0};
+    std::atomic<uint64_t> disk_bytes_{0};
+    std::atomic<uint64_t> referenced_bytes_{0};
+    std::atomic<uint64_t> ingested_bytes_{0};
+    std::atomic<uint64_t> ingest_time_ns_{0};
+};
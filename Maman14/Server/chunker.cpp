@@ -0,0 +1,113 @@
+#include "chunker.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+size_t FixedSizeChunker::find_cut(const uint8_t*, size_t size) {
+    size_t remaining = chunk_size_ - position_;
+    if (size < remaining) {
+        position_ += size;
+        return 0;
+    }
+    position_ = 0;
+    return remaining;
+}
+
+// A random value for each byte. The chunks of every backup depend on it, so it must never change
+static constexpr std::array<uint64_t, 256> make_gear_table() {
+    std::array<uint64_t, 256> table{};
+    // splitmix64
+    uint64_t state = 0x6765617263686b73ull;
+    for (auto& value : table) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        value = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static constexpr std::array<uint64_t, 256> GEAR = make_gear_table();
+
+// A mask of the top bits of the hash, which depend on all of the bytes in its window
+static uint64_t top_bits_mask(unsigned bits) {
+    bits = std::min(bits, 63u);
+    return bits == 0 ? 0 : ~0ull << (64 - bits);
+}
+
+ContentDefinedChunker::ContentDefinedChunker(size_t min_size, size_t avg_size, size_t max_size)
+    : min_size_(0), avg_size_(std::bit_floor(std::max<size_t>(avg_size, 1))), max_size_(std::max(max_size, avg_size_)), position_(0), hash_(0) {
+    min_size_ = std::clamp<size_t>(min_size, 1, avg_size_);
+    hash_start_ = min_size_ > WINDOW_SIZE ? min_size_ - WINDOW_SIZE : 0;
+    // A cut is found every 2^bits bytes on average, which is made 4 times harder before the average size
+    // and 4 times easier after it
+    unsigned bits = static_cast<unsigned>(std::bit_width(avg_size_) - 1);
+    small_mask_ = top_bits_mask(bits + 2);
+    large_mask_ = top_bits_mask(bits > 2 ? bits - 2 : 0);
+}
+
+size_t ContentDefinedChunker::roll(const uint8_t* data, size_t size, uint64_t mask, bool& found) {
+    uint64_t hash = hash_;
+    size_t i = 0;
+    found = true;
+    // Two bytes at a time. The hash after the second byte is computed from the hash before the first one,
+    // so the dependency chain between iterations is a single shift and add for every two bytes
+    for (; i + 2 <= size; i += 2) {
+        uint64_t first = (hash << 1) + GEAR[data[i]];
+        hash = (hash << 2) + ((GEAR[data[i]] << 1) + GEAR[data[i + 1]]);
+        if ((first & mask) == 0) {
+            hash_ = first;
+            return i + 1;
+        }
+        if ((hash & mask) == 0) {
+            hash_ = hash;
+            return i + 2;
+        }
+    }
+    if (i < size) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if ((hash & mask) == 0) {
+            hash_ = hash;
+            return i + 1;
+        }
+    }
+    hash_ = hash;
+    found = false;
+    return size;
+}
+
+size_t ContentDefinedChunker::find_cut(const uint8_t* data, size_t size) {
+    size_t offset = 0;
+    // Skip the bytes that can't affect the hash by the minimum size
+    if (position_ < hash_start_) {
+        size_t skipped = std::min(hash_start_ - position_, size);
+        position_ += skipped;
+        offset += skipped;
+    }
+    // Fill the hash's window, no cut can be made yet
+    if (position_ < min_size_) {
+        size_t filled = std::min(min_size_ - position_, size - offset);
+        for (size_t i = 0; i < filled; i++) {
+            hash_ = (hash_ << 1) + GEAR[data[offset + i]];
+        }
+        position_ += filled;
+        offset += filled;
+    }
+
+    // Before the average size, and then after it
+    while (offset < size) {
+        bool before_average = position_ < avg_size_;
+        size_t to_roll = std::min((before_average ? avg_size_ : max_size_) - position_, size - offset);
+        bool found;
+        size_t rolled = roll(data + offset, to_roll, before_average ? small_mask_ : large_mask_, found);
+        position_ += rolled;
+        offset += rolled;
+        if (found || position_ == max_size_) {
+            position_ = 0;
+            hash_ = 0;
+            return offset;
+        }
+    }
+    return 0;
+}
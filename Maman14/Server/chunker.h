@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Splits a stream of bytes into chunks for the chunk store.
+ * The stream is fed in pieces of any size, and the chunker remembers where it is in the current chunk
+ *
+ */
+class Chunker {
+public:
+    virtual ~Chunker() = default;
+
+    /**
+     * @brief Look for the end of the current chunk in the next bytes of the stream
+     *
+     * @return size_t How many of the bytes end the current chunk, or 0 if the chunk goes on after all of them
+     */
+    virtual size_t find_cut(const uint8_t* data, size_t size) = 0;
+
+protected:
+    Chunker() = default;
+};
+
+/**
+ * @brief Cuts the stream into chunks of the same size
+ *
+ */
+class FixedSizeChunker : public Chunker {
+public:
+    FixedSizeChunker(size_t chunk_size) : chunk_size_(chunk_size ? chunk_size : 1), position_(0) {}
+
+    virtual size_t find_cut(const uint8_t* data, size_t size) override;
+
+private:
+    size_t chunk_size_;
+    // How many bytes of the current chunk we've seen
+    size_t position_;
+};
+
+/**
+ * @brief Cuts the stream where its content says to (FastCDC), so inserting or removing bytes
+ * only changes the chunks around the change, and the chunks after it are found again.
+ * A cut is made where a gear hash of the last 64 bytes has its top bits clear. The hash needs more clear bits
+ * before the average size and fewer after it (normalized chunking), so chunk sizes stay close to the average.
+ * No cut is made before the minimum size, and a cut is forced at the maximum size.
+ * Since the hash only depends on the last 64 bytes, the bytes before the last 64 of the minimum size
+ * aren't hashed at all, and where a chunk ends only depends on where it starts and on its content.
+ *
+ */
+class ContentDefinedChunker : public Chunker {
+public:
+    static const size_t WINDOW_SIZE = 64;
+
+    /**
+     * @brief The sizes are adjusted so that min <= avg <= max, and the average is rounded down to a power of 2
+     *
+     */
+    ContentDefinedChunker(size_t min_size, size_t avg_size, size_t max_size);
+
+    virtual size_t find_cut(const uint8_t* data, size_t size) override;
+
+private:
+    /**
+     * @brief Roll the hash over the bytes, and stop after the first one where the hash has none of the mask's bits
+     *
+     * @param found Set to whether the hash had none of the mask's bits after the last byte that was rolled
+     * @return size_t How many bytes were rolled
+     */
+    size_t roll(const uint8_t* data, size_t size, uint64_t mask, bool& found);
+
+    size_t min_size_;
+    size_t avg_size_;
+    size_t max_size_;
+    // Where the hash starts rolling, so its window is full by the minimum size
+    size_t hash_start_;
+    uint64_t small_mask_;
+    uint64_t large_mask_;
+    size_t position_;
+    uint64_t hash_;
+};
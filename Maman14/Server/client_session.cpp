@@ -0,0 +1,116 @@
+#include "client_session.h"
+
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/make_unique.hpp>
+#include <string>
+
+#include "async_buffered_request_reader.h"
+#include "async_request_parser.h"
+#include "boost_connection_manager.h"
+#include "response_pipeline.h"
+#include "server.h"
+
+using std::string;
+using std::unique_ptr;
+
+static awaitable<void> sendServerError(shared_ptr<BoostConnectionManager> connection, ProtocolVersion version) {
+    if (connection == nullptr) {
+        BOOST_LOG_TRIVIAL(warning) << "sendServerError accepted nullptr - doing nothing ";
+        co_return;
+    }
+
+    try {
+        ServerErrorResponse response{version};
+        ResponseBuffers buffers{response};
+        co_await connection->async_send(buffers.buffers());
+    } catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Exception sending server error: " << e.what();
+    } catch (...) {
+        BOOST_LOG_TRIVIAL(fatal) << "Unknown exception sending server error: " << boost::current_exception_diagnostic_information();
+    }
+}
+
+awaitable<void> client_session(shared_ptr<Server> server, tcp::socket client_socket) {
+    string client_ip;
+    shared_ptr<BoostConnectionManager> connection = nullptr;
+    shared_ptr<ResponsePipeline> pipeline = nullptr;
+    // Until the client tells us otherwise we answer with the oldest version
+    ProtocolVersion version{server->get_min_version()};
+    size_t requests_served = 0;
+    // We can't co_await inside a catch block, so remember the failure and respond after it
+    bool failed = false;
+
+    try {
+        client_ip = client_socket.remote_endpoint().address().to_string();
+        BOOST_LOG_TRIVIAL(debug) << "[Server " << server->get_port() << "] accepted new client: " << client_ip;
+        any_io_executor strand = client_socket.get_executor();
+        connection = std::make_shared<BoostConnectionManager>(boost::make_unique<tcp::socket>(std::move(client_socket)),
+                                                              server->get_options().idle_timeout);
+
+        // The first request decides the version of the whole connection
+        AsyncRequestParser parser{boost::make_unique<AsyncBufferedRequestReader>(connection), true, &server->get_backup_memory_budget()};
+        unique_ptr<ProtocolRequest> request{co_await parser.parse_message(server->get_min_version(), server->get_max_version())};
+        version = request->get_version();
+        // Clients of the versions without keep-alive expect the connection to close after the response
+        bool keep_alive{server->is_keep_alive() && version_has_keep_alive(version)};
+        if (version_has_request_id(version)) {
+            pipeline = std::make_shared<ResponsePipeline>(server, connection, strand, server->get_options().max_pipelined_requests);
+        }
+
+        // With keep-alive we keep serving requests until the client closes the connection or goes idle
+        for (;;) {
+            if (request->is_payload_streamed()) {
+                // The payload must be read off the connection before the next request, so even
+                // a pipelining session handles this one itself. A backup that fails gets an error response of its
+                // own, only failing to read its payload ends the session
+                server->get_request_router().admit(*request);
+                unique_ptr<ProtocolResponse> response{co_await server->streamBackupFile(std::move(request), parser)};
+                if (pipeline != nullptr) {
+                    co_await pipeline->dispatch_response(std::move(response));
+                } else {
+                    co_await server->sendReply(*connection, Reply(std::move(response)));
+                }
+            } else if (pipeline != nullptr) {
+                co_await pipeline->dispatch(std::move(request));
+            } else {
+                Reply reply{co_await server->asyncHandleRequest(std::move(request))};
+                co_await server->sendReply(*connection, reply);
+            }
+            server->get_session_statistics().on_request_served(++requests_served);
+
+            if (!keep_alive) {
+                break;
+            }
+            request = co_await parser.parse_message(version);
+        }
+
+    } catch (const boost::system::system_error& e) {
+        if (connection != nullptr && connection->timed_out()) {
+            BOOST_LOG_TRIVIAL(debug) << "Client " << client_ip << " was idle for too long";
+            server->get_session_statistics().on_idle_timeout();
+        } else if (e.code() == boost::asio::error::eof && requests_served > 0) {
+            BOOST_LOG_TRIVIAL(debug) << "Client " << client_ip << " closed the connection";
+        } else {
+            BOOST_LOG_TRIVIAL(fatal) << "Exception during client session: " << e.what();
+            failed = true;
+        }
+    } catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(fatal) << "Exception during client session: " << e.what();
+        failed = true;
+    } catch (...) {
+        BOOST_LOG_TRIVIAL(fatal) << "Unknown exception in client session: " << boost::current_exception_diagnostic_information();
+    }
+
+    // Pipelined requests that are still being handled get their responses before we close
+    if (pipeline != nullptr) {
+        co_await pipeline->drain();
+    }
+
+    if (failed) {
+        co_await sendServerError(connection, version);
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "[Server " << server->get_port() << "] Closing connection with: " << client_ip
+                             << " after " << requests_served << " requests";
+}
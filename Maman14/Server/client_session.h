@@ -0,0 +1,20 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+
+using boost::asio::awaitable;
+using boost::asio::ip::tcp;
+using std::shared_ptr;
+
+class Server;
+
+/**
+ * @brief Serve a single client connection.
+ * Runs as a coroutine on the server's io_context pool, so a client that is slow to send
+ * its request only holds a suspended coroutine frame and not a thread
+ *
+ * @param server The server that handles the parsed requests
+ * @param client_socket The accepted client socket
+ */
+awaitable<void> client_session(shared_ptr<Server> server, tcp::socket client_socket);
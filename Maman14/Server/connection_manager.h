@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 using std::vector;
@@ -8,5 +9,12 @@ class AbstractConnectionManager {
 public:
     virtual void send(const vector<uint8_t>& to_send) = 0;
     virtual vector<uint8_t> recv(size_t size) = 0;
+
+    /**
+     * @brief Receive whatever is available, at least one byte and at most max_size, into data
+     *
+     * @return size_t The number of bytes received
+     */
+    virtual size_t recv_some(uint8_t* data, size_t max_size) = 0;
     virtual ~AbstractConnectionManager() = default;
 };
@@ -0,0 +1,322 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+#include "sha256.h"
+
+enum class DeltaCommand : uint8_t {
+    COPY = 0,
+    LITERAL = 1,
+};
+
+static const size_t SIGNATURES_HEADER_SIZE = 4 + 8 + 4;
+static const size_t BLOCK_SIGNATURE_SIZE = 4 + 16;
+static const size_t DELTA_HEADER_SIZE = 4 + 8 + 8 + 32;
+static const uint32_t MIN_BLOCK_SIZE = 2048;
+static const uint32_t MAX_BLOCK_SIZE = 128 * 1024;
+// Copies from the base are read and written in pieces of this size
+static const size_t COPY_BUFFER_SIZE = 64 * 1024;
+
+static void push_le(vector<uint8_t>& buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * @brief Reads little endian values one after the other, checking that they are in bounds
+ *
+ */
+class DeltaCursor {
+public:
+    DeltaCursor(const uint8_t* data, size_t size) : data_(data), size_(size), offset_(0) {}
+
+    uint64_t read_le(size_t size) {
+        const uint8_t* data = take(size);
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            value |= static_cast<uint64_t>(data[i]) << (8 * i);
+        }
+        return value;
+    }
+
+    const uint8_t* take(size_t size) {
+        if (size > size_ - offset_) {
+            throw InvalidDeltaException("Delta is truncated");
+        }
+        const uint8_t* data = data_ + offset_;
+        offset_ += size;
+        return data;
+    }
+
+    size_t remaining() const { return size_ - offset_; };
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_;
+};
+
+void RollingChecksum::reset(const uint8_t* data, size_t size) {
+    a_ = 0;
+    b_ = 0;
+    size_ = static_cast<uint32_t>(size);
+    for (size_t i = 0; i < size; i++) {
+        a_ += data[i];
+        b_ += static_cast<uint32_t>(size - i) * data[i];
+    }
+}
+
+void RollingChecksum::roll(uint8_t out, uint8_t in) {
+    a_ += in - out;
+    b_ += a_ - size_ * out;
+}
+
+BlockSignature compute_block_signature(const uint8_t* data, size_t size) {
+    BlockSignature signature;
+    RollingChecksum checksum;
+    checksum.reset(data, size);
+    signature.weak = checksum.value();
+    utils::Sha256::Digest digest = utils::Sha256::hash(data, size);
+    std::copy(digest.begin(), digest.begin() + signature.strong.size(), signature.strong.begin());
+    return signature;
+}
+
+uint32_t FileSignatures::choose_block_size(uint64_t file_size) {
+    uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+    return static_cast<uint32_t>(std::clamp<uint64_t>(std::bit_ceil(std::max<uint64_t>(root, 1)), MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+}
+
+FileSignatures compute_signatures(const BackupFileReader& file) {
+    FileSignatures signatures;
+    signatures.file_size = file.size();
+    signatures.block_size = FileSignatures::choose_block_size(file.size());
+    signatures.blocks.reserve((file.size() + signatures.block_size - 1) / signatures.block_size);
+
+    vector<uint8_t> block(signatures.block_size);
+    for (uint64_t offset = 0; offset < file.size(); offset += block.size()) {
+        size_t block_size = static_cast<size_t>(std::min<uint64_t>(block.size(), file.size() - offset));
+        size_t filled = 0;
+        while (filled < block_size) {
+            size_t bytes_read = file.read(offset + filled, block.data() + filled, block_size - filled);
+            if (bytes_read == 0) {
+                throw FailedToReadFileException(file.get_path());
+            }
+            filled += bytes_read;
+        }
+        signatures.blocks.push_back(compute_block_signature(block.data(), block_size));
+    }
+    return signatures;
+}
+
+vector<uint8_t> FileSignatures::serialize() const {
+    vector<uint8_t> buffer;
+    buffer.reserve(SIGNATURES_HEADER_SIZE + blocks.size() * BLOCK_SIGNATURE_SIZE);
+    push_le(buffer, block_size, 4);
+    push_le(buffer, file_size, 8);
+    push_le(buffer, blocks.size(), 4);
+    for (const auto& block : blocks) {
+        push_le(buffer, block.weak, 4);
+        buffer.insert(buffer.end(), block.strong.begin(), block.strong.end());
+    }
+    return buffer;
+}
+
+FileSignatures FileSignatures::parse(const uint8_t* data, size_t size) {
+    DeltaCursor cursor(data, size);
+    FileSignatures signatures;
+    signatures.block_size = static_cast<uint32_t>(cursor.read_le(4));
+    signatures.file_size = cursor.read_le(8);
+    uint64_t num_blocks = cursor.read_le(4);
+    if (num_blocks * BLOCK_SIGNATURE_SIZE != cursor.remaining() || signatures.block_size == 0) {
+        throw InvalidDeltaException("Signatures have the wrong size");
+    }
+    signatures.blocks.resize(num_blocks);
+    for (auto& block : signatures.blocks) {
+        block.weak = static_cast<uint32_t>(cursor.read_le(4));
+        std::memcpy(block.strong.data(), cursor.take(block.strong.size()), block.strong.size());
+    }
+    return signatures;
+}
+
+/**
+ * @brief Appends commands to a delta, merging copies of consecutive blocks into one
+ *
+ */
+class DeltaEncoder {
+public:
+    DeltaEncoder(vector<uint8_t>& delta) : delta_(delta), copy_start_(0), copy_count_(0), literal_start_(nullptr), literal_size_(0) {}
+
+    void copy(uint32_t block) {
+        flush_literal();
+        if (copy_count_ > 0 && copy_start_ + copy_count_ == block) {
+            copy_count_++;
+            return;
+        }
+        flush_copy();
+        copy_start_ = block;
+        copy_count_ = 1;
+    }
+
+    // The literal bytes must follow each other, and stay valid until they're flushed
+    void literal(const uint8_t* data, size_t size) {
+        flush_copy();
+        if (literal_size_ == 0) {
+            literal_start_ = data;
+        }
+        literal_size_ += size;
+    }
+
+    void flush() {
+        flush_copy();
+        flush_literal();
+    }
+
+private:
+    void flush_copy() {
+        if (copy_count_ == 0) {
+            return;
+        }
+        delta_.push_back(static_cast<uint8_t>(DeltaCommand::COPY));
+        push_le(delta_, copy_start_, 4);
+        push_le(delta_, copy_count_, 4);
+        copy_count_ = 0;
+    }
+
+    void flush_literal() {
+        while (literal_size_ > 0) {
+            uint32_t size = static_cast<uint32_t>(std::min<size_t>(literal_size_, UINT32_MAX));
+            delta_.push_back(static_cast<uint8_t>(DeltaCommand::LITERAL));
+            push_le(delta_, size, 4);
+            delta_.insert(delta_.end(), literal_start_, literal_start_ + size);
+            literal_start_ += size;
+            literal_size_ -= size;
+        }
+    }
+
+    vector<uint8_t>& delta_;
+    uint32_t copy_start_;
+    uint32_t copy_count_;
+    const uint8_t* literal_start_;
+    size_t literal_size_;
+};
+
+vector<uint8_t> make_delta(const FileSignatures& signatures, const uint8_t* data, size_t size) {
+    vector<uint8_t> delta;
+    push_le(delta, signatures.block_size, 4);
+    push_le(delta, signatures.file_size, 8);
+    push_le(delta, size, 8);
+    utils::Sha256::Digest hash = utils::Sha256::hash(data, size);
+    delta.insert(delta.end(), hash.begin(), hash.end());
+
+    // Only whole blocks are matched, a short last block of the base is sent as a literal if it's still there
+    size_t block_size = signatures.block_size;
+    size_t num_full_blocks = signatures.file_size / block_size;
+    std::unordered_multimap<uint32_t, uint32_t> blocks_by_weak;
+    blocks_by_weak.reserve(num_full_blocks);
+    for (uint32_t i = 0; i < num_full_blocks; i++) {
+        blocks_by_weak.emplace(signatures.blocks[i].weak, i);
+    }
+
+    DeltaEncoder encoder(delta);
+    size_t offset = 0;
+    RollingChecksum checksum;
+    bool checksum_valid = false;
+    while (offset + block_size <= size && num_full_blocks > 0) {
+        if (!checksum_valid) {
+            checksum.reset(data + offset, block_size);
+            checksum_valid = true;
+        }
+        auto [begin, end] = blocks_by_weak.equal_range(checksum.value());
+        bool matched = false;
+        if (begin != end) {
+            BlockSignature signature = compute_block_signature(data + offset, block_size);
+            for (auto it = begin; it != end; it++) {
+                if (signatures.blocks[it->second].strong == signature.strong) {
+                    encoder.copy(it->second);
+                    offset += block_size;
+                    checksum_valid = false;
+                    matched = true;
+                    break;
+                }
+            }
+        }
+        if (matched) {
+            continue;
+        }
+        encoder.literal(data + offset, 1);
+        if (offset + block_size < size) {
+            checksum.roll(data[offset], data[offset + block_size]);
+        }
+        offset++;
+    }
+    if (offset < size) {
+        encoder.literal(data + offset, size - offset);
+    }
+    encoder.flush();
+    return delta;
+}
+
+uint64_t apply_delta(const BackupFileReader& base, const uint8_t* delta, size_t size, BackupFileWriter& writer) {
+    DeltaCursor cursor(delta, size);
+    uint64_t block_size = cursor.read_le(4);
+    uint64_t base_size = cursor.read_le(8);
+    uint64_t new_size = cursor.read_le(8);
+    utils::Sha256::Digest expected_hash;
+    std::memcpy(expected_hash.data(), cursor.take(expected_hash.size()), expected_hash.size());
+    if (block_size == 0) {
+        throw InvalidDeltaException("Delta has no block size");
+    }
+    if (base_size != base.size()) {
+        throw InvalidDeltaException("Delta was made against another version of the file");
+    }
+
+    utils::Sha256 hash;
+    uint64_t written = 0;
+    auto write = [&](const uint8_t* data, size_t data_size) {
+        if (data_size > new_size - written) {
+            throw InvalidDeltaException("Delta is longer than its size");
+        }
+        writer.write(data, data_size);
+        hash.update(data, data_size);
+        written += data_size;
+    };
+
+    vector<uint8_t> buffer;
+    while (cursor.remaining() > 0) {
+        DeltaCommand command = static_cast<DeltaCommand>(cursor.read_le(1));
+        if (command == DeltaCommand::LITERAL) {
+            size_t length = static_cast<size_t>(cursor.read_le(4));
+            write(cursor.take(length), length);
+            continue;
+        }
+        if (command != DeltaCommand::COPY) {
+            throw InvalidDeltaException("Unknown delta command: " + std::to_string(static_cast<int>(command)));
+        }
+
+        uint64_t offset = cursor.read_le(4) * block_size;
+        uint64_t end = offset + cursor.read_le(4) * block_size;
+        if (offset >= base_size) {
+            throw InvalidDeltaException("Delta copies from beyond the base");
+        }
+        end = std::min(end, base_size);
+        buffer.resize(COPY_BUFFER_SIZE);
+        while (offset < end) {
+            size_t bytes_read = base.read(offset, buffer.data(), static_cast<size_t>(std::min<uint64_t>(buffer.size(), end - offset)));
+            if (bytes_read == 0) {
+                throw FailedToReadFileException(base.get_path());
+            }
+            write(buffer.data(), bytes_read);
+            offset += bytes_read;
+        }
+    }
+
+    if (written != new_size || hash.finish() != expected_hash) {
+        throw InvalidDeltaException("Delta doesn't produce the content it was made for");
+    }
+    return written;
+}
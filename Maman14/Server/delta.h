@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "user_backup_directory.h"
+
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+class InvalidDeltaException : public runtime_error {
+public:
+    InvalidDeltaException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief The rsync weak checksum of a block, which can be rolled along the data a byte at a time
+ *
+ */
+class RollingChecksum {
+public:
+    RollingChecksum() : a_(0), b_(0), size_(0) {}
+
+    void reset(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Move the window a byte forward
+     *
+     * @param out The byte that leaves the window
+     * @param in The byte that enters it
+     */
+    void roll(uint8_t out, uint8_t in);
+
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); };
+
+private:
+    uint32_t a_;
+    uint32_t b_;
+    uint32_t size_;
+};
+
+struct BlockSignature {
+    uint32_t weak;
+    // The first bytes of the block's SHA-256, checked when the weak checksum matches
+    std::array<uint8_t, 16> strong;
+};
+
+/**
+ * @brief The signatures of the blocks of a stored file, which a client compares its new version against
+ * to find which blocks it doesn't have to send again.
+ * On the wire: block size (4) file size (8) number of blocks (4), and then each block's
+ * weak checksum (4) and strong hash (16), all little endian
+ *
+ */
+struct FileSignatures {
+    uint32_t block_size = 0;
+    uint64_t file_size = 0;
+    vector<BlockSignature> blocks;
+
+    vector<uint8_t> serialize() const;
+    static FileSignatures parse(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Pick a block size of about the square root of the file's size, as rsync does,
+     * so the signatures and the matching work both grow slowly with the size
+     *
+     */
+    static uint32_t choose_block_size(uint64_t file_size);
+};
+
+BlockSignature compute_block_signature(const uint8_t* data, size_t size);
+FileSignatures compute_signatures(const BackupFileReader& file);
+
+/**
+ * @brief Encode the new content of a file as a delta against the signatures of its stored version.
+ * The delta is made of ranges of blocks to copy from the stored version and literal bytes, and ends
+ * up as big as the bytes that changed plus a few bytes for each range.
+ * On the wire: block size (4) base size (8) new size (8) new content's SHA-256 (32), and then commands:
+ *   copy:    0 (1) first block (4) number of blocks (4)
+ *   literal: 1 (1) length (4) bytes
+ *
+ */
+vector<uint8_t> make_delta(const FileSignatures& signatures, const uint8_t* data, size_t size);
+
+/**
+ * @brief Write the content a delta describes, copying its blocks from the base file.
+ * Throws InvalidDeltaException if the delta is malformed, or wasn't made against the base's current content,
+ * which is found by the size of the base and the hash of the result
+ *
+ * @return uint64_t The size of the new content
+ */
+uint64_t apply_delta(const BackupFileReader& base, const uint8_t* delta, size_t size, BackupFileWriter& writer);
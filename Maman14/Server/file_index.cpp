@@ -0,0 +1,100 @@
+#include "file_index.h"
+
+#include <mutex>
+
+using std::lock_guard;
+using std::shared_lock;
+
+// A red-black tree node holds a color and three pointers before the value
+static const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+
+FileIndexEntry FileIndexEntry::from_stat(const struct stat& file_stat) {
+    int64_t mtime_ns = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+    return FileIndexEntry{static_cast<uint64_t>(file_stat.st_size), mtime_ns, std::nullopt};
+}
+
+FileIndex::~FileIndex() {
+    if (filter_ == nullptr) {
+        return;
+    }
+    for (const auto& [filename, entry] : entries_) {
+        filter_->remove(MembershipFilter::hash(filter_seed_, filename));
+    }
+}
+
+void FileIndex::set_filter(MembershipFilter* filter, uint64_t seed) {
+    lock_guard<shared_mutex> lock(mutex_);
+    filter_ = filter;
+    filter_seed_ = seed;
+    for (const auto& [filename, entry] : entries_) {
+        filter_->add(MembershipFilter::hash(filter_seed_, filename));
+    }
+}
+
+void FileIndex::insert(const string& filename, FileIndexEntry entry) {
+    lock_guard<shared_mutex> lock(mutex_);
+    bool inserted = entries_.insert_or_assign(filename, std::move(entry)).second;
+    // Under the lock, so the filter counts each file exactly once
+    if (inserted && filter_ != nullptr) {
+        filter_->add(MembershipFilter::hash(filter_seed_, filename));
+    }
+}
+
+bool FileIndex::erase(const string& filename) {
+    lock_guard<shared_mutex> lock(mutex_);
+    if (entries_.erase(filename) == 0) {
+        return false;
+    }
+    if (filter_ != nullptr) {
+        filter_->remove(MembershipFilter::hash(filter_seed_, filename));
+    }
+    return true;
+}
+
+bool FileIndex::contains(const string& filename) const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return entries_.find(filename) != entries_.end();
+}
+
+optional<FileIndexEntry> FileIndex::find(const string& filename) const {
+    shared_lock<shared_mutex> lock(mutex_);
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+vector<string> FileIndex::get_filenames() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    vector<string> filenames;
+    filenames.reserve(entries_.size());
+    for (const auto& [filename, entry] : entries_) {
+        filenames.push_back(filename);
+    }
+    return filenames;
+}
+
+vector<std::pair<string, FileIndexEntry>> FileIndex::get_entries() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return vector<std::pair<string, FileIndexEntry>>(entries_.begin(), entries_.end());
+}
+
+size_t FileIndex::size() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return entries_.size();
+}
+
+size_t FileIndex::get_memory_usage() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    // Short names are stored inside the string itself
+    const size_t inline_capacity = string().capacity();
+    size_t usage = sizeof(*this);
+    for (const auto& [filename, entry] : entries_) {
+        usage += MAP_NODE_OVERHEAD + sizeof(std::pair<const string, FileIndexEntry>);
+        if (filename.capacity() > inline_capacity) {
+            usage += filename.capacity() + 1;
+        }
+    }
+    return usage;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "membership_filter.h"
+
+using std::optional;
+using std::shared_mutex;
+using std::string;
+using std::vector;
+
+typedef std::array<uint8_t, 32> ContentHash;
+
+/**
+ * @brief What we know about a backed up file without touching the disk
+ *
+ */
+struct FileIndexEntry {
+    uint64_t size;
+    // Last modification time, in nanoseconds since the epoch
+    int64_t mtime_ns;
+    // Only known for files whose content was hashed while backing them up
+    optional<ContentHash> content_hash;
+
+    static FileIndexEntry from_stat(const struct stat& file_stat);
+};
+
+/**
+ * @brief An in-memory index of a user's backup files, kept up to date as files are backed up and deleted,
+ * so listing the files and checking if one exists don't need any system calls.
+ * The index can keep its filenames in a membership filter as well, which is told about every file that's
+ * added or removed, so files that were never backed up are told apart without the index's lock
+ *
+ */
+class FileIndex {
+public:
+    FileIndex() = default;
+    FileIndex(const FileIndex&) = delete;
+    FileIndex& operator=(const FileIndex&) = delete;
+
+    /**
+     * @brief Removes the files from the membership filter
+     *
+     */
+    ~FileIndex();
+
+    /**
+     * @brief Add the files to a membership filter, and keep it up to date from now on.
+     * The filter must outlive the index
+     *
+     * @param seed Tells apart the files of this index from those of other indexes that share the filter
+     */
+    void set_filter(MembershipFilter* filter, uint64_t seed);
+
+    /**
+     * @brief Add a file, or replace what we know about it
+     *
+     */
+    void insert(const string& filename, FileIndexEntry entry);
+
+    /**
+     * @brief Remove a file
+     *
+     * @return bool Whether the file was in the index
+     */
+    bool erase(const string& filename);
+
+    bool contains(const string& filename) const;
+    optional<FileIndexEntry> find(const string& filename) const;
+
+    /**
+     * @brief Get the names of all of the files, sorted
+     *
+     */
+    vector<string> get_filenames() const;
+
+    /**
+     * @brief Get a copy of all of the entries, sorted by filename
+     *
+     */
+    vector<std::pair<string, FileIndexEntry>> get_entries() const;
+
+    size_t size() const;
+
+    /**
+     * @brief Estimate how many bytes of memory the index takes, including the map's nodes and the filenames
+     *
+     */
+    size_t get_memory_usage() const;
+
+private:
+    std::map<string, FileIndexEntry> entries_;
+    MembershipFilter* filter_ = nullptr;
+    uint64_t filter_seed_ = 0;
+    mutable shared_mutex mutex_;
+};
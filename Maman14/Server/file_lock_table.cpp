@@ -0,0 +1,44 @@
+#include "file_lock_table.h"
+
+using std::lock_guard;
+
+FileLockTable::Lock::Lock(FileLockTable& table, const string& filename, bool exclusive)
+    : table_(table), filename_(filename), exclusive_(exclusive), mutex_(table.acquire_entry(filename)) {
+    if (exclusive_) {
+        mutex_->lock();
+    } else {
+        mutex_->lock_shared();
+    }
+}
+
+FileLockTable::Lock::~Lock() {
+    if (exclusive_) {
+        mutex_->unlock();
+    } else {
+        mutex_->unlock_shared();
+    }
+    table_.release_entry(filename_);
+}
+
+size_t FileLockTable::size() const {
+    lock_guard<mutex> lock(mutex_);
+    return entries_.size();
+}
+
+shared_mutex* FileLockTable::acquire_entry(const string& filename) {
+    lock_guard<mutex> lock(mutex_);
+    auto& entry = entries_[filename];
+    if (!entry) {
+        entry = std::make_unique<Entry>();
+    }
+    entry->users++;
+    return &entry->mutex;
+}
+
+void FileLockTable::release_entry(const string& filename) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = entries_.find(filename);
+    if (--it->second->users == 0) {
+        entries_.erase(it);
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+using std::mutex;
+using std::shared_mutex;
+using std::string;
+using std::unique_ptr;
+
+/**
+ * @brief Shared/exclusive locks keyed by filename, so operations on different files never wait for each other.
+ * A name's lock only exists while someone holds or waits for it.
+ *
+ */
+class FileLockTable {
+public:
+    /**
+     * @brief RAII handle to a file's lock, which is released on destruction
+     *
+     */
+    class Lock {
+    public:
+        Lock(FileLockTable& table, const string& filename, bool exclusive);
+        Lock(const Lock&) = delete;
+        Lock& operator=(const Lock&) = delete;
+        ~Lock();
+
+    private:
+        FileLockTable& table_;
+        string filename_;
+        bool exclusive_;
+        shared_mutex* mutex_;
+    };
+
+    /**
+     * @brief Lock the file for reading it. Any number of readers may hold it at once
+     *
+     */
+    Lock lock_shared(const string& filename) { return Lock(*this, filename, false); };
+
+    /**
+     * @brief Lock the file for changing it, waiting for every other holder
+     *
+     */
+    Lock lock_exclusive(const string& filename) { return Lock(*this, filename, true); };
+
+    /**
+     * @brief Get the number of names that currently have a lock
+     *
+     */
+    size_t size() const;
+
+private:
+    struct Entry {
+        shared_mutex mutex;
+        // How many locks hold or wait for the mutex
+        size_t users = 0;
+    };
+
+    shared_mutex* acquire_entry(const string& filename);
+    void release_entry(const string& filename);
+
+    std::unordered_map<string, unique_ptr<Entry>> entries_;
+    // Only guards the table itself, never held while waiting for a file's lock
+    mutable mutex mutex_;
+};
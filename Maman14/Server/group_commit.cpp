@@ -0,0 +1,236 @@
+#include "group_commit.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <iterator>
+#include <map>
+#include <utility>
+
+using boost::system::error_code;
+using boost::system::system_error;
+
+// Retries system calls that were interrupted, and returns 0 or their errno
+template <typename SystemCall>
+static int retry_system_call(SystemCall system_call) {
+    for (;;) {
+        if (system_call() == 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+/**
+ * @brief The syncs a blocked thread waits for, and the first error of their batches
+ *
+ */
+struct BlockingSyncs {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining;
+    int error = 0;
+};
+
+/**
+ * @brief Wakes up a thread that's blocked in sync, once the last of its syncs is done
+ *
+ */
+class BlockingWaiter : public GroupCommitter::Waiter {
+public:
+    BlockingWaiter(BlockingSyncs& syncs) : syncs_(syncs) {}
+
+    virtual void complete(int error) override {
+        std::lock_guard<std::mutex> lock(syncs_.mutex);
+        if (syncs_.error == 0) {
+            syncs_.error = error;
+        }
+        if (--syncs_.remaining == 0) {
+            syncs_.done.notify_one();
+        }
+    }
+
+private:
+    BlockingSyncs& syncs_;
+};
+
+/**
+ * @brief Resumes the awaiting coroutine with the result, on its own executor
+ *
+ */
+template <typename Handler>
+class HandlerWaiter : public GroupCommitter::Waiter {
+public:
+    HandlerWaiter(Handler handler)
+        : handler_(std::move(handler)),
+          // Keeps the coroutine's io_context running while the batch is flushed
+          work_(boost::asio::prefer(boost::asio::get_associated_executor(handler_),
+                                    boost::asio::execution::outstanding_work.tracked)) {}
+
+    virtual void complete(int error) override {
+        boost::asio::post(work_, [handler = std::move(handler_), error]() mutable {
+            handler(error);
+        });
+    }
+
+private:
+    Handler handler_;
+    boost::asio::any_io_executor work_;
+};
+
+double GroupCommitStatistics::get_average_batch_size() const {
+    return batches > 0 ? static_cast<double>(syncs) / batches : 0;
+}
+
+string GroupCommitStatistics::to_string() const {
+    return "syncs: " + std::to_string(syncs) +
+           " batches: " + std::to_string(batches) +
+           " single syncs: " + std::to_string(single_syncs) +
+           " flushes: " + std::to_string(flushes) +
+           " average batch size: " + std::to_string(get_average_batch_size());
+}
+
+GroupCommitter::GroupCommitter(GroupCommitOptions options)
+    : options_(options), stopping_(false), syncs_(0), batches_(0), single_syncs_(0) {
+    options_.max_batch_size = std::max<size_t>(options_.max_batch_size, 1);
+    thread_ = std::thread([this]() { run(); });
+}
+
+GroupCommitter::~GroupCommitter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    pending_changed_.notify_one();
+    thread_.join();
+}
+
+void GroupCommitter::push(vector<PendingSync> syncs) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::move(syncs.begin(), syncs.end(), std::back_inserter(pending_));
+    }
+    pending_changed_.notify_one();
+}
+
+void GroupCommitter::sync(int fd) {
+    sync(vector<int>{fd});
+}
+
+void GroupCommitter::sync(const vector<int>& fds) {
+    if (fds.empty()) {
+        return;
+    }
+    BlockingSyncs syncs;
+    syncs.remaining = fds.size();
+    vector<PendingSync> pending;
+    for (int fd : fds) {
+        pending.push_back(PendingSync{fd, std::make_unique<BlockingWaiter>(syncs)});
+    }
+    push(std::move(pending));
+    std::unique_lock<std::mutex> lock(syncs.mutex);
+    syncs.done.wait(lock, [&syncs]() { return syncs.remaining == 0; });
+    if (syncs.error != 0) {
+        throw system_error(error_code(syncs.error, boost::system::system_category()));
+    }
+}
+
+awaitable<void> GroupCommitter::async_sync(int fd) {
+    int error = co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void(int)>(
+        [this, fd](auto handler) {
+            using Handler = decltype(handler);
+            vector<PendingSync> pending;
+            pending.push_back(PendingSync{fd, std::make_unique<HandlerWaiter<Handler>>(std::move(handler))});
+            push(std::move(pending));
+        },
+        boost::asio::use_awaitable);
+    if (error != 0) {
+        throw system_error(error_code(error, boost::system::system_category()));
+    }
+}
+
+void GroupCommitter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        pending_changed_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            // Stopping, and everything was flushed
+            return;
+        }
+        if (options_.max_delay.count() > 0 && !stopping_) {
+            auto deadline = std::chrono::steady_clock::now() + options_.max_delay;
+            pending_changed_.wait_until(lock, deadline, [this]() {
+                return stopping_ || pending_.size() >= options_.max_batch_size;
+            });
+        }
+
+        size_t batch_size = std::min(pending_.size(), options_.max_batch_size);
+        vector<PendingSync> batch(std::make_move_iterator(pending_.begin()), std::make_move_iterator(pending_.begin() + batch_size));
+        pending_.erase(pending_.begin(), pending_.begin() + batch_size);
+        syncs_ += batch.size();
+        batches_++;
+        single_syncs_ += batch.size() == 1;
+
+        // New syncs are queued while the batch is flushed, and become the next batch
+        lock.unlock();
+        vector<int> errors = flush(batch);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].waiter->complete(errors[i]);
+        }
+        lock.lock();
+    }
+}
+
+vector<int> GroupCommitter::flush(const vector<PendingSync>& batch) {
+    if (options_.sync_filesystem && batch.size() > 1) {
+        int fd = batch.front().fd;
+        int error = retry_system_call([fd]() { return ::syncfs(fd); });
+        if (error != ENOSYS) {
+            flushes_++;
+            return vector<int>(batch.size(), error);
+        }
+        // Without syncfs, the batch is flushed file by file
+    }
+
+    // The syncs of a batch often share a file, like the segment of packed files or the directory that files were
+    // renamed into, so each distinct file is flushed once and its result goes to all of its syncs
+    struct DistinctFile {
+        int fd;
+        bool directory;
+        vector<size_t> syncs;
+    };
+    vector<int> errors(batch.size(), 0);
+    std::map<std::pair<dev_t, ino_t>, DistinctFile> files;
+    for (size_t i = 0; i < batch.size(); i++) {
+        struct stat file_stat;
+        if (::fstat(batch[i].fd, &file_stat) != 0) {
+            errors[i] = errno;
+            continue;
+        }
+        auto [file, inserted] = files.try_emplace({file_stat.st_dev, file_stat.st_ino},
+                                                  DistinctFile{batch[i].fd, S_ISDIR(file_stat.st_mode), {}});
+        file->second.syncs.push_back(i);
+    }
+    for (const auto& [inode, file] : files) {
+        int fd = file.fd;
+        // A directory's entries are metadata, which fdatasync may skip
+        int error = file.directory ? retry_system_call([fd]() { return ::fsync(fd); })
+                                   : retry_system_call([fd]() { return ::fdatasync(fd); });
+        flushes_++;
+        // A file that fails only fails its own syncs, the rest of the batch is still flushed
+        for (size_t i : file.syncs) {
+            errors[i] = error;
+        }
+    }
+    return errors;
+}
+
+GroupCommitStatistics GroupCommitter::get_statistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return GroupCommitStatistics{syncs_, batches_, single_syncs_, flushes_};
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <boost/asio/awaitable.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::awaitable;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+struct GroupCommitOptions {
+    // How long the first sync of a batch waits for more syncs to join it. With no delay a batch is flushed
+    // right away, and the syncs that come while it's flushed join the next batch
+    std::chrono::microseconds max_delay = std::chrono::microseconds(0);
+
+    // The most syncs that are flushed together
+    size_t max_batch_size = 1024;
+
+    // Flush a batch with a single syncfs instead of a flush of each of its files. It's fewer calls, but syncfs
+    // flushes all of the filesystem's dirty data, so on a shared volume a batch waits for unrelated writers too
+    bool sync_filesystem = false;
+};
+
+struct GroupCommitStatistics {
+    uint64_t syncs;
+    uint64_t batches;
+    // The batches of a single sync
+    uint64_t single_syncs;
+    // The fdatasyncs, fsyncs and syncfs calls of the batches, a file that many syncs of a batch share is flushed once
+    uint64_t flushes;
+
+    double get_average_batch_size() const;
+    string to_string() const;
+};
+
+/**
+ * @brief Makes files durable in batches, so concurrent backups share the cost of a flush.
+ * Syncs are queued to the committer's thread, which takes all of the queued syncs as a batch and flushes each
+ * distinct file of the batch once: an fdatasync of a file, or an fsync of a directory that files were renamed into.
+ * The backups of a batch take a single trip to the thread and wake up together, and a file that fails to sync only
+ * fails the syncs of that file.
+ * With GroupCommitOptions::sync_filesystem the batch is a single syncfs instead, and all of the files must be
+ * on the same filesystem.
+ * A sync returns once its batch is durable.
+ *
+ */
+class GroupCommitter {
+public:
+    GroupCommitter(GroupCommitOptions options = GroupCommitOptions());
+    GroupCommitter(const GroupCommitter&) = delete;
+    GroupCommitter& operator=(const GroupCommitter&) = delete;
+
+    /**
+     * @brief Flushes the syncs that are queued, and stops the thread
+     *
+     */
+    ~GroupCommitter();
+
+    /**
+     * @brief Make a file durable, or a directory's entries after files were renamed into it.
+     * Blocks until the batch of the sync is flushed, and throws boost::system::system_error if the file failed to sync.
+     * The file must stay open until then
+     *
+     */
+    void sync(int fd);
+
+    /**
+     * @brief Make many files durable, which are queued together so they share a batch
+     *
+     */
+    void sync(const vector<int>& fds);
+
+    /**
+     * @brief Like sync, but suspends instead of blocking. Resumes on the executor of the coroutine that awaited it
+     *
+     */
+    awaitable<void> async_sync(int fd);
+
+    GroupCommitStatistics get_statistics() const;
+
+    /**
+     * @brief Waits for the result of a sync
+     *
+     */
+    class Waiter {
+    public:
+        virtual ~Waiter() = default;
+        // Called on the committer's thread, with 0 or the errno of the flush
+        virtual void complete(int error) = 0;
+    };
+
+private:
+    struct PendingSync {
+        int fd;
+        unique_ptr<Waiter> waiter;
+    };
+
+    void push(vector<PendingSync> syncs);
+    void run();
+    // Returns 0 or the errno of the flush of each sync of the batch
+    vector<int> flush(const vector<PendingSync>& batch);
+
+    GroupCommitOptions options_;
+    vector<PendingSync> pending_;
+    bool stopping_;
+    uint64_t syncs_;
+    uint64_t batches_;
+    uint64_t single_syncs_;
+    // Counted by flush, which runs without the mutex
+    std::atomic<uint64_t> flushes_{0};
+    mutable std::mutex mutex_;
+    std::condition_variable pending_changed_;
+    std::thread thread_;
+};
@@ -0,0 +1,193 @@
+#include "index_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+// The layout, in the host's byte order since a snapshot never leaves the machine it was written on:
+//   header: magic (8) version (4) number of users (4)
+//   user:   user ID (4) directory mtime (8) number of files (4)
+//   file:   size (8) mtime (8) has hash (1) [hash (32)] name length (2) name
+//   after the users: has chunks (1) [number of chunks (4)]
+//   chunk:  hash (32) size (4) references (4)
+static const char SNAPSHOT_MAGIC[8] = {'B', 'K', 'I', 'D', 'X', 'S', 'N', 'P'};
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const size_t MIN_USER_RECORD_SIZE = 16;
+static const size_t MIN_FILE_RECORD_SIZE = 19;
+static const size_t CHUNK_RECORD_SIZE = 40;
+
+template <typename T>
+static void append(vector<uint8_t>& buffer, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+void write_index_snapshot(const bfs::path& path, const vector<UserIndexSnapshot>& users, const std::optional<vector<ChunkRecord>>& chunks) {
+    vector<uint8_t> buffer(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + sizeof(SNAPSHOT_MAGIC));
+    append(buffer, SNAPSHOT_VERSION);
+    append(buffer, static_cast<uint32_t>(users.size()));
+    for (const auto& user : users) {
+        append(buffer, user.user_id);
+        append(buffer, user.directory_mtime_ns);
+        append(buffer, static_cast<uint32_t>(user.files.size()));
+        for (const auto& [filename, entry] : user.files) {
+            append(buffer, entry.size);
+            append(buffer, entry.mtime_ns);
+            append(buffer, static_cast<uint8_t>(entry.content_hash.has_value()));
+            if (entry.content_hash) {
+                buffer.insert(buffer.end(), entry.content_hash->begin(), entry.content_hash->end());
+            }
+            append(buffer, static_cast<uint16_t>(filename.size()));
+            buffer.insert(buffer.end(), filename.begin(), filename.end());
+        }
+    }
+    append(buffer, static_cast<uint8_t>(chunks.has_value()));
+    if (chunks) {
+        append(buffer, static_cast<uint32_t>(chunks->size()));
+        for (const auto& chunk : *chunks) {
+            buffer.insert(buffer.end(), chunk.hash.begin(), chunk.hash.end());
+            append(buffer, chunk.size);
+            append(buffer, chunk.references);
+        }
+    }
+
+    bfs::path temp_path = path.string() + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw IndexSnapshotException("Failed to create index snapshot: " + temp_path.string());
+    }
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t result = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            ::close(fd);
+            throw IndexSnapshotException("Failed to write index snapshot: " + temp_path.string());
+        }
+        written += result;
+    }
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!synced || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw IndexSnapshotException("Failed to save index snapshot: " + path.string());
+    }
+}
+
+/**
+ * @brief Reads values one after the other from the mapped snapshot, checking that they are in bounds
+ *
+ */
+class SnapshotCursor {
+public:
+    SnapshotCursor(const uint8_t* data, size_t size) : data_(data), size_(size), offset_(0) {}
+
+    template <typename T>
+    T read() {
+        T value;
+        std::memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    const uint8_t* take(size_t size) {
+        if (size > size_ - offset_) {
+            throw IndexSnapshotException("Index snapshot is truncated");
+        }
+        const uint8_t* data = data_ + offset_;
+        offset_ += size;
+        return data;
+    }
+
+    /**
+     * @brief Read a count of records, checking that the rest of the snapshot has room for them,
+     * so a corrupt count can't make us allocate a huge vector
+     *
+     */
+    uint32_t read_count(size_t min_record_size) {
+        uint32_t count = read<uint32_t>();
+        if (static_cast<uint64_t>(count) * min_record_size > size_ - offset_) {
+            throw IndexSnapshotException("Index snapshot is truncated");
+        }
+        return count;
+    }
+
+    bool at_end() const { return offset_ == size_; };
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_;
+};
+
+static IndexSnapshot parse_snapshot(SnapshotCursor& cursor) {
+    if (std::memcmp(cursor.take(sizeof(SNAPSHOT_MAGIC)), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        throw IndexSnapshotException("Not an index snapshot");
+    }
+    if (cursor.read<uint32_t>() != SNAPSHOT_VERSION) {
+        throw IndexSnapshotException("Unsupported index snapshot version");
+    }
+
+    IndexSnapshot snapshot;
+    snapshot.users.resize(cursor.read_count(MIN_USER_RECORD_SIZE));
+    for (auto& user : snapshot.users) {
+        user.user_id = cursor.read<uint32_t>();
+        user.directory_mtime_ns = cursor.read<int64_t>();
+        user.files.resize(cursor.read_count(MIN_FILE_RECORD_SIZE));
+        for (auto& [filename, entry] : user.files) {
+            entry.size = cursor.read<uint64_t>();
+            entry.mtime_ns = cursor.read<int64_t>();
+            if (cursor.read<uint8_t>()) {
+                ContentHash hash;
+                std::memcpy(hash.data(), cursor.take(hash.size()), hash.size());
+                entry.content_hash = hash;
+            }
+            uint16_t name_length = cursor.read<uint16_t>();
+            const uint8_t* name = cursor.take(name_length);
+            filename.assign(reinterpret_cast<const char*>(name), name_length);
+        }
+    }
+    if (cursor.read<uint8_t>()) {
+        snapshot.chunks.emplace(cursor.read_count(CHUNK_RECORD_SIZE));
+        for (auto& chunk : *snapshot.chunks) {
+            std::memcpy(chunk.hash.data(), cursor.take(chunk.hash.size()), chunk.hash.size());
+            chunk.size = cursor.read<uint32_t>();
+            chunk.references = cursor.read<uint32_t>();
+        }
+    }
+    if (!cursor.at_end()) {
+        throw IndexSnapshotException("Index snapshot has trailing data");
+    }
+    return snapshot;
+}
+
+IndexSnapshot read_index_snapshot(const bfs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw IndexSnapshotException("No index snapshot at: " + path.string());
+    }
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        ::close(fd);
+        throw IndexSnapshotException("Failed to read index snapshot: " + path.string());
+    }
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw IndexSnapshotException("Failed to map index snapshot: " + path.string());
+    }
+
+    try {
+        SnapshotCursor cursor(static_cast<const uint8_t*>(mapping), size);
+        IndexSnapshot snapshot = parse_snapshot(cursor);
+        ::munmap(mapping, size);
+        return snapshot;
+    } catch (...) {
+        ::munmap(mapping, size);
+        throw;
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chunk_store.h"
+#include "file_index.h"
+
+namespace bfs = boost::filesystem;
+using std::pair;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+class IndexSnapshotException : public runtime_error {
+public:
+    IndexSnapshotException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief The index of a single user's backup directory, as it's saved in a snapshot
+ *
+ */
+struct UserIndexSnapshot {
+    uint32_t user_id;
+    // The directory's mtime changes whenever a file is added to or removed from it,
+    // so a different mtime means the files changed after the snapshot was saved
+    int64_t directory_mtime_ns;
+    vector<pair<string, FileIndexEntry>> files;
+};
+
+struct IndexSnapshot {
+    vector<UserIndexSnapshot> users;
+    // The reference counts of the chunk store, if the backups were deduplicated.
+    // Only valid if none of the users' directories changed
+    std::optional<vector<ChunkRecord>> chunks;
+};
+
+/**
+ * @brief Save the indexes of all of the users to a file, so the next start doesn't need to scan the backups.
+ * The file is written next to the snapshot and renamed over it, so a crash never leaves half a snapshot behind
+ *
+ */
+void write_index_snapshot(const bfs::path& path, const vector<UserIndexSnapshot>& users, const std::optional<vector<ChunkRecord>>& chunks = std::nullopt);
+
+/**
+ * @brief Load a snapshot written by write_index_snapshot. The file is mmapped and parsed in place.
+ * Throws IndexSnapshotException if the file doesn't exist or isn't a valid snapshot
+ *
+ */
+IndexSnapshot read_index_snapshot(const bfs::path& path);
@@ -0,0 +1,310 @@
+#include "io_uring_storage_backend.h"
+
+#ifdef HAS_IO_URING_STORAGE_BACKEND
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+using boost::system::error_code;
+using boost::system::system_error;
+
+// The operation the completion thread gets when we wake it up to stop
+static const uint64_t WAKE_UP_USER_DATA = 0;
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+template <typename T>
+static T* ring_field(void* ring, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+IoUringStorageBackend::Operation::Operation(const Submission& submission, string path, string new_path)
+    : submission(submission), path(std::move(path)), new_path(std::move(new_path)) {}
+
+/**
+ * @brief Resumes the awaiting coroutine with the result, on its own executor
+ *
+ */
+template <typename Handler>
+class HandlerOperation : public IoUringStorageBackend::Operation {
+public:
+    HandlerOperation(Handler handler, const IoUringStorageBackend::Submission& submission, string path, string new_path)
+        : Operation(submission, std::move(path), std::move(new_path)),
+          handler_(std::move(handler)),
+          // Keeps the coroutine's io_context running while the kernel works on the operation
+          work_(boost::asio::prefer(boost::asio::get_associated_executor(handler_),
+                                    boost::asio::execution::outstanding_work.tracked)) {}
+
+    virtual void complete(int result) override {
+        boost::asio::post(work_, [handler = std::move(handler_), result]() mutable {
+            handler(result);
+        });
+    }
+
+private:
+    Handler handler_;
+    boost::asio::any_io_executor work_;
+};
+
+IoUringStorageBackend::IoUringStorageBackend(unsigned queue_depth)
+    : ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      in_flight_(0),
+      stopping_(false) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = io_uring_setup(std::max(queue_depth, 1u), &params);
+    if (ring_fd_ < 0) {
+        throw StorageBackendUnavailableException(string("io_uring_setup failed: ") + std::strerror(errno));
+    }
+
+    try {
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            throw StorageBackendUnavailableException("Failed to map the io_uring submission queue");
+        }
+        if (single_mmap) {
+            cq_ring_ = sq_ring_;
+        } else {
+            cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) {
+                throw StorageBackendUnavailableException("Failed to map the io_uring completion queue");
+            }
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(
+            ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED) {
+            throw StorageBackendUnavailableException("Failed to map the io_uring submission entries");
+        }
+
+        sq_head_ = ring_field<unsigned>(sq_ring_, params.sq_off.head);
+        sq_tail_ = ring_field<unsigned>(sq_ring_, params.sq_off.tail);
+        sq_mask_ = *ring_field<unsigned>(sq_ring_, params.sq_off.ring_mask);
+        sq_entries_ = *ring_field<unsigned>(sq_ring_, params.sq_off.ring_entries);
+        sq_array_ = ring_field<unsigned>(sq_ring_, params.sq_off.array);
+        cq_head_ = ring_field<unsigned>(cq_ring_, params.cq_off.head);
+        cq_tail_ = ring_field<unsigned>(cq_ring_, params.cq_off.tail);
+        cq_mask_ = *ring_field<unsigned>(cq_ring_, params.cq_off.ring_mask);
+        cq_entries_ = *ring_field<unsigned>(cq_ring_, params.cq_off.ring_entries);
+        cqes_ = ring_field<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+        check_supported_operations();
+    } catch (...) {
+        unmap_ring();
+        throw;
+    }
+
+    completion_thread_ = std::thread([this]() { run_completions(); });
+}
+
+IoUringStorageBackend::~IoUringStorageBackend() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    // A no-op wakes the completion thread up so it sees that we're stopping
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        prepare_sqe(index, Submission{IORING_OP_NOP, -1, 0, 0, 0, 0}, WAKE_UP_USER_DATA);
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        io_uring_enter(ring_fd_, 1, 0, 0);
+    }
+    completion_thread_.join();
+    unmap_ring();
+}
+
+void IoUringStorageBackend::unmap_ring() {
+    if (sqes_ != MAP_FAILED) {
+        ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        ::munmap(sq_ring_, sq_ring_size_);
+    }
+    ::close(ring_fd_);
+}
+
+void IoUringStorageBackend::check_supported_operations() {
+    const size_t max_ops = 256;
+    std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+    if (io_uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, max_ops) < 0) {
+        throw StorageBackendUnavailableException(string("Failed to probe io_uring operations: ") + std::strerror(errno));
+    }
+
+    for (uint8_t op : {IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_RENAMEAT}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            throw StorageBackendUnavailableException("io_uring doesn't support operation " + std::to_string(op));
+        }
+    }
+}
+
+void IoUringStorageBackend::prepare_sqe(unsigned index, const Submission& submission, uint64_t user_data) {
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = submission.opcode;
+    sqe->fd = submission.fd;
+    sqe->addr = submission.addr;
+    sqe->len = submission.len;
+    sqe->off = submission.off;
+    // All of the operation flags share the same place
+    sqe->rw_flags = submission.op_flags;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+}
+
+bool IoUringStorageBackend::try_submit(Operation* operation) {
+    // The completion queue must have room for everything in flight
+    if (in_flight_ >= cq_entries_) {
+        return false;
+    }
+    unsigned tail = *sq_tail_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries_) {
+        return false;
+    }
+
+    unsigned index = tail & sq_mask_;
+    Submission submission{operation->submission};
+    if (!operation->path.empty()) {
+        submission.addr = reinterpret_cast<uint64_t>(operation->path.c_str());
+    }
+    if (!operation->new_path.empty()) {
+        // addr2 shares its place with off
+        submission.off = reinterpret_cast<uint64_t>(operation->new_path.c_str());
+    }
+    prepare_sqe(index, submission, reinterpret_cast<uint64_t>(operation));
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    do {
+        submitted = io_uring_enter(ring_fd_, 1, 0, 0);
+    } while (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+    if (submitted < 0) {
+        // The kernel never took it, so take it back and fail the operation
+        int error = errno;
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+        operation->complete(-error);
+        delete operation;
+        return true;
+    }
+    in_flight_++;
+    return true;
+}
+
+void IoUringStorageBackend::push(Operation* operation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pending_.empty() || !try_submit(operation)) {
+        pending_.push_back(operation);
+    }
+}
+
+void IoUringStorageBackend::run_completions() {
+    std::vector<std::pair<Operation*, int>> completed;
+    bool woken_up = false;
+    for (;;) {
+        if (io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            // Nothing to do but try again, the completions are still in the ring
+            continue;
+        }
+
+        completed.clear();
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data == WAKE_UP_USER_DATA) {
+                woken_up = true;
+                continue;
+            }
+            completed.emplace_back(reinterpret_cast<Operation*>(cqe.user_data), cqe.res);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+        bool stop;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_flight_ -= completed.size();
+            while (!pending_.empty() && try_submit(pending_.front())) {
+                pending_.pop_front();
+            }
+            // Only stop once every operation got its completion
+            stop = stopping_ && woken_up && in_flight_ == 0 && pending_.empty();
+        }
+
+        for (auto& [operation, result] : completed) {
+            operation->complete(result);
+            delete operation;
+        }
+        if (stop) {
+            return;
+        }
+    }
+}
+
+awaitable<int> IoUringStorageBackend::submit(Submission submission, string path, string new_path) {
+    int result = co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void(int)>(
+        [this, &submission, &path, &new_path](auto handler) {
+            using Handler = decltype(handler);
+            push(new HandlerOperation<Handler>(std::move(handler), submission, std::move(path), std::move(new_path)));
+        },
+        boost::asio::use_awaitable);
+    if (result < 0) {
+        throw system_error(error_code(-result, boost::system::system_category()));
+    }
+    co_return result;
+}
+
+awaitable<size_t> IoUringStorageBackend::write(int fd, const uint8_t* data, size_t size, uint64_t offset) {
+    uint32_t length = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+    co_return static_cast<size_t>(co_await submit(Submission{IORING_OP_WRITE, fd, reinterpret_cast<uint64_t>(data), length, offset, 0}));
+}
+
+awaitable<size_t> IoUringStorageBackend::read(int fd, uint8_t* data, size_t size, uint64_t offset) {
+    uint32_t length = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+    co_return static_cast<size_t>(co_await submit(Submission{IORING_OP_READ, fd, reinterpret_cast<uint64_t>(data), length, offset, 0}));
+}
+
+awaitable<void> IoUringStorageBackend::fsync(int fd) {
+    co_await submit(Submission{IORING_OP_FSYNC, fd, 0, 0, 0, 0});
+}
+
+awaitable<void> IoUringStorageBackend::rename_no_replace(const bfs::path& from, const bfs::path& to) {
+    // The new directory's fd goes in len, and the paths are filled in when submitting
+    Submission submission{IORING_OP_RENAMEAT, AT_FDCWD, 0, static_cast<uint32_t>(AT_FDCWD), 0, RENAME_NOREPLACE};
+    co_await submit(submission, from.string(), to.string());
+}
+#endif
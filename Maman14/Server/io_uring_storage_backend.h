@@ -0,0 +1,109 @@
+#pragma once
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING_STORAGE_BACKEND 1
+#endif
+
+#ifdef HAS_IO_URING_STORAGE_BACKEND
+#include <linux/io_uring.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "storage_backend.h"
+
+/**
+ * @brief A storage backend that submits the operations to an io_uring, so the kernel runs them
+ * asynchronously, and many of them can be in flight without a thread each.
+ * A single thread waits for completions and hands them back to the awaiting coroutines' executors.
+ * It talks to the ring with the raw system calls, so it doesn't need liburing.
+ *
+ */
+class IoUringStorageBackend : public StorageBackend {
+public:
+    /**
+     * @brief Set up the ring.
+     * Throws StorageBackendUnavailableException if the kernel doesn't support io_uring or one of the operations we need
+     *
+     * @param queue_depth How many operations may be submitted at once. More wait in a queue of our own
+     */
+    IoUringStorageBackend(unsigned queue_depth);
+    ~IoUringStorageBackend();
+    IoUringStorageBackend(const IoUringStorageBackend&) = delete;
+    IoUringStorageBackend& operator=(const IoUringStorageBackend&) = delete;
+
+    virtual awaitable<size_t> write(int fd, const uint8_t* data, size_t size, uint64_t offset) override;
+    virtual awaitable<size_t> read(int fd, uint8_t* data, size_t size, uint64_t offset) override;
+    virtual awaitable<void> fsync(int fd) override;
+    virtual awaitable<void> rename_no_replace(const bfs::path& from, const bfs::path& to) override;
+    virtual const char* name() const override { return "io_uring"; };
+
+    /**
+     * @brief The fields of a submission queue entry that our operations use.
+     * io_uring_sqe itself ends with a flexible array, so it can't be a member of our classes
+     *
+     */
+    struct Submission {
+        uint8_t opcode;
+        int fd;
+        uint64_t addr;
+        uint32_t len;
+        uint64_t off;
+        uint32_t op_flags;
+    };
+
+    /**
+     * @brief A submitted operation, that outlives the awaiting coroutine's frame until the kernel is done with it
+     *
+     */
+    class Operation {
+    public:
+        Operation(const Submission& submission, string path, string new_path);
+        virtual ~Operation() = default;
+        virtual void complete(int result) = 0;
+
+        Submission submission;
+        // Paths the kernel reads while running the operation
+        string path;
+        string new_path;
+    };
+
+private:
+    awaitable<int> submit(Submission submission, string path = "", string new_path = "");
+    void prepare_sqe(unsigned index, const Submission& submission, uint64_t user_data);
+    void push(Operation* operation);
+    bool try_submit(Operation* operation);
+    void run_completions();
+    void check_supported_operations();
+    void unmap_ring();
+
+    int ring_fd_;
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    unsigned cq_entries_;
+    io_uring_cqe* cqes_;
+
+    // Guards the submission queue and the following state
+    std::mutex mutex_;
+    // Operations that didn't fit in the ring yet
+    std::deque<Operation*> pending_;
+    unsigned in_flight_;
+    bool stopping_;
+    std::thread completion_thread_;
+};
+#endif
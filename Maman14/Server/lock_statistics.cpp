@@ -0,0 +1,21 @@
+#include "lock_statistics.h"
+
+void LockStatistics::on_contended_acquired(std::chrono::nanoseconds wait_time) {
+    uint64_t wait_ns = static_cast<uint64_t>(wait_time.count());
+    acquisitions_++;
+    contended_acquisitions_++;
+    total_wait_ns_ += wait_ns;
+
+    uint64_t max_wait_ns = max_wait_ns_;
+    while (wait_ns > max_wait_ns && !max_wait_ns_.compare_exchange_weak(max_wait_ns, wait_ns)) {
+    }
+}
+
+string LockStatistics::to_string() const {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    return "acquisitions: " + std::to_string(get_acquisitions()) +
+           " contended: " + std::to_string(get_contended_acquisitions()) +
+           " total wait (us): " + std::to_string(duration_cast<microseconds>(get_total_wait_time()).count()) +
+           " max wait (us): " + std::to_string(duration_cast<microseconds>(get_max_wait_time()).count());
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using std::string;
+
+/**
+ * @brief Counters of how long threads waited to take a lock.
+ * Only contended acquisitions are timed, so taking a free lock stays cheap
+ *
+ */
+class LockStatistics {
+public:
+    void on_acquired() { acquisitions_++; };
+    void on_contended_acquired(std::chrono::nanoseconds wait_time);
+
+    uint64_t get_acquisitions() const { return acquisitions_; };
+    uint64_t get_contended_acquisitions() const { return contended_acquisitions_; };
+    std::chrono::nanoseconds get_total_wait_time() const { return std::chrono::nanoseconds(total_wait_ns_); };
+    std::chrono::nanoseconds get_max_wait_time() const { return std::chrono::nanoseconds(max_wait_ns_); };
+
+    string to_string() const;
+
+private:
+    std::atomic<uint64_t> acquisitions_{0};
+    std::atomic<uint64_t> contended_acquisitions_{0};
+    std::atomic<uint64_t> total_wait_ns_{0};
+    std::atomic<uint64_t> max_wait_ns_{0};
+};
+
+/**
+ * @brief Take the lock, and time the wait in the statistics if someone else is holding it
+ *
+ * @tparam Lock A std::unique_lock or std::shared_lock that was created with std::defer_lock
+ */
+template <typename Lock>
+void lock_and_measure(Lock& lock, LockStatistics& statistics) {
+    if (lock.try_lock()) {
+        statistics.on_acquired();
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    lock.lock();
+    statistics.on_contended_acquired(std::chrono::steady_clock::now() - start);
+}
@@ -4,7 +4,6 @@
 #include <exception>
 #include <memory>
 
-#include "request_parser.h"
 #include "server.h"
 
 using std::shared_ptr;
@@ -0,0 +1,98 @@
+#include "manifest.h"
+
+#include <fstream>
+
+#include "sha256.h"
+
+// magic (8) file size (8) number of chunks (4), and then each chunk's hash (32) and size (4), all little endian
+static const char MANIFEST_MAGIC[8] = {'B', 'K', 'M', 'A', 'N', 'I', 'F', '1'};
+static const size_t MANIFEST_HEADER_SIZE = sizeof(MANIFEST_MAGIC) + 8 + 4;
+static const size_t CHUNK_REFERENCE_SIZE = 32 + 4;
+
+static void push_le(vector<uint8_t>& buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static uint64_t read_le(const uint8_t* data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+void Manifest::add_chunk(const ContentHash& hash, uint32_t chunk_size) {
+    chunks.push_back(ChunkReference{hash, chunk_size});
+    size += chunk_size;
+}
+
+ContentHash Manifest::get_content_hash() const {
+    utils::Sha256 sha;
+    for (const auto& chunk : chunks) {
+        sha.update(chunk.hash.data(), chunk.hash.size());
+    }
+    return sha.finish();
+}
+
+vector<uint8_t> Manifest::serialize() const {
+    vector<uint8_t> buffer(MANIFEST_MAGIC, MANIFEST_MAGIC + sizeof(MANIFEST_MAGIC));
+    buffer.reserve(MANIFEST_HEADER_SIZE + chunks.size() * CHUNK_REFERENCE_SIZE);
+    push_le(buffer, size, 8);
+    push_le(buffer, chunks.size(), 4);
+    for (const auto& chunk : chunks) {
+        buffer.insert(buffer.end(), chunk.hash.begin(), chunk.hash.end());
+        push_le(buffer, chunk.size, 4);
+    }
+    return buffer;
+}
+
+Manifest Manifest::parse(const uint8_t* data, size_t size) {
+    if (size < MANIFEST_HEADER_SIZE || !std::equal(MANIFEST_MAGIC, MANIFEST_MAGIC + sizeof(MANIFEST_MAGIC), data)) {
+        throw InvalidManifestException("Not a manifest");
+    }
+    uint64_t file_size = read_le(data + sizeof(MANIFEST_MAGIC), 8);
+    uint64_t num_chunks = read_le(data + sizeof(MANIFEST_MAGIC) + 8, 4);
+    if (size != MANIFEST_HEADER_SIZE + num_chunks * CHUNK_REFERENCE_SIZE) {
+        throw InvalidManifestException("Manifest has the wrong size");
+    }
+
+    Manifest manifest;
+    manifest.chunks.reserve(num_chunks);
+    const uint8_t* chunk = data + MANIFEST_HEADER_SIZE;
+    for (uint64_t i = 0; i < num_chunks; i++, chunk += CHUNK_REFERENCE_SIZE) {
+        ContentHash hash;
+        std::copy(chunk, chunk + hash.size(), hash.begin());
+        manifest.add_chunk(hash, static_cast<uint32_t>(read_le(chunk + hash.size(), 4)));
+    }
+    if (manifest.size != file_size) {
+        throw InvalidManifestException("Manifest's chunks don't add up to its size");
+    }
+    return manifest;
+}
+
+Manifest Manifest::read(const bfs::path& path) {
+    std::ifstream file(path.string(), std::ios::binary);
+    if (!file) {
+        throw InvalidManifestException("Failed to open manifest: " + path.string());
+    }
+    // Check the header first, so a file that isn't a manifest isn't read whole
+    vector<uint8_t> content(MANIFEST_HEADER_SIZE);
+    if (!file.read(reinterpret_cast<char*>(content.data()), content.size()) ||
+        !std::equal(MANIFEST_MAGIC, MANIFEST_MAGIC + sizeof(MANIFEST_MAGIC), content.data())) {
+        throw InvalidManifestException("Not a manifest: " + path.string());
+    }
+    uint64_t num_chunks = read_le(content.data() + sizeof(MANIFEST_MAGIC) + 8, 4);
+    uint64_t manifest_size = MANIFEST_HEADER_SIZE + num_chunks * CHUNK_REFERENCE_SIZE;
+    // Check the size before reading, so a corrupt count can't make us allocate a huge buffer
+    if (!file.seekg(0, std::ios::end) || static_cast<uint64_t>(file.tellg()) != manifest_size) {
+        throw InvalidManifestException("Manifest has the wrong size: " + path.string());
+    }
+    content.resize(manifest_size);
+    file.seekg(MANIFEST_HEADER_SIZE);
+    if (!file.read(reinterpret_cast<char*>(content.data()) + MANIFEST_HEADER_SIZE, content.size() - MANIFEST_HEADER_SIZE)) {
+        throw InvalidManifestException("Failed to read manifest: " + path.string());
+    }
+    return parse(content.data(), content.size());
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "file_index.h"
+
+namespace bfs = boost::filesystem;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+class InvalidManifestException : public runtime_error {
+public:
+    InvalidManifestException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief One chunk of a deduplicated file, found in the chunk store by the SHA-256 of its content
+ *
+ */
+struct ChunkReference {
+    ContentHash hash;
+    uint32_t size;
+
+    bool operator==(const ChunkReference& other) const = default;
+};
+
+/**
+ * @brief What a deduplicated backup file is stored as in the user's directory: the list of its chunks, in order
+ *
+ */
+struct Manifest {
+    uint64_t size = 0;
+    vector<ChunkReference> chunks;
+
+    /**
+     * @brief Add the next chunk of the file
+     *
+     */
+    void add_chunk(const ContentHash& hash, uint32_t chunk_size);
+
+    /**
+     * @brief A hash that identifies the file's content: the SHA-256 of its chunks' hashes
+     *
+     */
+    ContentHash get_content_hash() const;
+
+    vector<uint8_t> serialize() const;
+
+    /**
+     * @brief Parse a serialized manifest. Throws InvalidManifestException if it isn't one
+     *
+     */
+    static Manifest parse(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Read and parse a manifest file. Throws InvalidManifestException if it can't be read or isn't a manifest
+     *
+     */
+    static Manifest read(const bfs::path& path);
+};
@@ -0,0 +1,94 @@
+#include "membership_filter.h"
+
+#include <cmath>
+#include <functional>
+
+static uint64_t mix(uint64_t value) {
+    // The finalizer of SplitMix64
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+string MembershipFilterStatistics::to_string() const {
+    return "keys: " + std::to_string(num_keys) +
+           " size: " + std::to_string(size) +
+           " false positive rate: " + std::to_string(false_positive_rate);
+}
+
+MembershipFilter::MembershipFilter(MembershipFilterOptions options)
+    : num_blocks_(1), num_keys_(0) {
+    // A power of two, so a block is picked with a mask
+    while (num_blocks_ * BLOCK_SIZE < options.expected_keys * options.counters_per_key) {
+        num_blocks_ *= 2;
+    }
+    counters_.reset(new std::atomic<uint8_t>[num_blocks_ * BLOCK_SIZE]);
+    for (size_t i = 0; i < num_blocks_ * BLOCK_SIZE; i++) {
+        counters_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+uint64_t MembershipFilter::hash(uint64_t seed, const string& key) {
+    return mix(std::hash<string>{}(key) ^ mix(seed + 0x9e3779b97f4a7c15ULL));
+}
+
+template <typename Function>
+void MembershipFilter::for_each_counter(uint64_t hash, Function function) const {
+    // The high bits pick the block, and the low bits the counters in it. An odd step over a block
+    // of a power of two counters never repeats a counter
+    std::atomic<uint8_t>* block = &counters_[((hash >> 32) & (num_blocks_ - 1)) * BLOCK_SIZE];
+    size_t position = hash & (BLOCK_SIZE - 1);
+    size_t step = ((hash >> 8) & (BLOCK_SIZE - 1)) | 1;
+    for (size_t i = 0; i < NUM_PROBES; i++) {
+        if (!function(block[position])) {
+            return;
+        }
+        position = (position + step) & (BLOCK_SIZE - 1);
+    }
+}
+
+void MembershipFilter::add(uint64_t hash) {
+    for_each_counter(hash, [](std::atomic<uint8_t>& counter) {
+        uint8_t count = counter.load(std::memory_order_relaxed);
+        while (count < MAX_COUNT && !counter.compare_exchange_weak(count, count + 1, std::memory_order_release,
+                                                                   std::memory_order_relaxed)) {
+        }
+        return true;
+    });
+    num_keys_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MembershipFilter::remove(uint64_t hash) {
+    for_each_counter(hash, [](std::atomic<uint8_t>& counter) {
+        uint8_t count = counter.load(std::memory_order_relaxed);
+        // An overflowed counter doesn't know how many keys it counts anymore
+        while (count > 0 && count < MAX_COUNT && !counter.compare_exchange_weak(count, count - 1, std::memory_order_release,
+                                                                                std::memory_order_relaxed)) {
+        }
+        return true;
+    });
+    num_keys_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool MembershipFilter::might_contain(uint64_t hash) const {
+    bool found = true;
+    for_each_counter(hash, [&found](std::atomic<uint8_t>& counter) {
+        found = counter.load(std::memory_order_acquire) > 0;
+        return found;
+    });
+    return found;
+}
+
+MembershipFilterStatistics MembershipFilter::get_statistics() const {
+    size_t num_counters = num_blocks_ * BLOCK_SIZE;
+    size_t num_set = 0;
+    for (size_t i = 0; i < num_counters; i++) {
+        num_set += counters_[i].load(std::memory_order_relaxed) > 0;
+    }
+    // A missing key is a false positive if all of its counters are set
+    double false_positive_rate = std::pow(static_cast<double>(num_set) / num_counters, NUM_PROBES);
+    return MembershipFilterStatistics{num_keys_.load(), num_counters, false_positive_rate};
+}
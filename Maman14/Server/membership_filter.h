@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+using std::string;
+using std::unique_ptr;
+
+struct MembershipFilterOptions {
+    // How many keys the filter is sized for. More keys still work, with more false positives
+    size_t expected_keys = 1024 * 1024;
+
+    // With 10 counters per key, about 1% of the keys that aren't in the filter are said to maybe be in it
+    size_t counters_per_key = 10;
+};
+
+struct MembershipFilterStatistics {
+    size_t num_keys;
+    // The bytes of the counters
+    size_t size;
+    // How many of the keys that aren't in the filter are said to maybe be in it, from how many counters are set
+    double false_positive_rate;
+
+    string to_string() const;
+};
+
+/**
+ * @brief A counting Bloom filter, which says whether a key definitely isn't in a set or may be in it.
+ * Unlike a plain Bloom filter, keys can be removed as well. All of a key's counters are in the same cache line,
+ * so a lookup costs a single cache miss. The counters are atomic, so lookups, adds and removes never take a lock.
+ * A counter that overflows stays at its maximum and is never decremented, so the filter never forgets a key
+ * that's still in the set, it only answers maybe for more of the keys that aren't.
+ * A key must only be removed after it was added, and as many times as it was added.
+ *
+ */
+class MembershipFilter {
+public:
+    MembershipFilter(MembershipFilterOptions options = MembershipFilterOptions());
+    MembershipFilter(const MembershipFilter&) = delete;
+    MembershipFilter& operator=(const MembershipFilter&) = delete;
+
+    /**
+     * @brief Hash a key for the filter. The seed tells apart equal keys of different sets that share the filter
+     *
+     */
+    static uint64_t hash(uint64_t seed, const string& key);
+
+    void add(uint64_t hash);
+    void remove(uint64_t hash);
+
+    /**
+     * @brief Whether the key may be in the set. False means it definitely isn't
+     *
+     */
+    bool might_contain(uint64_t hash) const;
+
+    /**
+     * @brief Counts the set counters, so it takes a while for a big filter
+     *
+     */
+    MembershipFilterStatistics get_statistics() const;
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64;
+    static constexpr size_t NUM_PROBES = 7;
+    static constexpr uint8_t MAX_COUNT = 255;
+
+    // Calls the function with each of the key's counters
+    template <typename Function>
+    void for_each_counter(uint64_t hash, Function function) const;
+
+    size_t num_blocks_;
+    unique_ptr<std::atomic<uint8_t>[]> counters_;
+    std::atomic<size_t> num_keys_;
+};
@@ -0,0 +1,62 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+
+using boost::system::error_code;
+using std::lock_guard;
+
+MemoryBudget::Reservation::~Reservation() {
+    if (budget_ != nullptr) {
+        budget_->release(size_);
+    }
+}
+
+void MemoryBudget::Reservation::shrink(size_t size) {
+    if (budget_ == nullptr || size >= size_) {
+        return;
+    }
+    budget_->release(size_ - size);
+    size_ = size;
+}
+
+MemoryBudget::MemoryBudget(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)), used_(0) {}
+
+awaitable<MemoryBudget::Reservation> MemoryBudget::acquire(size_t size) {
+    size = std::min(size, capacity_);
+    auto executor = co_await boost::asio::this_coro::executor;
+    for (;;) {
+        shared_ptr<boost::asio::steady_timer> waiter;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (used_ + size <= capacity_) {
+                used_ += size;
+                co_return Reservation(this, size);
+            }
+
+            waiter = std::make_shared<boost::asio::steady_timer>(executor, boost::asio::steady_timer::time_point::max());
+            waiters_.push_back(waiter);
+        }
+
+        error_code ignored;
+        co_await waiter->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+    }
+}
+
+size_t MemoryBudget::get_used() const {
+    lock_guard<mutex> lock(mutex_);
+    return used_;
+}
+
+void MemoryBudget::release(size_t size) {
+    lock_guard<mutex> lock(mutex_);
+    used_ -= size;
+    for (auto& waiter : waiters_) {
+        // Timers aren't thread safe, so expire each one on its waiter's own executor.
+        // Expiring rather than cancelling also wakes a waiter that didn't start waiting yet
+        boost::asio::post(waiter->get_executor(), [waiter]() {
+            waiter->expires_at(boost::asio::steady_timer::time_point::min());
+        });
+    }
+    waiters_.clear();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <list>
+#include <memory>
+#include <mutex>
+
+using boost::asio::awaitable;
+using std::mutex;
+using std::shared_ptr;
+
+/**
+ * @brief A global ceiling on how many bytes may be buffered at once.
+ * Coroutines acquire reservations from it, and suspend while it's exhausted
+ * until other reservations are released.
+ *
+ */
+class MemoryBudget {
+public:
+    /**
+     * @brief RAII handle to reserved bytes, which are returned to the budget on destruction
+     *
+     */
+    class Reservation {
+    public:
+        Reservation(MemoryBudget* budget, size_t size) : budget_(budget), size_(size) {}
+        Reservation(Reservation&& other) noexcept : budget_(other.budget_), size_(other.size_) { other.budget_ = nullptr; }
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+        Reservation& operator=(Reservation&&) = delete;
+        ~Reservation();
+
+        size_t size() const { return size_; };
+
+        /**
+         * @brief Give back what's reserved beyond size, once it turns out that less is needed
+         *
+         */
+        void shrink(size_t size);
+
+    private:
+        MemoryBudget* budget_;
+        size_t size_;
+    };
+
+    MemoryBudget(size_t capacity);
+
+    /**
+     * @brief Reserve size bytes, waiting until they are available.
+     * Requests larger than the whole budget are capped to it
+     *
+     */
+    awaitable<Reservation> acquire(size_t size);
+
+    size_t get_capacity() const { return capacity_; };
+    size_t get_used() const;
+
+private:
+    void release(size_t size);
+
+    size_t capacity_;
+    size_t used_;
+    // Each waiter waits on its own timer, and we expire them to wake them up when bytes are released
+    std::list<shared_ptr<boost::asio::steady_timer>> waiters_;
+    mutable mutex mutex_;
+};
@@ -0,0 +1,570 @@
+#include "pack_store.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+
+#include "sha256.h"
+
+// The layouts, in the host's byte order since the segments never leave the machine they were written on:
+//   record:       magic (4) crc32 of the rest of the record (4) type (1) name length (2) size (4) mtime (8) hash (32)
+//                 name, content
+//   offsets file: magic (8) number of records (4)
+//                 record: type (1) record offset (8) size (4) mtime (8) hash (32) name length (2) name
+//                 crc32 of everything before it (4)
+static const uint32_t RECORD_MAGIC = 0x4b434150;
+static const size_t RECORD_HEADER_SIZE = 55;
+static const size_t RECORD_CRC_OFFSET = 8;
+static const char OFFSETS_MAGIC[8] = {'B', 'K', 'P', 'K', 'O', 'F', 'F', 'S'};
+static const char* SEGMENT_EXTENSION = ".pack";
+static const char* OFFSETS_EXTENSION = ".offsets";
+
+template <typename T>
+static void append_value(vector<uint8_t>& buffer, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+template <typename T>
+static T read_value(const uint8_t* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint32_t get_crc(const uint8_t* data, size_t size) {
+    return static_cast<uint32_t>(::crc32(::crc32(0, nullptr, 0), data, static_cast<uInt>(size)));
+}
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset, const bfs::path& path) {
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw PackStoreException("Failed to write: " + path.string());
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+// Returns how many bytes were read, which is less than the size only at the end of the file
+static size_t pread_all(int fd, uint8_t* data, size_t size, uint64_t offset, const bfs::path& path) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes_read = ::pread(fd, data + total, size - total, static_cast<off_t>(offset + total));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            throw PackStoreException("Failed to read: " + path.string());
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
+
+string PackStoreStatistics::to_string() const {
+    return "files: " + std::to_string(num_files) +
+           " segments: " + std::to_string(num_segments) +
+           " live bytes: " + std::to_string(live_bytes) +
+           " dead bytes: " + std::to_string(dead_bytes) +
+           " compactions: " + std::to_string(num_compactions) +
+           " reclaimed bytes: " + std::to_string(reclaimed_bytes);
+}
+
+PackStore::PackStore(bfs::path directory, PackStoreOptions options)
+    : directory_(std::move(directory)), options_(options), active_segment_(0), has_active_segment_(false),
+      num_compactions_(0), reclaimed_bytes_(0) {
+    load();
+}
+
+PackStore::~PackStore() {
+    for (auto& [id, segment] : segments_) {
+        ::close(segment.fd);
+    }
+}
+
+uint64_t PackStore::get_record_size(const string& filename, uint64_t size) {
+    return RECORD_HEADER_SIZE + filename.size() + size;
+}
+
+bfs::path PackStore::get_segment_path(uint32_t id) const {
+    return directory_ / (std::to_string(id) + SEGMENT_EXTENSION);
+}
+
+bfs::path PackStore::get_offsets_path(uint32_t id) const {
+    return directory_ / (std::to_string(id) + OFFSETS_EXTENSION);
+}
+
+void PackStore::load() {
+    boost::system::error_code error;
+    bfs::directory_iterator it(directory_, error);
+    if (error) {
+        // Nothing was packed yet
+        return;
+    }
+    vector<uint32_t> ids;
+    for (; it != bfs::directory_iterator(); it++) {
+        if (it->path().extension() != SEGMENT_EXTENSION) {
+            continue;
+        }
+        string stem = it->path().stem().string();
+        uint32_t id;
+        auto [end, parse_error] = std::from_chars(stem.data(), stem.data() + stem.size(), id);
+        if (parse_error == std::errc() && end == stem.data() + stem.size()) {
+            ids.push_back(id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    // The records are replayed in the order they were written, so a later record of a file wins
+    for (uint32_t id : ids) {
+        int fd = ::open(get_segment_path(id).c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            throw PackStoreException("Failed to open: " + get_segment_path(id).string());
+        }
+        Segment& segment = segments_[id];
+        segment.fd = fd;
+        segment.size = 0;
+        segment.live_bytes = 0;
+        for (const auto& record : load_segment(id, segment, id != ids.back())) {
+            apply(record);
+        }
+    }
+    for (const auto& [filename, file] : files_) {
+        segments_[file.segment].live_bytes += get_record_size(filename, file.size);
+    }
+    if (!ids.empty()) {
+        active_segment_ = ids.back();
+        has_active_segment_ = true;
+    }
+}
+
+vector<PackStore::RecordInfo> PackStore::load_segment(uint32_t id, Segment& segment, bool sealed) {
+    if (sealed) {
+        if (auto records = read_offsets(id)) {
+            struct stat segment_stat;
+            if (::fstat(segment.fd, &segment_stat) != 0) {
+                throw PackStoreException("Failed to stat: " + get_segment_path(id).string());
+            }
+            segment.size = segment_stat.st_size;
+            for (const auto& record : *records) {
+                if (record.type == RecordType::DELETE) {
+                    segment.deleted.emplace_back(record.file.record_offset, record.filename);
+                }
+            }
+            return std::move(*records);
+        }
+    }
+    return read_records(id, segment);
+}
+
+vector<PackStore::RecordInfo> PackStore::read_records(uint32_t id, Segment& segment) {
+    bfs::path path = get_segment_path(id);
+    vector<RecordInfo> records;
+    vector<uint8_t> record;
+    uint64_t offset = 0;
+    for (;;) {
+        record.resize(RECORD_HEADER_SIZE);
+        if (pread_all(segment.fd, record.data(), RECORD_HEADER_SIZE, offset, path) < RECORD_HEADER_SIZE ||
+            read_value<uint32_t>(record.data()) != RECORD_MAGIC) {
+            break;
+        }
+        uint32_t crc = read_value<uint32_t>(record.data() + 4);
+        RecordInfo info;
+        info.type = static_cast<RecordType>(record[8]);
+        if (info.type != RecordType::PUT && info.type != RecordType::DELETE) {
+            break;
+        }
+        uint16_t name_length = read_value<uint16_t>(record.data() + 9);
+        info.file.segment = id;
+        info.file.record_offset = offset;
+        info.file.size = read_value<uint32_t>(record.data() + 11);
+        info.file.mtime_ns = read_value<int64_t>(record.data() + 15);
+        std::memcpy(info.file.content_hash.data(), record.data() + 23, info.file.content_hash.size());
+
+        size_t rest = name_length + (info.type == RecordType::PUT ? info.file.size : 0);
+        record.resize(RECORD_HEADER_SIZE + rest);
+        if (pread_all(segment.fd, record.data() + RECORD_HEADER_SIZE, rest, offset + RECORD_HEADER_SIZE, path) < rest ||
+            get_crc(record.data() + RECORD_CRC_OFFSET, record.size() - RECORD_CRC_OFFSET) != crc) {
+            break;
+        }
+        info.filename.assign(reinterpret_cast<const char*>(record.data()) + RECORD_HEADER_SIZE, name_length);
+        if (info.type == RecordType::DELETE) {
+            segment.deleted.emplace_back(offset, info.filename);
+        }
+        offset += record.size();
+        records.push_back(std::move(info));
+    }
+
+    // Whatever follows the last whole record was torn by a crash, and new records are written over it
+    segment.size = offset;
+    if (::ftruncate(segment.fd, static_cast<off_t>(offset)) != 0) {
+        throw PackStoreException("Failed to truncate: " + path.string());
+    }
+    return records;
+}
+
+std::optional<vector<PackStore::RecordInfo>> PackStore::read_offsets(uint32_t id) const {
+    bfs::path path = get_offsets_path(id);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat offsets_stat;
+    vector<uint8_t> buffer;
+    bool read = ::fstat(fd, &offsets_stat) == 0;
+    if (read) {
+        buffer.resize(offsets_stat.st_size);
+        read = pread_all(fd, buffer.data(), buffer.size(), 0, path) == buffer.size();
+    }
+    ::close(fd);
+    size_t min_size = sizeof(OFFSETS_MAGIC) + sizeof(uint32_t) * 2;
+    if (!read || buffer.size() < min_size || std::memcmp(buffer.data(), OFFSETS_MAGIC, sizeof(OFFSETS_MAGIC)) != 0 ||
+        get_crc(buffer.data(), buffer.size() - 4) != read_value<uint32_t>(buffer.data() + buffer.size() - 4)) {
+        return std::nullopt;
+    }
+
+    const uint8_t* position = buffer.data() + sizeof(OFFSETS_MAGIC);
+    const uint8_t* end = buffer.data() + buffer.size() - 4;
+    uint32_t num_records = read_value<uint32_t>(position);
+    position += sizeof(uint32_t);
+    vector<RecordInfo> records;
+    for (uint32_t i = 0; i < num_records; i++) {
+        static const size_t FIXED_SIZE = 1 + 8 + 4 + 8 + 32 + 2;
+        if (static_cast<size_t>(end - position) < FIXED_SIZE) {
+            return std::nullopt;
+        }
+        RecordInfo info;
+        info.type = static_cast<RecordType>(position[0]);
+        info.file.segment = id;
+        info.file.record_offset = read_value<uint64_t>(position + 1);
+        info.file.size = read_value<uint32_t>(position + 9);
+        info.file.mtime_ns = read_value<int64_t>(position + 13);
+        std::memcpy(info.file.content_hash.data(), position + 21, info.file.content_hash.size());
+        uint16_t name_length = read_value<uint16_t>(position + 53);
+        position += FIXED_SIZE;
+        if (static_cast<size_t>(end - position) < name_length) {
+            return std::nullopt;
+        }
+        info.filename.assign(reinterpret_cast<const char*>(position), name_length);
+        position += name_length;
+        records.push_back(std::move(info));
+    }
+    return records;
+}
+
+void PackStore::write_offsets(uint32_t id) const {
+    // The segment's files that are still packed, and its deletes, which hide the files of older segments
+    vector<RecordInfo> records;
+    for (const auto& [filename, file] : files_) {
+        if (file.segment == id) {
+            records.push_back(RecordInfo{RecordType::PUT, filename, file});
+        }
+    }
+    for (const auto& [offset, filename] : segments_.at(id).deleted) {
+        records.push_back(RecordInfo{RecordType::DELETE, filename, PackedFile{id, offset, 0, 0, ContentHash{}}});
+    }
+    std::sort(records.begin(), records.end(),
+              [](const RecordInfo& a, const RecordInfo& b) { return a.file.record_offset < b.file.record_offset; });
+
+    vector<uint8_t> buffer(OFFSETS_MAGIC, OFFSETS_MAGIC + sizeof(OFFSETS_MAGIC));
+    append_value(buffer, static_cast<uint32_t>(records.size()));
+    for (const auto& record : records) {
+        append_value(buffer, static_cast<uint8_t>(record.type));
+        append_value(buffer, record.file.record_offset);
+        append_value(buffer, record.file.size);
+        append_value(buffer, record.file.mtime_ns);
+        buffer.insert(buffer.end(), record.file.content_hash.begin(), record.file.content_hash.end());
+        append_value(buffer, static_cast<uint16_t>(record.filename.size()));
+        buffer.insert(buffer.end(), record.filename.begin(), record.filename.end());
+    }
+    append_value(buffer, get_crc(buffer.data(), buffer.size()));
+
+    // A missing or torn offsets file only means the segment is read on startup, so it isn't synced
+    bfs::path temp_path = get_offsets_path(id).string() + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw PackStoreException("Failed to create: " + temp_path.string());
+    }
+    try {
+        pwrite_all(fd, buffer.data(), buffer.size(), 0, temp_path);
+    } catch (const PackStoreException&) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    if (::rename(temp_path.c_str(), get_offsets_path(id).c_str()) != 0) {
+        throw PackStoreException("Failed to save: " + get_offsets_path(id).string());
+    }
+}
+
+void PackStore::apply(const RecordInfo& record) {
+    if (record.type == RecordType::PUT) {
+        files_[record.filename] = record.file;
+    } else {
+        files_.erase(record.filename);
+    }
+}
+
+void PackStore::open_active_segment(uint32_t id) {
+    bfs::create_directories(directory_);
+    int fd = ::open(get_segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw PackStoreException("Failed to create: " + get_segment_path(id).string());
+    }
+    // The new segment's name has to be durable before the puts into it are
+    int directory_fd = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd < 0 || ::fsync(directory_fd) != 0) {
+        if (directory_fd >= 0) {
+            ::close(directory_fd);
+        }
+        ::close(fd);
+        throw PackStoreException("Failed to sync: " + directory_.string());
+    }
+    ::close(directory_fd);
+    segments_[id] = Segment{fd, 0, 0, {}};
+    active_segment_ = id;
+    has_active_segment_ = true;
+}
+
+void PackStore::seal_active_segment() {
+    Segment& active = segments_.at(active_segment_);
+    if (::fdatasync(active.fd) != 0) {
+        throw PackStoreException("Failed to sync: " + get_segment_path(active_segment_).string());
+    }
+    write_offsets(active_segment_);
+    open_active_segment(active_segment_ + 1);
+}
+
+PackStore::PackedFile PackStore::append(RecordType type, const string& filename, const uint8_t* data, size_t size,
+                                        int64_t mtime_ns, const ContentHash& content_hash) {
+    uint64_t record_size = get_record_size(filename, size);
+    if (!has_active_segment_) {
+        open_active_segment(0);
+    } else if (segments_.at(active_segment_).size > 0 && segments_.at(active_segment_).size + record_size > options_.segment_size) {
+        seal_active_segment();
+    }
+
+    vector<uint8_t> record;
+    record.reserve(record_size);
+    append_value(record, RECORD_MAGIC);
+    append_value(record, uint32_t(0));
+    append_value(record, static_cast<uint8_t>(type));
+    append_value(record, static_cast<uint16_t>(filename.size()));
+    append_value(record, static_cast<uint32_t>(size));
+    append_value(record, mtime_ns);
+    record.insert(record.end(), content_hash.begin(), content_hash.end());
+    record.insert(record.end(), filename.begin(), filename.end());
+    record.insert(record.end(), data, data + size);
+    uint32_t crc = get_crc(record.data() + RECORD_CRC_OFFSET, record.size() - RECORD_CRC_OFFSET);
+    std::memcpy(record.data() + 4, &crc, sizeof(crc));
+
+    Segment& active = segments_.at(active_segment_);
+    uint64_t offset = active.size;
+    pwrite_all(active.fd, record.data(), record.size(), offset, get_segment_path(active_segment_));
+    active.size += record.size();
+    if (type == RecordType::DELETE) {
+        active.deleted.emplace_back(offset, filename);
+    }
+    return PackedFile{active_segment_, offset, static_cast<uint32_t>(size), mtime_ns, content_hash};
+}
+
+void PackStore::forget(const string& filename) {
+    auto it = files_.find(filename);
+    if (it == files_.end()) {
+        return;
+    }
+    segments_.at(it->second.segment).live_bytes -= get_record_size(filename, it->second.size);
+    files_.erase(it);
+}
+
+FileIndexEntry PackStore::put(const string& filename, const uint8_t* data, size_t size) {
+    if (!fits(size)) {
+        throw PackStoreException("Too big to pack: " + filename);
+    }
+    ContentHash content_hash = utils::Sha256::hash(data, size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    PackedFile file = append(RecordType::PUT, filename, data, size, now_ns(), content_hash);
+    if (::fdatasync(segments_.at(file.segment).fd) != 0) {
+        throw PackStoreException("Failed to sync: " + get_segment_path(file.segment).string());
+    }
+    forget(filename);
+    files_[filename] = file;
+    segments_.at(file.segment).live_bytes += get_record_size(filename, size);
+    return FileIndexEntry{size, file.mtime_ns, content_hash};
+}
+
+UnsyncedPut PackStore::put_unsynced(const string& filename, const uint8_t* data, size_t size) {
+    if (!fits(size)) {
+        throw PackStoreException("Too big to pack: " + filename);
+    }
+    ContentHash content_hash = utils::Sha256::hash(data, size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    PackedFile file = append(RecordType::PUT, filename, data, size, now_ns(), content_hash);
+    // The segment may be sealed and compacted before the caller syncs it, so the caller gets an fd of its own
+    int fd = ::fcntl(segments_.at(file.segment).fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        throw PackStoreException("Failed to open: " + get_segment_path(file.segment).string());
+    }
+    forget(filename);
+    files_[filename] = file;
+    segments_.at(file.segment).live_bytes += get_record_size(filename, size);
+    return UnsyncedPut{FileIndexEntry{size, file.mtime_ns, content_hash}, file.segment, fd};
+}
+
+bool PackStore::remove(const string& filename) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (files_.count(filename) == 0) {
+        return false;
+    }
+    append(RecordType::DELETE, filename, nullptr, 0, now_ns(), ContentHash{});
+    forget(filename);
+    return true;
+}
+
+bool PackStore::contains(const string& filename) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return files_.count(filename) > 0;
+}
+
+std::optional<PackedFileHandle> PackStore::open(const string& filename) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(filename);
+    if (it == files_.end()) {
+        return std::nullopt;
+    }
+    const PackedFile& file = it->second;
+    int fd = ::fcntl(segments_.at(file.segment).fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        throw PackStoreException("Failed to open: " + get_segment_path(file.segment).string());
+    }
+    return PackedFileHandle{fd, get_segment_path(file.segment), file.record_offset + RECORD_HEADER_SIZE + filename.size(),
+                            file.size};
+}
+
+vector<std::pair<string, FileIndexEntry>> PackStore::get_entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    vector<std::pair<string, FileIndexEntry>> entries;
+    entries.reserve(files_.size());
+    for (const auto& [filename, file] : files_) {
+        entries.emplace_back(filename, FileIndexEntry{file.size, file.mtime_ns, file.content_hash});
+    }
+    return entries;
+}
+
+vector<std::pair<uint32_t, uint64_t>> PackStore::find_segments_to_compact() const {
+    vector<std::pair<uint32_t, uint64_t>> segments;
+    for (const auto& [id, segment] : segments_) {
+        if (id == active_segment_ || segment.size == 0) {
+            continue;
+        }
+        uint64_t dead_bytes = segment.size - segment.live_bytes;
+        if (dead_bytes >= options_.compaction_threshold * segment.size) {
+            segments.emplace_back(id, dead_bytes);
+        }
+    }
+    return segments;
+}
+
+size_t PackStore::compact() {
+    std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+    vector<std::pair<uint32_t, uint64_t>> segments;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        segments = find_segments_to_compact();
+    }
+    for (const auto& [id, dead_bytes] : segments) {
+        compact_segment(id);
+    }
+    return segments.size();
+}
+
+void PackStore::compact_segment(uint32_t id) {
+    bfs::path path = get_segment_path(id);
+    int fd;
+    vector<std::pair<string, PackedFile>> live_files;
+    vector<string> deleted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = segments_.at(id).fd;
+        for (const auto& [filename, file] : files_) {
+            if (file.segment == id) {
+                live_files.emplace_back(filename, file);
+            }
+        }
+        for (const auto& [offset, filename] : segments_.at(id).deleted) {
+            deleted.push_back(filename);
+        }
+    }
+
+    // The content is read without the lock, and only copied if the file wasn't replaced or removed meanwhile
+    vector<uint8_t> content;
+    uint64_t copied_bytes = 0;
+    for (const auto& [filename, file] : live_files) {
+        content.resize(file.size);
+        uint64_t content_offset = file.record_offset + RECORD_HEADER_SIZE + filename.size();
+        if (pread_all(fd, content.data(), file.size, content_offset, path) < file.size) {
+            throw PackStoreException("Failed to read: " + path.string());
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = files_.find(filename);
+        if (it == files_.end() || it->second.segment != id || it->second.record_offset != file.record_offset) {
+            continue;
+        }
+        PackedFile copy = append(RecordType::PUT, filename, content.data(), file.size, file.mtime_ns, file.content_hash);
+        forget(filename);
+        files_[filename] = copy;
+        segments_.at(copy.segment).live_bytes += get_record_size(filename, file.size);
+        copied_bytes += get_record_size(filename, file.size);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A delete still hides the file in an older segment, unless the file was packed again since
+    if (segments_.begin()->first < id) {
+        for (const auto& filename : deleted) {
+            if (files_.count(filename) == 0) {
+                append(RecordType::DELETE, filename, nullptr, 0, now_ns(), ContentHash{});
+            }
+        }
+    }
+    // The copies must be on disk before the segment they were copied from is gone
+    if (has_active_segment_ && ::fdatasync(segments_.at(active_segment_).fd) != 0) {
+        throw PackStoreException("Failed to sync: " + get_segment_path(active_segment_).string());
+    }
+    reclaimed_bytes_ += segments_.at(id).size - std::min(copied_bytes, segments_.at(id).size);
+    ::close(fd);
+    segments_.erase(id);
+    ::unlink(path.c_str());
+    ::unlink(get_offsets_path(id).c_str());
+    num_compactions_++;
+}
+
+PackStoreStatistics PackStore::get_statistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PackStoreStatistics statistics{files_.size(), segments_.size(), 0, 0, num_compactions_, 0};
+    for (const auto& [id, segment] : segments_) {
+        statistics.live_bytes += segment.live_bytes;
+        statistics.dead_bytes += segment.size - segment.live_bytes;
+    }
+    statistics.reclaimed_bytes = reclaimed_bytes_;
+    return statistics;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file_index.h"
+
+namespace bfs = boost::filesystem;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+struct PackStoreOptions {
+    // Files up to this size are appended to the segments, bigger ones are kept in files of their own
+    uint64_t max_packed_size = 64 * 1024;
+
+    // Once the active segment is this big, it's sealed and a new one is started
+    uint64_t segment_size = 64 * 1024 * 1024;
+
+    // A sealed segment is compacted once at least this much of it was deleted or replaced
+    double compaction_threshold = 0.5;
+};
+
+class PackStoreException : public runtime_error {
+public:
+    PackStoreException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief A packed file's segment, opened for the caller, and where the file's content is in it
+ *
+ */
+struct PackedFileHandle {
+    // The caller owns the fd, and should close it
+    int fd;
+    bfs::path segment_path;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+ * @brief A file that was appended without a sync, and the segment that should be synced to make it durable
+ *
+ */
+struct UnsyncedPut {
+    FileIndexEntry entry;
+    // Puts to the same segment are all made durable by a single sync of it
+    uint64_t segment;
+    // An fd of the segment, which the caller owns and should close, or -1 if there's nothing to sync
+    int fd;
+};
+
+struct PackStoreStatistics {
+    size_t num_files;
+    size_t num_segments;
+    // The bytes of the records of the files that are packed, and of those that were deleted or replaced
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    size_t num_compactions;
+    uint64_t reclaimed_bytes;
+
+    string to_string() const;
+};
+
+/**
+ * @brief A log-structured store of a user's small backup files, so each of them doesn't take an inode of its own.
+ * Files are appended as records to the active segment, and a delete appends a record that says so.
+ * Once the active segment is big enough it's sealed, and the offsets of its records are saved next to it,
+ * so on startup only the active segment is read to find the files.
+ * Compaction copies the files that are still packed out of the sealed segments that are mostly dead,
+ * and removes those segments. Files that were opened before keep reading the removed segment.
+ *
+ */
+class PackStore {
+public:
+    PackStore(bfs::path directory, PackStoreOptions options = PackStoreOptions());
+    ~PackStore();
+    PackStore(const PackStore&) = delete;
+    PackStore& operator=(const PackStore&) = delete;
+
+    /**
+     * @brief Whether a file of this size belongs in the pack store
+     *
+     */
+    bool fits(uint64_t size) const { return size <= options_.max_packed_size; };
+
+    /**
+     * @brief Append a file and sync it, replacing the file of the same name if it's packed
+     *
+     * @return FileIndexEntry What the directory's index should know about the file
+     */
+    FileIndexEntry put(const string& filename, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Append a file like put, but leave syncing it to the caller, so it's synced without the store's lock
+     * and can share a flush with other puts. The put is only durable once the returned fd is synced
+     *
+     * @return UnsyncedPut The file's entry, and its segment
+     */
+    UnsyncedPut put_unsynced(const string& filename, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Remove a file
+     *
+     * @return bool Whether the file was packed
+     */
+    bool remove(const string& filename);
+
+    bool contains(const string& filename) const;
+
+    /**
+     * @brief Open the segment of a packed file, which can be read even if the file is removed or compacted meanwhile
+     *
+     * @return std::optional<PackedFileHandle> Nothing if the file isn't packed
+     */
+    std::optional<PackedFileHandle> open(const string& filename) const;
+
+    /**
+     * @brief Get the entries of all of the packed files, for the directory's index
+     *
+     */
+    vector<std::pair<string, FileIndexEntry>> get_entries() const;
+
+    /**
+     * @brief Compact the sealed segments whose dead part passed the threshold.
+     * Files are put and removed as usual while a segment is compacted
+     *
+     * @return size_t How many segments were compacted
+     */
+    size_t compact();
+
+    PackStoreStatistics get_statistics() const;
+
+private:
+    enum class RecordType : uint8_t {
+        PUT = 0,
+        DELETE = 1,
+    };
+
+    struct PackedFile {
+        uint32_t segment;
+        // Where the record starts, its content comes after the header and the name
+        uint64_t record_offset;
+        uint32_t size;
+        int64_t mtime_ns;
+        ContentHash content_hash;
+    };
+
+    struct Segment {
+        int fd;
+        uint64_t size;
+        // The bytes of the records of the files that are still packed in the segment
+        uint64_t live_bytes;
+        // Where the segment's deletes are, and of which files
+        vector<std::pair<uint64_t, string>> deleted;
+    };
+
+    // A record as it's saved in a segment's offsets file, and as the load of a segment finds it
+    struct RecordInfo {
+        RecordType type;
+        string filename;
+        PackedFile file;
+    };
+
+    static uint64_t get_record_size(const string& filename, uint64_t size);
+    bfs::path get_segment_path(uint32_t id) const;
+    bfs::path get_offsets_path(uint32_t id) const;
+
+    void load();
+
+    /**
+     * @brief Find the records of a segment, from its offsets file if it's sealed and has a valid one,
+     * or else by reading it. A record that was torn by a crash ends the segment, and is cut off
+     *
+     */
+    vector<RecordInfo> load_segment(uint32_t id, Segment& segment, bool sealed);
+    vector<RecordInfo> read_records(uint32_t id, Segment& segment);
+    std::optional<vector<RecordInfo>> read_offsets(uint32_t id) const;
+    void write_offsets(uint32_t id) const;
+    void apply(const RecordInfo& record);
+
+    // The following are called with the mutex held
+    void open_active_segment(uint32_t id);
+    void seal_active_segment();
+    PackedFile append(RecordType type, const string& filename, const uint8_t* data, size_t size, int64_t mtime_ns,
+                      const ContentHash& content_hash);
+    void forget(const string& filename);
+    vector<std::pair<uint32_t, uint64_t>> find_segments_to_compact() const;
+
+    void compact_segment(uint32_t id);
+
+    bfs::path directory_;
+    PackStoreOptions options_;
+    std::map<string, PackedFile> files_;
+    std::map<uint32_t, Segment> segments_;
+    uint32_t active_segment_;
+    bool has_active_segment_;
+    size_t num_compactions_;
+    uint64_t reclaimed_bytes_;
+    mutable std::mutex mutex_;
+    // Only one compaction runs at a time, so a segment's fd isn't closed while it's being copied
+    std::mutex compaction_mutex_;
+};
@@ -1,3 +1,62 @@
 #pragma once
 
+#include <cstdint>
+
 typedef uint8_t ProtocolVersion;
+typedef uint32_t RequestID;
+
+const ProtocolVersion PROTOCOL_VERSION_1{1};
+// Version 2 adds a request ID to every request that is echoed in its response,
+// so a client can pipeline requests and the server can answer them out of order.
+// It also keeps the connection open for more requests, where version 1 clients expect it to close after the response
+const ProtocolVersion PROTOCOL_VERSION_2{2};
+// Version 3 keeps the request ID, and sends the sizes of payloads as uint64s so files of 4 GiB and up can be
+// backed up and restored. A backup's payload may also be chunked, when its size isn't known up front
+const ProtocolVersion PROTOCOL_VERSION_3{3};
+
+// The payload size of a version 3 request whose payload is chunked, i.e sent in frames:
+// each is a uint32 size and that many bytes, and an empty frame ends the payload
+const uint64_t CHUNKED_PAYLOAD_SIZE{UINT64_MAX};
+
+/**
+ * @brief How the messages of a version of the protocol are laid out, which the parsers and the responses follow
+ *
+ */
+struct ProtocolRevision {
+    ProtocolVersion version;
+    bool has_request_id;
+    bool has_u64_sizes;
+    bool has_keep_alive;
+};
+
+// Every version of the protocol there is. A version is never removed, so the clients that don't upgrade keep working
+inline constexpr ProtocolRevision PROTOCOL_REVISIONS[] = {
+    {PROTOCOL_VERSION_1, false, false, false},
+    {PROTOCOL_VERSION_2, true, false, true},
+    {PROTOCOL_VERSION_3, true, true, true},
+};
+
+// Nothing if there's no such version
+inline const ProtocolRevision* find_protocol_revision(ProtocolVersion version) {
+    for (const ProtocolRevision& revision : PROTOCOL_REVISIONS) {
+        if (revision.version == version) {
+            return &revision;
+        }
+    }
+    return nullptr;
+}
+
+inline bool version_has_request_id(ProtocolVersion version) {
+    const ProtocolRevision* revision{find_protocol_revision(version)};
+    return revision != nullptr && revision->has_request_id;
+}
+
+inline bool version_has_u64_sizes(ProtocolVersion version) {
+    const ProtocolRevision* revision{find_protocol_revision(version)};
+    return revision != nullptr && revision->has_u64_sizes;
+}
+
+inline bool version_has_keep_alive(ProtocolVersion version) {
+    const ProtocolRevision* revision{find_protocol_revision(version)};
+    return revision != nullptr && revision->has_keep_alive;
+}
@@ -3,7 +3,7 @@
 #include <string>
 
 ProtocolRequest::ProtocolRequest(uint32_t user_id, ProtocolVersion version, RequestOP op)
-    : user_id_(user_id), version_(version), op_(op) {}
+    : user_id_(user_id), version_(version), op_(op), request_id_(0) {}
 
 ProtocolFilenameRequest::ProtocolFilenameRequest(uint32_t user_id, ProtocolVersion version, RequestOP op, string filename)
     : ProtocolRequest(user_id, version, op), filename_(std::move(filename)) {}
@@ -13,7 +13,14 @@ ProtocolPayloadFilenameRequest::ProtocolPayloadFilenameRequest(uint32_t user_id,
                                                                RequestOP op,
                                                                string filename,
                                                                vector<uint8_t> payload)
-    : ProtocolFilenameRequest(user_id, version, op, std::move(filename)), payload_(std::move(payload)) {}
+    : ProtocolFilenameRequest(user_id, version, op, std::move(filename)), payload_(std::move(payload)), payload_size_(payload_.size()) {}
+
+ProtocolPayloadFilenameRequest::ProtocolPayloadFilenameRequest(uint32_t user_id,
+                                                               ProtocolVersion version,
+                                                               RequestOP op,
+                                                               string filename,
+                                                               uint64_t payload_size)
+    : ProtocolFilenameRequest(user_id, version, op, std::move(filename)), payload_size_(payload_size) {}
 
 BackupFileRequest::BackupFileRequest(uint32_t user_id,
                                      ProtocolVersion version,
@@ -21,14 +28,69 @@ BackupFileRequest::BackupFileRequest(uint32_t user_id,
                                      vector<uint8_t> payload)
     : ProtocolPayloadFilenameRequest(user_id, version, RequestOP::BACKUP_FILE, std::move(filename), std::move(payload)) {}
 
+BackupFileRequest::BackupFileRequest(uint32_t user_id,
+                                     ProtocolVersion version,
+                                     string filename,
+                                     uint64_t payload_size)
+    : ProtocolPayloadFilenameRequest(user_id, version, RequestOP::BACKUP_FILE, std::move(filename), payload_size) {}
+
+BackupDeltaRequest::BackupDeltaRequest(uint32_t user_id,
+                                       ProtocolVersion version,
+                                       string filename,
+                                       vector<uint8_t> delta)
+    : ProtocolPayloadFilenameRequest(user_id, version, RequestOP::BACKUP_DELTA, std::move(filename), std::move(delta)) {}
+
 RestoreFileRequest::RestoreFileRequest(uint32_t user_id, ProtocolVersion version, string filename)
     : ProtocolFilenameRequest(user_id, version, RequestOP::RESTORE_FILE, std::move(filename)) {}
 
+RestoreFileCompressedRequest::RestoreFileCompressedRequest(uint32_t user_id, ProtocolVersion version, string filename)
+    : ProtocolFilenameRequest(user_id, version, RequestOP::RESTORE_FILE_COMPRESSED, std::move(filename)) {}
+
 DeleteFileRequest::DeleteFileRequest(uint32_t user_id, ProtocolVersion version, string filename)
     : ProtocolFilenameRequest(user_id, version, RequestOP::DELETE_FILE, std::move(filename)) {}
 
+GetSignaturesRequest::GetSignaturesRequest(uint32_t user_id, ProtocolVersion version, string filename)
+    : ProtocolFilenameRequest(user_id, version, RequestOP::GET_SIGNATURES, std::move(filename)) {}
+
 ListFilesRequest::ListFilesRequest(uint32_t user_id, ProtocolVersion version)
     : ProtocolRequest(user_id, version, RequestOP::LIST_FILES) {}
 
+BatchRequest::BatchRequest(uint32_t user_id, ProtocolVersion version, RequestOP op, vector<string> filenames)
+    : ProtocolRequest(user_id, version, op), filenames_(std::move(filenames)) {}
+
+BackupBatchRequest::BackupBatchRequest(uint32_t user_id,
+                                       ProtocolVersion version,
+                                       vector<string> filenames,
+                                       vector<vector<uint8_t>> payloads)
+    : BatchRequest(user_id, version, RequestOP::BACKUP_BATCH, std::move(filenames)), payloads_(std::move(payloads)) {}
+
+RestoreBatchRequest::RestoreBatchRequest(uint32_t user_id, ProtocolVersion version, vector<string> filenames)
+    : BatchRequest(user_id, version, RequestOP::RESTORE_BATCH, std::move(filenames)) {}
+
+DeleteBatchRequest::DeleteBatchRequest(uint32_t user_id, ProtocolVersion version, vector<string> filenames)
+    : BatchRequest(user_id, version, RequestOP::DELETE_BATCH, std::move(filenames)) {}
+
+RestoreRangeRequest::RestoreRangeRequest(uint32_t user_id,
+                                         ProtocolVersion version,
+                                         string filename,
+                                         uint64_t offset,
+                                         uint32_t size)
+    : ProtocolFilenameRequest(user_id, version, RequestOP::RESTORE_RANGE, std::move(filename)), offset_(offset), size_(size) {}
+
+BeginUploadRequest::BeginUploadRequest(uint32_t user_id, ProtocolVersion version, string filename, uint64_t size)
+    : ProtocolFilenameRequest(user_id, version, RequestOP::BEGIN_UPLOAD, std::move(filename)), size_(size) {}
+
+UploadRequest::UploadRequest(uint32_t user_id, ProtocolVersion version, RequestOP op, uint64_t token)
+    : ProtocolRequest(user_id, version, op), token_(token) {}
+
+UploadPartRequest::UploadPartRequest(uint32_t user_id, ProtocolVersion version, uint64_t token, uint64_t offset, vector<uint8_t> payload)
+    : UploadRequest(user_id, version, RequestOP::UPLOAD_PART, token), offset_(offset), payload_(std::move(payload)) {}
+
+GetUploadStatusRequest::GetUploadStatusRequest(uint32_t user_id, ProtocolVersion version, uint64_t token)
+    : UploadRequest(user_id, version, RequestOP::GET_UPLOAD_STATUS, token) {}
+
+FinishUploadRequest::FinishUploadRequest(uint32_t user_id, ProtocolVersion version, uint64_t token)
+    : UploadRequest(user_id, version, RequestOP::FINISH_UPLOAD, token) {}
+
 InvalidRequestException::InvalidRequestException(uint8_t invalid_request_op)
     : runtime_error("Invalid request op: " + std::to_string(invalid_request_op)), invalid_request_op(invalid_request_op) {}
@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 
+#include "../memory_budget.h"
 #include "common.h"
 
 using std::runtime_error;
@@ -14,10 +15,26 @@ using std::vector;
 
 enum class RequestOP : uint8_t {
     BACKUP_FILE = 100,
+    // Update a backed up file with a delta against the signatures from GET_SIGNATURES
+    BACKUP_DELTA = 101,
+    // The batch ops carry many files in one request, and are answered with a status per file
+    BACKUP_BATCH = 102,
+    // A file that's uploaded in parts, at offsets, so an upload that was cut off can be resumed
+    BEGIN_UPLOAD = 103,
+    UPLOAD_PART = 104,
+    GET_UPLOAD_STATUS = 105,
+    FINISH_UPLOAD = 106,
 
     RESTORE_FILE = 200,
     DELETE_FILE = 201,
     LIST_FILES = 202,
+    GET_SIGNATURES = 203,
+    // Restore a file as it's stored, without decompressing it
+    RESTORE_FILE_COMPRESSED = 204,
+    RESTORE_BATCH = 205,
+    DELETE_BATCH = 206,
+    // Restore a part of a file, so several parts can be restored in parallel, or a restore resumed
+    RESTORE_RANGE = 207,
 };
 
 class ProtocolRequest {
@@ -27,11 +44,31 @@ protected:
     uint32_t user_id_;
     ProtocolVersion version_;
     RequestOP op_;
+    // Only sent from version 2, 0 otherwise
+    RequestID request_id_;
+    vector<MemoryBudget::Reservation> payload_reservations_;
 
 public:
     virtual ~ProtocolRequest() = default;
     uint32_t get_user_id() const { return user_id_; };
+    ProtocolVersion get_version() const { return version_; };
     RequestOP get_request_op() const { return op_; };
+    RequestID get_request_id() const { return request_id_; };
+    void set_request_id(RequestID request_id) { request_id_ = request_id; };
+
+    /**
+     * @brief Hold memory that was reserved for the payload that was read into the request until it's destroyed,
+     * so the payloads that wait in a pipeline to be handled count against the budget
+     *
+     */
+    void add_payload_reservation(MemoryBudget::Reservation reservation) { payload_reservations_.push_back(std::move(reservation)); };
+
+    /**
+     * @brief Whether the request's payload was left on the connection to be read in chunks,
+     * instead of being read into the request
+     *
+     */
+    virtual bool is_payload_streamed() const { return false; };
 };
 
 class ProtocolFilenameRequest : public ProtocolRequest {
@@ -52,10 +89,21 @@ protected:
                                    string filename,
                                    vector<uint8_t> payload);
 
+    ProtocolPayloadFilenameRequest(uint32_t user_id,
+                                   ProtocolVersion version,
+                                   RequestOP op,
+                                   string filename,
+                                   uint64_t payload_size);
+
     vector<uint8_t> payload_;
+    uint64_t payload_size_;
 
 public:
     const vector<uint8_t>& get_payload() const { return payload_; };
+    // CHUNKED_PAYLOAD_SIZE if the payload is streamed in chunks
+    uint64_t get_payload_size() const { return payload_size_; };
+    virtual bool is_payload_streamed() const override { return payload_.size() != payload_size_; };
+    bool is_payload_chunked() const { return payload_size_ == CHUNKED_PAYLOAD_SIZE; };
 };
 
 class BackupFileRequest : public ProtocolPayloadFilenameRequest {
@@ -64,6 +112,27 @@ public:
                       ProtocolVersion version,
                       string filename,
                       vector<uint8_t> payload);
+
+    BackupFileRequest(uint32_t user_id,
+                      ProtocolVersion version,
+                      string filename,
+                      uint64_t payload_size);
+};
+
+/**
+ * @brief A new version of a backed up file, sent as a delta against the signatures of the stored version.
+ * The delta is read whole into the request, it's as big as the change
+ *
+ */
+class BackupDeltaRequest : public ProtocolPayloadFilenameRequest {
+public:
+    // A bigger change should be sent as a backup of the whole file, which is streamed
+    static const uint64_t MAX_DELTA_SIZE = 64 * 1024 * 1024;
+
+    BackupDeltaRequest(uint32_t user_id,
+                       ProtocolVersion version,
+                       string filename,
+                       vector<uint8_t> delta);
 };
 
 class RestoreFileRequest : public ProtocolFilenameRequest {
@@ -73,6 +142,13 @@ public:
                        string filename);
 };
 
+class RestoreFileCompressedRequest : public ProtocolFilenameRequest {
+public:
+    RestoreFileCompressedRequest(uint32_t user_id,
+                                 ProtocolVersion version,
+                                 string filename);
+};
+
 class DeleteFileRequest : public ProtocolFilenameRequest {
 public:
     DeleteFileRequest(uint32_t user_id,
@@ -80,11 +156,150 @@ public:
                       string filename);
 };
 
+class GetSignaturesRequest : public ProtocolFilenameRequest {
+public:
+    GetSignaturesRequest(uint32_t user_id,
+                         ProtocolVersion version,
+                         string filename);
+};
+
 class ListFilesRequest : public ProtocolRequest {
 public:
     ListFilesRequest(uint32_t user_id, ProtocolVersion version);
 };
 
+/**
+ * @brief A request of many files, sent as the number of files and then each file's filename,
+ * followed by its payload in a backup batch. The whole batch is read into the request
+ *
+ */
+class BatchRequest : public ProtocolRequest {
+public:
+    // A batch is meant for many small files, bigger ones should be sent on their own
+    static const uint32_t MAX_ENTRIES = 64 * 1024;
+    // The most bytes of filenames and payloads a batch may have together
+    static const uint64_t MAX_PAYLOADS_SIZE = 64 * 1024 * 1024;
+
+    const vector<string>& get_filenames() const { return filenames_; };
+
+protected:
+    BatchRequest(uint32_t user_id, ProtocolVersion version, RequestOP op, vector<string> filenames);
+
+    vector<string> filenames_;
+};
+
+class BackupBatchRequest : public BatchRequest {
+public:
+    BackupBatchRequest(uint32_t user_id,
+                       ProtocolVersion version,
+                       vector<string> filenames,
+                       vector<vector<uint8_t>> payloads);
+
+    // The payload of each of the filenames
+    const vector<vector<uint8_t>>& get_payloads() const { return payloads_; };
+
+private:
+    vector<vector<uint8_t>> payloads_;
+};
+
+class RestoreBatchRequest : public BatchRequest {
+public:
+    RestoreBatchRequest(uint32_t user_id, ProtocolVersion version, vector<string> filenames);
+};
+
+class DeleteBatchRequest : public BatchRequest {
+public:
+    DeleteBatchRequest(uint32_t user_id, ProtocolVersion version, vector<string> filenames);
+};
+
+class InvalidBatchException : public runtime_error {
+public:
+    InvalidBatchException(const string& what) : runtime_error(what) {}
+};
+
+class RestoreRangeRequest : public ProtocolFilenameRequest {
+public:
+    RestoreRangeRequest(uint32_t user_id,
+                        ProtocolVersion version,
+                        string filename,
+                        uint64_t offset,
+                        uint32_t size);
+
+    uint64_t get_offset() const { return offset_; };
+    uint32_t get_size() const { return size_; };
+
+private:
+    uint64_t offset_;
+    uint32_t size_;
+};
+
+/**
+ * @brief Start an upload of a file of the given size, which is answered with the upload's token
+ *
+ */
+class BeginUploadRequest : public ProtocolFilenameRequest {
+public:
+    BeginUploadRequest(uint32_t user_id, ProtocolVersion version, string filename, uint64_t size);
+
+    uint64_t get_size() const { return size_; };
+
+private:
+    uint64_t size_;
+};
+
+/**
+ * @brief Base class for the requests of an upload that was started, by its token
+ *
+ */
+class UploadRequest : public ProtocolRequest {
+public:
+    uint64_t get_token() const { return token_; };
+
+protected:
+    UploadRequest(uint32_t user_id, ProtocolVersion version, RequestOP op, uint64_t token);
+
+    uint64_t token_;
+};
+
+/**
+ * @brief A part of an upload and its offset in the file. The part is read whole into the request
+ *
+ */
+class UploadPartRequest : public UploadRequest {
+public:
+    // Bigger files are sent in more parts
+    static const uint32_t MAX_PART_SIZE = 64 * 1024 * 1024;
+
+    UploadPartRequest(uint32_t user_id, ProtocolVersion version, uint64_t token, uint64_t offset, vector<uint8_t> payload);
+
+    uint64_t get_offset() const { return offset_; };
+    const vector<uint8_t>& get_payload() const { return payload_; };
+
+private:
+    uint64_t offset_;
+    vector<uint8_t> payload_;
+};
+
+class GetUploadStatusRequest : public UploadRequest {
+public:
+    GetUploadStatusRequest(uint32_t user_id, ProtocolVersion version, uint64_t token);
+};
+
+class FinishUploadRequest : public UploadRequest {
+public:
+    FinishUploadRequest(uint32_t user_id, ProtocolVersion version, uint64_t token);
+};
+
+class InvalidUploadPartException : public runtime_error {
+public:
+    InvalidUploadPartException(const string& what) : runtime_error(what) {}
+};
+
+class PayloadTooBigException : public runtime_error {
+public:
+    PayloadTooBigException(uint64_t max_size) : runtime_error("A payload is bigger than: " + std::to_string(max_size)) {}
+};
+
 class InvalidRequestException : public runtime_error {
 public:
     InvalidRequestException(uint8_t invalid_request_op);
@@ -1,47 +1,119 @@
 #include "response.h"
 
-ProtocolResponse::ProtocolResponse(ResponseOP op, ProtocolVersion version)
-    : op_(op), version_(version) {}
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+ResponseBuffers::ResponseBuffers(const ProtocolResponse& response)
+    : fields_{}, fields_size_(0), buffers_{}, num_buffers_(0), last_buffer_is_fields_(false) {
+    response.push_buffers(*this);
+}
 
-utils::Bytearray ProtocolResponse::pack_header() const {
-    // We assume we are running on a little endian machine
-    utils::Bytearray packed_header;
-    packed_header.push_u8(version_);
-    packed_header.push_u16(static_cast<uint16_t>(op_));
+void ResponseBuffers::push_buffer(const uint8_t* data, size_t size) {
+    if (num_buffers_ == MAX_BUFFERS) {
+        throw std::length_error("Too many response buffers");
+    }
+    buffers_[num_buffers_++] = boost::asio::const_buffer(data, size);
+}
 
-    return packed_header;  // No copy because of RVO so it's ok to return like this
+void ResponseBuffers::push_field(const uint8_t* data, size_t size) {
+    if (fields_size_ + size > MAX_FIELDS_SIZE) {
+        throw std::length_error("Response fields are too big");
+    }
+    uint8_t* field = fields_.data() + fields_size_;
+    std::memcpy(field, data, size);
+    fields_size_ += size;
+
+    // Fields that follow each other are sent as one buffer
+    if (last_buffer_is_fields_) {
+        const boost::asio::const_buffer& last = buffers_[num_buffers_ - 1];
+        buffers_[num_buffers_ - 1] = boost::asio::const_buffer(last.data(), last.size() + size);
+    } else {
+        push_buffer(field, size);
+        last_buffer_is_fields_ = true;
+    }
+}
+
+void ResponseBuffers::push_u8(uint8_t value) {
+    push_field(&value, sizeof(value));
+}
+
+void ResponseBuffers::push_u16(uint16_t value) {
+    // We want to pack in little endian
+    uint8_t packed[] = {static_cast<uint8_t>(value & 0xff), static_cast<uint8_t>(value >> 8)};
+    push_field(packed, sizeof(packed));
+}
+
+void ResponseBuffers::push_u32(uint32_t value) {
+    uint8_t packed[] = {static_cast<uint8_t>(value & 0xff), static_cast<uint8_t>((value >> 8) & 0xff),
+                        static_cast<uint8_t>((value >> 16) & 0xff), static_cast<uint8_t>((value >> 24) & 0xff)};
+    push_field(packed, sizeof(packed));
+}
+
+void ResponseBuffers::push_u64(uint64_t value) {
+    push_u32(static_cast<uint32_t>(value & 0xffffffff));
+    push_u32(static_cast<uint32_t>(value >> 32));
+}
+
+void ResponseBuffers::push_reference(const void* data, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    push_buffer(static_cast<const uint8_t*>(data), size);
+    last_buffer_is_fields_ = false;
+}
+
+size_t ResponseBuffers::size() const {
+    return boost::asio::buffer_size(buffers());
+}
+
+utils::Bytearray ResponseBuffers::flatten() const {
+    utils::Bytearray packed;
+    for (const auto& buffer : buffers()) {
+        packed.push_bytes(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+    }
+    return packed;
+}
+
+ProtocolResponse::ProtocolResponse(ResponseOP op, ProtocolVersion version)
+    : op_(op), version_(version), request_id_(0) {}
+
+void ProtocolResponse::push_buffers(ResponseBuffers& buffers) const {
+    buffers.push_u8(version_);
+    buffers.push_u16(static_cast<uint16_t>(op_));
+    if (version_has_request_id(version_)) {
+        buffers.push_u32(request_id_);
+    }
+}
+
+void ProtocolResponse::push_payload_size(ResponseBuffers& buffers, uint64_t payload_size) const {
+    if (version_has_u64_sizes(version_)) {
+        buffers.push_u64(payload_size);
+    } else {
+        buffers.push_u32(static_cast<uint32_t>(payload_size));
+    }
 }
 
 utils::Bytearray ProtocolResponse::pack() const {
-    return pack_header();
+    return ResponseBuffers(*this).flatten();
 }
 
 FilenameProtocolResponse::FilenameProtocolResponse(ResponseOP op, ProtocolVersion version, string filename)
     : ProtocolResponse(op, version), filename_(std::move(filename)) {}
 
-utils::Bytearray FilenameProtocolResponse::pack_header_filename(const string& filename) const {
-    utils::Bytearray packed_header = pack_header();
-    packed_header.push_u16(static_cast<uint16_t>(filename.length()));
-    packed_header.push_string(filename);
-    return packed_header;
-}
-
-utils::Bytearray FilenameProtocolResponse::pack() const {
-    return pack_header_filename(filename_);
+void FilenameProtocolResponse::push_buffers(ResponseBuffers& buffers) const {
+    ProtocolResponse::push_buffers(buffers);
+    buffers.push_u16(static_cast<uint16_t>(filename_.length()));
+    buffers.push_reference(filename_.data(), filename_.length());
 }
 
 PayloadFilenameProtocolResponse::PayloadFilenameProtocolResponse(ResponseOP op, ProtocolVersion version, string filename, utils::Bytearray payload)
     : FilenameProtocolResponse(op, version, std::move(filename)), payload_(std::move(payload)) {}
 
-utils::Bytearray PayloadFilenameProtocolResponse::pack_header_filename_payload(const string& filename, const utils::Bytearray& payload) const {
-    utils::Bytearray packed_header = pack_header_filename(filename);
-    packed_header.push_u32(payload.len());
-    packed_header.push_bytes(payload);
-    return packed_header;
-}
-
-utils::Bytearray PayloadFilenameProtocolResponse::pack() const {
-    return pack_header_filename_payload(filename_, payload_);
+void PayloadFilenameProtocolResponse::push_buffers(ResponseBuffers& buffers) const {
+    FilenameProtocolResponse::push_buffers(buffers);
+    push_payload_size(buffers, payload_.len());
+    buffers.push_reference(payload_.data(), payload_.len());
 }
 
 SuccessfulRestoreResponse::SuccessfulRestoreResponse(ProtocolVersion version,
@@ -49,19 +121,125 @@ SuccessfulRestoreResponse::SuccessfulRestoreResponse(ProtocolVersion version,
                                                      utils::Bytearray payload)
     : PayloadFilenameProtocolResponse(ResponseOP::SUCCESSFUL_RESTORE, version, std::move(filename), std::move(payload)) {}
 
+StreamedRestoreResponse::StreamedRestoreResponse(ProtocolVersion version,
+                                                 string filename,
+                                                 uint64_t payload_size)
+    : StreamedRestoreResponse(ResponseOP::SUCCESSFUL_RESTORE, version, std::move(filename), payload_size) {}
+
+StreamedRestoreResponse::StreamedRestoreResponse(ResponseOP op,
+                                                 ProtocolVersion version,
+                                                 string filename,
+                                                 uint64_t payload_size)
+    : FilenameProtocolResponse(op, version, std::move(filename)), payload_size_(payload_size) {}
+
+StreamedCompressedRestoreResponse::StreamedCompressedRestoreResponse(ProtocolVersion version,
+                                                                     string filename,
+                                                                     uint64_t payload_size)
+    : StreamedRestoreResponse(ResponseOP::SUCCESSFUL_COMPRESSED_RESTORE, version, std::move(filename), payload_size) {}
+
+void StreamedRestoreResponse::push_buffers(ResponseBuffers& buffers) const {
+    FilenameProtocolResponse::push_buffers(buffers);
+    push_payload_size(buffers, payload_size_);
+}
+
+bool StreamedRestoreResponse::fits_version(ProtocolVersion version, uint64_t payload_size) {
+    return version_has_u64_sizes(version) || payload_size <= std::numeric_limits<uint32_t>::max();
+}
+
 SuccessfulListFilesResponse::SuccessfulListFilesResponse(ProtocolVersion version,
                                                          string filename,
                                                          utils::Bytearray payload)
     : PayloadFilenameProtocolResponse(ResponseOP::SUCCESSFUL_LIST_FILES, version, std::move(filename), std::move(payload)) {}
 
+SuccessfulSignaturesResponse::SuccessfulSignaturesResponse(ProtocolVersion version,
+                                                           string filename,
+                                                           utils::Bytearray signatures)
+    : PayloadFilenameProtocolResponse(ResponseOP::SUCCESSFUL_SIGNATURES, version, std::move(filename), std::move(signatures)) {}
+
 SuccessfulBackupOrDeleteResponse::SuccessfulBackupOrDeleteResponse(ProtocolVersion version,
                                                                    string filename)
     : FilenameProtocolResponse(ResponseOP::SUCCESSFUL_BACKUP_OR_DELETE, version, std::move(filename)) {}
 
+SuccessfulBatchResponse::SuccessfulBatchResponse(ProtocolVersion version, vector<BatchEntryStatus> statuses, utils::Bytearray payload)
+    : ProtocolResponse(ResponseOP::SUCCESSFUL_BATCH, version), statuses_(std::move(statuses)), payload_(std::move(payload)) {}
+
+void SuccessfulBatchResponse::push_buffers(ResponseBuffers& buffers) const {
+    ProtocolResponse::push_buffers(buffers);
+    buffers.push_u32(static_cast<uint32_t>(statuses_.size()));
+    // The statuses are a byte each, so they're sent as they are
+    buffers.push_reference(statuses_.data(), statuses_.size());
+    buffers.push_u32(static_cast<uint32_t>(payload_.len()));
+    buffers.push_reference(payload_.data(), payload_.len());
+}
+
+StreamedRangeRestoreResponse::StreamedRangeRestoreResponse(ProtocolVersion version, string filename, uint64_t file_size,
+                                                           uint64_t offset, uint32_t payload_size)
+    : FilenameProtocolResponse(ResponseOP::SUCCESSFUL_RANGE_RESTORE, version, std::move(filename)),
+      file_size_(file_size),
+      offset_(offset),
+      payload_size_(payload_size) {}
+
+void StreamedRangeRestoreResponse::push_buffers(ResponseBuffers& buffers) const {
+    FilenameProtocolResponse::push_buffers(buffers);
+    buffers.push_u64(file_size_);
+    buffers.push_u64(offset_);
+    buffers.push_u32(payload_size_);
+}
+
+UploadStatusResponse::UploadStatusResponse(ProtocolVersion version, uint64_t token, uint64_t size,
+                                           const vector<std::pair<uint64_t, uint64_t>>& ranges)
+    : UploadStatusResponse(ResponseOP::UPLOAD_STATUS, version, token, size, ranges) {}
+
+UploadStatusResponse::UploadStatusResponse(ResponseOP op, ProtocolVersion version, uint64_t token, uint64_t size,
+                                           const vector<std::pair<uint64_t, uint64_t>>& ranges)
+    : ProtocolResponse(op, version), token_(token), size_(size), num_ranges_(static_cast<uint32_t>(ranges.size())) {
+    for (const auto& [offset, range_size] : ranges) {
+        ranges_.push_u64(offset);
+        ranges_.push_u64(range_size);
+    }
+}
+
+void UploadStatusResponse::push_buffers(ResponseBuffers& buffers) const {
+    ProtocolResponse::push_buffers(buffers);
+    buffers.push_u64(token_);
+    buffers.push_u64(size_);
+    buffers.push_u32(num_ranges_);
+    buffers.push_reference(ranges_.data(), ranges_.len());
+}
+
+IncompleteUploadResponse::IncompleteUploadResponse(ProtocolVersion version, uint64_t token, uint64_t size,
+                                                   const vector<std::pair<uint64_t, uint64_t>>& ranges)
+    : UploadStatusResponse(ResponseOP::UPLOAD_INCOMPLETE, version, token, size, ranges) {}
+
+UploadNotFoundResponse::UploadNotFoundResponse(ProtocolVersion version, uint64_t token)
+    : UploadNotFoundResponse(ResponseOP::UPLOAD_NOT_FOUND, version, token) {}
+
+UploadNotFoundResponse::UploadNotFoundResponse(ResponseOP op, ProtocolVersion version, uint64_t token)
+    : ProtocolResponse(op, version), token_(token) {}
+
+void UploadNotFoundResponse::push_buffers(ResponseBuffers& buffers) const {
+    ProtocolResponse::push_buffers(buffers);
+    buffers.push_u64(token_);
+}
+
+InvalidUploadPartResponse::InvalidUploadPartResponse(ProtocolVersion version, uint64_t token)
+    : UploadNotFoundResponse(ResponseOP::INVALID_UPLOAD_PART, version, token) {}
+
+TooManyUploadsResponse::TooManyUploadsResponse(ProtocolVersion version)
+    : ProtocolResponse(ResponseOP::TOO_MANY_UPLOADS, version) {}
+
+FileAlreadyExistsResponse::FileAlreadyExistsResponse(ProtocolVersion version,
+                                                     string filename)
+    : FilenameProtocolResponse(ResponseOP::FILE_ALREADY_EXISTS, version, std::move(filename)) {}
+
 FileNotFoundResponse::FileNotFoundResponse(ProtocolVersion version,
                                            string filename)
     : FilenameProtocolResponse(ResponseOP::FILE_NOT_FOUND, version, std::move(filename)) {}
 
+DeltaMismatchResponse::DeltaMismatchResponse(ProtocolVersion version,
+                                             string filename)
+    : FilenameProtocolResponse(ResponseOP::DELTA_MISMATCH, version, std::move(filename)) {}
+
 NoBackupFilesForClientResponse::NoBackupFilesForClientResponse(ProtocolVersion version)
     : ProtocolResponse(ResponseOP::NO_BACKUP_FILES_FOR_CLIENT, version) {}
 
@@ -1,6 +1,10 @@
 #pragma once
+#include <array>
+#include <boost/asio/buffer.hpp>
 #include <cstdint>
+#include <span>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "../bytearray.h"
@@ -13,10 +17,88 @@ enum class ResponseOP : uint16_t {
     SUCCESSFUL_RESTORE = 210,
     SUCCESSFUL_LIST_FILES = 211,
     SUCCESSFUL_BACKUP_OR_DELETE = 212,
+    SUCCESSFUL_SIGNATURES = 213,
+    SUCCESSFUL_COMPRESSED_RESTORE = 214,
+    // The answer to any batch request, with the status of each of its files
+    SUCCESSFUL_BATCH = 215,
+    SUCCESSFUL_RANGE_RESTORE = 216,
+    // The answer to the requests of an upload, with the parts of it that the server has
+    UPLOAD_STATUS = 217,
 
     FILE_NOT_FOUND = 1001,
     NO_BACKUP_FILES_FOR_CLIENT = 1002,
     SERVER_ERROR = 1003,
+    // The delta wasn't made against the stored version of the file, the client should get the signatures again
+    DELTA_MISMATCH = 1004,
+    // The upload's token is unknown, or the upload was finished already
+    UPLOAD_NOT_FOUND = 1005,
+    // An upload was asked to finish before it was complete, the client should send the parts it's missing
+    UPLOAD_INCOMPLETE = 1006,
+    // The file of an upload is already backed up
+    FILE_ALREADY_EXISTS = 1007,
+    // A part of an upload doesn't fit in the size the upload was begun with
+    INVALID_UPLOAD_PART = 1008,
+    // The user has as many uploads as the server allows, one should be finished or left to expire first
+    TOO_MANY_UPLOADS = 1009,
+};
+
+/**
+ * @brief What happened to a file of a batch request. Sent as a byte per file, in the order of the request
+ *
+ */
+enum class BatchEntryStatus : uint8_t {
+    SUCCESS = 0,
+    FILE_NOT_FOUND = 1,
+    FILE_ALREADY_EXISTS = 2,
+    SERVER_ERROR = 3,
+    // The restored files of the batch are too big together, the file should be restored on its own
+    TOO_BIG_FOR_BATCH = 4,
+};
+
+class ProtocolResponse;
+
+/**
+ * @brief A response as it's sent on the wire, as a list of buffers for a single vectored write.
+ * The fixed size fields are packed into a small array inside this object,
+ * and the filename and payload are referenced in the response without being copied.
+ * It's valid as long as the response it was made from, and can't be copied or moved
+ * since its buffers point into itself.
+ *
+ */
+class ResponseBuffers {
+public:
+    explicit ResponseBuffers(const ProtocolResponse& response);
+    ResponseBuffers(const ResponseBuffers&) = delete;
+    ResponseBuffers& operator=(const ResponseBuffers&) = delete;
+
+    void push_u8(uint8_t value);
+    void push_u16(uint16_t value);
+    void push_u32(uint32_t value);
+    void push_u64(uint64_t value);
+    // The data isn't copied, so it must outlive this object
+    void push_reference(const void* data, size_t size);
+
+    std::span<const boost::asio::const_buffer> buffers() const { return {buffers_.data(), num_buffers_}; };
+    size_t size() const;
+    // Copy all of the buffers into one Bytearray
+    utils::Bytearray flatten() const;
+
+private:
+    void push_field(const uint8_t* data, size_t size);
+    void push_buffer(const uint8_t* data, size_t size);
+
+    // Room for every fixed size field: version, op, request ID, and a filename length or a batch's
+    // number of files, a file's size and a range's offset, and a payload size, which may be a uint64
+    static const size_t MAX_FIELDS_SIZE = 1 + 2 + 4 + 4 + 8 + 8 + 8;
+    // Header, filename, payload size and payload
+    static const size_t MAX_BUFFERS = 4;
+
+    std::array<uint8_t, MAX_FIELDS_SIZE> fields_;
+    size_t fields_size_;
+    std::array<boost::asio::const_buffer, MAX_BUFFERS> buffers_;
+    size_t num_buffers_;
+    // Whether the last buffer points into fields_, so new fields can extend it
+    bool last_buffer_is_fields_;
 };
 
 /**
@@ -30,14 +112,30 @@ class ProtocolResponse {
 protected:
     ProtocolResponse(ResponseOP op, ProtocolVersion version);
 
-    utils::Bytearray pack_header() const;
+    // A uint32 before version 3, and a uint64 from it
+    void push_payload_size(ResponseBuffers& buffers, uint64_t payload_size) const;
 
     ResponseOP op_;
     ProtocolVersion version_;
+    // Echo of the request's ID, only sent from version 2
+    RequestID request_id_;
 
 public:
     virtual ~ProtocolResponse() = default;
-    virtual utils::Bytearray pack() const;
+
+    /**
+     * @brief Add the response's fields and data, in the order they're sent, to the buffers
+     *
+     */
+    virtual void push_buffers(ResponseBuffers& buffers) const;
+
+    /**
+     * @brief The response in a single buffer. Prefer sending ResponseBuffers, which doesn't copy the data
+     *
+     */
+    utils::Bytearray pack() const;
+    RequestID get_request_id() const { return request_id_; };
+    void set_request_id(RequestID request_id) { request_id_ = request_id; };
 };
 
 /**
@@ -48,12 +146,10 @@ class FilenameProtocolResponse : public ProtocolResponse {
 protected:
     FilenameProtocolResponse(ResponseOP op, ProtocolVersion version, string filename);
 
-    utils::Bytearray pack_header_filename(const string& filename) const;
-
     string filename_;
 
 public:
-    virtual utils::Bytearray pack() const override;
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
 };
 
 /**
@@ -64,12 +160,10 @@ class PayloadFilenameProtocolResponse : public FilenameProtocolResponse {
 protected:
     PayloadFilenameProtocolResponse(ResponseOP op, ProtocolVersion version, string filename, utils::Bytearray payload);
 
-    utils::Bytearray pack_header_filename_payload(const string& filename, const utils::Bytearray& payload) const;
-
     utils::Bytearray payload_;
 
 public:
-    virtual utils::Bytearray pack() const override;
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
 };
 
 class SuccessfulRestoreResponse : public PayloadFilenameProtocolResponse {
@@ -77,21 +171,161 @@ public:
     SuccessfulRestoreResponse(ProtocolVersion version, string filename, utils::Bytearray payload);
 };
 
+/**
+ * @brief A successful restore whose payload isn't held in memory.
+ * Its buffers are everything up to and including the payload size,
+ * and the caller sends the payload_size bytes of the file right after it
+ *
+ */
+class StreamedRestoreResponse : public FilenameProtocolResponse {
+public:
+    StreamedRestoreResponse(ProtocolVersion version, string filename, uint64_t payload_size);
+
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
+    uint64_t get_payload_size() const { return payload_size_; };
+
+    /**
+     * @brief Whether a payload of this size can be sent in a response of the version
+     *
+     */
+    static bool fits_version(ProtocolVersion version, uint64_t payload_size);
+
+protected:
+    StreamedRestoreResponse(ResponseOP op, ProtocolVersion version, string filename, uint64_t payload_size);
+
+private:
+    uint64_t payload_size_;
+};
+
+/**
+ * @brief A restore of a file as it's stored, whose payload is streamed like StreamedRestoreResponse's.
+ * The payload is the pieces the file is stored in, each sent as:
+ * encoding (1) decoded size (4) stored size (4), and the stored bytes, which are raw or a zlib stream
+ *
+ */
+class StreamedCompressedRestoreResponse : public StreamedRestoreResponse {
+public:
+    static const size_t FRAME_HEADER_SIZE = 1 + 4 + 4;
+
+    StreamedCompressedRestoreResponse(ProtocolVersion version, string filename, uint64_t payload_size);
+};
+
 class SuccessfulListFilesResponse : public PayloadFilenameProtocolResponse {
 public:
     SuccessfulListFilesResponse(ProtocolVersion version, string filename, utils::Bytearray payload);
 };
 
+class SuccessfulSignaturesResponse : public PayloadFilenameProtocolResponse {
+public:
+    SuccessfulSignaturesResponse(ProtocolVersion version, string filename, utils::Bytearray signatures);
+};
+
 class SuccessfulBackupOrDeleteResponse : public FilenameProtocolResponse {
 public:
     SuccessfulBackupOrDeleteResponse(ProtocolVersion version, string filename);
 };
 
+/**
+ * @brief The answer to a batch request: the number of files, a status of each (see BatchEntryStatus),
+ * and a payload. The payload of a restore batch is the size (4) and content of each file that was restored,
+ * in order, and the payload of the other batches is empty
+ *
+ */
+class SuccessfulBatchResponse : public ProtocolResponse {
+public:
+    SuccessfulBatchResponse(ProtocolVersion version, vector<BatchEntryStatus> statuses, utils::Bytearray payload = utils::Bytearray());
+
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
+    const vector<BatchEntryStatus>& get_statuses() const { return statuses_; };
+
+private:
+    vector<BatchEntryStatus> statuses_;
+    utils::Bytearray payload_;
+};
+
+/**
+ * @brief A restore of a range of a file, whose payload is streamed like StreamedRestoreResponse's.
+ * Before the payload size it has the size (8) of the whole file and the offset (8) of the range.
+ * A range that goes past the end of the file is cut off there
+ *
+ */
+class StreamedRangeRestoreResponse : public FilenameProtocolResponse {
+public:
+    StreamedRangeRestoreResponse(ProtocolVersion version, string filename, uint64_t file_size, uint64_t offset, uint32_t payload_size);
+
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
+
+private:
+    uint64_t file_size_;
+    uint64_t offset_;
+    uint32_t payload_size_;
+};
+
+/**
+ * @brief The status of an upload: its token (8), the size (8) of its file and the number (4) of the ranges
+ * of the file that the server has, and then each range as offset (8) and size (8)
+ *
+ */
+class UploadStatusResponse : public ProtocolResponse {
+public:
+    UploadStatusResponse(ProtocolVersion version, uint64_t token, uint64_t size, const vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
+
+protected:
+    UploadStatusResponse(ResponseOP op, ProtocolVersion version, uint64_t token, uint64_t size,
+                         const vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+private:
+    uint64_t token_;
+    uint64_t size_;
+    uint32_t num_ranges_;
+    utils::Bytearray ranges_;
+};
+
+class IncompleteUploadResponse : public UploadStatusResponse {
+public:
+    IncompleteUploadResponse(ProtocolVersion version, uint64_t token, uint64_t size, const vector<std::pair<uint64_t, uint64_t>>& ranges);
+};
+
+class UploadNotFoundResponse : public ProtocolResponse {
+public:
+    UploadNotFoundResponse(ProtocolVersion version, uint64_t token);
+
+    virtual void push_buffers(ResponseBuffers& buffers) const override;
+
+protected:
+    UploadNotFoundResponse(ResponseOP op, ProtocolVersion version, uint64_t token);
+
+private:
+    uint64_t token_;
+};
+
+class InvalidUploadPartResponse : public UploadNotFoundResponse {
+public:
+    InvalidUploadPartResponse(ProtocolVersion version, uint64_t token);
+};
+
+class TooManyUploadsResponse : public ProtocolResponse {
+public:
+    TooManyUploadsResponse(ProtocolVersion version);
+};
+
+class FileAlreadyExistsResponse : public FilenameProtocolResponse {
+public:
+    FileAlreadyExistsResponse(ProtocolVersion version, string filename);
+};
+
 class FileNotFoundResponse : public FilenameProtocolResponse {
 public:
     FileNotFoundResponse(ProtocolVersion version, string filename);
 };
 
+class DeltaMismatchResponse : public FilenameProtocolResponse {
+public:
+    DeltaMismatchResponse(ProtocolVersion version, string filename);
+};
+
 class NoBackupFilesForClientResponse : public ProtocolResponse {
 public:
     NoBackupFilesForClientResponse(ProtocolVersion version);
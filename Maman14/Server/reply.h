@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#include "protocol/response.h"
+#include "user_backup_directory.h"
+
+using std::unique_ptr;
+
+/**
+ * @brief A handled request's response, ready to be sent to the client.
+ * A restored file isn't packed into the response, but kept open in file_body,
+ * so its content can go straight from the file to the socket after the packed response
+ *
+ */
+struct Reply {
+    Reply(unique_ptr<ProtocolResponse> response, unique_ptr<BackupFileReader> file_body = nullptr)
+        : response(std::move(response)), file_body(std::move(file_body)) {}
+
+    unique_ptr<ProtocolResponse> response;
+    // Sent right after the packed response, if there is one
+    unique_ptr<BackupFileReader> file_body;
+    // Send the file as it's stored, in the frames of StreamedCompressedRestoreResponse, instead of decompressing it
+    bool send_stored = false;
+    // Only send this range of the file, which is all of it unless the size is set
+    uint64_t body_offset = 0;
+    std::optional<uint64_t> body_size;
+};
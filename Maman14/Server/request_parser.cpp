@@ -1,44 +1,39 @@
 #include "request_parser.h"
 
-RequestParser::RequestParser(unique_ptr<AbstractRequestReader> reader)
-    : reader_(std::move(reader)) {}
+#include <boost/asio/use_future.hpp>
+#include <boost/make_unique.hpp>
 
-unique_ptr<ProtocolRequest> RequestParser::parse_message(ProtocolVersion expected_version) {
-    uint32_t user_id{reader_->read_uint32()};
-    ProtocolVersion version{reader_->read_uint8()};
-    if (version != expected_version) {
-        throw VersionMismatchException{expected_version, version};
-    }
-    RequestOP request_op = static_cast<RequestOP>(reader_->read_uint8());
-
-    string filename;
-    vector<uint8_t> payload;
-
-    switch (request_op) {
-        case RequestOP::BACKUP_FILE:
-            filename = read_filename();
-            payload = read_payload();
-            return unique_ptr<BackupFileRequest>(new BackupFileRequest(user_id, version, filename, payload));
-        case RequestOP::RESTORE_FILE:
-            filename = read_filename();
-            return unique_ptr<RestoreFileRequest>(new RestoreFileRequest(user_id, version, filename));
-        case RequestOP::DELETE_FILE:
-            filename = read_filename();
-            return unique_ptr<DeleteFileRequest>(new DeleteFileRequest(user_id, version, filename));
-        case RequestOP::LIST_FILES:
-            return unique_ptr<ListFilesRequest>(new ListFilesRequest(user_id, version));
-        default:
-            throw InvalidRequestException(static_cast<uint8_t>(request_op));
-    }
+awaitable<uint32_t> BlockingRequestReaderAdapter::read_uint32() {
+    co_return reader_->read_uint32();
+}
+
+awaitable<uint16_t> BlockingRequestReaderAdapter::read_uint16() {
+    co_return reader_->read_uint16();
 }
 
-string RequestParser::read_filename() {
-    uint16_t length{reader_->read_uint16()};
-    vector<uint8_t> payload{reader_->read_bytes(length)};
-    return string(payload.begin(), payload.end());
+awaitable<uint8_t> BlockingRequestReaderAdapter::read_uint8() {
+    co_return reader_->read_uint8();
+}
+
+awaitable<vector<uint8_t>> BlockingRequestReaderAdapter::read_bytes(size_t size) {
+    co_return reader_->read_bytes(size);
+}
+
+awaitable<std::span<const uint8_t>> BlockingRequestReaderAdapter::read_span(size_t max_size) {
+    last_span_ = reader_->read_bytes(max_size);
+    co_return std::span<const uint8_t>(last_span_);
+}
+
+RequestParser::RequestParser(unique_ptr<AbstractRequestReader> reader)
+    : io_context_(1), parser_(boost::make_unique<BlockingRequestReaderAdapter>(std::move(reader))) {}
+
+unique_ptr<ProtocolRequest> RequestParser::parse_message(ProtocolVersion expected_version) {
+    return parse_message(expected_version, expected_version);
 }
 
-vector<uint8_t> RequestParser::read_payload() {
-    uint32_t length{reader_->read_uint32()};
-    return reader_->read_bytes(length);
+unique_ptr<ProtocolRequest> RequestParser::parse_message(ProtocolVersion min_version, ProtocolVersion max_version) {
+    auto request = boost::asio::co_spawn(io_context_, parser_.parse_message(min_version, max_version), boost::asio::use_future);
+    io_context_.restart();
+    io_context_.run();
+    return request.get();
 }
@@ -1,25 +1,42 @@
 #pragma once
+#include <boost/asio.hpp>
 #include <memory>
-#include <stdexcept>
-#include <string>
+#include <span>
 
+#include "async_request_parser.h"
+#include "async_request_reader.h"
 #include "protocol/request.h"
 #include "request_reader.h"
 
-using std::runtime_error;
-using std::string;
 using std::unique_ptr;
 
-class VersionMismatchException : public runtime_error {
+/**
+ * @brief Lets AsyncRequestParser read from a blocking reader. Every read blocks and then completes at once
+ *
+ */
+class BlockingRequestReaderAdapter : public AbstractAsyncRequestReader {
 public:
-    VersionMismatchException(ProtocolVersion expected, ProtocolVersion real)
-        : runtime_error("Expected version: " + std::to_string(expected) + " Got: " + std::to_string(real)) {}
+    BlockingRequestReaderAdapter(unique_ptr<AbstractRequestReader> reader) : reader_(std::move(reader)) {}
+
+    virtual awaitable<uint32_t> read_uint32() override;
+    virtual awaitable<uint16_t> read_uint16() override;
+    virtual awaitable<uint8_t> read_uint8() override;
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t size) override;
+
+    // Reads exactly max_size bytes, a blocking reader can't tell how many are available
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t max_size) override;
+
+private:
+    unique_ptr<AbstractRequestReader> reader_;
+    // Holds the bytes of the last read_span
+    vector<uint8_t> last_span_;
 };
 
 /**
- * @brief Class to parse incoming messages.
+ * @brief Parses incoming messages from a blocking reader.
  * We want reader_ to be a unique_ptr so that no one else can
- * read from the buffer but us
+ * read from the buffer but us. The messages are decoded by AsyncRequestParser,
+ * which runs to completion on a private io_context
  *
  */
 class RequestParser {
@@ -27,8 +44,13 @@ public:
     RequestParser(unique_ptr<AbstractRequestReader> reader);
     unique_ptr<ProtocolRequest> parse_message(ProtocolVersion expected_version);
 
+    /**
+     * @brief Parse a message of any version in [min_version, max_version]
+     *
+     */
+    unique_ptr<ProtocolRequest> parse_message(ProtocolVersion min_version, ProtocolVersion max_version);
+
 private:
-    string read_filename();
-    vector<uint8_t> read_payload();
-    unique_ptr<AbstractRequestReader> reader_;
+    boost::asio::io_context io_context_;
+    AsyncRequestParser parser_;
 };
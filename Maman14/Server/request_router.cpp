@@ -0,0 +1,81 @@
+#include "request_router.h"
+
+#include <boost/make_unique.hpp>
+
+uint64_t ProtocolStatistics::get_requests(ProtocolVersion version) const {
+    for (const auto& [requests_version, num_requests] : requests) {
+        if (requests_version == version) {
+            return num_requests;
+        }
+    }
+    return 0;
+}
+
+string ProtocolStatistics::to_string() const {
+    string result;
+    for (const auto& [version, num_requests] : requests) {
+        if (!result.empty()) {
+            result += " ";
+        }
+        result += "version " + std::to_string(version) + " requests: " + std::to_string(num_requests);
+    }
+    return result;
+}
+
+void RequestRouter::register_version(ProtocolVersion version, HandlerTable handlers) {
+    if (find_protocol_revision(version) == nullptr || is_supported(version)) {
+        throw UnsupportedVersionException(version);
+    }
+
+    auto entry = boost::make_unique<Version>();
+    entry->handlers = std::move(handlers);
+    versions_.emplace(version, std::move(entry));
+}
+
+ProtocolVersion RequestRouter::get_min_version() const {
+    if (versions_.empty()) {
+        throw runtime_error("No protocol version is registered");
+    }
+    return versions_.begin()->first;
+}
+
+ProtocolVersion RequestRouter::get_max_version() const {
+    if (versions_.empty()) {
+        throw runtime_error("No protocol version is registered");
+    }
+    return versions_.rbegin()->first;
+}
+
+const RequestRouter::Handler& RequestRouter::get_handler(const ProtocolRequest& request) const {
+    auto version = versions_.find(request.get_version());
+    if (version == versions_.end()) {
+        throw UnsupportedVersionException(request.get_version());
+    }
+
+    auto handler = version->second->handlers.find(request.get_request_op());
+    if (handler == version->second->handlers.end()) {
+        throw UnsupportedRequestException(request.get_version(), request.get_request_op());
+    }
+    version->second->requests++;
+    return handler->second;
+}
+
+void RequestRouter::admit(const ProtocolRequest& request) const {
+    get_handler(request);
+}
+
+Reply RequestRouter::route(unique_ptr<ProtocolRequest> request) const {
+    if (request == nullptr) {
+        throw std::invalid_argument("nullptr request to route");
+    }
+    const Handler& handler{get_handler(*request)};
+    return handler(std::move(request));
+}
+
+ProtocolStatistics RequestRouter::get_statistics() const {
+    ProtocolStatistics statistics;
+    for (const auto& [version, entry] : versions_) {
+        statistics.requests.emplace_back(version, entry->requests.load());
+    }
+    return statistics;
+}
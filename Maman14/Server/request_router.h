@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "protocol/common.h"
+#include "protocol/request.h"
+#include "reply.h"
+
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+class UnsupportedVersionException : public runtime_error {
+public:
+    UnsupportedVersionException(ProtocolVersion version)
+        : runtime_error("Unsupported protocol version: " + std::to_string(version)) {}
+};
+
+class UnsupportedRequestException : public runtime_error {
+public:
+    UnsupportedRequestException(ProtocolVersion version, RequestOP op)
+        : runtime_error("Request op " + std::to_string(static_cast<uint8_t>(op)) + " isn't in protocol version " +
+                        std::to_string(version)) {}
+};
+
+/**
+ * @brief How many requests each version served, so we can tell when the clients of an old version are gone
+ *
+ */
+struct ProtocolStatistics {
+    // Sorted by version
+    vector<std::pair<ProtocolVersion, uint64_t>> requests;
+
+    uint64_t get_requests(ProtocolVersion version) const;
+    string to_string() const;
+};
+
+/**
+ * @brief The versions of the protocol the server speaks, each with a table of its requests and their handlers.
+ * A session is served from the table of its client's version, so a new version can add or change requests
+ * without breaking the clients of the older ones. All of the versions are registered before the server starts
+ * serving and aren't changed after, so routing a request takes no locks
+ *
+ */
+class RequestRouter {
+public:
+    typedef std::function<Reply(unique_ptr<ProtocolRequest>)> Handler;
+    typedef std::unordered_map<RequestOP, Handler> HandlerTable;
+
+    /**
+     * @brief Serve a version with the handlers of its requests.
+     * The version must be in PROTOCOL_REVISIONS, which is how its messages are parsed
+     *
+     * @throws UnsupportedVersionException If there's no such version, or it's already registered
+     */
+    void register_version(ProtocolVersion version, HandlerTable handlers);
+
+    bool is_supported(ProtocolVersion version) const { return versions_.count(version) > 0; };
+    ProtocolVersion get_min_version() const;
+    ProtocolVersion get_max_version() const;
+
+    /**
+     * @brief Check the request is in its version's table, and count it for its version.
+     * For requests that are handled outside of the tables, like a streamed backup
+     *
+     * @throws UnsupportedRequestException If it isn't
+     */
+    void admit(const ProtocolRequest& request) const;
+
+    /**
+     * @brief Admit the request, and hand it to its handler in its version's table
+     *
+     */
+    Reply route(unique_ptr<ProtocolRequest> request) const;
+
+    ProtocolStatistics get_statistics() const;
+
+private:
+    struct Version {
+        HandlerTable handlers;
+        mutable std::atomic<uint64_t> requests{0};
+    };
+
+    const Handler& get_handler(const ProtocolRequest& request) const;
+
+    std::map<ProtocolVersion, unique_ptr<Version>> versions_;
+};
@@ -0,0 +1,100 @@
+#include "response_pipeline.h"
+
+#include <boost/log/trivial.hpp>
+#include <boost/make_unique.hpp>
+
+#include "server.h"
+
+using boost::system::error_code;
+
+ResponsePipeline::ResponsePipeline(shared_ptr<Server> server,
+                                   shared_ptr<BoostConnectionManager> connection,
+                                   any_io_executor strand,
+                                   size_t max_in_flight)
+    : server_(std::move(server)),
+      connection_(std::move(connection)),
+      strand_(std::move(strand)),
+      max_in_flight_(std::max<size_t>(max_in_flight, 1)),
+      in_flight_(0),
+      writing_(false),
+      failed_(false),
+      state_changed_(strand_) {}
+
+awaitable<void> ResponsePipeline::wait_for_slot() {
+    while (in_flight_ >= max_in_flight_ && !failed_) {
+        co_await wait_for_state_change();
+    }
+    in_flight_++;
+}
+
+awaitable<void> ResponsePipeline::dispatch(unique_ptr<ProtocolRequest> request) {
+    co_await wait_for_slot();
+
+    // Handle the request on the handler pool, so other requests of this connection can be handled at the same time
+    // and the strand is free to read them
+    boost::asio::post(server_->get_handler_executor(), [self = shared_from_this(), request = std::move(request)]() mutable {
+        ProtocolVersion version{request->get_version()};
+        RequestID request_id{request->get_request_id()};
+        Reply reply{nullptr};
+        try {
+            reply = self->server_->handleRequest(std::move(request));
+        } catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << "Exception handling pipelined request " << request_id << ": " << e.what();
+            reply = Reply(boost::make_unique<ServerErrorResponse>(version));
+            reply.response->set_request_id(request_id);
+        }
+
+        boost::asio::post(self->strand_, [self, reply = std::move(reply)]() mutable {
+            self->on_reply(std::move(reply));
+        });
+    });
+}
+
+awaitable<void> ResponsePipeline::dispatch_response(unique_ptr<ProtocolResponse> response) {
+    co_await wait_for_slot();
+    on_reply(Reply(std::move(response)));
+}
+
+awaitable<void> ResponsePipeline::drain() {
+    while (in_flight_ > 0 && !failed_) {
+        co_await wait_for_state_change();
+    }
+}
+
+void ResponsePipeline::on_reply(Reply reply) {
+    ready_replies_.push_back(std::move(reply));
+    if (!writing_) {
+        writing_ = true;
+        boost::asio::co_spawn(strand_, write_responses(), boost::asio::detached);
+    }
+}
+
+awaitable<void> ResponsePipeline::write_responses() {
+    // Keep ourselves alive while writing, even if the session already gave up on us
+    auto self = shared_from_this();
+    try {
+        while (!ready_replies_.empty()) {
+            Reply reply = std::move(ready_replies_.front());
+            ready_replies_.pop_front();
+            co_await server_->sendReply(*connection_, reply);
+            in_flight_--;
+            notify_state_change();
+        }
+    } catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Failed writing pipelined response: " << e.what();
+        failed_ = true;
+        ready_replies_.clear();
+        notify_state_change();
+    }
+    writing_ = false;
+}
+
+awaitable<void> ResponsePipeline::wait_for_state_change() {
+    state_changed_.expires_at(boost::asio::steady_timer::time_point::max());
+    error_code ignored;
+    co_await state_changed_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+}
+
+void ResponsePipeline::notify_state_change() {
+    state_changed_.cancel();
+}
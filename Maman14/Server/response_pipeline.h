@@ -0,0 +1,78 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <deque>
+#include <memory>
+
+#include "boost_connection_manager.h"
+#include "bytearray.h"
+#include "protocol/request.h"
+#include "protocol/response.h"
+#include "reply.h"
+
+using boost::asio::any_io_executor;
+using boost::asio::awaitable;
+using std::shared_ptr;
+using std::unique_ptr;
+
+class Server;
+
+/**
+ * @brief Handles the requests of a pipelining (version 2) connection concurrently on the server's pool,
+ * and writes each response as soon as it is ready, so responses may go out in a different order than
+ * their requests came in. Clients match them by request ID.
+ * All of the state is only touched from the session's strand.
+ *
+ */
+class ResponsePipeline : public std::enable_shared_from_this<ResponsePipeline> {
+public:
+    /**
+     * @brief Construct a new Response Pipeline
+     *
+     * @param server Handles the requests
+     * @param connection Responses are written here
+     * @param strand The session's strand
+     * @param max_in_flight How many requests may be handled or waiting to be written at once
+     */
+    ResponsePipeline(shared_ptr<Server> server,
+                     shared_ptr<BoostConnectionManager> connection,
+                     any_io_executor strand,
+                     size_t max_in_flight);
+
+    /**
+     * @brief Start handling a request in the background.
+     * Suspends while max_in_flight requests are already in flight, which stops us from reading more requests
+     *
+     */
+    awaitable<void> dispatch(unique_ptr<ProtocolRequest> request);
+
+    /**
+     * @brief Queue a response for a request that was already handled by the session itself
+     *
+     */
+    awaitable<void> dispatch_response(unique_ptr<ProtocolResponse> response);
+
+    /**
+     * @brief Wait until every dispatched request had its response written, or writing failed
+     *
+     */
+    awaitable<void> drain();
+
+private:
+    awaitable<void> wait_for_slot();
+    void on_reply(Reply reply);
+    awaitable<void> write_responses();
+    awaitable<void> wait_for_state_change();
+    void notify_state_change();
+
+    shared_ptr<Server> server_;
+    shared_ptr<BoostConnectionManager> connection_;
+    any_io_executor strand_;
+    size_t max_in_flight_;
+    size_t in_flight_;
+    std::deque<Reply> ready_replies_;
+    bool writing_;
+    bool failed_;
+    // Used as a condition variable for coroutines: waiters wait for it forever and we cancel it to wake them up
+    boost::asio::steady_timer state_changed_;
+};
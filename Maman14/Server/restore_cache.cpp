@@ -0,0 +1,297 @@
+#include "restore_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+// What an entry takes besides its content: the key, the list and map nodes and the shared pointer's control block
+static const size_t ENTRY_OVERHEAD = 128;
+// For sizing the frequency sketches, how big a cached file is on average
+static const size_t EXPECTED_FILE_SIZE = 4096;
+static const size_t MIN_SKETCH_COUNTERS = 1024;
+
+static uint64_t mix(uint64_t value) {
+    // The finalizer of SplitMix64, so every bit of the hash affects the counters that are picked
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+static bool is_same_version(const FileIndexEntry& a, const FileIndexEntry& b) {
+    return a.size == b.size && a.mtime_ns == b.mtime_ns && a.content_hash == b.content_hash;
+}
+
+double RestoreCacheStatistics::get_hit_rate() const {
+    uint64_t lookups = hits + misses;
+    return lookups > 0 ? static_cast<double>(hits) / lookups : 0;
+}
+
+string RestoreCacheStatistics::to_string() const {
+    return "hits: " + std::to_string(hits) +
+           " misses: " + std::to_string(misses) +
+           " hit rate: " + std::to_string(get_hit_rate()) +
+           " bytes served: " + std::to_string(bytes_served) +
+           " insertions: " + std::to_string(insertions) +
+           " rejections: " + std::to_string(rejections) +
+           " evictions: " + std::to_string(evictions) +
+           " invalidations: " + std::to_string(invalidations) +
+           " files: " + std::to_string(num_files) +
+           " size: " + std::to_string(size);
+}
+
+FrequencySketch::FrequencySketch(size_t num_counters) : num_increments_(0) {
+    size_t size = MIN_SKETCH_COUNTERS;
+    while (size < num_counters) {
+        size *= 2;
+    }
+    counters_.assign(size, 0);
+    mask_ = size - 1;
+    reset_after_ = 10 * size;
+}
+
+size_t FrequencySketch::get_index(uint64_t hash, size_t row) const {
+    return mix(hash + (row + 1) * 0x9e3779b97f4a7c15ULL) & mask_;
+}
+
+void FrequencySketch::increment(uint64_t hash) {
+    for (size_t row = 0; row < DEPTH; row++) {
+        uint8_t& counter = counters_[get_index(hash, row)];
+        if (counter < MAX_FREQUENCY) {
+            counter++;
+        }
+    }
+    if (++num_increments_ >= reset_after_) {
+        // Age the counts, so files that were popular once make room for those that are popular now
+        for (auto& counter : counters_) {
+            counter /= 2;
+        }
+        num_increments_ /= 2;
+    }
+}
+
+uint8_t FrequencySketch::estimate(uint64_t hash) const {
+    uint8_t frequency = MAX_FREQUENCY;
+    for (size_t row = 0; row < DEPTH; row++) {
+        frequency = std::min(frequency, counters_[get_index(hash, row)]);
+    }
+    return frequency;
+}
+
+RestoreCache::RestoreCache(RestoreCacheOptions options)
+    : options_(options),
+      shard_capacity_(options.capacity / std::max<size_t>(options.num_shards, 1)),
+      window_capacity_(static_cast<size_t>(shard_capacity_ * options.window_fraction)),
+      protected_capacity_(static_cast<size_t>((shard_capacity_ - window_capacity_) * options.protected_fraction)),
+      shards_(new unique_ptr<Shard>[std::max<size_t>(options.num_shards, 1)]),
+      hits_(0),
+      misses_(0),
+      bytes_served_(0),
+      insertions_(0),
+      rejections_(0),
+      evictions_(0),
+      invalidations_(0) {
+    options_.num_shards = std::max<size_t>(options.num_shards, 1);
+    for (size_t i = 0; i < options_.num_shards; i++) {
+        shards_[i] = std::make_unique<Shard>(shard_capacity_ / EXPECTED_FILE_SIZE);
+    }
+}
+
+string RestoreCache::make_key(uint32_t user_id, const string& filename) {
+    string key(reinterpret_cast<const char*>(&user_id), sizeof(user_id));
+    key += filename;
+    return key;
+}
+
+RestoreCache::Shard& RestoreCache::get_shard(uint64_t hash) const {
+    return *shards_[mix(hash) % options_.num_shards];
+}
+
+std::list<RestoreCache::Entry>& RestoreCache::get_list(Shard& shard, Segment segment) const {
+    switch (segment) {
+        case Segment::WINDOW:
+            return shard.window;
+        case Segment::PROBATION:
+            return shard.probation;
+        default:
+            return shard.protected_entries;
+    }
+}
+
+size_t& RestoreCache::get_size(Shard& shard, Segment segment) const {
+    switch (segment) {
+        case Segment::WINDOW:
+            return shard.window_size;
+        case Segment::PROBATION:
+            return shard.probation_size;
+        default:
+            return shard.protected_size;
+    }
+}
+
+void RestoreCache::move_to(Shard& shard, Location& location, Segment segment) {
+    size_t charge = location.it->charge;
+    get_size(shard, location.segment) -= charge;
+    get_list(shard, segment).splice(get_list(shard, segment).begin(), get_list(shard, location.segment), location.it);
+    get_size(shard, segment) += charge;
+    location.segment = segment;
+}
+
+void RestoreCache::erase(Shard& shard, std::unordered_map<string, Location>::iterator it) {
+    Location& location = it->second;
+    get_size(shard, location.segment) -= location.it->charge;
+    get_list(shard, location.segment).erase(location.it);
+    shard.entries.erase(it);
+}
+
+void RestoreCache::on_hit(Shard& shard, Location& location) {
+    if (location.segment == Segment::WINDOW || location.segment == Segment::PROTECTED) {
+        move_to(shard, location, location.segment);
+        return;
+    }
+    // A second hit in the main part protects the file, and the least recent protected files are put on probation again
+    move_to(shard, location, Segment::PROTECTED);
+    while (shard.protected_size > protected_capacity_ && shard.protected_entries.size() > 1) {
+        move_to(shard, shard.entries.at(shard.protected_entries.back().key), Segment::PROBATION);
+    }
+}
+
+void RestoreCache::evict_window(Shard& shard) {
+    size_t main_capacity = shard_capacity_ - window_capacity_;
+    while (shard.window_size > window_capacity_) {
+        Entry& candidate = shard.window.back();
+        auto candidate_it = shard.entries.find(candidate.key);
+        size_t main_size = shard.probation_size + shard.protected_size;
+        if (main_size + candidate.charge <= main_capacity) {
+            move_to(shard, candidate_it->second, Segment::PROBATION);
+            continue;
+        }
+
+        // The candidate is admitted only if it's more popular than every file it would evict
+        uint8_t candidate_frequency = shard.sketch.estimate(candidate.hash);
+        vector<string> victims;
+        size_t freed = 0;
+        bool admit = candidate.charge <= main_capacity;
+        for (auto* list : {&shard.probation, &shard.protected_entries}) {
+            for (auto it = list->rbegin(); admit && it != list->rend() && main_size - freed + candidate.charge > main_capacity; it++) {
+                if (shard.sketch.estimate(it->hash) >= candidate_frequency) {
+                    admit = false;
+                    break;
+                }
+                victims.push_back(it->key);
+                freed += it->charge;
+            }
+        }
+        if (!admit) {
+            erase(shard, candidate_it);
+            rejections_++;
+            continue;
+        }
+        for (const auto& victim : victims) {
+            erase(shard, shard.entries.find(victim));
+            evictions_++;
+        }
+        move_to(shard, candidate_it->second, Segment::PROBATION);
+    }
+}
+
+shared_ptr<const CachedFile> RestoreCache::find(uint32_t user_id, const string& filename, const FileIndexEntry& version) {
+    string key = make_key(user_id, filename);
+    uint64_t hash = std::hash<string>{}(key);
+    Shard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sketch.increment(hash);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        misses_++;
+        return nullptr;
+    }
+    if (!is_same_version(it->second.it->file->version, version)) {
+        // Replaced since it was cached
+        erase(shard, it);
+        invalidations_++;
+        misses_++;
+        return nullptr;
+    }
+    shared_ptr<const CachedFile> file = it->second.it->file;
+    on_hit(shard, it->second);
+    hits_++;
+    bytes_served_ += file->content.size();
+    return file;
+}
+
+bool RestoreCache::should_insert(uint32_t user_id, const string& filename, uint64_t size) const {
+    if (size > options_.max_file_size || size + ENTRY_OVERHEAD > shard_capacity_ - window_capacity_) {
+        return false;
+    }
+    string key = make_key(user_id, filename);
+    uint64_t hash = std::hash<string>{}(key);
+    Shard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.sketch.estimate(hash) >= options_.min_frequency;
+}
+
+void RestoreCache::insert(uint32_t user_id, const string& filename, shared_ptr<const CachedFile> file) {
+    string key = make_key(user_id, filename);
+    uint64_t hash = std::hash<string>{}(key);
+    size_t charge = file->content.size() + key.size() + ENTRY_OVERHEAD;
+    Shard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        // Another restore of the file inserted it first, maybe of another version
+        erase(shard, it);
+    }
+    shard.window.push_front(Entry{key, hash, std::move(file), charge});
+    shard.window_size += charge;
+    shard.entries.emplace(std::move(key), Location{Segment::WINDOW, shard.window.begin()});
+    insertions_++;
+    evict_window(shard);
+}
+
+void RestoreCache::invalidate(uint32_t user_id, const string& filename) {
+    string key = make_key(user_id, filename);
+    uint64_t hash = std::hash<string>{}(key);
+    Shard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        erase(shard, it);
+        invalidations_++;
+    }
+}
+
+RestoreCacheStatistics RestoreCache::get_statistics() const {
+    RestoreCacheStatistics statistics{hits_, misses_, bytes_served_, insertions_, rejections_, evictions_, invalidations_, 0, 0};
+    for (size_t i = 0; i < options_.num_shards; i++) {
+        std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+        statistics.num_files += shards_[i]->entries.size();
+        statistics.size += shards_[i]->window_size + shards_[i]->probation_size + shards_[i]->protected_size;
+    }
+    return statistics;
+}
+
+CachedBackupFileReader::CachedBackupFileReader(bfs::path path, shared_ptr<const CachedFile> file)
+    : BackupFileReader(std::move(path), file->content.size()), file_(std::move(file)) {}
+
+size_t CachedBackupFileReader::read(uint64_t offset, uint8_t* data, size_t size) const {
+    if (offset >= size_) {
+        return 0;
+    }
+    size_t bytes_read = std::min<uint64_t>(size, size_ - offset);
+    std::memcpy(data, file_->content.data() + offset, bytes_read);
+    return bytes_read;
+}
+
+FileSegment CachedBackupFileReader::get_segment(uint64_t offset) const {
+    if (offset >= size_) {
+        return FileSegment{-1, offset, 0, file_->content.data()};
+    }
+    return FileSegment{-1, offset, size_ - offset, file_->content.data() + offset};
+}
+
+StoredSegment CachedBackupFileReader::get_stored_segment(size_t index) const {
+    return get_raw_segment(index, -1, 0, file_->content.data());
+}
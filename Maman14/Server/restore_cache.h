@@ -0,0 +1,207 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_index.h"
+#include "user_backup_directory.h"
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+struct RestoreCacheOptions {
+    // The most bytes of file content all of the shards may hold together
+    size_t capacity = 256 * 1024 * 1024;
+
+    // Bigger files are never cached, they're sent with sendfile
+    size_t max_file_size = 4 * 1024 * 1024;
+
+    // Each shard has its own lock, and an equal part of the capacity
+    size_t num_shards = 16;
+
+    // How much of a shard's capacity is the window, where new files are before they're considered for the main part
+    double window_fraction = 0.01;
+
+    // How much of the main part is for the files that were hit again since they were admitted
+    double protected_fraction = 0.8;
+
+    // A file is only read into the cache once it was restored this many times recently, so a scan over
+    // files that are restored once doesn't copy them all through memory
+    uint8_t min_frequency = 2;
+};
+
+/**
+ * @brief The content of a cached file, and the version of the file it was read from
+ *
+ */
+struct CachedFile {
+    vector<uint8_t> content;
+    FileIndexEntry version;
+};
+
+struct RestoreCacheStatistics {
+    uint64_t hits;
+    uint64_t misses;
+    // The bytes of content that were restored from the cache instead of the disk
+    uint64_t bytes_served;
+    uint64_t insertions;
+    // Files that left the window and lost to the main part's victims, so they weren't admitted
+    uint64_t rejections;
+    uint64_t evictions;
+    // Files that were deleted or replaced while they were cached
+    uint64_t invalidations;
+    size_t num_files;
+    size_t size;
+
+    double get_hit_rate() const;
+    string to_string() const;
+};
+
+/**
+ * @brief Estimates how often keys were seen recently, in a few bits per counter, with a count-min sketch.
+ * All of the counters are halved every so often, so the estimates follow what's popular now
+ *
+ */
+class FrequencySketch {
+public:
+    static constexpr uint8_t MAX_FREQUENCY = 15;
+
+    FrequencySketch(size_t num_counters);
+
+    void increment(uint64_t hash);
+    uint8_t estimate(uint64_t hash) const;
+
+private:
+    static constexpr size_t DEPTH = 4;
+    size_t get_index(uint64_t hash, size_t row) const;
+
+    vector<uint8_t> counters_;
+    size_t mask_;
+    size_t num_increments_;
+    size_t reset_after_;
+};
+
+/**
+ * @brief A cache of the content of files that are restored over and over, in front of the backup directories.
+ * Each shard is a W-TinyLFU cache of bytes: files enter an LRU window, and when they leave it they're only
+ * admitted to the main segmented LRU if they were restored more often than the file they would evict,
+ * by the shard's frequency sketch. That keeps the popular files cached through scans of files that are
+ * restored once. A cached file is only served if its version matches the index, so a file that was replaced
+ * is never served from the cache, and deletes and replaces drop the file as well.
+ *
+ */
+class RestoreCache {
+public:
+    RestoreCache(RestoreCacheOptions options = RestoreCacheOptions());
+    RestoreCache(const RestoreCache&) = delete;
+    RestoreCache& operator=(const RestoreCache&) = delete;
+
+    /**
+     * @brief Find a file, and count the restore in the frequency sketch
+     *
+     * @param version The file's entry in the index, which the cached file must match
+     * @return shared_ptr<const CachedFile> nullptr on a miss
+     */
+    shared_ptr<const CachedFile> find(uint32_t user_id, const string& filename, const FileIndexEntry& version);
+
+    /**
+     * @brief Whether a file that was missed is worth reading into the cache
+     *
+     */
+    bool should_insert(uint32_t user_id, const string& filename, uint64_t size) const;
+
+    void insert(uint32_t user_id, const string& filename, shared_ptr<const CachedFile> file);
+    void invalidate(uint32_t user_id, const string& filename);
+
+    RestoreCacheStatistics get_statistics() const;
+
+private:
+    enum class Segment {
+        WINDOW,
+        PROBATION,
+        PROTECTED,
+    };
+
+    struct Entry {
+        string key;
+        uint64_t hash;
+        shared_ptr<const CachedFile> file;
+        size_t charge;
+    };
+
+    struct Location {
+        Segment segment;
+        std::list<Entry>::iterator it;
+    };
+
+    struct Shard {
+        Shard(size_t num_counters) : sketch(num_counters) {}
+
+        // The most recently used entries are at the front
+        std::list<Entry> window;
+        std::list<Entry> probation;
+        std::list<Entry> protected_entries;
+        size_t window_size = 0;
+        size_t probation_size = 0;
+        size_t protected_size = 0;
+        std::unordered_map<string, Location> entries;
+        FrequencySketch sketch;
+        mutable std::mutex mutex;
+    };
+
+    static string make_key(uint32_t user_id, const string& filename);
+    Shard& get_shard(uint64_t hash) const;
+
+    // The following are called with the shard's lock held
+    std::list<Entry>& get_list(Shard& shard, Segment segment) const;
+    size_t& get_size(Shard& shard, Segment segment) const;
+    void move_to(Shard& shard, Location& location, Segment segment);
+    void erase(Shard& shard, std::unordered_map<string, Location>::iterator it);
+    void on_hit(Shard& shard, Location& location);
+
+    /**
+     * @brief Move the files that don't fit in the window to the main part, if they win against its victims
+     *
+     */
+    void evict_window(Shard& shard);
+
+    RestoreCacheOptions options_;
+    size_t shard_capacity_;
+    size_t window_capacity_;
+    size_t protected_capacity_;
+    unique_ptr<unique_ptr<Shard>[]> shards_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> bytes_served_;
+    std::atomic<uint64_t> insertions_;
+    std::atomic<uint64_t> rejections_;
+    std::atomic<uint64_t> evictions_;
+    std::atomic<uint64_t> invalidations_;
+};
+
+/**
+ * @brief Reads a file from its content in the restore cache. The content is kept alive by the reader,
+ * even if the file is evicted meanwhile
+ *
+ */
+class CachedBackupFileReader : public BackupFileReader {
+public:
+    CachedBackupFileReader(bfs::path path, shared_ptr<const CachedFile> file);
+
+    virtual size_t read(uint64_t offset, uint8_t* data, size_t size) const override;
+    virtual FileSegment get_segment(uint64_t offset) const override;
+    virtual size_t get_num_stored_segments() const override { return get_num_raw_segments(); };
+    virtual StoredSegment get_stored_segment(size_t index) const override;
+    virtual uint64_t get_stored_size() const override { return size_; };
+
+private:
+    shared_ptr<const CachedFile> file_;
+};
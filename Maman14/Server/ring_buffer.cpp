@@ -0,0 +1,95 @@
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace utils {
+
+static size_t round_up_to_power_of_two(size_t value) {
+    size_t power = 1;
+    while (power < value) {
+        power <<= 1;
+    }
+    return power;
+}
+
+RingBuffer::RingBuffer(size_t capacity)
+    : buffer_(round_up_to_power_of_two(std::max<size_t>(capacity, 1))),
+      mask_(buffer_.size() - 1),
+      read_position_(0),
+      write_position_(0) {}
+
+std::span<uint8_t> RingBuffer::writable() {
+    size_t offset = write_position_ & mask_;
+    size_t until_end = capacity() - offset;
+    return {buffer_.data() + offset, std::min(until_end, free_space())};
+}
+
+void RingBuffer::commit(size_t size) {
+    if (size > free_space()) {
+        throw std::out_of_range("Committed more than the free space of the ring buffer");
+    }
+    write_position_ += size;
+}
+
+std::span<const uint8_t> RingBuffer::readable() const {
+    size_t offset = read_position_ & mask_;
+    size_t until_end = capacity() - offset;
+    return {buffer_.data() + offset, std::min(until_end, size())};
+}
+
+void RingBuffer::consume(size_t size) {
+    if (size > this->size()) {
+        throw std::out_of_range("Consumed more than the size of the ring buffer");
+    }
+    read_position_ += size;
+    if (empty()) {
+        // Start over from the beginning, so the next reads and writes are as contiguous as possible
+        read_position_ = 0;
+        write_position_ = 0;
+    }
+}
+
+uint8_t RingBuffer::read_u8() {
+    if (empty()) {
+        throw std::out_of_range("Not enough bytes in the ring buffer");
+    }
+    uint8_t value = at(0);
+    consume(1);
+    return value;
+}
+
+uint16_t RingBuffer::read_u16() {
+    if (size() < 2) {
+        throw std::out_of_range("Not enough bytes in the ring buffer");
+    }
+    uint16_t value = at(1) << 8 | at(0);
+    consume(2);
+    return value;
+}
+
+uint32_t RingBuffer::read_u32() {
+    if (size() < 4) {
+        throw std::out_of_range("Not enough bytes in the ring buffer");
+    }
+    uint32_t value = static_cast<uint32_t>(at(3)) << 24 | at(2) << 16 | at(1) << 8 | at(0);
+    consume(4);
+    return value;
+}
+
+void RingBuffer::read(uint8_t* data, size_t size) {
+    if (size > this->size()) {
+        throw std::out_of_range("Not enough bytes in the ring buffer");
+    }
+    while (size > 0) {
+        std::span<const uint8_t> front = readable();
+        size_t to_copy = std::min(front.size(), size);
+        std::memcpy(data, front.data(), to_copy);
+        consume(to_copy);
+        data += to_copy;
+        size -= to_copy;
+    }
+}
+
+}  // namespace utils
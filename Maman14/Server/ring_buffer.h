@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <vector>
+
+using std::vector;
+
+namespace utils {
+
+/**
+ * @brief A fixed size byte queue that wraps around, so bytes are never moved once they were written.
+ * Data is written straight into its free space (e.g. by a recv) and then committed,
+ * and read either through spans of the contiguous readable bytes or by decoding
+ * little endian fields in place, which may wrap around the end of the buffer.
+ *
+ */
+class RingBuffer {
+public:
+    /**
+     * @brief Construct a new Ring Buffer
+     *
+     * @param capacity Rounded up to a power of two
+     */
+    explicit RingBuffer(size_t capacity);
+
+    size_t size() const { return write_position_ - read_position_; };
+    size_t capacity() const { return buffer_.size(); };
+    size_t free_space() const { return capacity() - size(); };
+    bool empty() const { return size() == 0; };
+
+    /**
+     * @brief The contiguous free space after the written bytes. Write into it and then commit
+     *
+     */
+    std::span<uint8_t> writable();
+    void commit(size_t size);
+
+    /**
+     * @brief The contiguous readable bytes at the front. Might be less than size() when the data wraps around
+     *
+     */
+    std::span<const uint8_t> readable() const;
+    void consume(size_t size);
+
+    // Decode and consume a field. The buffer must hold enough bytes
+    uint8_t read_u8();
+    uint16_t read_u16();
+    uint32_t read_u32();
+
+    /**
+     * @brief Copy size bytes from the front into data, and consume them
+     *
+     */
+    void read(uint8_t* data, size_t size);
+
+private:
+    uint8_t at(size_t index) const { return buffer_[(read_position_ + index) & mask_]; };
+
+    vector<uint8_t> buffer_;
+    size_t mask_;
+    // The positions only grow, and are wrapped with the mask when indexing
+    size_t read_position_;
+    size_t write_position_;
+};
+
+}  // namespace utils
@@ -3,68 +3,25 @@
 #include <boost/exception/diagnostic_information.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/make_unique.hpp>
+#include <algorithm>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include "client_session.h"
+#include "delta.h"
 #include "protocol/request.h"
 #include "protocol/response.h"
-#include "request_parser.h"
-#include "request_reader.h"
 #include "string_utils.h"
 
-using boost::asio::io_service;
-
 using std::runtime_error;
 using std::shared_ptr;
 using std::unique_ptr;
 
-class InvalidRequestOpToHandleException : public runtime_error {
-public:
-    InvalidRequestOpToHandleException(RequestOP op)
-        : runtime_error("Invalid request op to handle: " + std::to_string(static_cast<uint8_t>(op))) {}
-};
-
-static void sendServerError(shared_ptr<BoostConnectionManager> connection, ProtocolVersion version) {
-    if (connection == nullptr) {
-        BOOST_LOG_TRIVIAL(warning) << "sendServerError accepted nullptr - doing nothing ";
-        return;
-    }
-
-    try {
-        ServerErrorResponse response{version};
-        connection->send(response.pack().buffer());
-    } catch (const std::exception& e) {
-        BOOST_LOG_TRIVIAL(error) << "Exception sending server error: " << e.what();
-    } catch (...) {
-        BOOST_LOG_TRIVIAL(fatal) << "Unknown exception sending server error: " << boost::current_exception_diagnostic_information();
-    }
-}
-
-static void client_session(shared_ptr<Server> server, unique_ptr<tcp::socket> client_socket) {
-    string client_ip;
-    shared_ptr<BoostConnectionManager> connection = nullptr;
-
-    try {
-        client_ip = client_socket->remote_endpoint().address().to_string();
-        BOOST_LOG_TRIVIAL(debug) << "[Server " << server->get_port() << "] accepted new client: " << client_ip;
-        connection = shared_ptr<BoostConnectionManager>(new BoostConnectionManager(std::move(client_socket)));
-
-        RequestParser parser{boost::make_unique<RequestReader>(connection)};
-        unique_ptr<ProtocolRequest> request{parser.parse_message(server->get_version())};
-        server->handleRequest(connection, std::move(request));
-
-    } catch (const std::exception& e) {
-        BOOST_LOG_TRIVIAL(fatal) << "Exception during client session: " << e.what();
-        sendServerError(connection, server->get_version());
-    } catch (...) {
-        BOOST_LOG_TRIVIAL(fatal) << "Unknown exception in client session: " << boost::current_exception_diagnostic_information();
-    }
-
-    BOOST_LOG_TRIVIAL(debug) << "[Server " << server->get_port() << "] Closing connection with: " << client_ip;
-}
-
 template <typename Derived, typename Base>
 inline std::unique_ptr<Derived> dynamic_pointer_cast(std::unique_ptr<Base>&& ptr_) {
     Derived* const converted_ptr = dynamic_cast<Derived*>(ptr_.get());
@@ -76,21 +33,151 @@ inline std::unique_ptr<Derived> dynamic_pointer_cast(std::unique_ptr<Base>&& ptr
     return std::unique_ptr<Derived>(converted_ptr);
 }
 
-void Server::backupFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<BackupFileRequest> request) {
+// Adapt a handler of a specific request to the tables of the router
+template <typename Request, typename Result>
+static RequestRouter::Handler bind_handler(Server* server, Result (Server::*handler)(unique_ptr<Request>)) {
+    return [server, handler](unique_ptr<ProtocolRequest> request) {
+        return Reply((server->*handler)(dynamic_pointer_cast<Request>(std::move(request))));
+    };
+}
+
+unique_ptr<ProtocolResponse> Server::backupFile(unique_ptr<BackupFileRequest> request) {
     BOOST_LOG_TRIVIAL(info) << "Backing up file: " << request->get_filename() << " for user: " << request->get_user_id();
     backup_directory_manager_.backup_file_for_user_id(request->get_user_id(), request->get_filename(), request->get_payload());
-    SuccessfulBackupOrDeleteResponse response{get_version(), request->get_filename()};
-    connection->send(response.pack().buffer());
+    return boost::make_unique<SuccessfulBackupOrDeleteResponse>(request->get_version(), request->get_filename());
+}
+
+unique_ptr<ProtocolResponse> Server::backupDelta(unique_ptr<BackupDeltaRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Backing up delta of file: " << request->get_filename() << " for user: " << request->get_user_id()
+                            << " delta size: " << request->get_payload_size();
+    if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
+    try {
+        unique_ptr<BackupFileReader> base{backup_directory_manager_.open_file_for_user(request->get_user_id(), request->get_filename())};
+        unique_ptr<BackupFileWriter> writer{backup_directory_manager_.begin_replace_for_user(request->get_user_id(), request->get_filename())};
+        const vector<uint8_t>& delta{request->get_payload()};
+        uint64_t new_size = apply_delta(*base, delta.data(), delta.size(), *writer);
+        writer->commit();
+        BOOST_LOG_TRIVIAL(info) << "Applied delta of file: " << request->get_filename() << " new size: " << new_size;
+        return boost::make_unique<SuccessfulBackupOrDeleteResponse>(request->get_version(), request->get_filename());
+    } catch (const FileNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    } catch (const InvalidDeltaException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Invalid delta for file " << request->get_filename() << ": " << e.what();
+        return boost::make_unique<DeltaMismatchResponse>(request->get_version(), request->get_filename());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
+}
+
+unique_ptr<ProtocolResponse> Server::getSignatures(unique_ptr<GetSignaturesRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Getting signatures of file: " << request->get_filename() << " for user: " << request->get_user_id();
+    if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
+    try {
+        unique_ptr<BackupFileReader> file{backup_directory_manager_.open_file_for_user(request->get_user_id(), request->get_filename())};
+        vector<uint8_t> signatures{compute_signatures(*file).serialize()};
+        if (!StreamedRestoreResponse::fits_version(request->get_version(), signatures.size())) {
+            return boost::make_unique<ServerErrorResponse>(request->get_version());
+        }
+        utils::Bytearray payload;
+        payload.push_vector(signatures);
+        return boost::make_unique<SuccessfulSignaturesResponse>(request->get_version(), request->get_filename(), std::move(payload));
+    } catch (const FileNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
 }
 
-void Server::deleteFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<DeleteFileRequest> request) {
+awaitable<unique_ptr<ProtocolResponse>> Server::streamBackupFile(unique_ptr<ProtocolRequest> protocol_request, AsyncRequestParser& parser) {
+    unique_ptr<BackupFileRequest> request{dynamic_pointer_cast<BackupFileRequest>(std::move(protocol_request))};
+    bool chunked{request->is_payload_chunked()};
+    BOOST_LOG_TRIVIAL(info) << "Streaming backup of file: " << request->get_filename() << " for user: " << request->get_user_id()
+                            << " size: " << (chunked ? string("chunked") : std::to_string(request->get_payload_size()));
+
+    // Beginning and committing the backup take the file's lock and touch the disk, so only the reads of the payload
+    // run on the io threads
+    unique_ptr<BackupFileWriter> writer;
+    std::function<awaitable<void>()> begin = [&]() -> awaitable<void> {
+        writer = backup_directory_manager_.begin_backup_for_user_id(request->get_user_id(), request->get_filename());
+        co_return;
+    };
+    // A backup that fails, like one of a file that already exists, only fails its own request. The rest of its
+    // payload is still read off the connection, so the session and its other requests go on
+    bool failed{false};
+    try {
+        co_await runOnHandlers(begin);
+    } catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to begin backup of file " << request->get_filename() << ": " << e.what();
+        failed = true;
+    }
+    // A chunked payload is streamed a frame at a time, and its size is only known once the last frame is read
+    uint64_t remaining{request->get_payload_size()};
+    if (chunked) {
+        remaining = co_await parser.read_payload_frame_size();
+    }
+    size_t reservation_size{chunked ? options_.backup_chunk_size : static_cast<size_t>(std::min<uint64_t>(options_.backup_chunk_size, remaining))};
+    MemoryBudget::Reservation reservation{co_await backup_memory_budget_.acquire(reservation_size)};
+    while (remaining > 0) {
+        std::span<const uint8_t> chunk{co_await parser.read_payload_chunk(static_cast<size_t>(std::min<uint64_t>(reservation.size(), remaining)))};
+        if (!failed) {
+            try {
+                co_await writer->async_write(*storage_, chunk.data(), chunk.size());
+            } catch (const std::exception& e) {
+                BOOST_LOG_TRIVIAL(error) << "Failed to write backup of file " << request->get_filename() << ": " << e.what();
+                failed = true;
+            }
+        }
+        remaining -= chunk.size();
+        if (remaining == 0 && chunked) {
+            remaining = co_await parser.read_payload_frame_size();
+        }
+    }
+    if (!failed) {
+        std::function<awaitable<void>()> commit = [&]() -> awaitable<void> { co_await writer->async_commit(*storage_); };
+        try {
+            co_await runOnHandlers(commit);
+        } catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to commit backup of file " << request->get_filename() << ": " << e.what();
+            failed = true;
+        }
+    }
+
+    unique_ptr<ProtocolResponse> response;
+    if (failed) {
+        response = boost::make_unique<ServerErrorResponse>(request->get_version());
+    } else {
+        response = boost::make_unique<SuccessfulBackupOrDeleteResponse>(request->get_version(), request->get_filename());
+    }
+    response->set_request_id(request->get_request_id());
+    co_return response;
+}
+
+unique_ptr<ProtocolResponse> Server::deleteFile(unique_ptr<DeleteFileRequest> request) {
     BOOST_LOG_TRIVIAL(info) << "Deleting file: " << request->get_filename() << " for user: " << request->get_user_id();
-    backup_directory_manager_.delete_file_for_user(request->get_user_id(), request->get_filename());
-    SuccessfulBackupOrDeleteResponse response{get_version(), request->get_filename()};
-    connection->send(response.pack().buffer());
+    if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
+    try {
+        backup_directory_manager_.delete_file_for_user(request->get_user_id(), request->get_filename());
+        return boost::make_unique<SuccessfulBackupOrDeleteResponse>(request->get_version(), request->get_filename());
+    } catch (const FileNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename());
+    }
 }
 
-void Server::listFiles(shared_ptr<BoostConnectionManager> connection, unique_ptr<ListFilesRequest> request) {
+unique_ptr<ProtocolResponse> Server::listFiles(unique_ptr<ListFilesRequest> request) {
     BOOST_LOG_TRIVIAL(info) << "Listing files for  " << request->get_user_id();
     try {
         vector<string> user_filenames{backup_directory_manager_.get_backup_filenames_for_user(request->get_user_id())};
@@ -102,72 +189,517 @@ void Server::listFiles(shared_ptr<BoostConnectionManager> connection, unique_ptr
             payload.push_string("\n");
         }
 
-        SuccessfulListFilesResponse response{get_version(), filename, payload};
-        connection->send(response.pack().buffer());
+        return boost::make_unique<SuccessfulListFilesResponse>(request->get_version(), filename, payload);
     } catch (const BackupDirectoryForUserNotFound& e) {
         BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
-        NoBackupFilesForClientResponse response{get_version()};
-        connection->send(response.pack().buffer());
+        return boost::make_unique<NoBackupFilesForClientResponse>(request->get_version());
     }
 }
 
-void Server::restoreFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<RestoreFileRequest> request) {
+Reply Server::restoreFile(unique_ptr<RestoreFileRequest> request) {
     try {
-        BOOST_LOG_TRIVIAL(error) << "restoring file:" << request->get_filename() << " For: " << request->get_user_id();
-        vector<uint8_t> file_content{backup_directory_manager_.get_file_content_for_user(request->get_user_id(), request->get_filename())};
-        utils::Bytearray payload;
-        payload.push_vector(file_content);
+        BOOST_LOG_TRIVIAL(info) << "restoring file:" << request->get_filename() << " For: " << request->get_user_id();
+        if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+            return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+        }
+        unique_ptr<BackupFileReader> file{backup_directory_manager_.open_file_for_restore(request->get_user_id(), request->get_filename())};
+        if (!StreamedRestoreResponse::fits_version(request->get_version(), file->size())) {
+            BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " is too big to restore: " << file->size();
+            return Reply(boost::make_unique<ServerErrorResponse>(request->get_version()));
+        }
 
-        SuccessfulRestoreResponse response{get_version(), request->get_filename(), payload};
-        connection->send(response.pack().buffer());
+        uint64_t payload_size{file->size()};
+        return Reply(boost::make_unique<StreamedRestoreResponse>(request->get_version(), request->get_filename(), payload_size),
+                     std::move(file));
     } catch (const FileNotFoundException& e) {
         BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
-        FileNotFoundResponse response{get_version(), request->get_filename()};
-        connection->send(response.pack().buffer());
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
     }
 }
 
-void Server::handleRequest(shared_ptr<BoostConnectionManager> connection, unique_ptr<ProtocolRequest> request) {
-    if (connection == nullptr || request == nullptr) {
-        throw std::invalid_argument("nullptr arguments to handleRequest");
+Reply Server::restoreFileCompressed(unique_ptr<RestoreFileCompressedRequest> request) {
+    try {
+        BOOST_LOG_TRIVIAL(info) << "restoring file compressed:" << request->get_filename() << " For: " << request->get_user_id();
+        if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+            return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+        }
+        unique_ptr<BackupFileReader> file{backup_directory_manager_.open_file_for_user(request->get_user_id(), request->get_filename())};
+        uint64_t payload_size = file->get_num_stored_segments() * StreamedCompressedRestoreResponse::FRAME_HEADER_SIZE + file->get_stored_size();
+        if (!StreamedRestoreResponse::fits_version(request->get_version(), payload_size)) {
+            BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " is too big to restore: " << payload_size;
+            return Reply(boost::make_unique<ServerErrorResponse>(request->get_version()));
+        }
+
+        Reply reply(boost::make_unique<StreamedCompressedRestoreResponse>(request->get_version(), request->get_filename(),
+                                                                          payload_size),
+                    std::move(file));
+        reply.send_stored = true;
+        return reply;
+    } catch (const FileNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
     }
+}
 
-    RequestOP op{request->get_request_op()};
-    switch (op) {
-        case RequestOP::BACKUP_FILE:
-            backupFile(connection, dynamic_pointer_cast<BackupFileRequest>(std::move(request)));
-            break;
-        case RequestOP::DELETE_FILE:
-            deleteFile(connection, dynamic_pointer_cast<DeleteFileRequest>(std::move(request)));
-            break;
-        case RequestOP::LIST_FILES:
-            listFiles(connection, dynamic_pointer_cast<ListFilesRequest>(std::move(request)));
-            break;
-        case RequestOP::RESTORE_FILE:
-            restoreFile(connection, dynamic_pointer_cast<RestoreFileRequest>(std::move(request)));
-            break;
+static BatchEntryStatus to_batch_entry_status(BatchResult result) {
+    switch (result) {
+        case BatchResult::DONE:
+            return BatchEntryStatus::SUCCESS;
+        case BatchResult::NOT_FOUND:
+            return BatchEntryStatus::FILE_NOT_FOUND;
+        case BatchResult::ALREADY_EXISTS:
+            return BatchEntryStatus::FILE_ALREADY_EXISTS;
+        case BatchResult::TOO_BIG:
+            return BatchEntryStatus::TOO_BIG_FOR_BATCH;
         default:
-            throw InvalidRequestOpToHandleException(request->get_request_op());
+            return BatchEntryStatus::SERVER_ERROR;
     }
 }
 
-shared_ptr<Server> Server::get_server(unsigned short port, bfs::path root_backup_directory) {
-    return shared_ptr<Server>(new Server(port, std::move(root_backup_directory)));
+static vector<BatchEntryStatus> to_batch_entry_statuses(const vector<BatchResult>& results) {
+    vector<BatchEntryStatus> statuses;
+    statuses.reserve(results.size());
+    for (BatchResult result : results) {
+        statuses.push_back(to_batch_entry_status(result));
+    }
+    return statuses;
+}
+
+unique_ptr<ProtocolResponse> Server::backupBatch(unique_ptr<BackupBatchRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Backing up a batch of " << request->get_filenames().size() << " files for user: " << request->get_user_id();
+    vector<BatchResult> results{backup_directory_manager_.backup_files_for_user_id(request->get_user_id(), request->get_filenames(),
+                                                                                   request->get_payloads())};
+    return boost::make_unique<SuccessfulBatchResponse>(request->get_version(), to_batch_entry_statuses(results));
 }
 
-Server::Server(unsigned short port, bfs::path root_backup_directory)
-    : backup_directory_manager_(std::move(root_backup_directory)), port_(port) {
+unique_ptr<ProtocolResponse> Server::restoreBatch(unique_ptr<RestoreBatchRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Restoring a batch of " << request->get_filenames().size() << " files for user: " << request->get_user_id();
+    const vector<string>& filenames{request->get_filenames()};
+    vector<RestoredFile> files;
+    try {
+        // The files are sent in the response itself, so they're capped like the payloads of a backup batch
+        files = backup_directory_manager_.restore_files_for_user(request->get_user_id(), filenames, BatchRequest::MAX_PAYLOADS_SIZE);
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        files.assign(filenames.size(), RestoredFile{BatchResult::NOT_FOUND, {}});
+    }
+
+    vector<BatchEntryStatus> statuses;
+    statuses.reserve(files.size());
+    utils::Bytearray payload;
+    for (const auto& file : files) {
+        statuses.push_back(to_batch_entry_status(file.result));
+        if (file.result == BatchResult::DONE) {
+            // The files are capped at MAX_PAYLOADS_SIZE together, so each one's size fits its u32 field
+            static_assert(BatchRequest::MAX_PAYLOADS_SIZE <= std::numeric_limits<uint32_t>::max());
+            payload.push_u32(static_cast<uint32_t>(file.content.size()));
+            payload.push_vector(file.content);
+        }
+    }
+    return boost::make_unique<SuccessfulBatchResponse>(request->get_version(), std::move(statuses), std::move(payload));
+}
+
+unique_ptr<ProtocolResponse> Server::deleteBatch(unique_ptr<DeleteBatchRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Deleting a batch of " << request->get_filenames().size() << " files for user: " << request->get_user_id();
+    try {
+        vector<BatchResult> results{backup_directory_manager_.delete_files_for_user(request->get_user_id(), request->get_filenames())};
+        return boost::make_unique<SuccessfulBatchResponse>(request->get_version(), to_batch_entry_statuses(results));
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<SuccessfulBatchResponse>(
+            request->get_version(), vector<BatchEntryStatus>(request->get_filenames().size(), BatchEntryStatus::FILE_NOT_FOUND));
+    }
+}
+
+Reply Server::restoreRange(unique_ptr<RestoreRangeRequest> request) {
+    try {
+        BOOST_LOG_TRIVIAL(info) << "restoring range of file:" << request->get_filename() << " For: " << request->get_user_id()
+                                << " offset: " << request->get_offset() << " size: " << request->get_size();
+        if (!backup_directory_manager_.might_have_file(request->get_user_id(), request->get_filename())) {
+            return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+        }
+        unique_ptr<BackupFileReader> file{backup_directory_manager_.open_file_for_restore(request->get_user_id(), request->get_filename())};
+        uint64_t file_size{file->size()};
+        uint64_t offset{std::min(request->get_offset(), file_size)};
+        // The range is at most the request's u32 size, so it's cut off to the end of the file without casting that down
+        uint32_t payload_size{request->get_size()};
+        if (file_size - offset < payload_size) {
+            payload_size = static_cast<uint32_t>(file_size - offset);
+        }
+        Reply reply(boost::make_unique<StreamedRangeRestoreResponse>(request->get_version(), request->get_filename(), file_size,
+                                                                     offset, payload_size),
+                    std::move(file));
+        reply.body_offset = offset;
+        reply.body_size = payload_size;
+        return reply;
+    } catch (const FileNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " Not found for user: " << request->get_user_id();
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return Reply(boost::make_unique<FileNotFoundResponse>(request->get_version(), request->get_filename()));
+    }
+}
+
+static vector<std::pair<uint64_t, uint64_t>> get_committed_ranges(const UploadStatus& status) {
+    vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(status.committed.size());
+    for (const auto& range : status.committed) {
+        ranges.emplace_back(range.offset, range.size);
+    }
+    return ranges;
+}
+
+unique_ptr<ProtocolResponse> Server::beginUpload(unique_ptr<BeginUploadRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Beginning upload of file: " << request->get_filename() << " for user: " << request->get_user_id()
+                            << " size: " << request->get_size();
+    try {
+        UploadStatus status{backup_directory_manager_.begin_upload_for_user(request->get_user_id(), request->get_filename(), request->get_size())};
+        return boost::make_unique<UploadStatusResponse>(request->get_version(), status.token, status.size, get_committed_ranges(status));
+    } catch (const FileAlreadyExistsException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Filename " << request->get_filename() << " already exists for user: " << request->get_user_id();
+        return boost::make_unique<FileAlreadyExistsResponse>(request->get_version(), request->get_filename());
+    } catch (const TooManyUploadsException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has too many uploads: " << e.what();
+        return boost::make_unique<TooManyUploadsResponse>(request->get_version());
+    }
+}
+
+unique_ptr<ProtocolResponse> Server::uploadPart(unique_ptr<UploadPartRequest> request) {
+    const vector<uint8_t>& payload{request->get_payload()};
+    try {
+        UploadStatus status{backup_directory_manager_.write_upload_part_for_user(request->get_user_id(), request->get_token(),
+                                                                                 request->get_offset(), payload.data(), payload.size())};
+        return boost::make_unique<UploadStatusResponse>(request->get_version(), status.token, status.size, get_committed_ranges(status));
+    } catch (const UploadPartOutOfRangeException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Invalid part for user: " << request->get_user_id() << ": " << e.what();
+        return boost::make_unique<InvalidUploadPartResponse>(request->get_version(), request->get_token());
+    } catch (const UploadNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Upload " << request->get_token() << " not found for user: " << request->get_user_id();
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    }
+}
+
+unique_ptr<ProtocolResponse> Server::getUploadStatus(unique_ptr<GetUploadStatusRequest> request) {
+    try {
+        UploadStatus status{backup_directory_manager_.get_upload_status_for_user(request->get_user_id(), request->get_token())};
+        return boost::make_unique<UploadStatusResponse>(request->get_version(), status.token, status.size, get_committed_ranges(status));
+    } catch (const UploadNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Upload " << request->get_token() << " not found for user: " << request->get_user_id();
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    }
+}
+
+unique_ptr<ProtocolResponse> Server::finishUpload(unique_ptr<FinishUploadRequest> request) {
+    BOOST_LOG_TRIVIAL(info) << "Finishing upload " << request->get_token() << " for user: " << request->get_user_id();
+    try {
+        UploadStatus status{backup_directory_manager_.finish_upload_for_user(request->get_user_id(), request->get_token())};
+        if (!status.is_complete()) {
+            return boost::make_unique<IncompleteUploadResponse>(request->get_version(), status.token, status.size,
+                                                                get_committed_ranges(status));
+        }
+        return boost::make_unique<SuccessfulBackupOrDeleteResponse>(request->get_version(), status.filename);
+    } catch (const FileAlreadyExistsException& e) {
+        // The file was backed up some other way while it was uploaded. The upload is left, so the client may delete
+        // the file and finish it again
+        BOOST_LOG_TRIVIAL(error) << "Filename " << e.get_filename() << " already exists for user: " << request->get_user_id();
+        return boost::make_unique<FileAlreadyExistsResponse>(request->get_version(), e.get_filename());
+    } catch (const UploadNotFoundException& e) {
+        BOOST_LOG_TRIVIAL(error) << "Upload " << request->get_token() << " not found for user: " << request->get_user_id();
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    } catch (const BackupDirectoryForUserNotFound& e) {
+        BOOST_LOG_TRIVIAL(error) << "Client " << request->get_user_id() << " has no backup files";
+        return boost::make_unique<UploadNotFoundResponse>(request->get_version(), request->get_token());
+    }
+}
+
+Reply Server::handleRequest(unique_ptr<ProtocolRequest> request) {
+    if (request == nullptr) {
+        throw std::invalid_argument("nullptr arguments to handleRequest");
+    }
+
+    RequestID request_id{request->get_request_id()};
+    Reply reply{request_router_.route(std::move(request))};
+
+    // Pipelining clients match responses to requests by this
+    reply.response->set_request_id(request_id);
+    return reply;
+}
+
+awaitable<Reply> Server::asyncHandleRequest(unique_ptr<ProtocolRequest> request) {
+    // A Reply can't be default constructed, which co_spawn needs for a result, so it's passed out through here
+    std::optional<Reply> reply;
+    std::function<awaitable<void>()> handle = [&]() -> awaitable<void> {
+        reply.emplace(handleRequest(std::move(request)));
+        co_return;
+    };
+    co_await runOnHandlers(handle);
+    co_return std::move(*reply);
+}
+
+awaitable<void> Server::runOnHandlers(const std::function<awaitable<void>()>& work) {
+    co_await boost::asio::co_spawn(handler_pool_, work, boost::asio::use_awaitable);
+}
+
+awaitable<void> Server::sendReply(BoostConnectionManager& connection, const Reply& reply) const {
+    ResponseBuffers buffers{*reply.response};
+    co_await connection.async_send(buffers.buffers());
+    if (reply.file_body == nullptr) {
+        co_return;
+    }
+
+    const BackupFileReader& file{*reply.file_body};
+    vector<uint8_t> chunk;
+    if (reply.send_stored) {
+        for (size_t i = 0; i < file.get_num_stored_segments(); i++) {
+            StoredSegment segment{file.get_stored_segment(i)};
+            utils::Bytearray header;
+            header.push_u8(static_cast<uint8_t>(segment.encoding));
+            // The readers keep their stored segments within BackupFileReader::MAX_STORED_SEGMENT_SIZE
+            header.push_u32(static_cast<uint32_t>(segment.size));
+            header.push_u32(static_cast<uint32_t>(segment.stored.size));
+            boost::asio::const_buffer buffer(header.data(), header.len());
+            co_await connection.async_send(std::span<const boost::asio::const_buffer>(&buffer, 1));
+            co_await sendSegment(connection, file, segment.stored, chunk);
+        }
+        co_return;
+    }
+
+    uint64_t offset = reply.body_offset;
+    uint64_t end = reply.body_size ? offset + *reply.body_size : file.size();
+    // A deduplicated file is made of segments in different chunk files, a plain one is a single segment
+    while (offset < end) {
+        FileSegment segment{file.get_segment(offset)};
+        segment.size = std::min(segment.size, end - offset);
+        offset += segment.size;
+        co_await sendSegment(connection, file, segment, chunk);
+    }
+}
+
+awaitable<void> Server::sendSegment(BoostConnectionManager& connection, const BackupFileReader& file, FileSegment segment,
+                                    vector<uint8_t>& chunk) const {
+    if (segment.data != nullptr) {
+        // A decompressed segment
+        boost::asio::const_buffer buffer(segment.data, segment.size);
+        co_await connection.async_send(std::span<const boost::asio::const_buffer>(&buffer, 1));
+        co_return;
+    }
+
+    uint64_t segment_end = segment.offset + segment.size;
+    if (options_.zero_copy_restore) {
+        segment.offset += co_await connection.async_sendfile(segment.fd, segment.offset, segment.size);
+    }
+
+    // Whatever sendfile didn't send is read through the storage backend and sent in chunks
+    if (segment.offset < segment_end && chunk.empty()) {
+        chunk.resize(static_cast<size_t>(std::min<uint64_t>(std::max<size_t>(options_.restore_chunk_size, 1), file.size())));
+    }
+    while (segment.offset < segment_end) {
+        size_t to_read = static_cast<size_t>(std::min<uint64_t>(chunk.size(), segment_end - segment.offset));
+        size_t bytes_read = co_await storage_->read(segment.fd, chunk.data(), to_read, segment.offset);
+        if (bytes_read == 0) {
+            throw FailedToReadFileException(file.get_path());
+        }
+        boost::asio::const_buffer buffer(chunk.data(), bytes_read);
+        co_await connection.async_send(std::span<const boost::asio::const_buffer>(&buffer, 1));
+        segment.offset += bytes_read;
+    }
+}
+
+shared_ptr<Server> Server::get_server(unsigned short port, bfs::path root_backup_directory, ServerOptions options) {
+    return shared_ptr<Server>(new Server(port, std::move(root_backup_directory), std::move(options)));
+}
+
+Server::Server(unsigned short port, bfs::path root_backup_directory, ServerOptions options)
+    : backup_directory_manager_(std::move(root_backup_directory), BackupDirectoryManager::DEFAULT_NUM_SHARDS, options.deduplication,
+                                options.packing, options.restore_cache, options.lookup_filter,
+                                options.group_commit),
+      port_(port),
+      options_(std::move(options)),
+      backup_memory_budget_(options_.max_backup_memory),
+      storage_(make_storage(options_)),
+      handler_pool_(std::max<size_t>(options_.handler_threads, 1)),
+      io_context_(static_cast<int>(options_.num_threads)),
+      acceptor_(io_context_) {
     BOOST_LOG_TRIVIAL(info) << "Backup directory is: " << backup_directory_manager_.get_root_backup_directory();
+    BOOST_LOG_TRIVIAL(info) << "Storage backend is: " << storage_->name();
+    StartupReport report = backup_directory_manager_.load_existing_users(options_.startup_scan_threads,
+                                                                         options_.index_snapshot ? get_snapshot_path() : bfs::path());
+    BOOST_LOG_TRIVIAL(info) << "Existing backups loaded: " << report.to_string();
+    register_versions();
 }
 
-void Server::serve_requests() {
-    io_service io;
-    tcp::acceptor a(io, tcp::endpoint(tcp::v4(), port_));
+void Server::register_versions() {
+    for (const ProtocolRevision& revision : PROTOCOL_REVISIONS) {
+        request_router_.register_version(revision.version, get_handlers(revision.version));
+    }
+    BOOST_LOG_TRIVIAL(info) << "Protocol versions: " << std::to_string(get_min_version()) << " to "
+                            << std::to_string(get_max_version());
+}
 
-    BOOST_LOG_TRIVIAL(info) << "Starting to serve requests";
-    for (;;) {
-        unique_ptr<tcp::socket> client_socket = unique_ptr<tcp::socket>(new tcp::socket(io));
-        a.accept(*client_socket);
-        std::thread(client_session, shared_from_this(), std::move(client_socket)).detach();
+RequestRouter::HandlerTable Server::get_handlers(ProtocolVersion version) {
+    // The requests of the original protocol
+    RequestRouter::HandlerTable handlers{
+        {RequestOP::BACKUP_FILE, bind_handler(this, &Server::backupFile)},
+        {RequestOP::DELETE_FILE, bind_handler(this, &Server::deleteFile)},
+        {RequestOP::LIST_FILES, bind_handler(this, &Server::listFiles)},
+        {RequestOP::RESTORE_FILE, bind_handler(this, &Server::restoreFile)},
     };
+    // A version has every request of the versions before it, and a version that changes a request
+    // registers its own handler for it
+    if (version >= PROTOCOL_VERSION_2) {
+        handlers.insert({
+            {RequestOP::BACKUP_DELTA, bind_handler(this, &Server::backupDelta)},
+            {RequestOP::GET_SIGNATURES, bind_handler(this, &Server::getSignatures)},
+            {RequestOP::RESTORE_FILE_COMPRESSED, bind_handler(this, &Server::restoreFileCompressed)},
+            {RequestOP::BACKUP_BATCH, bind_handler(this, &Server::backupBatch)},
+            {RequestOP::RESTORE_BATCH, bind_handler(this, &Server::restoreBatch)},
+            {RequestOP::DELETE_BATCH, bind_handler(this, &Server::deleteBatch)},
+        });
+    }
+    // Ranges and uploads are for the big files that only fit version 3's sizes
+    if (version >= PROTOCOL_VERSION_3) {
+        handlers.insert({
+            {RequestOP::RESTORE_RANGE, bind_handler(this, &Server::restoreRange)},
+            {RequestOP::BEGIN_UPLOAD, bind_handler(this, &Server::beginUpload)},
+            {RequestOP::UPLOAD_PART, bind_handler(this, &Server::uploadPart)},
+            {RequestOP::GET_UPLOAD_STATUS, bind_handler(this, &Server::getUploadStatus)},
+            {RequestOP::FINISH_UPLOAD, bind_handler(this, &Server::finishUpload)},
+        });
+    }
+    return handlers;
+}
+
+unique_ptr<StorageBackend> Server::make_storage(const ServerOptions& options) {
+    try {
+        return make_storage_backend(options.storage_backend, options.storage_threads, options.storage_queue_depth);
+    } catch (const StorageBackendUnavailableException& e) {
+        BOOST_LOG_TRIVIAL(warning) << "Storage backend unavailable, falling back to the thread pool: " << e.what();
+        return make_storage_backend(StorageBackendType::THREAD_POOL, options.storage_threads, options.storage_queue_depth);
+    }
+}
+
+awaitable<void> Server::accept_clients() {
+    boost::asio::steady_timer retry_timer(io_context_);
+    for (;;) {
+        bool failed{false};
+        try {
+            // Each client gets its own strand, so its session and its idle timer never run concurrently
+            tcp::socket client_socket = co_await acceptor_.async_accept(boost::asio::make_strand(io_context_), boost::asio::use_awaitable);
+            session_statistics_.on_connection_accepted();
+            // A response is written in pieces, and a small one shouldn't wait for the ack of its header
+            // on a keep-alive connection
+            client_socket.set_option(tcp::no_delay(true));
+            auto executor = client_socket.get_executor();
+            boost::asio::co_spawn(executor, client_session(shared_from_this(), std::move(client_socket)), boost::asio::detached);
+        } catch (const boost::system::system_error& e) {
+            BOOST_LOG_TRIVIAL(error) << "Failed accepting client: " << e.what();
+            failed = true;
+        }
+        if (failed) {
+            retry_timer.expires_after(options_.accept_retry_delay);
+            co_await retry_timer.async_wait(boost::asio::use_awaitable);
+        }
+    }
+}
+
+awaitable<void> Server::report_statistics() {
+    boost::asio::steady_timer timer(io_context_);
+    for (;;) {
+        timer.expires_after(options_.statistics_interval);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        BOOST_LOG_TRIVIAL(info) << "Session statistics: " << session_statistics_.to_string();
+        BOOST_LOG_TRIVIAL(info) << "Protocol version statistics: " << request_router_.get_statistics().to_string();
+        BOOST_LOG_TRIVIAL(info) << "Backup directory lock statistics: " << backup_directory_manager_.get_lock_statistics().to_string();
+        BOOST_LOG_TRIVIAL(info) << "Backup index statistics: " << backup_directory_manager_.get_index_statistics().to_string();
+        if (const ChunkStore* chunk_store = backup_directory_manager_.get_chunk_store()) {
+            BOOST_LOG_TRIVIAL(info) << "Chunk store statistics: " << chunk_store->get_statistics().to_string();
+        }
+        if (auto pack_statistics = backup_directory_manager_.get_pack_statistics()) {
+            BOOST_LOG_TRIVIAL(info) << "Pack store statistics: " << pack_statistics->to_string();
+        }
+        if (const RestoreCache* restore_cache = backup_directory_manager_.get_restore_cache()) {
+            BOOST_LOG_TRIVIAL(info) << "Restore cache statistics: " << restore_cache->get_statistics().to_string();
+        }
+        if (const MembershipFilter* lookup_filter = backup_directory_manager_.get_lookup_filter()) {
+            BOOST_LOG_TRIVIAL(info) << "Lookup filter statistics: " << lookup_filter->get_statistics().to_string();
+        }
+        if (auto group_commit_statistics = backup_directory_manager_.get_group_commit_statistics()) {
+            BOOST_LOG_TRIVIAL(info) << "Group commit statistics: " << group_commit_statistics->to_string();
+        }
+    }
+}
+
+awaitable<void> Server::compact_packs() {
+    boost::asio::steady_timer timer(io_context_);
+    auto compact = [this]() -> awaitable<size_t> { co_return backup_directory_manager_.compact_packs(); };
+    for (;;) {
+        timer.expires_after(options_.compaction_interval);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        try {
+            size_t num_compacted = co_await boost::asio::co_spawn(handler_pool_, compact, boost::asio::use_awaitable);
+            if (num_compacted > 0) {
+                BOOST_LOG_TRIVIAL(info) << "Compacted " << num_compacted << " pack segments";
+            }
+        } catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << "Failed compacting the pack stores: " << e.what();
+        }
+    }
+}
+
+void Server::serve_requests() {
+    tcp::endpoint endpoint(tcp::v4(), port_);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    boost::asio::co_spawn(io_context_, accept_clients(), boost::asio::detached);
+    boost::asio::co_spawn(io_context_, report_statistics(), boost::asio::detached);
+    if (options_.packing) {
+        boost::asio::co_spawn(io_context_, compact_packs(), boost::asio::detached);
+    }
+
+    boost::asio::signal_set signals(io_context_, SIGINT, SIGTERM);
+    signals.async_wait([this](const boost::system::error_code& error, int signal_number) {
+        if (!error) {
+            BOOST_LOG_TRIVIAL(info) << "Got signal " << signal_number << ", stopping";
+            io_context_.stop();
+        }
+    });
+
+    // hardware_concurrency() may return 0 if it can't tell
+    size_t num_threads = std::max<size_t>(options_.num_threads, 1);
+    BOOST_LOG_TRIVIAL(info) << "Starting to serve requests on " << num_threads << " threads";
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < num_threads; i++) {
+        workers.emplace_back([this]() { io_context_.run(); });
+    }
+    io_context_.run();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    // The handlers that are still running finish before the index is saved
+    handler_pool_.join();
+
+    if (options_.index_snapshot) {
+        try {
+            backup_directory_manager_.save_snapshot(get_snapshot_path());
+            BOOST_LOG_TRIVIAL(info) << "Saved the backup index snapshot";
+        } catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to save the backup index snapshot: " << e.what();
+        }
+    }
 }
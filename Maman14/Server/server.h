@@ -1,35 +1,225 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <thread>
 
+#include "async_request_parser.h"
 #include "backup_directory_manager.h"
 #include "boost_connection_manager.h"
+#include "memory_budget.h"
 #include "protocol/common.h"
-#include "request_parser.h"
+#include "protocol/response.h"
+#include "reply.h"
+#include "request_router.h"
+#include "session_statistics.h"
+#include "storage_backend.h"
 
 namespace bfs = boost::filesystem;
+using boost::asio::awaitable;
+using boost::asio::io_context;
 using boost::asio::ip::tcp;
 using std::shared_ptr;
 
+struct ServerOptions {
+    // Number of threads running the io_context
+    size_t num_threads = std::thread::hardware_concurrency();
+
+    // How long a keep-alive connection may sit without progress before we close it.
+    // Only clients of a version with keep-alive (2 and up) get it, version 1 connections serve a single request.
+    // Zero disables keep-alive for every version
+    std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds(30);
+
+    // How long to wait after a failed accept before accepting again. Failures like running out of fds last
+    // until some connections are closed, and retrying right away would only spin and flood the log
+    std::chrono::steady_clock::duration accept_retry_delay = std::chrono::milliseconds(100);
+
+    // How many requests of a pipelining (version 2) connection may be handled or waiting
+    // to be written at once, before we stop reading more requests from it
+    size_t max_pipelined_requests = 128;
+
+    // Threads that run the handlers of the requests. The handlers do blocking disk I/O and syncs,
+    // so they run here and the io_context's threads are left to serve the connections
+    size_t handler_threads = 4;
+
+    // BACKUP_FILE payloads are streamed to disk in chunks of this size
+    size_t backup_chunk_size = 64 * 1024;
+
+    // The most memory all streamed backups may use together for their chunks, along with the deltas, batches
+    // and upload parts that were read and wait to be handled
+    size_t max_backup_memory = 64 * 1024 * 1024;
+
+    // RESTORE_FILE sends the file with sendfile, so its content is never copied into our memory
+    bool zero_copy_restore = true;
+
+    // Files that can't be sent with sendfile are read and sent in chunks of this size
+    size_t restore_chunk_size = 64 * 1024;
+
+    // Which backend does the file I/O of backups and restores. If io_uring isn't available
+    // we fall back to the thread pool
+    StorageBackendType storage_backend = StorageBackendType::IO_URING;
+
+    // Threads of the thread pool storage backend
+    size_t storage_threads = 4;
+
+    // How many operations the io_uring storage backend keeps submitted at once
+    unsigned storage_queue_depth = 256;
+
+    // How to deduplicate new backups in the content-addressed chunk store, or nothing to store them as they are
+    std::optional<ChunkStoreOptions> deduplication = ChunkStoreOptions();
+
+    // How to pack small files into the segments of each user's pack store, or nothing to store each of them
+    // in a file of its own
+    std::optional<PackStoreOptions> packing = PackStoreOptions();
+
+    // How often the segments of the pack stores that are mostly deleted are compacted
+    std::chrono::steady_clock::duration compaction_interval = std::chrono::minutes(5);
+
+    // How to cache the content of the files that are restored over and over, or nothing to always read them.
+    // Compressed restores aren't cached, they're sent as the chunks are stored
+    std::optional<RestoreCacheOptions> restore_cache = RestoreCacheOptions();
+
+    // How big the filter of the users' filenames is, which answers requests for files that were never backed up
+    // without looking them up, or nothing to always look them up
+    std::optional<MembershipFilterOptions> lookup_filter = MembershipFilterOptions();
+
+    // How to batch the syncs of concurrent backups, which are only acknowledged once they're durable,
+    // or nothing to sync each backup on its own
+    std::optional<GroupCommitOptions> group_commit = GroupCommitOptions();
+
+    // How many threads scan the existing backups on startup
+    size_t startup_scan_threads = std::thread::hardware_concurrency();
+
+    // Save the backup index to a snapshot when the server is stopped, and load it on the next start
+    // instead of scanning all of the backups
+    bool index_snapshot = true;
+
+    // How often the session statistics are logged
+    std::chrono::steady_clock::duration statistics_interval = std::chrono::minutes(1);
+};
+
 class Server : public std::enable_shared_from_this<Server> {
 public:
     // TODO: change this to C:\backsrv for windows
-    static shared_ptr<Server> get_server(unsigned short port, bfs::path root_backup_directory = bfs::temp_directory_path());
+    static shared_ptr<Server> get_server(unsigned short port,
+                                         bfs::path root_backup_directory = bfs::temp_directory_path(),
+                                         ServerOptions options = ServerOptions());
+
+    /**
+     * @brief Accept clients asynchronously and serve them on a pool of threads
+     * that all run the same io_context. Blocks until the server gets SIGINT or SIGTERM.
+     *
+     */
     void serve_requests();
-    void handleRequest(shared_ptr<BoostConnectionManager> connection, unique_ptr<ProtocolRequest> request);
+
+    /**
+     * @brief Make serve_requests return, like SIGINT does. May be called from any thread
+     *
+     */
+    void stop() { io_context_.stop(); };
+    Reply handleRequest(unique_ptr<ProtocolRequest> request);
+
+    /**
+     * @brief Handle the request on the handler pool, and resume on the caller's executor with its reply
+     *
+     */
+    awaitable<Reply> asyncHandleRequest(unique_ptr<ProtocolRequest> request);
+
+    /**
+     * @brief Write a reply to the client: the packed response, and then the content of the file body if there is one
+     *
+     */
+    awaitable<void> sendReply(BoostConnectionManager& connection, const Reply& reply) const;
+
+    /**
+     * @brief Handle a BACKUP_FILE request whose payload was left on the connection.
+     * The payload is read in chunks straight into the backup file, so the memory used
+     * doesn't depend on the size of the file.
+     * A backup that fails is answered with a ServerErrorResponse of its request, only the errors of reading
+     * the payload off the connection are thrown
+     *
+     * @param request The backup request, parsed with stream_payloads
+     * @param parser The parser the request was read from
+     */
+    awaitable<unique_ptr<ProtocolResponse>> streamBackupFile(unique_ptr<ProtocolRequest> request, AsyncRequestParser& parser);
 
     unsigned short get_port() const { return port_; };
-    ProtocolVersion get_version() const { return PROTOCOL_VERSION_; };
+    ProtocolVersion get_min_version() const { return request_router_.get_min_version(); };
+    ProtocolVersion get_max_version() const { return request_router_.get_max_version(); };
+    const RequestRouter& get_request_router() const { return request_router_; };
+    io_context::executor_type get_executor() { return io_context_.get_executor(); };
+    // Where the handlers of the requests run, see ServerOptions::handler_threads
+    boost::asio::thread_pool::executor_type get_handler_executor() { return handler_pool_.get_executor(); };
+    const ServerOptions& get_options() const { return options_; };
+    bool is_keep_alive() const { return options_.idle_timeout != std::chrono::steady_clock::duration::zero(); };
+    SessionStatistics& get_session_statistics() { return session_statistics_; };
+    // Sessions reserve the payloads they read into their requests from it, see max_backup_memory
+    MemoryBudget& get_backup_memory_budget() { return backup_memory_budget_; };
 
 private:
-    Server(unsigned short port, bfs::path root_backup_directory);
-    void backupFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<BackupFileRequest> request);
-    void deleteFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<DeleteFileRequest> request);
-    void listFiles(shared_ptr<BoostConnectionManager> connection, unique_ptr<ListFilesRequest> request);
-    void restoreFile(shared_ptr<BoostConnectionManager> connection, unique_ptr<RestoreFileRequest> request);
+    Server(unsigned short port, bfs::path root_backup_directory, ServerOptions options);
+    static unique_ptr<StorageBackend> make_storage(const ServerOptions& options);
+
+    /**
+     * @brief Run work that blocks, on the disk or on locks, on the handler pool instead of the io threads,
+     * and resume on the caller's executor once it's done
+     *
+     */
+    awaitable<void> runOnHandlers(const std::function<awaitable<void>()>& work);
+
+    /**
+     * @brief Register every version of the protocol we serve with the handlers of its requests.
+     * Version 1 is never dropped, the original client speaks it
+     *
+     */
+    void register_versions();
+    // The requests the version has, which a client of an older version can't send
+    RequestRouter::HandlerTable get_handlers(ProtocolVersion version);
+    awaitable<void> accept_clients();
+    awaitable<void> report_statistics();
+
+    /**
+     * @brief Compact the pack stores every compaction interval. Each compaction runs on the handler pool,
+     * so the io_context's threads keep serving requests
+     *
+     */
+    awaitable<void> compact_packs();
+    bfs::path get_snapshot_path() const { return backup_directory_manager_.get_root_backup_directory() / ".index_snapshot"; };
+    unique_ptr<ProtocolResponse> backupFile(unique_ptr<BackupFileRequest> request);
+    unique_ptr<ProtocolResponse> backupDelta(unique_ptr<BackupDeltaRequest> request);
+    unique_ptr<ProtocolResponse> getSignatures(unique_ptr<GetSignaturesRequest> request);
+    unique_ptr<ProtocolResponse> deleteFile(unique_ptr<DeleteFileRequest> request);
+    unique_ptr<ProtocolResponse> listFiles(unique_ptr<ListFilesRequest> request);
+    Reply restoreFile(unique_ptr<RestoreFileRequest> request);
+    Reply restoreFileCompressed(unique_ptr<RestoreFileCompressedRequest> request);
+    unique_ptr<ProtocolResponse> backupBatch(unique_ptr<BackupBatchRequest> request);
+    unique_ptr<ProtocolResponse> restoreBatch(unique_ptr<RestoreBatchRequest> request);
+    unique_ptr<ProtocolResponse> deleteBatch(unique_ptr<DeleteBatchRequest> request);
+    Reply restoreRange(unique_ptr<RestoreRangeRequest> request);
+    unique_ptr<ProtocolResponse> beginUpload(unique_ptr<BeginUploadRequest> request);
+    unique_ptr<ProtocolResponse> uploadPart(unique_ptr<UploadPartRequest> request);
+    unique_ptr<ProtocolResponse> getUploadStatus(unique_ptr<GetUploadStatusRequest> request);
+    unique_ptr<ProtocolResponse> finishUpload(unique_ptr<FinishUploadRequest> request);
+
+    /**
+     * @brief Send a segment of a restored file: from memory, with sendfile, or read in chunks when sendfile can't
+     *
+     * @param chunk A buffer for the chunks, allocated when it's first needed
+     */
+    awaitable<void> sendSegment(BoostConnectionManager& connection, const BackupFileReader& file, FileSegment segment,
+                                vector<uint8_t>& chunk) const;
 
     BackupDirectoryManager backup_directory_manager_;
     unsigned short port_;
-    static const ProtocolVersion PROTOCOL_VERSION_{1};
+    ServerOptions options_;
+    SessionStatistics session_statistics_;
+    MemoryBudget backup_memory_budget_;
+    unique_ptr<StorageBackend> storage_;
+    boost::asio::thread_pool handler_pool_;
+    io_context io_context_;
+    tcp::acceptor acceptor_;
+    RequestRouter request_router_;
 };
@@ -0,0 +1,15 @@
+#include "session_statistics.h"
+
+void SessionStatistics::on_request_served(size_t requests_on_connection) {
+    requests_++;
+    if (requests_on_connection > 1) {
+        reused_requests_++;
+    }
+}
+
+string SessionStatistics::to_string() const {
+    return "connections: " + std::to_string(get_connections()) +
+           " requests: " + std::to_string(get_requests()) +
+           " reused connection requests: " + std::to_string(get_reused_requests()) +
+           " idle timeouts: " + std::to_string(get_idle_timeouts());
+}
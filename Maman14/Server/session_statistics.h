@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+using std::string;
+
+/**
+ * @brief Counters of how client connections are used.
+ * Every request after the first on a connection is a reuse, and saved us a handshake
+ *
+ */
+class SessionStatistics {
+public:
+    void on_connection_accepted() { connections_++; };
+
+    /**
+     * @brief Count a request that was served
+     *
+     * @param requests_on_connection How many requests the connection served including this one
+     */
+    void on_request_served(size_t requests_on_connection);
+    void on_idle_timeout() { idle_timeouts_++; };
+
+    uint64_t get_connections() const { return connections_; };
+    uint64_t get_requests() const { return requests_; };
+    uint64_t get_reused_requests() const { return reused_requests_; };
+    uint64_t get_idle_timeouts() const { return idle_timeouts_; };
+
+    string to_string() const;
+
+private:
+    std::atomic<uint64_t> connections_{0};
+    std::atomic<uint64_t> requests_{0};
+    std::atomic<uint64_t> reused_requests_{0};
+    std::atomic<uint64_t> idle_timeouts_{0};
+};
@@ -0,0 +1,222 @@
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAS_SHA_EXTENSIONS_PATH 1
+#endif
+
+namespace utils {
+
+static const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const std::array<uint32_t, 8> INITIAL_STATE = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t rotate_right(uint32_t value, unsigned bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void compress_portable(uint32_t* state, const uint8_t* data, size_t num_blocks) {
+    for (; num_blocks > 0; num_blocks--, data += Sha256::BLOCK_SIZE) {
+        uint32_t w[64];
+        for (size_t i = 0; i < 16; i++) {
+            w[i] = (static_cast<uint32_t>(data[4 * i]) << 24) | (static_cast<uint32_t>(data[4 * i + 1]) << 16) |
+                   (static_cast<uint32_t>(data[4 * i + 2]) << 8) | static_cast<uint32_t>(data[4 * i + 3]);
+        }
+        for (size_t i = 16; i < 64; i++) {
+            uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (size_t i = 0; i < 64; i++) {
+            uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+            uint32_t choose = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + s1 + choose + ROUND_CONSTANTS[i] + w[i];
+            uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = s0 + majority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef HAS_SHA_EXTENSIONS_PATH
+__attribute__((target("sha,sse4.1"))) static void compress_sha_extensions(uint32_t* state, const uint8_t* data, size_t num_blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i temp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    temp = _mm_shuffle_epi32(temp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    __m128i state0 = _mm_alignr_epi8(temp, state1, 8);
+    state1 = _mm_blend_epi16(state1, temp, 0xf0);
+
+    for (; num_blocks > 0; num_blocks--, data += Sha256::BLOCK_SIZE) {
+        __m128i saved0 = state0;
+        __m128i saved1 = state1;
+        // The message words of the last four groups of four rounds
+        __m128i messages[4];
+        for (size_t group = 0; group < 16; group++) {
+            if (group < 4) {
+                messages[group] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * group)), byte_swap);
+            }
+            __m128i& current = messages[group % 4];
+            __m128i& previous = messages[(group + 3) % 4];
+            __m128i& next = messages[(group + 1) % 4];
+
+            __m128i words = _mm_add_epi32(current, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ROUND_CONSTANTS[4 * group])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (group >= 3 && group <= 14) {
+                next = _mm_add_epi32(next, _mm_alignr_epi8(current, previous, 4));
+                next = _mm_sha256msg2_epu32(next, current);
+            }
+            words = _mm_shuffle_epi32(words, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+            if (group >= 1 && group <= 12) {
+                previous = _mm_sha256msg1_epu32(previous, current);
+            }
+        }
+        state0 = _mm_add_epi32(state0, saved0);
+        state1 = _mm_add_epi32(state1, saved1);
+    }
+
+    temp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(temp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, temp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+static bool has_sha_extensions() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    bool sha = ebx & (1u << 29);
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    bool sse41 = ecx & (1u << 19);
+    bool ssse3 = ecx & (1u << 9);
+    return sha && sse41 && ssse3;
+}
+#endif
+
+static void compress(uint32_t* state, const uint8_t* data, size_t num_blocks) {
+#ifdef HAS_SHA_EXTENSIONS_PATH
+    static const bool use_sha_extensions = has_sha_extensions();
+    if (use_sha_extensions) {
+        compress_sha_extensions(state, data, num_blocks);
+        return;
+    }
+#endif
+    compress_portable(state, data, num_blocks);
+}
+
+Sha256::Sha256() {
+    reset();
+}
+
+void Sha256::reset() {
+    state_ = INITIAL_STATE;
+    block_size_ = 0;
+    total_size_ = 0;
+}
+
+void Sha256::update(const uint8_t* data, size_t size) {
+    total_size_ += size;
+    if (block_size_ > 0) {
+        size_t to_copy = std::min(size, BLOCK_SIZE - block_size_);
+        std::memcpy(block_.data() + block_size_, data, to_copy);
+        block_size_ += to_copy;
+        data += to_copy;
+        size -= to_copy;
+        if (block_size_ < BLOCK_SIZE) {
+            return;
+        }
+        compress(state_.data(), block_.data(), 1);
+        block_size_ = 0;
+    }
+
+    size_t num_blocks = size / BLOCK_SIZE;
+    if (num_blocks > 0) {
+        compress(state_.data(), data, num_blocks);
+        data += num_blocks * BLOCK_SIZE;
+        size -= num_blocks * BLOCK_SIZE;
+    }
+    std::memcpy(block_.data(), data, size);
+    block_size_ = size;
+}
+
+Sha256::Digest Sha256::finish() {
+    uint64_t total_bits = total_size_ * 8;
+    uint8_t padding[BLOCK_SIZE * 2] = {0x80};
+    // Pad up to 8 bytes before the end of a block, and then the length
+    size_t padding_size = (block_size_ < BLOCK_SIZE - 8 ? BLOCK_SIZE : 2 * BLOCK_SIZE) - block_size_;
+    for (size_t i = 0; i < 8; i++) {
+        padding[padding_size - 1 - i] = static_cast<uint8_t>(total_bits >> (8 * i));
+    }
+    update(padding, padding_size);
+
+    Digest digest;
+    for (size_t i = 0; i < state_.size(); i++) {
+        digest[4 * i] = static_cast<uint8_t>(state_[i] >> 24);
+        digest[4 * i + 1] = static_cast<uint8_t>(state_[i] >> 16);
+        digest[4 * i + 2] = static_cast<uint8_t>(state_[i] >> 8);
+        digest[4 * i + 3] = static_cast<uint8_t>(state_[i]);
+    }
+    return digest;
+}
+
+Sha256::Digest Sha256::hash(const uint8_t* data, size_t size) {
+    Sha256 sha;
+    sha.update(data, size);
+    return sha.finish();
+}
+
+std::string Sha256::to_hex(const Digest& digest) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (uint8_t byte : digest) {
+        hex.push_back(HEX_DIGITS[byte >> 4]);
+        hex.push_back(HEX_DIGITS[byte & 0xf]);
+    }
+    return hex;
+}
+
+}  // namespace utils
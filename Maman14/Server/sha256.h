@@ -0,0 +1,40 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace utils {
+
+/**
+ * @brief Incremental SHA-256, used to address backup chunks by their content.
+ * Uses the CPU's SHA extensions when it has them
+ *
+ */
+class Sha256 {
+public:
+    typedef std::array<uint8_t, 32> Digest;
+    static const size_t BLOCK_SIZE = 64;
+
+    Sha256();
+
+    void update(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Get the digest of everything that was updated so far. The object should be reset before it's used again
+     *
+     */
+    Digest finish();
+    void reset();
+
+    static Digest hash(const uint8_t* data, size_t size);
+    static std::string to_hex(const Digest& digest);
+
+private:
+    std::array<uint32_t, 8> state_;
+    std::array<uint8_t, BLOCK_SIZE> block_;
+    size_t block_size_;
+    uint64_t total_size_;
+};
+
+}  // namespace utils
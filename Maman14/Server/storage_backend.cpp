@@ -0,0 +1,21 @@
+#include "storage_backend.h"
+
+#include <boost/make_unique.hpp>
+
+#include "io_uring_storage_backend.h"
+#include "thread_pool_storage_backend.h"
+
+unique_ptr<StorageBackend> make_storage_backend(StorageBackendType type, size_t num_threads, unsigned queue_depth) {
+    switch (type) {
+        case StorageBackendType::THREAD_POOL:
+            return boost::make_unique<ThreadPoolStorageBackend>(num_threads);
+        case StorageBackendType::IO_URING:
+#ifdef HAS_IO_URING_STORAGE_BACKEND
+            return boost::make_unique<IoUringStorageBackend>(queue_depth);
+#else
+            (void)queue_depth;
+            throw StorageBackendUnavailableException("io_uring isn't supported on this platform");
+#endif
+    }
+    throw StorageBackendUnavailableException("Unknown storage backend");
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace bfs = boost::filesystem;
+using boost::asio::awaitable;
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+
+/**
+ * @brief Does the blocking file I/O of backups off the network threads.
+ * Every operation completes back on the executor of the coroutine that awaited it,
+ * and throws boost::system::system_error if it failed.
+ *
+ */
+class StorageBackend {
+public:
+    virtual ~StorageBackend() = default;
+
+    /**
+     * @brief Write up to size bytes at offset in the file
+     *
+     * @return size_t How many bytes were written
+     */
+    virtual awaitable<size_t> write(int fd, const uint8_t* data, size_t size, uint64_t offset) = 0;
+
+    /**
+     * @brief Read up to size bytes from offset in the file
+     *
+     * @return size_t How many bytes were read, 0 at the end of the file
+     */
+    virtual awaitable<size_t> read(int fd, uint8_t* data, size_t size, uint64_t offset) = 0;
+
+    virtual awaitable<void> fsync(int fd) = 0;
+
+    /**
+     * @brief Rename a file, failing with EEXIST instead of replacing an existing file
+     *
+     */
+    virtual awaitable<void> rename_no_replace(const bfs::path& from, const bfs::path& to) = 0;
+
+    virtual const char* name() const = 0;
+
+protected:
+    StorageBackend() = default;
+};
+
+enum class StorageBackendType {
+    THREAD_POOL,
+    IO_URING,
+};
+
+class StorageBackendUnavailableException : public runtime_error {
+public:
+    StorageBackendUnavailableException(const string& what) : runtime_error(what) {}
+};
+
+/**
+ * @brief Create a storage backend.
+ * Throws StorageBackendUnavailableException if the type isn't supported on this machine
+ *
+ * @param type Which backend to create
+ * @param num_threads Threads of the thread pool backend
+ * @param queue_depth Operations the io_uring backend keeps submitted at once
+ */
+unique_ptr<StorageBackend> make_storage_backend(StorageBackendType type, size_t num_threads, unsigned queue_depth);
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace bfs = boost::filesystem;
@@ -71,3 +72,217 @@ TEST_F(BackupDirectoryManagerTest, test_get_file_content_for_user) {
 
     ASSERT_EQ(payload, manager.get_file_content_for_user(user_id, filename));
 }
+
+TEST_F(BackupDirectoryManagerTest, test_unknown_user_throws) {
+    BackupDirectoryManager manager;
+    ASSERT_THROW(manager.get_backup_filenames_for_user(user_id), BackupDirectoryForUserNotFound);
+    ASSERT_THROW(manager.delete_file_for_user(user_id, filename), BackupDirectoryForUserNotFound);
+}
+
+TEST_F(BackupDirectoryManagerTest, test_concurrent_users) {
+    bfs::path root = directory / "backup_directory_manager_test_concurrent";
+    bfs::remove_all(root);
+    const size_t num_threads = 8;
+    const size_t users_per_thread = 10;
+    {
+        // Fewer shards than users, so users share shards
+        BackupDirectoryManager manager(root, 4);
+        vector<uint8_t> payload = get_payload();
+        vector<std::thread> threads;
+        for (size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back([&, i]() {
+                for (size_t j = 0; j < users_per_thread; j++) {
+                    user_id_t id = static_cast<user_id_t>(i * users_per_thread + j);
+                    manager.backup_file_for_user_id(id, filename, payload);
+                    ASSERT_EQ(payload, manager.get_file_content_for_user(id, filename));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        ASSERT_EQ(num_threads * users_per_thread, manager.get_num_backup_directories());
+        ASSERT_LE(num_threads * users_per_thread * 2, manager.get_lock_statistics().get_acquisitions());
+    }
+    bfs::remove_all(root);
+}
+
+class BackupDirectoryManagerStartupTest : public ::testing::Test {
+protected:
+    BackupDirectoryManagerStartupTest()
+        : root(bfs::temp_directory_path() / "backup_directory_manager_startup_test"), snapshot_path(root / ".index_snapshot") {}
+
+    void SetUp() override {
+        bfs::remove_all(root);
+        BackupDirectoryManager manager(root);
+        for (user_id_t user_id = 1; user_id <= 10; user_id++) {
+            manager.backup_file_for_user_id(user_id, "file", get_payload());
+        }
+        manager.save_snapshot(snapshot_path);
+    }
+
+    void TearDown() override {
+        bfs::remove_all(root);
+    }
+
+    bfs::path root;
+    bfs::path snapshot_path;
+};
+
+TEST_F(BackupDirectoryManagerStartupTest, test_scan_existing_users) {
+    BackupDirectoryManager manager(root);
+    StartupReport report = manager.load_existing_users(4);
+
+    ASSERT_EQ(10, report.num_users);
+    ASSERT_EQ(10, report.num_files);
+    ASSERT_EQ(0, report.num_users_from_snapshot);
+    ASSERT_EQ(10, manager.get_num_backup_directories());
+    ASSERT_EQ(get_payload(), manager.get_file_content_for_user(3, "file"));
+}
+
+TEST_F(BackupDirectoryManagerStartupTest, test_load_snapshot) {
+    BackupDirectoryManager manager(root);
+    StartupReport report = manager.load_existing_users(4, snapshot_path);
+
+    ASSERT_EQ(10, report.num_users);
+    ASSERT_EQ(10, report.num_files);
+    ASSERT_EQ(10, report.num_users_from_snapshot);
+    vector<string> filenames{"file"};
+    ASSERT_EQ(filenames, manager.get_backup_filenames_for_user(7));
+    // The snapshot is stale once we start changing things
+    ASSERT_FALSE(bfs::exists(snapshot_path));
+}
+
+TEST_F(BackupDirectoryManagerStartupTest, test_changed_user_rescanned) {
+    // Adding a file changes the directory's mtime. Move it forward too, in case the clock is too coarse to tell
+    bfs::path directory = root / "5";
+    std::time_t mtime = bfs::last_write_time(directory);
+    std::ofstream((directory / "new_file").string()) << "content";
+    bfs::last_write_time(directory, mtime + 10);
+
+    BackupDirectoryManager manager(root);
+    StartupReport report = manager.load_existing_users(4, snapshot_path);
+
+    ASSERT_EQ(9, report.num_users_from_snapshot);
+    ASSERT_EQ(11, report.num_files);
+    vector<string> filenames{"file", "new_file"};
+    ASSERT_EQ(filenames, manager.get_backup_filenames_for_user(5));
+}
+
+TEST_F(BackupDirectoryManagerStartupTest, test_deduplicated_references_restored) {
+    bfs::remove_all(root);
+    {
+        BackupDirectoryManager manager(root, BackupDirectoryManager::DEFAULT_NUM_SHARDS, ChunkStoreOptions{ChunkingMethod::FIXED_SIZE, 4});
+        for (user_id_t user_id = 1; user_id <= 3; user_id++) {
+            manager.backup_file_for_user_id(user_id, "file", get_payload());
+        }
+        manager.save_snapshot(snapshot_path);
+    }
+
+    // Once from the snapshot's chunk table, and once from scanning the manifests
+    for (bool use_snapshot : {true, false}) {
+        BackupDirectoryManager manager(root, BackupDirectoryManager::DEFAULT_NUM_SHARDS, ChunkStoreOptions{ChunkingMethod::FIXED_SIZE, 4});
+        manager.load_existing_users(2, use_snapshot ? snapshot_path : bfs::path());
+        ChunkStoreStatistics statistics = manager.get_chunk_store()->get_statistics();
+        ASSERT_EQ(get_payload().size(), statistics.stored_bytes);
+        ASSERT_EQ(3 * get_payload().size(), statistics.referenced_bytes);
+        ASSERT_EQ(get_payload(), manager.get_file_content_for_user(2, "file"));
+    }
+}
+
+TEST_F(BackupDirectoryManagerTest, test_restore_cache) {
+    RestoreCacheOptions options;
+    options.min_frequency = 1;
+    BackupDirectoryManager manager(directory, BackupDirectoryManager::DEFAULT_NUM_SHARDS, std::nullopt, std::nullopt, options);
+    vector<uint8_t> payload = get_payload();
+    manager.backup_file_for_user_id(user_id, filename, payload);
+
+    ASSERT_EQ(payload, manager.open_file_for_restore(user_id, filename)->read_all());
+    unique_ptr<BackupFileReader> cached{manager.open_file_for_restore(user_id, filename)};
+    ASSERT_NE(nullptr, cached->get_segment(0).data);
+    ASSERT_EQ(payload, cached->read_all());
+    ASSERT_EQ(1, manager.get_restore_cache()->get_statistics().hits);
+
+    // A replaced file is read again
+    vector<uint8_t> new_payload{'n', 'e', 'w'};
+    unique_ptr<BackupFileWriter> writer{manager.begin_replace_for_user(user_id, filename)};
+    writer->write(new_payload.data(), new_payload.size());
+    writer->commit();
+    ASSERT_EQ(new_payload, manager.get_file_content_for_user(user_id, filename));
+    ASSERT_EQ(1, manager.get_restore_cache()->get_statistics().invalidations);
+
+    // And a deleted one is dropped
+    manager.delete_file_for_user(user_id, filename);
+    ASSERT_EQ(2, manager.get_restore_cache()->get_statistics().invalidations);
+    ASSERT_EQ(0, manager.get_restore_cache()->get_statistics().num_files);
+    ASSERT_THROW(manager.open_file_for_restore(user_id, filename), FileNotFoundException);
+}
+
+TEST_F(BackupDirectoryManagerTest, test_lookup_filter) {
+    {
+        BackupDirectoryManager manager(directory, BackupDirectoryManager::DEFAULT_NUM_SHARDS, std::nullopt, std::nullopt,
+                                       std::nullopt, MembershipFilterOptions());
+        ASSERT_FALSE(manager.might_have_file(user_id, filename));
+        manager.backup_file_for_user_id(user_id, filename, get_payload());
+        manager.backup_file_for_user_id(user_id, filename2, get_payload());
+        ASSERT_TRUE(manager.might_have_file(user_id, filename));
+        ASSERT_FALSE(manager.might_have_file(user_id + 1, filename));
+
+        manager.delete_file_for_user(user_id, filename2);
+        ASSERT_FALSE(manager.might_have_file(user_id, filename2));
+        ASSERT_EQ(1, manager.get_lookup_filter()->get_statistics().num_keys);
+    }
+
+    // The files that were already backed up are added when they're loaded
+    BackupDirectoryManager manager(directory, BackupDirectoryManager::DEFAULT_NUM_SHARDS, std::nullopt, std::nullopt,
+                                   std::nullopt, MembershipFilterOptions());
+    manager.load_existing_users(1);
+    ASSERT_TRUE(manager.might_have_file(user_id, filename));
+    ASSERT_FALSE(manager.might_have_file(user_id, filename2));
+
+    // Without a filter, every file should be looked up
+    BackupDirectoryManager unfiltered(directory);
+    ASSERT_TRUE(unfiltered.might_have_file(user_id + 1, filename));
+}
+
+TEST_F(BackupDirectoryManagerTest, test_batch) {
+    BackupDirectoryManager manager;
+    vector<uint8_t> payload = get_payload();
+    vector<uint8_t> big(100, 'b');
+    vector<BatchResult> results = manager.backup_files_for_user_id(user_id, {filename, filename2}, {payload, big});
+    ASSERT_EQ((vector<BatchResult>{BatchResult::DONE, BatchResult::DONE}), results);
+
+    // The second file doesn't fit with the first, but a missing one takes no room
+    vector<RestoredFile> files = manager.restore_files_for_user(user_id, {filename, "missing", filename2}, payload.size() + 1);
+    ASSERT_EQ(3, files.size());
+    ASSERT_EQ(BatchResult::DONE, files[0].result);
+    ASSERT_EQ(payload, files[0].content);
+    ASSERT_EQ(BatchResult::NOT_FOUND, files[1].result);
+    ASSERT_EQ(BatchResult::TOO_BIG, files[2].result);
+    ASSERT_TRUE(files[2].content.empty());
+
+    results = manager.delete_files_for_user(user_id, {filename2, filename2});
+    ASSERT_EQ((vector<BatchResult>{BatchResult::DONE, BatchResult::NOT_FOUND}), results);
+    ASSERT_EQ(vector<string>{filename}, manager.get_backup_filenames_for_user(user_id));
+    ASSERT_THROW(manager.delete_files_for_user(user_id + 1, {filename}), BackupDirectoryForUserNotFound);
+}
+
+TEST_F(BackupDirectoryManagerTest, test_upload) {
+    BackupDirectoryManager manager;
+    vector<uint8_t> payload = get_payload();
+    ASSERT_THROW(manager.get_upload_status_for_user(user_id, 1), BackupDirectoryForUserNotFound);
+
+    UploadStatus status = manager.begin_upload_for_user(user_id, filename, payload.size());
+    manager.write_upload_part_for_user(user_id, status.token, 4, payload.data() + 4, payload.size() - 4);
+    ASSERT_FALSE(manager.finish_upload_for_user(user_id, status.token).is_complete());
+    ASSERT_THROW(manager.get_upload_status_for_user(user_id, status.token + 1), UploadNotFoundException);
+
+    manager.write_upload_part_for_user(user_id, status.token, 0, payload.data(), 4);
+    ASSERT_TRUE(manager.finish_upload_for_user(user_id, status.token).is_complete());
+    ASSERT_EQ(payload, manager.get_file_content_for_user(user_id, filename));
+    ASSERT_TRUE(manager.might_have_file(user_id, filename));
+
+    // An upload can't replace a backed up file
+    ASSERT_THROW(manager.begin_upload_for_user(user_id, filename, payload.size()), FileAlreadyExistsException);
+}
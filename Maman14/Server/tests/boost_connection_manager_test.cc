@@ -0,0 +1,107 @@
+#include "Maman14/Server/boost_connection_manager.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using boost::asio::awaitable;
+using boost::asio::ip::tcp;
+using std::vector;
+
+class BoostConnectionManagerTest : public ::testing::Test {
+protected:
+    BoostConnectionManagerTest() : acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), client(io) {
+        client.connect(acceptor.local_endpoint());
+        connection = std::make_shared<BoostConnectionManager>(std::make_unique<tcp::socket>(acceptor.accept()), IDLE_TIMEOUT);
+    }
+
+public:
+    static constexpr std::chrono::milliseconds IDLE_TIMEOUT{100};
+
+    boost::asio::io_context io;
+    tcp::acceptor acceptor;
+    tcp::socket client;
+    std::shared_ptr<BoostConnectionManager> connection;
+};
+
+TEST_F(BoostConnectionManagerTest, test_idle_read_times_out) {
+    bool read_failed = false;
+    auto read = [&]() -> awaitable<void> {
+        uint8_t byte;
+        try {
+            co_await connection->async_recv_some(&byte, 1);
+        } catch (const boost::system::system_error&) {
+            read_failed = true;
+        }
+    };
+    boost::asio::co_spawn(io, read, boost::asio::detached);
+    io.run_for(std::chrono::seconds(5));
+
+    ASSERT_TRUE(read_failed);
+    ASSERT_TRUE(connection->timed_out());
+}
+
+TEST_F(BoostConnectionManagerTest, test_idle_read_times_out_after_response) {
+    // A pipelined session waits for the next request while it writes the response to the last one
+    bool read_failed = false;
+    bool sent = false;
+    auto read = [&]() -> awaitable<void> {
+        uint8_t byte;
+        try {
+            co_await connection->async_recv_some(&byte, 1);
+        } catch (const boost::system::system_error&) {
+            read_failed = true;
+        }
+    };
+    vector<uint8_t> response{1, 2, 3};
+    auto send = [&]() -> awaitable<void> {
+        co_await connection->async_send(response);
+        sent = true;
+    };
+    boost::asio::co_spawn(io, read, boost::asio::detached);
+    boost::asio::co_spawn(io, send, boost::asio::detached);
+    io.run_for(std::chrono::seconds(5));
+
+    ASSERT_TRUE(sent);
+    ASSERT_TRUE(read_failed);
+    ASSERT_TRUE(connection->timed_out());
+}
+
+TEST_F(BoostConnectionManagerTest, test_slow_write_that_makes_progress_does_not_time_out) {
+    // With small socket buffers, the write only finishes as fast as the client reads, and the writer sees
+    // each of the reads as progress
+    tcp::socket slow_client(io);
+    slow_client.open(tcp::v4());
+    slow_client.set_option(tcp::socket::receive_buffer_size(64 * 1024));
+    slow_client.connect(acceptor.local_endpoint());
+    auto server_socket = std::make_unique<tcp::socket>(acceptor.accept());
+    server_socket->set_option(tcp::socket::send_buffer_size(64 * 1024));
+    auto slow_connection = std::make_shared<BoostConnectionManager>(std::move(server_socket), IDLE_TIMEOUT);
+
+    vector<uint8_t> response(4 * 1024 * 1024, 'r');
+    bool sent = false;
+    auto send = [&]() -> awaitable<void> {
+        co_await slow_connection->async_send(response);
+        sent = true;
+    };
+    boost::asio::co_spawn(io, send, boost::asio::detached);
+    std::thread reader([&slow_client, size = response.size()]() {
+        // The whole write takes several idle timeouts, but no read waits for as long as one
+        vector<uint8_t> piece(64 * 1024);
+        size_t received = 0;
+        boost::system::error_code error;
+        while (received < size && !error) {
+            std::this_thread::sleep_for(IDLE_TIMEOUT / 10);
+            received += slow_client.read_some(boost::asio::buffer(piece), error);
+        }
+    });
+    io.run_for(std::chrono::seconds(30));
+    reader.join();
+
+    ASSERT_TRUE(sent);
+    ASSERT_FALSE(slow_connection->timed_out());
+}
@@ -0,0 +1,301 @@
+#include "Maman14/Server/chunk_store.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/chunk_compression.h"
+#include "Maman14/Server/chunker.h"
+#include "Maman14/Server/manifest.h"
+#include "Maman14/Server/sha256.h"
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::vector;
+
+static ContentHash make_hash(uint8_t value) {
+    ContentHash hash;
+    hash.fill(value);
+    return hash;
+}
+
+TEST(ManifestTest, round_trip) {
+    Manifest manifest;
+    manifest.add_chunk(make_hash(1), 100);
+    manifest.add_chunk(make_hash(2), 50);
+    ASSERT_EQ(150, manifest.size);
+
+    vector<uint8_t> serialized = manifest.serialize();
+    Manifest parsed = Manifest::parse(serialized.data(), serialized.size());
+    ASSERT_EQ(manifest.size, parsed.size);
+    ASSERT_EQ(manifest.chunks, parsed.chunks);
+    ASSERT_EQ(manifest.get_content_hash(), parsed.get_content_hash());
+}
+
+TEST(ManifestTest, invalid_throws) {
+    string not_a_manifest = "this is not a manifest at all";
+    EXPECT_THROW(Manifest::parse(reinterpret_cast<const uint8_t*>(not_a_manifest.data()), not_a_manifest.size()),
+                 InvalidManifestException);
+
+    Manifest manifest;
+    manifest.add_chunk(make_hash(1), 100);
+    vector<uint8_t> serialized = manifest.serialize();
+    EXPECT_THROW(Manifest::parse(serialized.data(), serialized.size() - 1), InvalidManifestException);
+}
+
+TEST(FixedSizeChunkerTest, cuts_across_writes) {
+    FixedSizeChunker chunker(10);
+    uint8_t data[25] = {};
+    ASSERT_EQ(0, chunker.find_cut(data, 6));
+    ASSERT_EQ(4, chunker.find_cut(data, 25));
+    ASSERT_EQ(10, chunker.find_cut(data, 21));
+}
+
+static vector<uint8_t> random_data(size_t size, uint32_t seed) {
+    std::mt19937 generator(seed);
+    vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        byte = static_cast<uint8_t>(generator());
+    }
+    return data;
+}
+
+// Feed the data to the chunker in pieces of the given size, and return the sizes of the chunks
+static vector<size_t> chunk(Chunker& chunker, const vector<uint8_t>& data, size_t piece_size) {
+    vector<size_t> chunks;
+    size_t chunk_size = 0;
+    for (size_t offset = 0; offset < data.size();) {
+        size_t size = std::min(piece_size, data.size() - offset);
+        size_t cut = chunker.find_cut(data.data() + offset, size);
+        size_t taken = cut ? cut : size;
+        chunk_size += taken;
+        offset += taken;
+        if (cut) {
+            chunks.push_back(chunk_size);
+            chunk_size = 0;
+        }
+    }
+    if (chunk_size > 0) {
+        chunks.push_back(chunk_size);
+    }
+    return chunks;
+}
+
+TEST(ContentDefinedChunkerTest, sizes_within_bounds) {
+    vector<uint8_t> data = random_data(4 * 1024 * 1024, 1);
+    ContentDefinedChunker chunker(2048, 8192, 32768);
+    vector<size_t> chunks = chunk(chunker, data, data.size());
+    for (size_t i = 0; i + 1 < chunks.size(); i++) {
+        ASSERT_GE(chunks[i], 2048);
+        ASSERT_LE(chunks[i], 32768);
+    }
+    double average = static_cast<double>(data.size()) / chunks.size();
+    ASSERT_GT(average, 4096);
+    ASSERT_LT(average, 16384);
+}
+
+TEST(ContentDefinedChunkerTest, cuts_independent_of_pieces) {
+    vector<uint8_t> data = random_data(1024 * 1024, 2);
+    ContentDefinedChunker whole(1024, 4096, 16384);
+    ContentDefinedChunker pieces(1024, 4096, 16384);
+    ASSERT_EQ(chunk(whole, data, data.size()), chunk(pieces, data, 333));
+}
+
+TEST(ContentDefinedChunkerTest, insert_only_changes_nearby_chunks) {
+    vector<uint8_t> data = random_data(1024 * 1024, 3);
+    vector<uint8_t> changed = data;
+    changed.insert(changed.begin() + changed.size() / 2, 10, 'x');
+
+    ContentDefinedChunker chunker(1024, 4096, 16384);
+    ContentDefinedChunker changed_chunker(1024, 4096, 16384);
+    vector<size_t> before = chunk(chunker, data, data.size());
+    vector<size_t> after = chunk(changed_chunker, changed, changed.size());
+    // The chunks before the insert are the same, and so are the chunks once the cuts line up again after it
+    size_t same_before = std::mismatch(before.begin(), before.end(), after.begin(), after.end()).first - before.begin();
+    size_t same_after = std::mismatch(before.rbegin(), before.rend(), after.rbegin(), after.rend()).first - before.rbegin();
+    ASSERT_LE(before.size() - same_before - same_after, 2);
+}
+
+TEST(ChunkCompressionTest, level_chosen_by_entropy) {
+    vector<uint8_t> zeros(4096, 0);
+    vector<uint8_t> random_data(4096);
+    std::mt19937 generator(1);
+    std::generate(random_data.begin(), random_data.end(), [&]() { return static_cast<uint8_t>(generator()); });
+    string text = "the quick brown fox jumps over the lazy dog ";
+
+    ASSERT_DOUBLE_EQ(0, estimate_entropy(zeros.data(), zeros.size()));
+    ASSERT_GT(estimate_entropy(random_data.data(), random_data.size()), 7.9);
+    ASSERT_EQ(ChunkEncoding::RAW, choose_compression_level(random_data.data(), random_data.size(), 7.5).encoding);
+    CompressionLevel text_level = choose_compression_level(reinterpret_cast<const uint8_t*>(text.data()), text.size(), 7.5);
+    ASSERT_EQ(ChunkEncoding::DEFLATE, text_level.encoding);
+    ASSERT_LT(text_level.level, choose_compression_level(zeros.data(), zeros.size(), 7.5).level);
+}
+
+TEST(ChunkCompressionTest, round_trip_in_pieces) {
+    string line = "a line of a log file, which repeats itself a lot\n";
+    vector<uint8_t> data;
+    for (size_t i = 0; i < 10000; i++) {
+        data.insert(data.end(), line.begin(), line.end());
+        data.push_back(static_cast<uint8_t>(i));
+    }
+
+    DeflateCompressor compressor(choose_compression_level(data.data(), data.size(), 7.5));
+    vector<vector<uint8_t>> chunks(2);
+    for (auto& chunk : chunks) {
+        for (size_t offset = 0; offset < data.size(); offset += 1000) {
+            compressor.compress(data.data() + offset, std::min<size_t>(1000, data.size() - offset), chunk);
+        }
+        compressor.finish(chunk);
+        ASSERT_LT(chunk.size(), data.size() / 10);
+    }
+    ASSERT_EQ(chunks[0], chunks[1]);
+
+    DeflateDecompressor decompressor;
+    vector<uint8_t> decompressed(data.size());
+    size_t decompressed_size = 0;
+    const uint8_t* input = chunks[0].data();
+    size_t input_size = chunks[0].size();
+    while (!decompressor.finished()) {
+        size_t input_piece = std::min<size_t>(input_size, 100);
+        size_t left = input_size - input_piece;
+        decompressed_size += decompressor.decompress(input, input_piece, decompressed.data() + decompressed_size,
+                                                     std::min<size_t>(4096, decompressed.size() - decompressed_size));
+        input_size = left + input_piece;
+    }
+    ASSERT_EQ(data, decompressed);
+    ASSERT_EQ(0, input_size);
+
+    vector<uint8_t> corrupt(chunks[1].size(), 0xff);
+    input = corrupt.data();
+    input_size = corrupt.size();
+    decompressor.reset();
+    EXPECT_THROW(decompressor.decompress(input, input_size, decompressed.data(), decompressed.size()), CompressionException);
+}
+
+class ChunkStoreTest : public ::testing::Test {
+protected:
+    ChunkStoreTest() : directory(bfs::temp_directory_path() / "chunk_store_test") {}
+
+    void SetUp() override { bfs::remove_all(directory); }
+    void TearDown() override { bfs::remove_all(directory); }
+
+    // Write a chunk to the store's incoming directory, as a writer would, and return its hash
+    ContentHash publish(ChunkStore& store, const string& content) {
+        ContentHash hash = utils::Sha256::hash(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+        bfs::path incoming = store.make_incoming_path();
+        std::ofstream(incoming.string()) << content;
+        store.publish(incoming, hash, content.size());
+        return hash;
+    }
+
+    bfs::path directory;
+};
+
+TEST_F(ChunkStoreTest, chunk_deleted_with_last_reference) {
+    ChunkStore store(directory);
+    ContentHash hash = publish(store, "chunk");
+    ASSERT_TRUE(bfs::exists(store.get_chunk_path(hash)));
+    ASSERT_TRUE(store.add_reference(hash));
+    ASSERT_FALSE(store.add_reference(make_hash(7)));
+
+    store.release(hash);
+    ASSERT_TRUE(bfs::exists(store.get_chunk_path(hash)));
+    store.release(hash);
+    ASSERT_FALSE(bfs::exists(store.get_chunk_path(hash)));
+    ASSERT_EQ(0, store.get_statistics().num_chunks);
+}
+
+TEST_F(ChunkStoreTest, same_chunk_stored_once) {
+    ChunkStore store(directory);
+    ContentHash hash = publish(store, "same content");
+    ASSERT_EQ(hash, publish(store, "same content"));
+
+    ChunkStoreStatistics statistics = store.get_statistics();
+    ASSERT_EQ(1, statistics.num_chunks);
+    ASSERT_EQ(12, statistics.stored_bytes);
+    ASSERT_EQ(24, statistics.referenced_bytes);
+    ASSERT_DOUBLE_EQ(2, statistics.get_dedup_ratio());
+    // The second copy was dropped
+    ASSERT_TRUE(bfs::is_empty(directory / ".incoming"));
+}
+
+TEST_F(ChunkStoreTest, publish_returns_directories_to_sync) {
+    ChunkStore store(directory);
+    string content = "first";
+    ContentHash hash = utils::Sha256::hash(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+    bfs::path incoming = store.make_incoming_path();
+    std::ofstream(incoming.string()) << content;
+    // The chunk's subdirectory was created, so the store's directory changed too
+    vector<bfs::path> directories = store.publish(incoming, hash, content.size());
+    ASSERT_EQ((vector<bfs::path>{store.get_chunk_path(hash).parent_path(), directory}), directories);
+
+    incoming = store.make_incoming_path();
+    std::ofstream(incoming.string()) << content;
+    ASSERT_EQ(vector<bfs::path>{store.get_chunk_path(hash).parent_path()}, store.publish(incoming, hash, content.size()));
+}
+
+TEST_F(ChunkStoreTest, acquire_missing_chunk_throws) {
+    ChunkStore store(directory);
+    Manifest manifest;
+    manifest.add_chunk(publish(store, "stored"), 6);
+    manifest.add_chunk(make_hash(9), 10);
+
+    EXPECT_THROW(store.acquire(manifest), ChunkNotFoundException);
+    // The references that were added before the missing chunk are released
+    ASSERT_EQ(6, store.get_statistics().referenced_bytes);
+}
+
+TEST_F(ChunkStoreTest, garbage_collected) {
+    ContentHash kept;
+    ContentHash leaked;
+    {
+        ChunkStore store(directory);
+        kept = publish(store, "kept");
+        leaked = publish(store, "leaked");
+        std::ofstream(store.make_incoming_path().string()) << "interrupted upload";
+    }
+
+    // Rebuild the references on startup, from a manifest that only has the first chunk
+    ChunkStore store(directory);
+    Manifest manifest;
+    manifest.add_chunk(kept, 4);
+    store.restore_references(manifest);
+    ASSERT_EQ(2, store.collect_garbage());
+    ASSERT_TRUE(bfs::exists(store.get_chunk_path(kept)));
+    ASSERT_FALSE(bfs::exists(store.get_chunk_path(leaked)));
+    ASSERT_TRUE(bfs::is_empty(directory / ".incoming"));
+}
+
+TEST_F(ChunkStoreTest, compressed_chunk_found_on_startup) {
+    string content = "pretend this is compressed";
+    ContentHash hash = utils::Sha256::hash(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+    {
+        ChunkStore store(directory);
+        bfs::path incoming = store.make_incoming_path();
+        std::ofstream(incoming.string()) << "small";
+        store.publish(incoming, hash, content.size(), 5);
+        ASSERT_TRUE(bfs::exists(store.get_chunk_path(hash, ChunkEncoding::DEFLATE)));
+        ASSERT_EQ(ChunkEncoding::DEFLATE, store.get_stored_chunk(hash).encoding);
+        ASSERT_EQ(5, store.get_statistics().disk_bytes);
+        ASSERT_EQ(content.size(), store.get_statistics().stored_bytes);
+    }
+
+    ChunkStore store(directory);
+    Manifest manifest;
+    manifest.add_chunk(hash, content.size());
+    store.restore_references(manifest);
+    ASSERT_EQ(0, store.collect_garbage());
+    StoredChunk stored = store.get_stored_chunk(hash);
+    ASSERT_EQ(ChunkEncoding::DEFLATE, stored.encoding);
+    ASSERT_EQ(5, stored.stored_size);
+    ASSERT_EQ(5, store.get_statistics().disk_bytes);
+
+    store.release(manifest);
+    ASSERT_FALSE(bfs::exists(store.get_chunk_path(hash, ChunkEncoding::DEFLATE)));
+    ASSERT_EQ(0, store.get_statistics().disk_bytes);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/use_future.hpp>
+
+using boost::asio::awaitable;
+
+/**
+ * @brief Run a coroutine to completion on a private io_context and return its result,
+ * so coroutine code can be checked from plain gtest bodies
+ *
+ */
+template <typename T>
+T run_awaitable(awaitable<T> coroutine) {
+    boost::asio::io_context io;
+    auto result = boost::asio::co_spawn(io, std::move(coroutine), boost::asio::use_future);
+    io.run();
+    return result.get();
+}
@@ -0,0 +1,146 @@
+#include "Maman14/Server/delta.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/user_backup_directory.h"
+
+namespace bfs = boost::filesystem;
+using std::unique_ptr;
+using std::vector;
+
+static vector<uint8_t> random_bytes(size_t size, uint32_t seed) {
+    std::mt19937 generator(seed);
+    vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        byte = static_cast<uint8_t>(generator());
+    }
+    return data;
+}
+
+class DeltaTest : public ::testing::Test {
+protected:
+    DeltaTest() : directory(bfs::temp_directory_path() / "delta_test") {}
+
+    void SetUp() override {
+        bfs::remove_all(directory);
+        bfs::create_directory(directory);
+    }
+
+    void TearDown() override { bfs::remove_all(directory); }
+
+    /**
+     * @brief Send the new content as a delta against the stored file, and return the delta's size
+     *
+     */
+    size_t update(UserBackupDirectory& backup_directory, const vector<uint8_t>& new_content) {
+        FileSignatures signatures = compute_signatures(*backup_directory.open_backup_file("file"));
+        vector<uint8_t> delta = make_delta(FileSignatures::parse(signatures.serialize().data(), signatures.serialize().size()),
+                                           new_content.data(), new_content.size());
+
+        unique_ptr<BackupFileReader> base{backup_directory.open_backup_file("file")};
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+        apply_delta(*base, delta.data(), delta.size(), *writer);
+        writer->commit();
+        return delta.size();
+    }
+
+    bfs::path directory;
+};
+
+TEST_F(DeltaTest, test_small_change_sends_small_delta) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> content = random_bytes(1024 * 1024, 1);
+    backup_directory.backup_file("file", content);
+
+    // Insert some bytes in the middle, and change a few near the end
+    vector<uint8_t> inserted = random_bytes(100, 2);
+    content.insert(content.begin() + 300000, inserted.begin(), inserted.end());
+    content[900000] ^= 0xff;
+    size_t delta_size = update(backup_directory, content);
+
+    ASSERT_EQ(content, backup_directory.get_backup_file_content("file"));
+    // Each change costs at most a block of literals around it
+    uint32_t block_size = FileSignatures::choose_block_size(content.size());
+    ASSERT_LT(delta_size, 2 * block_size + inserted.size() + 128);
+}
+
+TEST_F(DeltaTest, test_unchanged_file) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> content = random_bytes(100000, 3);
+    backup_directory.backup_file("file", content);
+
+    size_t delta_size = update(backup_directory, content);
+    ASSERT_EQ(content, backup_directory.get_backup_file_content("file"));
+    // The header, a copy of all of the whole blocks and the short last block
+    ASSERT_LT(delta_size, 64 + content.size() % FileSignatures::choose_block_size(content.size()) + 16);
+}
+
+TEST_F(DeltaTest, test_empty_base) {
+    UserBackupDirectory backup_directory(directory);
+    backup_directory.backup_file("file", {});
+    vector<uint8_t> content = random_bytes(5000, 4);
+
+    update(backup_directory, content);
+    ASSERT_EQ(content, backup_directory.get_backup_file_content("file"));
+}
+
+TEST_F(DeltaTest, test_delta_against_other_version_rejected) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> content = random_bytes(100000, 5);
+    backup_directory.backup_file("file", content);
+    FileSignatures signatures = compute_signatures(*backup_directory.open_backup_file("file"));
+    vector<uint8_t> new_content = content;
+    new_content[50] ^= 1;
+    vector<uint8_t> delta = make_delta(signatures, new_content.data(), new_content.size());
+
+    // The stored file changes after the signatures were taken, but keeps its size
+    vector<uint8_t> other_content = random_bytes(100000, 6);
+    backup_directory.delete_file("file");
+    backup_directory.backup_file("file", other_content);
+
+    unique_ptr<BackupFileReader> base{backup_directory.open_backup_file("file")};
+    {
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+        EXPECT_THROW(apply_delta(*base, delta.data(), delta.size(), *writer), InvalidDeltaException);
+    }
+    ASSERT_EQ(other_content, backup_directory.get_backup_file_content("file"));
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+    EXPECT_THROW(apply_delta(*base, delta.data(), delta.size() - 1, *writer), InvalidDeltaException);
+}
+
+TEST(FileSignaturesTest, serialize_and_parse) {
+    vector<uint8_t> block = random_bytes(3000, 7);
+    FileSignatures signatures;
+    signatures.block_size = 2048;
+    signatures.file_size = block.size();
+    signatures.blocks.push_back(compute_block_signature(block.data(), 2048));
+    signatures.blocks.push_back(compute_block_signature(block.data() + 2048, block.size() - 2048));
+
+    vector<uint8_t> serialized = signatures.serialize();
+    FileSignatures parsed = FileSignatures::parse(serialized.data(), serialized.size());
+    ASSERT_EQ(signatures.block_size, parsed.block_size);
+    ASSERT_EQ(signatures.file_size, parsed.file_size);
+    ASSERT_EQ(2, parsed.blocks.size());
+    ASSERT_EQ(signatures.blocks[1].weak, parsed.blocks[1].weak);
+    ASSERT_EQ(signatures.blocks[1].strong, parsed.blocks[1].strong);
+    EXPECT_THROW(FileSignatures::parse(serialized.data(), serialized.size() - 1), InvalidDeltaException);
+}
+
+TEST(FileSignaturesTest, rolling_checksum_matches_reset) {
+    vector<uint8_t> data = random_bytes(200, 8);
+    RollingChecksum rolled;
+    rolled.reset(data.data(), 64);
+    for (size_t i = 0; i + 64 < data.size(); i++) {
+        rolled.roll(data[i], data[i + 64]);
+        RollingChecksum fresh;
+        fresh.reset(data.data() + i + 1, 64);
+        ASSERT_EQ(fresh.value(), rolled.value());
+    }
+}
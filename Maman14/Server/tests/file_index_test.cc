@@ -0,0 +1,78 @@
+#include "Maman14/Server/file_index.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+TEST(FileIndexTest, insert_find_erase) {
+    FileIndex index;
+    index.insert("file", FileIndexEntry{10, 1234, std::nullopt});
+    ASSERT_TRUE(index.contains("file"));
+    ASSERT_FALSE(index.contains("other_file"));
+
+    auto entry = index.find("file");
+    ASSERT_TRUE(entry.has_value());
+    ASSERT_EQ(10, entry->size);
+    ASSERT_EQ(1234, entry->mtime_ns);
+    ASSERT_FALSE(entry->content_hash.has_value());
+
+    ASSERT_TRUE(index.erase("file"));
+    ASSERT_FALSE(index.erase("file"));
+    ASSERT_FALSE(index.find("file").has_value());
+}
+
+TEST(FileIndexTest, insert_replaces) {
+    FileIndex index;
+    index.insert("file", FileIndexEntry{10, 1, std::nullopt});
+    index.insert("file", FileIndexEntry{20, 2, ContentHash{}});
+    ASSERT_EQ(1, index.size());
+    ASSERT_EQ(20, index.find("file")->size);
+    ASSERT_TRUE(index.find("file")->content_hash.has_value());
+}
+
+TEST(FileIndexTest, filenames_sorted) {
+    FileIndex index;
+    index.insert("b", FileIndexEntry{1, 1, std::nullopt});
+    index.insert("c", FileIndexEntry{1, 1, std::nullopt});
+    index.insert("a", FileIndexEntry{1, 1, std::nullopt});
+    vector<string> expected{"a", "b", "c"};
+    ASSERT_EQ(expected, index.get_filenames());
+}
+
+TEST(FileIndexTest, memory_usage_grows_with_entries) {
+    FileIndex index;
+    size_t empty_usage = index.get_memory_usage();
+    index.insert("short", FileIndexEntry{1, 1, std::nullopt});
+    size_t short_usage = index.get_memory_usage();
+    ASSERT_GT(short_usage, empty_usage);
+
+    // A long name is stored on the heap, and counted as well
+    index.insert(string(100, 'x'), FileIndexEntry{1, 1, std::nullopt});
+    ASSERT_GE(index.get_memory_usage() - short_usage, short_usage - empty_usage + 100);
+}
+
+TEST(FileIndexTest, filter_follows_entries) {
+    MembershipFilter filter;
+    {
+        FileIndex index;
+        index.insert("before", FileIndexEntry{1, 1, std::nullopt});
+        index.set_filter(&filter, 7);
+        ASSERT_TRUE(filter.might_contain(MembershipFilter::hash(7, "before")));
+
+        // Replacing a file doesn't count it again
+        index.insert("file", FileIndexEntry{1, 1, std::nullopt});
+        index.insert("file", FileIndexEntry{2, 2, std::nullopt});
+        ASSERT_EQ(2, filter.get_statistics().num_keys);
+        ASSERT_TRUE(index.erase("file"));
+        ASSERT_FALSE(index.erase("file"));
+        ASSERT_FALSE(filter.might_contain(MembershipFilter::hash(7, "file")));
+        ASSERT_EQ(1, filter.get_statistics().num_keys);
+    }
+    // A destroyed index takes its files with it
+    ASSERT_FALSE(filter.might_contain(MembershipFilter::hash(7, "before")));
+    ASSERT_EQ(0, filter.get_statistics().num_keys);
+}
@@ -0,0 +1,59 @@
+#include "Maman14/Server/file_lock_table.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+TEST(FileLockTableTest, shared_locks_held_together) {
+    FileLockTable table;
+    auto first = table.lock_shared("file");
+    // Would wait forever if shared locks excluded each other
+    auto second = std::async(std::launch::async, [&]() {
+        auto lock = table.lock_shared("file");
+        return true;
+    });
+    ASSERT_EQ(std::future_status::ready, second.wait_for(5s));
+}
+
+TEST(FileLockTableTest, exclusive_lock_waits_for_shared) {
+    FileLockTable table;
+    std::atomic<bool> acquired{false};
+    std::thread writer;
+    {
+        auto reader = table.lock_shared("file");
+        writer = std::thread([&]() {
+            auto lock = table.lock_exclusive("file");
+            acquired = true;
+        });
+        std::this_thread::sleep_for(50ms);
+        ASSERT_FALSE(acquired);
+    }
+    writer.join();
+    ASSERT_TRUE(acquired);
+}
+
+TEST(FileLockTableTest, different_files_independent) {
+    FileLockTable table;
+    auto first = table.lock_exclusive("file");
+    auto second = std::async(std::launch::async, [&]() {
+        auto lock = table.lock_exclusive("other_file");
+        return true;
+    });
+    ASSERT_EQ(std::future_status::ready, second.wait_for(5s));
+}
+
+TEST(FileLockTableTest, unused_entries_removed) {
+    FileLockTable table;
+    {
+        auto first = table.lock_shared("file");
+        auto second = table.lock_shared("file");
+        auto third = table.lock_exclusive("other_file");
+        ASSERT_EQ(2, table.size());
+    }
+    ASSERT_EQ(0, table.size());
+}
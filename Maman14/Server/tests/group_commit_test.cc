@@ -0,0 +1,150 @@
+#include "Maman14/Server/group_commit.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bfs = boost::filesystem;
+using boost::asio::awaitable;
+
+class GroupCommitTest : public ::testing::Test {
+protected:
+    GroupCommitTest() : directory(bfs::temp_directory_path() / "group_commit_test") {}
+
+    void SetUp() override {
+        bfs::remove_all(directory);
+        bfs::create_directories(directory);
+    }
+
+    void TearDown() override {
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        bfs::remove_all(directory);
+    }
+
+    int open_file(const std::string& name) {
+        int fd = ::open((directory / name).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        EXPECT_LE(0, fd);
+        EXPECT_EQ(1, ::write(fd, "x", 1));
+        fds.push_back(fd);
+        return fd;
+    }
+
+    bfs::path directory;
+    std::vector<int> fds;
+};
+
+TEST_F(GroupCommitTest, sync_and_async_sync) {
+    GroupCommitter committer;
+    committer.sync(open_file("first"));
+
+    boost::asio::io_context io;
+    bool synced = false;
+    int fd = open_file("second");
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            co_await committer.async_sync(fd);
+            synced = true;
+        },
+        boost::asio::detached);
+    io.run();
+    ASSERT_TRUE(synced);
+
+    GroupCommitStatistics statistics = committer.get_statistics();
+    ASSERT_EQ(2, statistics.syncs);
+    ASSERT_EQ(2, statistics.batches);
+    ASSERT_EQ(2, statistics.single_syncs);
+}
+
+TEST_F(GroupCommitTest, concurrent_syncs_share_batches) {
+    // A batch is flushed file by file, or with a syncfs of the whole filesystem
+    for (bool sync_filesystem : {false, true}) {
+        GroupCommitOptions options;
+        // Long enough for all of the threads to join the first batch
+        options.max_delay = std::chrono::milliseconds(200);
+        options.max_batch_size = 8;
+        options.sync_filesystem = sync_filesystem;
+        GroupCommitter committer(options);
+        std::vector<int> thread_fds;
+        for (int i = 0; i < 8; i++) {
+            thread_fds.push_back(open_file("file" + std::to_string(i)));
+        }
+
+        std::vector<std::thread> threads;
+        for (int fd : thread_fds) {
+            threads.emplace_back([&committer, fd]() { committer.sync(fd); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        GroupCommitStatistics statistics = committer.get_statistics();
+        ASSERT_EQ(8, statistics.syncs);
+        ASSERT_LT(statistics.batches, 8);
+        ASSERT_LT(1, statistics.get_average_batch_size());
+    }
+}
+
+TEST_F(GroupCommitTest, failed_sync_throws) {
+    GroupCommitter committer;
+    int fd = open_file("closed");
+    ::close(fd);
+    fds.clear();
+    ASSERT_THROW(committer.sync(fd), boost::system::system_error);
+    // The committer keeps working after a failed batch
+    committer.sync(open_file("open"));
+    // A batch fails if any of its files fail to sync
+    ASSERT_THROW(committer.sync(std::vector<int>{open_file("other"), -1}), boost::system::system_error);
+}
+
+TEST_F(GroupCommitTest, failed_sync_only_fails_its_own_waiter) {
+    GroupCommitOptions options;
+    // Long enough for both syncs to join the same batch
+    options.max_delay = std::chrono::milliseconds(200);
+    options.max_batch_size = 2;
+    GroupCommitter committer(options);
+
+    boost::asio::io_context io;
+    int fd = open_file("open");
+    bool synced = false;
+    bool failed = false;
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            co_await committer.async_sync(-1);
+        },
+        [&](std::exception_ptr e) { failed = e != nullptr; });
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            co_await committer.async_sync(fd);
+            synced = true;
+        },
+        boost::asio::detached);
+    io.run();
+    ASSERT_TRUE(failed);
+    ASSERT_TRUE(synced);
+    ASSERT_EQ(1, committer.get_statistics().batches);
+}
+
+TEST_F(GroupCommitTest, shared_file_is_flushed_once_per_batch) {
+    GroupCommitter committer;
+    int fd = open_file("shared");
+    int other_fd = ::dup(fd);
+    ASSERT_LE(0, other_fd);
+    fds.push_back(other_fd);
+    int directory_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ASSERT_LE(0, directory_fd);
+    fds.push_back(directory_fd);
+
+    committer.sync(std::vector<int>{fd, other_fd, directory_fd, directory_fd});
+    GroupCommitStatistics statistics = committer.get_statistics();
+    ASSERT_EQ(4, statistics.syncs);
+    ASSERT_EQ(1, statistics.batches);
+    // The file and the directory
+    ASSERT_EQ(2, statistics.flushes);
+}
@@ -0,0 +1,74 @@
+#include "Maman14/Server/index_snapshot.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::vector;
+
+class IndexSnapshotTest : public ::testing::Test {
+protected:
+    IndexSnapshotTest() : path(bfs::temp_directory_path() / "index_snapshot_test") {}
+
+    void SetUp() override { bfs::remove(path); }
+    void TearDown() override { bfs::remove(path); }
+
+    bfs::path path;
+};
+
+TEST_F(IndexSnapshotTest, round_trip) {
+    ContentHash hash;
+    hash.fill(0xab);
+    vector<UserIndexSnapshot> users{
+        {1, 100, {{"file", FileIndexEntry{10, 20, std::nullopt}}, {"hashed", FileIndexEntry{30, 40, hash}}}},
+        {2, 200, {}},
+    };
+    vector<ChunkRecord> chunks{{hash, 4096, 3}};
+    write_index_snapshot(path, users, chunks);
+
+    IndexSnapshot snapshot = read_index_snapshot(path);
+    const vector<UserIndexSnapshot>& loaded = snapshot.users;
+    ASSERT_EQ(2, loaded.size());
+    ASSERT_EQ(1, loaded[0].user_id);
+    ASSERT_EQ(100, loaded[0].directory_mtime_ns);
+    ASSERT_EQ(2, loaded[0].files.size());
+    ASSERT_EQ("file", loaded[0].files[0].first);
+    ASSERT_EQ(10, loaded[0].files[0].second.size);
+    ASSERT_EQ(20, loaded[0].files[0].second.mtime_ns);
+    ASSERT_FALSE(loaded[0].files[0].second.content_hash.has_value());
+    ASSERT_EQ("hashed", loaded[0].files[1].first);
+    ASSERT_EQ(hash, loaded[0].files[1].second.content_hash);
+    ASSERT_EQ(2, loaded[1].user_id);
+    ASSERT_TRUE(loaded[1].files.empty());
+    ASSERT_TRUE(snapshot.chunks.has_value());
+    ASSERT_EQ(1, snapshot.chunks->size());
+    ASSERT_EQ(hash, (*snapshot.chunks)[0].hash);
+    ASSERT_EQ(4096, (*snapshot.chunks)[0].size);
+    ASSERT_EQ(3, (*snapshot.chunks)[0].references);
+}
+
+TEST_F(IndexSnapshotTest, without_chunks) {
+    write_index_snapshot(path, {{1, 100, {}}});
+    ASSERT_FALSE(read_index_snapshot(path).chunks.has_value());
+}
+
+TEST_F(IndexSnapshotTest, missing_throws) {
+    EXPECT_THROW(read_index_snapshot(path), IndexSnapshotException);
+}
+
+TEST_F(IndexSnapshotTest, truncated_throws) {
+    vector<UserIndexSnapshot> users{{1, 100, {{"file", FileIndexEntry{10, 20, std::nullopt}}}}};
+    write_index_snapshot(path, users);
+    bfs::resize_file(path, bfs::file_size(path) - 1);
+    EXPECT_THROW(read_index_snapshot(path), IndexSnapshotException);
+}
+
+TEST_F(IndexSnapshotTest, garbage_throws) {
+    std::ofstream(path.string()) << "this is not a snapshot";
+    EXPECT_THROW(read_index_snapshot(path), IndexSnapshotException);
+}
@@ -0,0 +1,97 @@
+#include "Maman14/Server/membership_filter.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static MembershipFilterOptions make_options(size_t expected_keys) {
+    MembershipFilterOptions options;
+    options.expected_keys = expected_keys;
+    return options;
+}
+
+TEST(MembershipFilterTest, add_and_remove) {
+    MembershipFilter filter(make_options(1000));
+    uint64_t hash = MembershipFilter::hash(1, "file");
+    ASSERT_FALSE(filter.might_contain(hash));
+    filter.add(hash);
+    ASSERT_TRUE(filter.might_contain(hash));
+    // The same name of another user is another key
+    ASSERT_NE(hash, MembershipFilter::hash(2, "file"));
+
+    // A key that was added twice stays until it's removed twice
+    filter.add(hash);
+    filter.remove(hash);
+    ASSERT_TRUE(filter.might_contain(hash));
+    filter.remove(hash);
+    ASSERT_FALSE(filter.might_contain(hash));
+    ASSERT_EQ(0, filter.get_statistics().num_keys);
+}
+
+TEST(MembershipFilterTest, no_false_negatives_and_few_false_positives) {
+    const size_t num_keys = 10000;
+    MembershipFilter filter(make_options(num_keys));
+    for (size_t i = 0; i < num_keys; i++) {
+        filter.add(MembershipFilter::hash(i % 10, "file" + std::to_string(i)));
+    }
+    // Remove every other key, which must not drop any of the rest
+    for (size_t i = 0; i < num_keys; i += 2) {
+        filter.remove(MembershipFilter::hash(i % 10, "file" + std::to_string(i)));
+    }
+    for (size_t i = 1; i < num_keys; i += 2) {
+        ASSERT_TRUE(filter.might_contain(MembershipFilter::hash(i % 10, "file" + std::to_string(i))));
+    }
+
+    size_t false_positives = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        false_positives += filter.might_contain(MembershipFilter::hash(i % 10, "missing" + std::to_string(i)));
+    }
+    ASSERT_LT(false_positives, num_keys / 100);
+    MembershipFilterStatistics statistics = filter.get_statistics();
+    ASSERT_EQ(num_keys / 2, statistics.num_keys);
+    ASSERT_LT(statistics.false_positive_rate, 0.01);
+}
+
+TEST(MembershipFilterTest, overflowed_counters_keep_keys) {
+    // A single block, whose counters overflow long before all of the keys are added
+    MembershipFilter filter(make_options(1));
+    vector<uint64_t> hashes;
+    for (size_t i = 0; i < 2000; i++) {
+        hashes.push_back(MembershipFilter::hash(0, std::to_string(i)));
+        filter.add(hashes.back());
+    }
+    for (size_t i = 1; i < hashes.size(); i++) {
+        filter.remove(hashes[i]);
+    }
+    ASSERT_TRUE(filter.might_contain(hashes[0]));
+}
+
+TEST(MembershipFilterTest, concurrent_adds_and_removes) {
+    MembershipFilter filter(make_options(100000));
+    vector<std::thread> threads;
+    for (uint64_t user_id = 0; user_id < 4; user_id++) {
+        threads.emplace_back([&filter, user_id]() {
+            for (size_t i = 0; i < 20000; i++) {
+                uint64_t hash = MembershipFilter::hash(user_id, std::to_string(i));
+                filter.add(hash);
+                if (i % 2 == 0) {
+                    filter.remove(hash);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(40000, filter.get_statistics().num_keys);
+    for (uint64_t user_id = 0; user_id < 4; user_id++) {
+        for (size_t i = 1; i < 20000; i += 2) {
+            ASSERT_TRUE(filter.might_contain(MembershipFilter::hash(user_id, std::to_string(i))));
+        }
+    }
+}
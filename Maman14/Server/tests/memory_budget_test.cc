@@ -0,0 +1,102 @@
+#include "Maman14/Server/memory_budget.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <optional>
+
+using boost::asio::awaitable;
+
+TEST(MemoryBudgetTest, acquire_and_release) {
+    MemoryBudget budget(100);
+    boost::asio::io_context io;
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            {
+                MemoryBudget::Reservation reservation{co_await budget.acquire(60)};
+                EXPECT_EQ(60, reservation.size());
+                EXPECT_EQ(60, budget.get_used());
+            }
+            EXPECT_EQ(0, budget.get_used());
+        },
+        boost::asio::detached);
+    io.run();
+}
+
+TEST(MemoryBudgetTest, acquire_capped_to_capacity) {
+    MemoryBudget budget(100);
+    boost::asio::io_context io;
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            MemoryBudget::Reservation reservation{co_await budget.acquire(1000)};
+            EXPECT_EQ(100, reservation.size());
+        },
+        boost::asio::detached);
+    io.run();
+}
+
+TEST(MemoryBudgetTest, waits_until_released) {
+    MemoryBudget budget(100);
+    boost::asio::io_context io;
+    std::optional<MemoryBudget::Reservation> first;
+    bool second_acquired = false;
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            first.emplace(co_await budget.acquire(80));
+        },
+        boost::asio::detached);
+    io.run();
+    io.restart();
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            MemoryBudget::Reservation second{co_await budget.acquire(50)};
+            second_acquired = true;
+        },
+        boost::asio::detached);
+    io.poll();
+    ASSERT_FALSE(second_acquired);
+
+    first.reset();
+    io.run();
+    ASSERT_TRUE(second_acquired);
+    ASSERT_EQ(0, budget.get_used());
+}
+
+TEST(MemoryBudgetTest, shrink_wakes_waiters) {
+    MemoryBudget budget(100);
+    boost::asio::io_context io;
+    std::optional<MemoryBudget::Reservation> first;
+    bool second_acquired = false;
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            first.emplace(co_await budget.acquire(100));
+        },
+        boost::asio::detached);
+    io.run();
+    io.restart();
+
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> {
+            MemoryBudget::Reservation second{co_await budget.acquire(50)};
+            second_acquired = true;
+        },
+        boost::asio::detached);
+    io.poll();
+    ASSERT_FALSE(second_acquired);
+
+    // Growing is ignored
+    first->shrink(200);
+    ASSERT_EQ(100, budget.get_used());
+    first->shrink(30);
+    ASSERT_EQ(30, first->size());
+    io.run();
+    ASSERT_TRUE(second_acquired);
+    first.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
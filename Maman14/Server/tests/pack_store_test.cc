@@ -0,0 +1,152 @@
+#include "Maman14/Server/pack_store.h"
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::vector;
+
+static vector<uint8_t> make_content(const string& filename, size_t size) {
+    vector<uint8_t> content(size);
+    for (size_t i = 0; i < size; i++) {
+        content[i] = static_cast<uint8_t>(filename[i % filename.size()] + i);
+    }
+    return content;
+}
+
+static vector<uint8_t> read_packed(const PackStore& pack_store, const string& filename) {
+    std::optional<PackedFileHandle> handle = pack_store.open(filename);
+    if (!handle) {
+        return {};
+    }
+    vector<uint8_t> content(handle->size);
+    ssize_t bytes_read = ::pread(handle->fd, content.data(), content.size(), handle->offset);
+    ::close(handle->fd);
+    EXPECT_EQ(static_cast<ssize_t>(content.size()), bytes_read);
+    return content;
+}
+
+class PackStoreTest : public ::testing::Test {
+protected:
+    PackStoreTest() : directory(bfs::temp_directory_path() / "pack_store_test") {}
+
+    void SetUp() override {
+        TearDown();
+    }
+
+    void TearDown() override {
+        bfs::remove_all(directory);
+    }
+
+    void put(PackStore& pack_store, const string& filename, size_t size) {
+        vector<uint8_t> content = make_content(filename, size);
+        FileIndexEntry entry = pack_store.put(filename, content.data(), content.size());
+        ASSERT_EQ(size, entry.size);
+    }
+
+    bfs::path directory;
+};
+
+TEST_F(PackStoreTest, put_open_remove) {
+    PackStore pack_store(directory);
+    put(pack_store, "first", 100);
+    put(pack_store, "second", 0);
+    ASSERT_TRUE(pack_store.contains("first"));
+    ASSERT_EQ(make_content("first", 100), read_packed(pack_store, "first"));
+    ASSERT_TRUE(read_packed(pack_store, "second").empty());
+
+    // Replacing a file packs the new version, and the old one is dead
+    put(pack_store, "first", 50);
+    ASSERT_EQ(make_content("first", 50), read_packed(pack_store, "first"));
+    ASSERT_EQ(2, pack_store.get_statistics().num_files);
+    ASSERT_LT(0, pack_store.get_statistics().dead_bytes);
+
+    ASSERT_TRUE(pack_store.remove("first"));
+    ASSERT_FALSE(pack_store.remove("first"));
+    ASSERT_FALSE(pack_store.contains("first"));
+    ASSERT_FALSE(pack_store.open("first"));
+    // All of the files are in a single segment
+    ASSERT_EQ(1, pack_store.get_statistics().num_segments);
+    ASSERT_THROW(put(pack_store, "too big", PackStoreOptions().max_packed_size + 1), PackStoreException);
+}
+
+TEST_F(PackStoreTest, files_found_after_restart) {
+    PackStoreOptions options;
+    // A few files per segment, so most of the segments are sealed
+    options.segment_size = 1024;
+    {
+        PackStore pack_store(directory, options);
+        for (int i = 0; i < 20; i++) {
+            put(pack_store, "file" + std::to_string(i), 200);
+        }
+        put(pack_store, "file3", 10);
+        pack_store.remove("file5");
+        ASSERT_LT(5, pack_store.get_statistics().num_segments);
+    }
+    // A torn record at the end of the active segment is cut off
+    bfs::path last_segment;
+    for (const auto& entry : bfs::directory_iterator(directory)) {
+        if (entry.path().extension() == ".pack" &&
+            (last_segment.empty() || std::stoul(entry.path().stem().string()) > std::stoul(last_segment.stem().string()))) {
+            last_segment = entry.path();
+        }
+    }
+    {
+        std::ofstream segment(last_segment.string(), std::ios::binary | std::ios::app);
+        segment << "PACK and then a torn record";
+    }
+
+    PackStore pack_store(directory, options);
+    vector<std::pair<string, FileIndexEntry>> entries = pack_store.get_entries();
+    ASSERT_EQ(19, entries.size());
+    ASSERT_FALSE(pack_store.contains("file5"));
+    ASSERT_EQ(make_content("file3", 10), read_packed(pack_store, "file3"));
+    ASSERT_EQ(make_content("file19", 200), read_packed(pack_store, "file19"));
+    put(pack_store, "after restart", 30);
+    ASSERT_EQ(make_content("after restart", 30), read_packed(pack_store, "after restart"));
+}
+
+TEST_F(PackStoreTest, compaction_reclaims_deleted_files) {
+    PackStoreOptions options;
+    options.segment_size = 4096;
+    PackStore pack_store(directory, options);
+    for (int i = 0; i < 40; i++) {
+        put(pack_store, "file" + std::to_string(i), 500);
+    }
+    for (int i = 0; i < 40; i++) {
+        if (i % 4 != 0) {
+            pack_store.remove("file" + std::to_string(i));
+        }
+    }
+    // A file that's read while its segment is compacted can still be read after
+    std::optional<PackedFileHandle> handle = pack_store.open("file0");
+    ASSERT_TRUE(handle);
+
+    PackStoreStatistics before = pack_store.get_statistics();
+    ASSERT_LT(0, pack_store.compact());
+    PackStoreStatistics after = pack_store.get_statistics();
+    ASSERT_EQ(10, after.num_files);
+    ASSERT_LT(after.num_segments, before.num_segments);
+    ASSERT_LT(after.dead_bytes, before.dead_bytes);
+    ASSERT_LT(0, after.reclaimed_bytes);
+
+    vector<uint8_t> content(500);
+    ASSERT_EQ(500, ::pread(handle->fd, content.data(), content.size(), handle->offset));
+    ::close(handle->fd);
+    ASSERT_EQ(make_content("file0", 500), content);
+
+    // The deleted files stay deleted after a restart, though the segments that deleted them are gone
+    PackStore reloaded(directory, options);
+    ASSERT_EQ(10, reloaded.get_entries().size());
+    for (int i = 0; i < 40; i += 4) {
+        ASSERT_EQ(make_content("file" + std::to_string(i), 500), read_packed(reloaded, "file" + std::to_string(i)));
+    }
+}
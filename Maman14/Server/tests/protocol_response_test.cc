@@ -48,6 +48,22 @@ TEST(ProtocolTest, restore_response) {
     ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
 }
 
+TEST(ProtocolTest, streamed_restore_response) {
+    ProtocolVersion version{123};
+    string filename("coolfile.txt");
+    Bytearray payload;
+    payload.push_string(string("This is my file\n"));
+
+    // The streamed response is everything but the payload, which is sent right after it
+    StreamedRestoreResponse response(123, filename, payload.len());
+    Bytearray packed_response = response.pack();
+    packed_response.push_bytes(payload);
+    Bytearray expected = pack_payload_filename_response(ResponseOP::SUCCESSFUL_RESTORE, version, filename, payload);
+
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
 TEST(ProtocolTest, list_files_response) {
     ProtocolVersion version{123};
     string filename("coolfile.txt");
@@ -76,6 +92,77 @@ TEST(ProtocolTest, backup_or_delete) {
     ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
 }
 
+TEST(ProtocolTest, batch_response) {
+    ProtocolVersion version{123};
+    vector<BatchEntryStatus> statuses{BatchEntryStatus::SUCCESS, BatchEntryStatus::FILE_NOT_FOUND,
+                                      BatchEntryStatus::TOO_BIG_FOR_BATCH};
+    Bytearray payload;
+    payload.push_u32(4);
+    payload.push_string(string("file"));
+
+    SuccessfulBatchResponse response(version, statuses, payload);
+    Bytearray packed_response = response.pack();
+    Bytearray expected = pack_header(ResponseOP::SUCCESSFUL_BATCH, version);
+    expected.push_u32(3);
+    expected.push_u8(0);
+    expected.push_u8(1);
+    expected.push_u8(4);
+    expected.push_u32(payload.len());
+    expected.push_bytes(payload);
+
+    ASSERT_EQ(1 + 2 + 4 + 3 + 4 + 8, expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
+TEST(ProtocolTest, range_restore_response) {
+    ProtocolVersion version{123};
+    string filename("coolfile.txt");
+
+    StreamedRangeRestoreResponse response(version, filename, 0x100000000, 4096, 512);
+    Bytearray packed_response = response.pack();
+    Bytearray expected = pack_filename_response(ResponseOP::SUCCESSFUL_RANGE_RESTORE, version, filename);
+    expected.push_u64(0x100000000);
+    expected.push_u64(4096);
+    expected.push_u32(512);
+
+    ASSERT_EQ(1 + 2 + 2 + filename.size() + 8 + 8 + 4, expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
+TEST(ProtocolTest, upload_status_response) {
+    ProtocolVersion version{123};
+
+    UploadStatusResponse response(version, 0xabcdef0123, 1000, {{0, 200}, {600, 400}});
+    Bytearray packed_response = response.pack();
+    Bytearray expected = pack_header(ResponseOP::UPLOAD_STATUS, version);
+    expected.push_u64(0xabcdef0123);
+    expected.push_u64(1000);
+    expected.push_u32(2);
+    expected.push_u64(0);
+    expected.push_u64(200);
+    expected.push_u64(600);
+    expected.push_u64(400);
+
+    ASSERT_EQ(1 + 2 + 8 + 8 + 4 + 2 * 16, expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
+TEST(ProtocolTest, invalid_upload_part_response) {
+    ProtocolVersion version{123};
+
+    InvalidUploadPartResponse response(version, 0xabcdef0123);
+    Bytearray packed_response = response.pack();
+    Bytearray expected = pack_header(ResponseOP::INVALID_UPLOAD_PART, version);
+    expected.push_u64(0xabcdef0123);
+
+    ASSERT_EQ(1 + 2 + 8, expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
 TEST(ProtocolTest, file_not_found) {
     ProtocolVersion version{123};
     string filename("coolfile211.txt");
@@ -112,3 +199,82 @@ TEST(ProtocolTest, server_error) {
     ASSERT_EQ(expected.len(), packed_response.len());
     ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
 }
+
+TEST(ProtocolTest, version_2_request_id) {
+    ProtocolVersion version{2};
+    string filename("coolfile2.txt");
+    RequestID request_id{0xdeadbeef};
+
+    SuccessfulBackupOrDeleteResponse response(version, filename);
+    response.set_request_id(request_id);
+    Bytearray packed_response = response.pack();
+
+    Bytearray expected = pack_header(ResponseOP::SUCCESSFUL_BACKUP_OR_DELETE, version);
+    expected.push_u32(request_id);
+    expected.push_u16(static_cast<uint16_t>(filename.length()));
+    expected.push_string(filename);
+
+    ASSERT_EQ(1 + 2 + 4 + 2 + filename.size(), expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+}
+
+TEST(ProtocolTest, restore_response_buffers) {
+    ProtocolVersion version{2};
+    string filename("coolfile.txt");
+    Bytearray payload;
+    payload.push_string(string("This is my file\n"));
+
+    SuccessfulRestoreResponse response(version, filename, payload);
+    response.set_request_id(7);
+    ResponseBuffers buffers{response};
+
+    // The fixed size fields before the filename are packed together, and so are the ones after it
+    ASSERT_EQ(4, buffers.buffers().size());
+    ASSERT_EQ(1 + 2 + 4 + 2, buffers.buffers()[0].size());
+    ASSERT_EQ(filename.size(), buffers.buffers()[1].size());
+    ASSERT_EQ(4, buffers.buffers()[2].size());
+    ASSERT_EQ(payload.len(), buffers.buffers()[3].size());
+
+    Bytearray flattened = buffers.flatten();
+    ASSERT_EQ(buffers.size(), flattened.len());
+    Bytearray packed_response = response.pack();
+    ASSERT_EQ(packed_response.len(), flattened.len());
+    ASSERT_TRUE(memcmp(packed_response.data(), flattened.data(), flattened.len()) == 0);
+}
+
+TEST(ProtocolTest, version_3_payload_size) {
+    ProtocolVersion version{3};
+    string filename("disk.img");
+    uint64_t payload_size{5ULL * 1024 * 1024 * 1024};
+
+    StreamedRestoreResponse response(version, filename, payload_size);
+    response.set_request_id(9);
+    Bytearray packed_response = response.pack();
+
+    Bytearray expected = pack_header(ResponseOP::SUCCESSFUL_RESTORE, version);
+    expected.push_u32(9);
+    expected.push_u16(static_cast<uint16_t>(filename.length()));
+    expected.push_string(filename);
+    expected.push_u64(payload_size);
+
+    ASSERT_EQ(1 + 2 + 4 + 2 + filename.size() + 8, expected.len());
+    ASSERT_EQ(expected.len(), packed_response.len());
+    ASSERT_TRUE(memcmp(expected.data(), packed_response.data(), packed_response.len()) == 0);
+
+    // Before version 3 the size is a uint32
+    ASSERT_FALSE(StreamedRestoreResponse::fits_version(PROTOCOL_VERSION_2, payload_size));
+    ASSERT_TRUE(StreamedRestoreResponse::fits_version(PROTOCOL_VERSION_2, 1024));
+    ASSERT_TRUE(StreamedRestoreResponse::fits_version(PROTOCOL_VERSION_3, payload_size));
+}
+
+TEST(ProtocolTest, empty_payload_buffers) {
+    ProtocolVersion version{123};
+    string filename("coolfile.txt");
+
+    // Empty data isn't worth a buffer
+    SuccessfulListFilesResponse response(version, filename, Bytearray());
+    ResponseBuffers buffers{response};
+    ASSERT_EQ(3, buffers.buffers().size());
+    ASSERT_EQ(1 + 2 + 2 + filename.size() + 4, buffers.size());
+}
@@ -3,10 +3,16 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <limits>
 #include <memory>
+#include <optional>
 
+#include "Maman14/Server/async_request_parser.h"
+#include "Maman14/Server/async_request_reader.h"
+#include "Maman14/Server/memory_budget.h"
 #include "Maman14/Server/protocol/request.h"
 #include "Maman14/Server/request_reader.h"
+#include "Maman14/Server/tests/coroutine_test_utils.h"
 
 class MockRequestReader : public AbstractRequestReader {
 public:
@@ -20,6 +26,57 @@ using std::unique_ptr;
 using ::testing::Return;
 using ::testing::ReturnPointee;
 
+/**
+ * @brief Forwards the coroutine reader interface to a MockRequestReader,
+ * so the same expectations apply to both parsers
+ *
+ */
+class MockAsyncRequestReader : public AbstractAsyncRequestReader {
+public:
+    MockAsyncRequestReader(unique_ptr<MockRequestReader> mock) : mock_(std::move(mock)) {}
+
+    virtual awaitable<uint32_t> read_uint32() override { co_return mock_->read_uint32(); }
+    virtual awaitable<uint16_t> read_uint16() override { co_return mock_->read_uint16(); }
+    virtual awaitable<uint8_t> read_uint8() override { co_return mock_->read_uint8(); }
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t size) override { co_return mock_->read_bytes(size); }
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t max_size) override {
+        last_span_ = mock_->read_bytes(max_size);
+        co_return std::span<const uint8_t>(last_span_);
+    }
+
+private:
+    unique_ptr<MockRequestReader> mock_;
+    vector<uint8_t> last_span_;
+};
+
+/**
+ * @brief Wraps AsyncRequestParser with the blocking interface of RequestParser,
+ * so the same tests run against both parsers
+ *
+ */
+class CoroutineRequestParser {
+public:
+    CoroutineRequestParser(unique_ptr<MockRequestReader> reader)
+        : parser_(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader)))) {}
+
+    unique_ptr<ProtocolRequest> parse_message(ProtocolVersion expected_version) {
+        return run_awaitable(parser_.parse_message(expected_version));
+    }
+
+    unique_ptr<ProtocolRequest> parse_message(ProtocolVersion min_version, ProtocolVersion max_version) {
+        return run_awaitable(parser_.parse_message(min_version, max_version));
+    }
+
+private:
+    AsyncRequestParser parser_;
+};
+
+template <typename T>
+class RequestTest : public ::testing::Test {};
+
+using RequestParserTypes = ::testing::Types<RequestParser, CoroutineRequestParser>;
+TYPED_TEST_SUITE(RequestTest, RequestParserTypes);
+
 template <typename Derived, typename Base>
 inline std::unique_ptr<Derived> dynamic_pointer_cast(std::unique_ptr<Base>&& ptr_) {
     Derived* const converted_ptr = dynamic_cast<Derived*>(ptr_.get());
@@ -31,7 +88,7 @@ inline std::unique_ptr<Derived> dynamic_pointer_cast(std::unique_ptr<Base>&& ptr
     return std::unique_ptr<Derived>(converted_ptr);
 }
 
-TEST(RequestTest, list_files_request) {
+TYPED_TEST(RequestTest, list_files_request) {
     MockRequestReader* mock_reader = new MockRequestReader();
     EXPECT_CALL(*mock_reader, read_uint32())
         .WillOnce(Return(123));
@@ -41,13 +98,13 @@ TEST(RequestTest, list_files_request) {
         .WillOnce(Return(202));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
 
     unique_ptr<ListFilesRequest> request{dynamic_pointer_cast<ListFilesRequest>(parser.parse_message(1))};
     ASSERT_EQ(123, request->get_user_id());
 }
 
-TEST(RequestTest, invalid_op_request) {
+TYPED_TEST(RequestTest, invalid_op_request) {
     MockRequestReader* mock_reader = new MockRequestReader();
     EXPECT_CALL(*mock_reader, read_uint32())
         .WillOnce(Return(123));
@@ -57,7 +114,7 @@ TEST(RequestTest, invalid_op_request) {
         .WillOnce(Return(0));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
 
     EXPECT_THROW(
         {
@@ -66,7 +123,7 @@ TEST(RequestTest, invalid_op_request) {
         InvalidRequestException);
 }
 
-TEST(RequestTest, wrong_request_cast) {
+TYPED_TEST(RequestTest, wrong_request_cast) {
     MockRequestReader* mock_reader = new MockRequestReader();
     string filename{"file.jpeg"};
     vector<uint8_t> filename_payload(filename.begin(), filename.end());
@@ -78,7 +135,7 @@ TEST(RequestTest, wrong_request_cast) {
         .WillOnce(Return(202));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
 
     EXPECT_THROW(
         {
@@ -87,7 +144,7 @@ TEST(RequestTest, wrong_request_cast) {
         std::bad_cast);
 }
 
-TEST(RequestTest, wrong_version) {
+TYPED_TEST(RequestTest, wrong_version) {
     MockRequestReader* mock_reader = new MockRequestReader();
     EXPECT_CALL(*mock_reader, read_uint32())
         .WillOnce(Return(123));
@@ -96,7 +153,7 @@ TEST(RequestTest, wrong_version) {
         .WillOnce(Return(50));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
 
     EXPECT_THROW(
         {
@@ -105,7 +162,7 @@ TEST(RequestTest, wrong_version) {
         VersionMismatchException);
 }
 
-TEST(RequestTest, backup_file_request) {
+TYPED_TEST(RequestTest, backup_file_request) {
     MockRequestReader* mock_reader = new MockRequestReader();
     string filename{"file.jpeg"};
     vector<uint8_t> filename_vector(filename.begin(), filename.end());
@@ -131,7 +188,7 @@ TEST(RequestTest, backup_file_request) {
         .WillOnce(Return(payload_vector));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
     unique_ptr<BackupFileRequest> request{dynamic_pointer_cast<BackupFileRequest>(parser.parse_message(1))};
 
     ASSERT_EQ(123, request->get_user_id());
@@ -139,7 +196,7 @@ TEST(RequestTest, backup_file_request) {
     ASSERT_EQ(payload_vector, request->get_payload());
 }
 
-TEST(RequestTest, restore_file_request) {
+TYPED_TEST(RequestTest, restore_file_request) {
     MockRequestReader* mock_reader = new MockRequestReader();
     string filename{"file.jpeg"};
     vector<uint8_t> filename_vector(filename.begin(), filename.end());
@@ -158,14 +215,14 @@ TEST(RequestTest, restore_file_request) {
         .WillOnce(Return(filename_vector));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
     unique_ptr<RestoreFileRequest> request{dynamic_pointer_cast<RestoreFileRequest>(parser.parse_message(1))};
 
     ASSERT_EQ(123, request->get_user_id());
     ASSERT_EQ(filename, request->get_filename());
 }
 
-TEST(RequestTest, delete_file_request) {
+TYPED_TEST(RequestTest, delete_file_request) {
     MockRequestReader* mock_reader = new MockRequestReader();
     string filename{"file.jpeg"};
     vector<uint8_t> filename_vector(filename.begin(), filename.end());
@@ -184,9 +241,747 @@ TEST(RequestTest, delete_file_request) {
         .WillOnce(Return(filename_vector));
 
     unique_ptr<MockRequestReader> reader{mock_reader};
-    RequestParser parser(std::move(reader));
+    TypeParam parser(std::move(reader));
     unique_ptr<DeleteFileRequest> request{dynamic_pointer_cast<DeleteFileRequest>(parser.parse_message(1))};
 
     ASSERT_EQ(123, request->get_user_id());
     ASSERT_EQ(filename, request->get_filename());
 }
+
+TYPED_TEST(RequestTest, backup_delta_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> delta{1, 2, 3, 4, 5};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(delta.size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(delta.size()))
+        .WillOnce(Return(delta));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<BackupDeltaRequest> request{dynamic_pointer_cast<BackupDeltaRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(filename, request->get_filename());
+    ASSERT_EQ(delta, request->get_payload());
+    ASSERT_FALSE(request->is_payload_streamed());
+}
+
+TYPED_TEST(RequestTest, get_signatures_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(203));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<GetSignaturesRequest> request{dynamic_pointer_cast<GetSignaturesRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(filename, request->get_filename());
+}
+
+TYPED_TEST(RequestTest, restore_file_compressed_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(204));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<RestoreFileCompressedRequest> request{dynamic_pointer_cast<RestoreFileCompressedRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(filename, request->get_filename());
+}
+
+TYPED_TEST(RequestTest, backup_batch_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    vector<string> filenames{"a.txt", "bb.txt"};
+    vector<vector<uint8_t>> payloads{{'h', 'e', 'l', 'l', 'o', ' ', 'w', 'o', 'r', 'l', 'd'}, {'x'}};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(filenames.size()))
+        .WillOnce(Return(payloads[0].size()))
+        .WillOnce(Return(payloads[1].size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(102));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filenames[0].size()))
+        .WillOnce(Return(filenames[1].size()));
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        EXPECT_CALL(*mock_reader, read_bytes(filenames[i].size()))
+            .WillOnce(Return(vector<uint8_t>(filenames[i].begin(), filenames[i].end())));
+        EXPECT_CALL(*mock_reader, read_bytes(payloads[i].size()))
+            .WillOnce(Return(payloads[i]));
+    }
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<BackupBatchRequest> request{dynamic_pointer_cast<BackupBatchRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(filenames, request->get_filenames());
+    ASSERT_EQ(payloads, request->get_payloads());
+}
+
+TYPED_TEST(RequestTest, delete_batch_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(2));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(206));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .Times(2)
+        .WillRepeatedly(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .Times(2)
+        .WillRepeatedly(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<DeleteBatchRequest> request{dynamic_pointer_cast<DeleteBatchRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ((vector<string>{filename, filename}), request->get_filenames());
+}
+
+TYPED_TEST(RequestTest, backup_delta_too_big) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(BackupDeltaRequest::MAX_DELTA_SIZE + 1));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(parser.parse_message(1), PayloadTooBigException);
+}
+
+TYPED_TEST(RequestTest, too_many_batch_entries) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(BatchRequest::MAX_ENTRIES + 1));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(205));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(parser.parse_message(1), InvalidBatchException);
+}
+
+TYPED_TEST(RequestTest, batch_filenames_too_big) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    // No filename is too long on its own, but there are enough of them to pass the cap together
+    string filename(std::numeric_limits<uint16_t>::max(), 'a');
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    uint32_t num_entries = BatchRequest::MAX_PAYLOADS_SIZE / filename.size() + 1;
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(num_entries));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(205));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .Times(num_entries)
+        .WillRepeatedly(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .Times(num_entries)
+        .WillRepeatedly(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(parser.parse_message(1), InvalidBatchException);
+}
+
+TYPED_TEST(RequestTest, restore_range_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    // The offset is sent as two halves, the low one first
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(0x10))
+        .WillOnce(Return(0x2))
+        .WillOnce(Return(4096));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(207));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<RestoreRangeRequest> request{dynamic_pointer_cast<RestoreRangeRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(filename, request->get_filename());
+    ASSERT_EQ(0x200000010, request->get_offset());
+    ASSERT_EQ(4096, request->get_size());
+}
+
+TYPED_TEST(RequestTest, upload_part_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    vector<uint8_t> payload{'p', 'a', 'r', 't'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(0xdeadbeef))
+        .WillOnce(Return(0x1))
+        .WillOnce(Return(1024))
+        .WillOnce(Return(0))
+        .WillOnce(Return(payload.size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(104));
+
+    EXPECT_CALL(*mock_reader, read_bytes(payload.size()))
+        .WillOnce(Return(payload));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<UploadPartRequest> request{dynamic_pointer_cast<UploadPartRequest>(parser.parse_message(1))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(0x1deadbeef, request->get_token());
+    ASSERT_EQ(1024, request->get_offset());
+    ASSERT_EQ(payload, request->get_payload());
+}
+
+TYPED_TEST(RequestTest, upload_part_too_big) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(1))
+        .WillOnce(Return(0))
+        .WillOnce(Return(0))
+        .WillOnce(Return(0))
+        .WillOnce(Return(UploadPartRequest::MAX_PART_SIZE + 1));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(104));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(parser.parse_message(1), InvalidUploadPartException);
+}
+
+TYPED_TEST(RequestTest, version_2_request_id) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(98765));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(2))
+        .WillOnce(Return(200));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<RestoreFileRequest> request{dynamic_pointer_cast<RestoreFileRequest>(parser.parse_message(1, 2))};
+
+    ASSERT_EQ(123, request->get_user_id());
+    ASSERT_EQ(2, request->get_version());
+    ASSERT_EQ(98765, request->get_request_id());
+    ASSERT_EQ(filename, request->get_filename());
+}
+
+TYPED_TEST(RequestTest, version_3_payload_size) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> payload{'d', 'e', 'l', 't', 'a'};
+
+    // The payload size is a uint64, sent as two halves
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(payload.size()))
+        .WillOnce(Return(0));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(payload.size()))
+        .WillOnce(Return(payload));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<BackupDeltaRequest> request{dynamic_pointer_cast<BackupDeltaRequest>(parser.parse_message(1, 3))};
+
+    ASSERT_EQ(3, request->get_version());
+    ASSERT_EQ(7, request->get_request_id());
+    ASSERT_EQ(payload, request->get_payload());
+}
+
+TYPED_TEST(RequestTest, version_3_chunked_payload) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"dump.sql"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> first{'a', 'b', 'c'};
+    vector<uint8_t> second{'d', 'e'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(first.size()))
+        .WillOnce(Return(second.size()))
+        .WillOnce(Return(0));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(100));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(first.size()))
+        .WillOnce(Return(first));
+
+    EXPECT_CALL(*mock_reader, read_bytes(second.size()))
+        .WillOnce(Return(second));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+    unique_ptr<BackupFileRequest> request{dynamic_pointer_cast<BackupFileRequest>(parser.parse_message(3))};
+
+    // The frames are joined into the payload
+    ASSERT_EQ(filename, request->get_filename());
+    ASSERT_EQ((vector<uint8_t>{'a', 'b', 'c', 'd', 'e'}), request->get_payload());
+    ASSERT_FALSE(request->is_payload_streamed());
+}
+
+TYPED_TEST(RequestTest, version_3_chunked_delta_too_big) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"dump.sql"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> first{'a', 'b', 'c', 'd'};
+
+    // No frame is too big on its own, together they are
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(first.size()))
+        .WillOnce(Return(BackupDeltaRequest::MAX_DELTA_SIZE - first.size() + 1));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(first.size()))
+        .WillOnce(Return(first));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(parser.parse_message(3), PayloadTooBigException);
+}
+
+TYPED_TEST(RequestTest, version_out_of_range) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    TypeParam parser(std::move(reader));
+
+    EXPECT_THROW(
+        {
+            unique_ptr<ListFilesRequest> request{dynamic_pointer_cast<ListFilesRequest>(parser.parse_message(1, 2))};
+        },
+        VersionMismatchException);
+}
+
+TEST(AsyncRequestTest, streamed_backup_file_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"file.jpeg"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> chunk{'a', 'b', 'c'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(1000));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(100));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    // The payload is only read when asked for, in chunks
+    EXPECT_CALL(*mock_reader, read_bytes(chunk.size()))
+        .WillOnce(Return(chunk));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true);
+    unique_ptr<BackupFileRequest> request{dynamic_pointer_cast<BackupFileRequest>(run_awaitable(parser.parse_message(1)))};
+
+    ASSERT_EQ(filename, request->get_filename());
+    ASSERT_TRUE(request->is_payload_streamed());
+    ASSERT_EQ(1000, request->get_payload_size());
+    ASSERT_TRUE(request->get_payload().empty());
+    std::span<const uint8_t> read_chunk{run_awaitable(parser.read_payload_chunk(chunk.size()))};
+    ASSERT_EQ(chunk, vector<uint8_t>(read_chunk.begin(), read_chunk.end()));
+}
+
+TEST(AsyncRequestTest, streamed_chunked_backup_file_request) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"dump.sql"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> chunk{'a', 'b', 'c'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(chunk.size()))
+        .WillOnce(Return(0));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(100));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(chunk.size()))
+        .WillOnce(Return(chunk));
+
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true);
+    unique_ptr<BackupFileRequest> request{dynamic_pointer_cast<BackupFileRequest>(run_awaitable(parser.parse_message(3)))};
+
+    ASSERT_TRUE(request->is_payload_streamed());
+    ASSERT_TRUE(request->is_payload_chunked());
+    // The frames are left on the connection, and read one at a time
+    ASSERT_EQ(chunk.size(), run_awaitable(parser.read_payload_frame_size()));
+    std::span<const uint8_t> read_chunk{run_awaitable(parser.read_payload_chunk(chunk.size()))};
+    ASSERT_EQ(chunk, vector<uint8_t>(read_chunk.begin(), read_chunk.end()));
+    ASSERT_EQ(0, run_awaitable(parser.read_payload_frame_size()));
+}
+
+TEST(AsyncRequestTest, upload_part_holds_its_memory) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    vector<uint8_t> payload{'p', 'a', 'r', 't'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(1))
+        .WillOnce(Return(0))
+        .WillOnce(Return(0))
+        .WillOnce(Return(0))
+        .WillOnce(Return(payload.size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(104));
+
+    EXPECT_CALL(*mock_reader, read_bytes(payload.size()))
+        .WillOnce(Return(payload));
+
+    MemoryBudget budget(1024);
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true, &budget);
+    unique_ptr<ProtocolRequest> request{run_awaitable(parser.parse_message(1))};
+
+    // The part stays reserved until it's handled
+    ASSERT_EQ(payload.size(), budget.get_used());
+    request.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
+
+TEST(AsyncRequestTest, chunked_delta_holds_its_memory) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"dump.sql"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> first{'a', 'b', 'c'};
+    vector<uint8_t> second{'d', 'e'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(first.size()))
+        .WillOnce(Return(second.size()))
+        .WillOnce(Return(0));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(first.size()))
+        .WillOnce(Return(first));
+
+    EXPECT_CALL(*mock_reader, read_bytes(second.size()))
+        .WillOnce(Return(second));
+
+    // Smaller than the delta, which takes all of it instead of waiting for itself
+    MemoryBudget budget(4);
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true, &budget);
+    unique_ptr<ProtocolRequest> request{run_awaitable(parser.parse_message(3))};
+
+    ASSERT_EQ(budget.get_capacity(), budget.get_used());
+    request.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
+
+TEST(AsyncRequestTest, chunked_delta_reserves_once) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    string filename{"dump.sql"};
+    vector<uint8_t> filename_vector(filename.begin(), filename.end());
+    vector<uint8_t> first{'a', 'b', 'c'};
+    vector<uint8_t> second{'d', 'e'};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(7))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(0xffffffff))
+        .WillOnce(Return(first.size()))
+        .WillOnce(Return(second.size()))
+        .WillOnce(Return(0));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(3))
+        .WillOnce(Return(101));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filename.size()));
+
+    EXPECT_CALL(*mock_reader, read_bytes(filename.size()))
+        .WillOnce(Return(filename_vector));
+
+    EXPECT_CALL(*mock_reader, read_bytes(first.size()))
+        .WillOnce(Return(first));
+
+    EXPECT_CALL(*mock_reader, read_bytes(second.size()))
+        .WillOnce(Return(second));
+
+    MemoryBudget budget(1024);
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true, &budget);
+    unique_ptr<ProtocolRequest> request{run_awaitable(parser.parse_message(3))};
+
+    // The frames were reserved together up front, and what they didn't take was given back
+    ASSERT_EQ(first.size() + second.size(), budget.get_used());
+    request.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
+
+TEST(AsyncRequestTest, backup_batch_holds_its_memory) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    vector<string> filenames{"a.txt", "bb.txt"};
+    vector<vector<uint8_t>> payloads{{'h', 'e', 'y'}, {'x'}};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(filenames.size()))
+        .WillOnce(Return(payloads[0].size()))
+        .WillOnce(Return(payloads[1].size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(102));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filenames[0].size()))
+        .WillOnce(Return(filenames[1].size()));
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        EXPECT_CALL(*mock_reader, read_bytes(filenames[i].size()))
+            .WillOnce(Return(vector<uint8_t>(filenames[i].begin(), filenames[i].end())));
+        EXPECT_CALL(*mock_reader, read_bytes(payloads[i].size()))
+            .WillOnce(Return(payloads[i]));
+    }
+
+    MemoryBudget budget(1024);
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true, &budget);
+    unique_ptr<ProtocolRequest> request{run_awaitable(parser.parse_message(1))};
+
+    ASSERT_EQ(payloads[0].size() + payloads[1].size(), budget.get_used());
+    request.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
+
+TEST(AsyncRequestTest, backup_batch_reserves_before_its_entries) {
+    MockRequestReader* mock_reader = new MockRequestReader();
+    vector<string> filenames{"a.txt", "bb.txt"};
+    vector<vector<uint8_t>> payloads{{'h', 'e', 'y'}, {'x'}};
+
+    EXPECT_CALL(*mock_reader, read_uint32())
+        .WillOnce(Return(123))
+        .WillOnce(Return(filenames.size()))
+        .WillOnce(Return(payloads[0].size()))
+        .WillOnce(Return(payloads[1].size()));
+
+    EXPECT_CALL(*mock_reader, read_uint8())
+        .WillOnce(Return(1))
+        .WillOnce(Return(102));
+
+    EXPECT_CALL(*mock_reader, read_uint16())
+        .WillOnce(Return(filenames[0].size()))
+        .WillOnce(Return(filenames[1].size()));
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        EXPECT_CALL(*mock_reader, read_bytes(filenames[i].size()))
+            .WillOnce(Return(vector<uint8_t>(filenames[i].begin(), filenames[i].end())));
+        EXPECT_CALL(*mock_reader, read_bytes(payloads[i].size()))
+            .WillOnce(Return(payloads[i]));
+    }
+
+    MemoryBudget budget(1024);
+    unique_ptr<MockRequestReader> reader{mock_reader};
+    AsyncRequestParser parser(unique_ptr<MockAsyncRequestReader>(new MockAsyncRequestReader(std::move(reader))), true, &budget);
+    boost::asio::io_context io;
+    std::optional<MemoryBudget::Reservation> held;
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> { held.emplace(co_await budget.acquire(1)); }, boost::asio::detached);
+    unique_ptr<ProtocolRequest> request;
+    boost::asio::co_spawn(
+        io, [&]() -> awaitable<void> { request = co_await parser.parse_message(1); }, boost::asio::detached);
+
+    // The batch waits for all of the budget that it may take before it reads its entries, instead of holding
+    // the first entries while it waits for the rest
+    io.poll();
+    ASSERT_EQ(nullptr, request);
+    ASSERT_EQ(1, budget.get_used());
+
+    held.reset();
+    io.run();
+    ASSERT_NE(nullptr, request);
+    // What the entries didn't take was given back
+    ASSERT_EQ(payloads[0].size() + payloads[1].size(), budget.get_used());
+    request.reset();
+    ASSERT_EQ(0, budget.get_used());
+}
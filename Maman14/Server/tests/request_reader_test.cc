@@ -3,55 +3,198 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 
+#include "Maman14/Server/async_buffered_request_reader.h"
+#include "Maman14/Server/async_connection_manager.h"
+#include "Maman14/Server/async_request_reader.h"
+#include "Maman14/Server/buffered_request_reader.h"
 #include "Maman14/Server/connection_manager.h"
+#include "Maman14/Server/tests/coroutine_test_utils.h"
 
 using std::unique_ptr;
+using ::testing::_;
 using ::testing::Return;
 
-class MockConnectionMangager : public AbstractConnectionManager {
+class MockConnectionMangager : public AbstractConnectionManager, public AbstractAsyncConnectionManager {
 public:
     MOCK_METHOD1(send, void(const vector<uint8_t>&));
     MOCK_METHOD1(recv, vector<uint8_t>(size_t));
+    MOCK_METHOD2(recv_some, size_t(uint8_t*, size_t));
+
+    // The coroutine interface forwards to the mocked methods so the same expectations apply to both
+    virtual awaitable<void> async_send(const vector<uint8_t>& to_send) override {
+        send(to_send);
+        co_return;
+    }
+    virtual awaitable<vector<uint8_t>> async_recv(size_t size) override { co_return recv(size); }
+    virtual awaitable<size_t> async_recv_some(uint8_t* data, size_t max_size) override { co_return recv_some(data, max_size); }
+};
+
+/**
+ * @brief Wraps AsyncRequestReader with the blocking interface of RequestReader,
+ * so the same tests run against both readers
+ *
+ */
+class CoroutineRequestReader {
+public:
+    CoroutineRequestReader(unique_ptr<MockConnectionMangager> connection) : reader_(std::move(connection)) {}
+
+    uint32_t read_uint32() { return run_awaitable(reader_.read_uint32()); }
+    uint16_t read_uint16() { return run_awaitable(reader_.read_uint16()); }
+    uint8_t read_uint8() { return run_awaitable(reader_.read_uint8()); }
+    vector<uint8_t> read_bytes(size_t size) { return run_awaitable(reader_.read_bytes(size)); }
+
+private:
+    AsyncRequestReader reader_;
 };
 
-TEST(RquestReaderTest, read_uint8) {
+template <typename T>
+class RquestReaderTest : public ::testing::Test {};
+
+using RequestReaderTypes = ::testing::Types<RequestReader, CoroutineRequestReader>;
+TYPED_TEST_SUITE(RquestReaderTest, RequestReaderTypes);
+
+TYPED_TEST(RquestReaderTest, read_uint8) {
     unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
     vector<uint8_t> vec{2};
     EXPECT_CALL(*mock_connection, recv(1))
         .WillOnce(Return(vec));
 
-    RequestReader reader(std::move(mock_connection));
+    TypeParam reader(std::move(mock_connection));
     ASSERT_EQ(2, reader.read_uint8());
 }
 
-TEST(RquestReaderTest, read_uint16) {
+TYPED_TEST(RquestReaderTest, read_uint16) {
     unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
     vector<uint8_t> vec{0x2, 0x25};
     EXPECT_CALL(*mock_connection, recv(2))
         .WillOnce(Return(vec));
 
-    RequestReader reader(std::move(mock_connection));
+    TypeParam reader(std::move(mock_connection));
     ASSERT_EQ(9474, reader.read_uint16());
 }
 
-TEST(RquestReaderTest, read_uint32) {
+TYPED_TEST(RquestReaderTest, read_uint32) {
     unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
     vector<uint8_t> vec{0x2, 0x25, 0x12, 0xfb};
     EXPECT_CALL(*mock_connection, recv(4))
         .WillOnce(Return(vec));
 
-    RequestReader reader(std::move(mock_connection));
+    TypeParam reader(std::move(mock_connection));
     ASSERT_EQ(4212270338, reader.read_uint32());
 }
 
-TEST(RquestReaderTest, read_bytes) {
+TYPED_TEST(RquestReaderTest, read_bytes) {
     unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
     vector<uint8_t> vec{'a', 'c', '1', 'g', '\x12', 255};
     EXPECT_CALL(*mock_connection, recv(vec.size()))
         .WillOnce(Return(vec));
 
-    RequestReader reader(std::move(mock_connection));
+    TypeParam reader(std::move(mock_connection));
     ASSERT_EQ(vec, reader.read_bytes(vec.size()));
 }
+
+/**
+ * @brief An action for recv_some, that receives the bytes (or as many of them as fit)
+ *
+ */
+static auto receive(vector<uint8_t> bytes) {
+    return [bytes](uint8_t* data, size_t max_size) {
+        size_t size = std::min(bytes.size(), max_size);
+        std::memcpy(data, bytes.data(), size);
+        return size;
+    };
+}
+
+/**
+ * @brief Wraps AsyncBufferedRequestReader with the blocking interface of BufferedRequestReader
+ *
+ */
+class CoroutineBufferedRequestReader {
+public:
+    CoroutineBufferedRequestReader(unique_ptr<MockConnectionMangager> connection, size_t buffer_size)
+        : reader_(std::move(connection), buffer_size) {}
+
+    uint32_t read_uint32() { return run_awaitable(reader_.read_uint32()); }
+    uint16_t read_uint16() { return run_awaitable(reader_.read_uint16()); }
+    uint8_t read_uint8() { return run_awaitable(reader_.read_uint8()); }
+    vector<uint8_t> read_bytes(size_t size) { return run_awaitable(reader_.read_bytes(size)); }
+    std::span<const uint8_t> read_span(size_t max_size) { return run_awaitable(reader_.read_span(max_size)); }
+
+private:
+    AsyncBufferedRequestReader reader_;
+};
+
+template <typename T>
+class BufferedRequestReaderTest : public ::testing::Test {};
+
+using BufferedRequestReaderTypes = ::testing::Types<BufferedRequestReader, CoroutineBufferedRequestReader>;
+TYPED_TEST_SUITE(BufferedRequestReaderTest, BufferedRequestReaderTypes);
+
+TYPED_TEST(BufferedRequestReaderTest, header_in_single_recv) {
+    unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
+    vector<uint8_t> header{0x2, 0x25, 0x12, 0xfb, 1, 100, 3, 0, 'a', 'b', 'c'};
+    EXPECT_CALL(*mock_connection, recv_some(_, _))
+        .WillOnce(receive(header));
+
+    TypeParam reader(std::move(mock_connection), 64);
+    ASSERT_EQ(4212270338, reader.read_uint32());
+    ASSERT_EQ(1, reader.read_uint8());
+    ASSERT_EQ(100, reader.read_uint8());
+    ASSERT_EQ(3, reader.read_uint16());
+    ASSERT_EQ(vector<uint8_t>({'a', 'b', 'c'}), reader.read_bytes(3));
+}
+
+TYPED_TEST(BufferedRequestReaderTest, fields_split_between_recvs) {
+    unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
+    EXPECT_CALL(*mock_connection, recv_some(_, _))
+        .WillOnce(receive({0x2}))
+        .WillOnce(receive({0x25, 0x12}))
+        .WillOnce(receive({0xfb, 0x2}))
+        .WillOnce(receive({0x25}));
+
+    TypeParam reader(std::move(mock_connection), 64);
+    ASSERT_EQ(4212270338, reader.read_uint32());
+    ASSERT_EQ(9474, reader.read_uint16());
+}
+
+TYPED_TEST(BufferedRequestReaderTest, fields_wrap_around_buffer) {
+    unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
+    // The buffer holds 8 bytes, so the second uint32 starts at its end and wraps around to its start
+    EXPECT_CALL(*mock_connection, recv_some(_, _))
+        .WillOnce(receive({0, 0, 0, 0, 0, 0, 0x2, 0x25}))
+        .WillOnce(receive({0x12, 0xfb}));
+
+    TypeParam reader(std::move(mock_connection), 8);
+    ASSERT_EQ(0, reader.read_uint32());
+    ASSERT_EQ(0, reader.read_uint16());
+    ASSERT_EQ(4212270338, reader.read_uint32());
+}
+
+TYPED_TEST(BufferedRequestReaderTest, large_read_bytes) {
+    unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
+    vector<uint8_t> bytes(100, 'x');
+    EXPECT_CALL(*mock_connection, recv_some(_, _))
+        .WillOnce(receive(vector<uint8_t>(bytes.begin(), bytes.begin() + 8)))
+        .WillOnce(receive(vector<uint8_t>(bytes.begin() + 8, bytes.end())));
+
+    TypeParam reader(std::move(mock_connection), 8);
+    ASSERT_EQ(bytes, reader.read_bytes(bytes.size()));
+}
+
+TYPED_TEST(BufferedRequestReaderTest, read_span) {
+    unique_ptr<MockConnectionMangager> mock_connection(new MockConnectionMangager());
+    EXPECT_CALL(*mock_connection, recv_some(_, _))
+        .WillOnce(receive({'a', 'b', 'c', 'd', 'e'}));
+
+    TypeParam reader(std::move(mock_connection), 64);
+    std::span<const uint8_t> span{reader.read_span(3)};
+    ASSERT_EQ(vector<uint8_t>({'a', 'b', 'c'}), vector<uint8_t>(span.begin(), span.end()));
+
+    // Only what's already buffered is returned, without receiving more
+    span = reader.read_span(100);
+    ASSERT_EQ(vector<uint8_t>({'d', 'e'}), vector<uint8_t>(span.begin(), span.end()));
+}
@@ -0,0 +1,75 @@
+#include "Maman14/Server/request_router.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/make_unique.hpp>
+
+#include "Maman14/Server/protocol/request.h"
+#include "Maman14/Server/protocol/response.h"
+
+static const uint32_t USER_ID = 1234;
+
+static RequestRouter::Handler make_handler(ProtocolVersion* handled_version) {
+    return [handled_version](unique_ptr<ProtocolRequest> request) {
+        *handled_version = request->get_version();
+        return Reply(boost::make_unique<ServerErrorResponse>(request->get_version()));
+    };
+}
+
+TEST(RequestRouterTest, route_by_version) {
+    RequestRouter router;
+    ProtocolVersion old_handled = 0;
+    ProtocolVersion new_handled = 0;
+    router.register_version(PROTOCOL_VERSION_1, {{RequestOP::LIST_FILES, make_handler(&old_handled)}});
+    router.register_version(PROTOCOL_VERSION_3, {{RequestOP::LIST_FILES, make_handler(&new_handled)},
+                                                 {RequestOP::DELETE_FILE, make_handler(&new_handled)}});
+    ASSERT_EQ(PROTOCOL_VERSION_1, router.get_min_version());
+    ASSERT_EQ(PROTOCOL_VERSION_3, router.get_max_version());
+    ASSERT_TRUE(router.is_supported(PROTOCOL_VERSION_1));
+    ASSERT_FALSE(router.is_supported(PROTOCOL_VERSION_2));
+
+    Reply reply{router.route(boost::make_unique<ListFilesRequest>(USER_ID, PROTOCOL_VERSION_1))};
+    ASSERT_NE(nullptr, dynamic_cast<ServerErrorResponse*>(reply.response.get()));
+    ASSERT_EQ(PROTOCOL_VERSION_1, old_handled);
+    ASSERT_EQ(0, new_handled);
+    router.route(boost::make_unique<DeleteFileRequest>(USER_ID, PROTOCOL_VERSION_3, "file"));
+    ASSERT_EQ(PROTOCOL_VERSION_3, new_handled);
+
+    // Only in the newer version's table
+    ASSERT_THROW(router.route(boost::make_unique<DeleteFileRequest>(USER_ID, PROTOCOL_VERSION_1, "file")),
+                 UnsupportedRequestException);
+    ASSERT_THROW(router.route(boost::make_unique<ListFilesRequest>(USER_ID, PROTOCOL_VERSION_2)),
+                 UnsupportedVersionException);
+}
+
+TEST(RequestRouterTest, statistics) {
+    RequestRouter router;
+    ProtocolVersion handled = 0;
+    router.register_version(PROTOCOL_VERSION_1, {{RequestOP::LIST_FILES, make_handler(&handled)}});
+    router.register_version(PROTOCOL_VERSION_2, {{RequestOP::LIST_FILES, make_handler(&handled)},
+                                                 {RequestOP::BACKUP_FILE, make_handler(&handled)}});
+    router.route(boost::make_unique<ListFilesRequest>(USER_ID, PROTOCOL_VERSION_1));
+    router.route(boost::make_unique<ListFilesRequest>(USER_ID, PROTOCOL_VERSION_2));
+    router.route(boost::make_unique<ListFilesRequest>(USER_ID, PROTOCOL_VERSION_2));
+    // Admitted without being handled, like a streamed backup
+    router.admit(ListFilesRequest(USER_ID, PROTOCOL_VERSION_2));
+    ASSERT_THROW(router.admit(ListFilesRequest(USER_ID, PROTOCOL_VERSION_3)), UnsupportedVersionException);
+    ASSERT_EQ(PROTOCOL_VERSION_2, handled);
+
+    ProtocolStatistics statistics{router.get_statistics()};
+    ASSERT_EQ(1, statistics.get_requests(PROTOCOL_VERSION_1));
+    ASSERT_EQ(3, statistics.get_requests(PROTOCOL_VERSION_2));
+    ASSERT_EQ(0, statistics.get_requests(PROTOCOL_VERSION_3));
+    ASSERT_EQ("version 1 requests: 1 version 2 requests: 3", statistics.to_string());
+}
+
+TEST(RequestRouterTest, invalid_versions) {
+    RequestRouter router;
+    ASSERT_THROW(router.get_min_version(), std::runtime_error);
+    router.register_version(PROTOCOL_VERSION_1, {});
+    // Registered already
+    ASSERT_THROW(router.register_version(PROTOCOL_VERSION_1, {}), UnsupportedVersionException);
+    // There's no way to parse it
+    ASSERT_THROW(router.register_version(123, {}), UnsupportedVersionException);
+    ASSERT_EQ(PROTOCOL_VERSION_1, router.get_max_version());
+}
@@ -0,0 +1,132 @@
+#include "Maman14/Server/restore_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static shared_ptr<const CachedFile> make_file(size_t size, int64_t mtime_ns = 1) {
+    return std::make_shared<CachedFile>(CachedFile{vector<uint8_t>(size, 'c'), FileIndexEntry{size, mtime_ns, std::nullopt}});
+}
+
+static RestoreCacheOptions make_options(size_t capacity) {
+    RestoreCacheOptions options;
+    options.capacity = capacity;
+    options.num_shards = 1;
+    options.window_fraction = 0.1;
+    return options;
+}
+
+TEST(FrequencySketchTest, counts_and_ages) {
+    FrequencySketch sketch(16);
+    for (int i = 0; i < 5; i++) {
+        sketch.increment(42);
+    }
+    ASSERT_EQ(5, sketch.estimate(42));
+    ASSERT_EQ(0, sketch.estimate(43));
+    for (int i = 0; i < 100; i++) {
+        sketch.increment(42);
+    }
+    ASSERT_EQ(FrequencySketch::MAX_FREQUENCY, sketch.estimate(42));
+
+    // The sketch has at least 1024 counters, and halves them after ten increments per counter
+    for (int i = 105; i < 10 * 1024; i++) {
+        sketch.increment(42);
+    }
+    ASSERT_EQ(FrequencySketch::MAX_FREQUENCY / 2, sketch.estimate(42));
+}
+
+TEST(RestoreCacheTest, hit_miss_and_version) {
+    RestoreCache cache(make_options(1024 * 1024));
+    shared_ptr<const CachedFile> file = make_file(100);
+    ASSERT_EQ(nullptr, cache.find(1, "file", file->version));
+    // Restored once so far, which isn't enough to cache it
+    ASSERT_FALSE(cache.should_insert(1, "file", 100));
+    ASSERT_EQ(nullptr, cache.find(1, "file", file->version));
+    ASSERT_TRUE(cache.should_insert(1, "file", 100));
+    ASSERT_FALSE(cache.should_insert(1, "file", RestoreCacheOptions().max_file_size + 1));
+    cache.insert(1, "file", file);
+
+    ASSERT_EQ(file, cache.find(1, "file", file->version));
+    // Another user's file of the same name
+    ASSERT_EQ(nullptr, cache.find(2, "file", file->version));
+    // A replaced file isn't served
+    ASSERT_EQ(nullptr, cache.find(1, "file", make_file(100, 2)->version));
+    ASSERT_EQ(nullptr, cache.find(1, "file", file->version));
+
+    RestoreCacheStatistics statistics = cache.get_statistics();
+    ASSERT_EQ(1, statistics.hits);
+    ASSERT_EQ(5, statistics.misses);
+    ASSERT_EQ(100, statistics.bytes_served);
+    ASSERT_EQ(1, statistics.invalidations);
+    ASSERT_EQ(0, statistics.num_files);
+}
+
+TEST(RestoreCacheTest, invalidate) {
+    RestoreCache cache(make_options(1024 * 1024));
+    shared_ptr<const CachedFile> file = make_file(100);
+    cache.insert(1, "file", file);
+    cache.invalidate(1, "file");
+    cache.invalidate(1, "file");
+    ASSERT_EQ(nullptr, cache.find(1, "file", file->version));
+    ASSERT_EQ(1, cache.get_statistics().invalidations);
+}
+
+TEST(RestoreCacheTest, popular_files_survive_a_scan) {
+    const size_t capacity = 64 * 1024;
+    RestoreCache cache(make_options(capacity));
+    shared_ptr<const CachedFile> file = make_file(1000);
+    for (int i = 0; i < 10; i++) {
+        string hot = "hot" + std::to_string(i);
+        for (int j = 0; j < 10; j++) {
+            cache.find(1, hot, file->version);
+        }
+        cache.insert(1, hot, file);
+    }
+    // Many files that are each restored once, and would push out the popular files from an LRU
+    for (int i = 0; i < 1000; i++) {
+        string cold = "cold" + std::to_string(i);
+        cache.find(1, cold, file->version);
+        cache.insert(1, cold, file);
+    }
+
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ(file, cache.find(1, "hot" + std::to_string(i), file->version));
+    }
+    RestoreCacheStatistics statistics = cache.get_statistics();
+    ASSERT_LE(statistics.size, capacity);
+    ASSERT_LT(0, statistics.rejections);
+}
+
+TEST(RestoreCacheTest, concurrent_use) {
+    RestoreCacheOptions options;
+    options.capacity = 1024 * 1024;
+    RestoreCache cache(options);
+    vector<std::thread> threads;
+    for (uint32_t user_id = 0; user_id < 4; user_id++) {
+        threads.emplace_back([&cache, user_id]() {
+            shared_ptr<const CachedFile> file = make_file(4096);
+            for (int i = 0; i < 2000; i++) {
+                string filename = "file" + std::to_string(i % 50);
+                if (!cache.find(user_id, filename, file->version) && cache.should_insert(user_id, filename, 4096)) {
+                    cache.insert(user_id, filename, file);
+                }
+                if (i % 100 == 0) {
+                    cache.invalidate(user_id, filename);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    RestoreCacheStatistics statistics = cache.get_statistics();
+    ASSERT_EQ(8000, statistics.hits + statistics.misses);
+    ASSERT_LT(0, statistics.hits);
+    ASSERT_LE(statistics.size, options.capacity);
+}
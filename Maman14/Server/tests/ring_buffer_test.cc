@@ -0,0 +1,73 @@
+#include "Maman14/Server/ring_buffer.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using std::vector;
+using utils::RingBuffer;
+
+static void write(RingBuffer& buffer, const vector<uint8_t>& bytes) {
+    size_t written = 0;
+    while (written < bytes.size()) {
+        std::span<uint8_t> free_space{buffer.writable()};
+        size_t size = std::min(free_space.size(), bytes.size() - written);
+        std::memcpy(free_space.data(), bytes.data() + written, size);
+        buffer.commit(size);
+        written += size;
+    }
+}
+
+TEST(RingBufferTest, capacity_rounded_to_power_of_two) {
+    RingBuffer buffer(100);
+    ASSERT_EQ(128, buffer.capacity());
+    ASSERT_TRUE(buffer.empty());
+}
+
+TEST(RingBufferTest, read_fields) {
+    RingBuffer buffer(16);
+    write(buffer, {1, 0x2, 0x25, 0x2, 0x25, 0x12, 0xfb});
+
+    ASSERT_EQ(7, buffer.size());
+    ASSERT_EQ(1, buffer.read_u8());
+    ASSERT_EQ(9474, buffer.read_u16());
+    ASSERT_EQ(4212270338, buffer.read_u32());
+    ASSERT_TRUE(buffer.empty());
+}
+
+TEST(RingBufferTest, wrap_around) {
+    RingBuffer buffer(8);
+    write(buffer, {0, 0, 0, 0, 0, 0});
+    buffer.consume(5);
+
+    // The free space wraps around, so it's writable in two parts
+    ASSERT_EQ(2, buffer.writable().size());
+    write(buffer, {0x2, 0x25, 0x12, 0xfb});
+    ASSERT_EQ(5, buffer.size());
+    ASSERT_EQ(3, buffer.readable().size());
+
+    ASSERT_EQ(0, buffer.read_u8());
+    ASSERT_EQ(4212270338, buffer.read_u32());
+}
+
+TEST(RingBufferTest, read_bytes_across_wrap) {
+    RingBuffer buffer(4);
+    write(buffer, {'x', 'x', 'x'});
+    buffer.consume(2);
+    write(buffer, {'a', 'b', 'c'});
+
+    vector<uint8_t> bytes(4);
+    buffer.read(bytes.data(), bytes.size());
+    ASSERT_EQ(vector<uint8_t>({'x', 'a', 'b', 'c'}), bytes);
+}
+
+TEST(RingBufferTest, not_enough_bytes_throws) {
+    RingBuffer buffer(8);
+    write(buffer, {1, 2, 3});
+
+    EXPECT_THROW(buffer.read_u32(), std::out_of_range);
+    EXPECT_THROW(buffer.consume(4), std::out_of_range);
+    EXPECT_THROW(buffer.commit(6), std::out_of_range);
+}
@@ -0,0 +1,113 @@
+#include "Maman14/Server/server.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/make_unique.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/async_request_parser.h"
+#include "Maman14/Server/async_request_reader.h"
+#include "Maman14/Server/protocol/request.h"
+#include "Maman14/Server/protocol/response.h"
+#include "Maman14/Server/request_router.h"
+#include "Maman14/Server/tests/coroutine_test_utils.h"
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+static const uint32_t USER_ID = 1234;
+static const string FILENAME{"coolfile"};
+
+class ServerTest : public ::testing::Test {
+protected:
+    ServerTest() : directory(bfs::temp_directory_path() / bfs::unique_path()) {}
+
+    void SetUp() override {
+        bfs::create_directories(directory);
+        server = Server::get_server(0, directory);
+        vector<uint8_t> payload{'c', 'o', 'o', 'l'};
+        server->handleRequest(boost::make_unique<BackupFileRequest>(USER_ID, PROTOCOL_VERSION_1, FILENAME, payload));
+    }
+
+    void TearDown() override {
+        server.reset();
+        bfs::remove_all(directory);
+    }
+
+public:
+    bfs::path directory;
+    shared_ptr<Server> server;
+};
+
+/**
+ * @brief Hands out the payload of a streamed request, a byte at a time
+ *
+ */
+class PayloadReader : public AbstractAsyncRequestReader {
+public:
+    PayloadReader(vector<uint8_t> payload, size_t& offset) : payload_(std::move(payload)), offset_(offset) {}
+
+    virtual awaitable<uint32_t> read_uint32() override { throw std::logic_error("Only the payload is read"); }
+    virtual awaitable<uint16_t> read_uint16() override { throw std::logic_error("Only the payload is read"); }
+    virtual awaitable<uint8_t> read_uint8() override { throw std::logic_error("Only the payload is read"); }
+    virtual awaitable<vector<uint8_t>> read_bytes(size_t) override { throw std::logic_error("Only the payload is read"); }
+    virtual awaitable<std::span<const uint8_t>> read_span(size_t) override {
+        if (offset_ >= payload_.size()) {
+            throw std::logic_error("Read past the payload");
+        }
+        co_return std::span<const uint8_t>(payload_.data() + offset_++, 1);
+    }
+
+private:
+    vector<uint8_t> payload_;
+    size_t& offset_;
+};
+
+static unique_ptr<ProtocolRequest> make_request(RequestOP op, ProtocolVersion version) {
+    switch (op) {
+        case RequestOP::RESTORE_FILE_COMPRESSED:
+            return boost::make_unique<RestoreFileCompressedRequest>(USER_ID, version, FILENAME);
+        case RequestOP::RESTORE_RANGE:
+            return boost::make_unique<RestoreRangeRequest>(USER_ID, version, FILENAME, 1, 2);
+        default:
+            return boost::make_unique<BackupBatchRequest>(USER_ID, version, vector<string>{"batchfile"},
+                                                          vector<vector<uint8_t>>{{'b', 'a', 't', 'c', 'h'}});
+    }
+}
+
+TEST_F(ServerTest, newer_requests_only_in_their_versions) {
+    for (RequestOP op : {RequestOP::RESTORE_FILE_COMPRESSED, RequestOP::RESTORE_RANGE, RequestOP::BACKUP_BATCH}) {
+        // A version 1 client gets the error of an unknown request, like it did before there were newer versions
+        unique_ptr<ProtocolRequest> old_request{make_request(op, PROTOCOL_VERSION_1)};
+        ASSERT_THROW(server->get_request_router().admit(*old_request), UnsupportedRequestException);
+        ASSERT_THROW(server->handleRequest(std::move(old_request)), UnsupportedRequestException);
+
+        unique_ptr<ProtocolRequest> new_request{make_request(op, PROTOCOL_VERSION_3)};
+        server->get_request_router().admit(*new_request);
+        Reply reply{server->handleRequest(std::move(new_request))};
+        ASSERT_EQ(nullptr, dynamic_cast<ServerErrorResponse*>(reply.response.get()));
+        ASSERT_EQ(nullptr, dynamic_cast<FileNotFoundResponse*>(reply.response.get()));
+    }
+}
+
+TEST_F(ServerTest, failed_streamed_backup_answers_its_own_request) {
+    vector<uint8_t> payload{'n', 'e', 'w'};
+    for (const string& filename : {FILENAME, string("newfile")}) {
+        auto request = boost::make_unique<BackupFileRequest>(USER_ID, PROTOCOL_VERSION_2, filename, payload.size());
+        request->set_request_id(7);
+        size_t offset = 0;
+        AsyncRequestParser parser{boost::make_unique<PayloadReader>(payload, offset), true};
+        unique_ptr<ProtocolResponse> response{run_awaitable(server->streamBackupFile(std::move(request), parser))};
+
+        // The payload is read off the connection either way, so the session can go on with the next request
+        ASSERT_EQ(payload.size(), offset);
+        ASSERT_EQ(7, response->get_request_id());
+        // The file already exists
+        ASSERT_EQ(filename == FILENAME, dynamic_cast<ServerErrorResponse*>(response.get()) != nullptr);
+    }
+}
@@ -0,0 +1,37 @@
+#include "Maman14/Server/sha256.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using utils::Sha256;
+
+static string hash_hex(const string& data) {
+    return Sha256::to_hex(Sha256::hash(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+}
+
+TEST(Sha256Test, known_digests) {
+    ASSERT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", hash_hex(""));
+    ASSERT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hash_hex("abc"));
+    ASSERT_EQ("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+              hash_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"));
+}
+
+TEST(Sha256Test, incremental_updates) {
+    // A million 'a's, fed in pieces that don't line up with the blocks
+    string piece(997, 'a');
+    Sha256 sha;
+    size_t remaining = 1000000;
+    while (remaining > 0) {
+        size_t size = std::min(piece.size(), remaining);
+        sha.update(reinterpret_cast<const uint8_t*>(piece.data()), size);
+        remaining -= size;
+    }
+    ASSERT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", Sha256::to_hex(sha.finish()));
+
+    sha.reset();
+    sha.update(reinterpret_cast<const uint8_t*>("abc"), 3);
+    ASSERT_EQ(hash_hex("abc"), Sha256::to_hex(sha.finish()));
+}
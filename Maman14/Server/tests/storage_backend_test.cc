@@ -0,0 +1,112 @@
+#include "Maman14/Server/storage_backend.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Maman14/Server/tests/coroutine_test_utils.h"
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+class StorageBackendTest : public ::testing::TestWithParam<StorageBackendType> {
+protected:
+    StorageBackendTest()
+        : path(bfs::temp_directory_path() / "storage_backend_test"),
+          renamed_path(bfs::temp_directory_path() / "storage_backend_test_renamed") {}
+
+    void SetUp() override {
+        try {
+            storage = make_storage_backend(GetParam(), 2, 8);
+        } catch (const StorageBackendUnavailableException& e) {
+            GTEST_SKIP() << e.what();
+        }
+        bfs::remove(path);
+        bfs::remove(renamed_path);
+    }
+
+    void TearDown() override {
+        bfs::remove(path);
+        bfs::remove(renamed_path);
+    }
+
+    unique_ptr<StorageBackend> storage;
+    bfs::path path;
+    bfs::path renamed_path;
+};
+
+TEST_P(StorageBackendTest, write_read_fsync) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    string content{"This is my file\n"};
+
+    size_t written = run_awaitable(storage->write(fd, reinterpret_cast<const uint8_t*>(content.data()), content.size(), 0));
+    ASSERT_EQ(content.size(), written);
+    run_awaitable(storage->fsync(fd));
+
+    vector<uint8_t> read_back(content.size());
+    size_t bytes_read = run_awaitable(storage->read(fd, read_back.data(), read_back.size(), 0));
+    ASSERT_EQ(content.size(), bytes_read);
+    ASSERT_EQ(content, string(read_back.begin(), read_back.end()));
+
+    // Reading at the end of the file reads nothing
+    ASSERT_EQ(0, run_awaitable(storage->read(fd, read_back.data(), read_back.size(), content.size())));
+    ::close(fd);
+}
+
+TEST_P(StorageBackendTest, rename_no_replace) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    ::close(fd);
+
+    run_awaitable(storage->rename_no_replace(path, renamed_path));
+    ASSERT_FALSE(bfs::exists(path));
+    ASSERT_TRUE(bfs::exists(renamed_path));
+
+    // An existing file is never replaced
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    ::close(fd);
+    EXPECT_THROW(run_awaitable(storage->rename_no_replace(path, renamed_path)), boost::system::system_error);
+    ASSERT_TRUE(bfs::exists(path));
+}
+
+TEST_P(StorageBackendTest, failure_throws) {
+    vector<uint8_t> buffer(16);
+    EXPECT_THROW(run_awaitable(storage->read(-1, buffer.data(), buffer.size(), 0)), boost::system::system_error);
+}
+
+TEST_P(StorageBackendTest, completes_on_awaiting_executor) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    boost::asio::io_context io;
+    auto strand = boost::asio::make_strand(io);
+    bool on_strand = false;
+
+    // More operations than the queue depth, so some of them wait to be submitted
+    boost::asio::co_spawn(
+        strand, [&]() -> awaitable<void> {
+            uint8_t byte = 'x';
+            for (uint64_t offset = 0; offset < 32; offset++) {
+                co_await storage->write(fd, &byte, 1, offset);
+            }
+            on_strand = strand.running_in_this_thread();
+        },
+        boost::asio::detached);
+    io.run();
+
+    ASSERT_TRUE(on_strand);
+    ASSERT_EQ(32, bfs::file_size(path));
+    ::close(fd);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, StorageBackendTest,
+                         ::testing::Values(StorageBackendType::THREAD_POOL, StorageBackendType::IO_URING));
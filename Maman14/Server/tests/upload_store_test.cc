@@ -0,0 +1,223 @@
+#include "Maman14/Server/upload_store.h"
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace bfs = boost::filesystem;
+using std::string;
+using std::vector;
+
+static vector<uint8_t> make_content(size_t size) {
+    vector<uint8_t> content(size);
+    for (size_t i = 0; i < size; i++) {
+        content[i] = static_cast<uint8_t>(i * 7 + 3);
+    }
+    return content;
+}
+
+class UploadStoreTest : public ::testing::Test {
+protected:
+    UploadStoreTest() : directory(bfs::temp_directory_path() / "upload_store_test") {}
+
+    void SetUp() override {
+        TearDown();
+    }
+
+    void TearDown() override {
+        bfs::remove_all(directory);
+    }
+
+    UploadStatus write_part(UploadStore& upload_store, UploadToken token, const vector<uint8_t>& content, size_t offset, size_t size) {
+        return upload_store.write_part(token, offset, content.data() + offset, size);
+    }
+
+    // Finish the upload, and return what was committed
+    vector<uint8_t> finish(UploadStore& upload_store, UploadToken token, bool* committed = nullptr) {
+        vector<uint8_t> content;
+        UploadStatus status = upload_store.finish(token, [&](const UploadStatus& status, int fd, const bfs::path&) {
+            content.resize(status.size);
+            EXPECT_EQ(static_cast<ssize_t>(content.size()), ::pread(fd, content.data(), content.size(), 0));
+        });
+        if (committed != nullptr) {
+            *committed = status.is_complete();
+        }
+        return content;
+    }
+
+    bfs::path directory;
+};
+
+TEST_F(UploadStoreTest, parts_out_of_order) {
+    UploadStore upload_store(directory);
+    vector<uint8_t> content = make_content(1000);
+    UploadStatus status = upload_store.begin("file", content.size());
+    ASSERT_EQ("file", status.filename);
+    ASSERT_EQ(1000, status.size);
+    ASSERT_TRUE(status.committed.empty());
+    ASSERT_FALSE(status.is_complete());
+
+    status = write_part(upload_store, status.token, content, 600, 400);
+    ASSERT_EQ(vector<UploadRange>({{600, 400}}), status.committed);
+    status = write_part(upload_store, status.token, content, 0, 200);
+    ASSERT_EQ(vector<UploadRange>({{0, 200}, {600, 400}}), status.committed);
+
+    // An unfinished upload isn't committed
+    bool committed = true;
+    ASSERT_TRUE(finish(upload_store, status.token, &committed).empty());
+    ASSERT_FALSE(committed);
+    ASSERT_EQ(1, upload_store.get_num_uploads());
+
+    // Overlaps both of the parts, which are merged into one
+    status = write_part(upload_store, status.token, content, 100, 550);
+    ASSERT_EQ(vector<UploadRange>({{0, 1000}}), status.committed);
+    ASSERT_TRUE(status.is_complete());
+    ASSERT_EQ(status.committed, upload_store.get_status(status.token).committed);
+
+    ASSERT_EQ(content, finish(upload_store, status.token, &committed));
+    ASSERT_TRUE(committed);
+    ASSERT_EQ(0, upload_store.get_num_uploads());
+    ASSERT_THROW(upload_store.get_status(status.token), UploadNotFoundException);
+    ASSERT_THROW(write_part(upload_store, status.token, content, 0, 10), UploadNotFoundException);
+}
+
+TEST_F(UploadStoreTest, invalid_parts) {
+    UploadStore upload_store(directory);
+    vector<uint8_t> content = make_content(100);
+    UploadStatus status = upload_store.begin("file", content.size());
+    ASSERT_THROW(upload_store.write_part(status.token, 90, content.data(), 11), UploadPartOutOfRangeException);
+    ASSERT_THROW(upload_store.write_part(status.token, 101, content.data(), 0), UploadPartOutOfRangeException);
+    ASSERT_THROW(upload_store.write_part(status.token + 1, 0, content.data(), 10), UploadNotFoundException);
+    ASSERT_TRUE(upload_store.get_status(status.token).committed.empty());
+}
+
+TEST_F(UploadStoreTest, resume_after_reopen) {
+    vector<uint8_t> content = make_content(4096);
+    UploadToken token;
+    {
+        UploadStore upload_store(directory);
+        token = upload_store.begin("resumed", content.size()).token;
+        write_part(upload_store, token, content, 0, 1024);
+        write_part(upload_store, token, content, 2048, 1024);
+    }
+
+    UploadStore upload_store(directory);
+    ASSERT_EQ(1, upload_store.get_num_uploads());
+    UploadStatus status = upload_store.get_status(token);
+    ASSERT_EQ("resumed", status.filename);
+    ASSERT_EQ(4096, status.size);
+    ASSERT_EQ(vector<UploadRange>({{0, 1024}, {2048, 1024}}), status.committed);
+
+    write_part(upload_store, token, content, 1024, 1024);
+    write_part(upload_store, token, content, 3072, 1024);
+    ASSERT_EQ(content, finish(upload_store, token));
+    ASSERT_TRUE(bfs::is_empty(directory));
+}
+
+TEST_F(UploadStoreTest, torn_journal) {
+    vector<uint8_t> content = make_content(4096);
+    UploadToken token;
+    {
+        UploadStore upload_store(directory);
+        token = upload_store.begin("torn", content.size()).token;
+        write_part(upload_store, token, content, 0, 1024);
+        write_part(upload_store, token, content, 1024, 1024);
+    }
+    // Tear the last record in half
+    bfs::path journal = directory / (std::to_string(token) + ".journal");
+    bfs::resize_file(journal, bfs::file_size(journal) - 8);
+
+    {
+        UploadStore upload_store(directory);
+        ASSERT_EQ(vector<UploadRange>({{0, 1024}}), upload_store.get_status(token).committed);
+        // Appended where the torn record started
+        write_part(upload_store, token, content, 3072, 1024);
+    }
+
+    UploadStore upload_store(directory);
+    ASSERT_EQ(vector<UploadRange>({{0, 1024}, {3072, 1024}}), upload_store.get_status(token).committed);
+}
+
+TEST_F(UploadStoreTest, stray_journal) {
+    UploadToken token;
+    {
+        UploadStore upload_store(directory);
+        token = upload_store.begin("file", 100).token;
+    }
+    // Not named after a token, so it isn't an upload
+    std::ofstream(directory / "notes.journal") << "not an upload";
+
+    UploadStore upload_store(directory);
+    ASSERT_EQ(1, upload_store.get_num_uploads());
+    ASSERT_EQ("file", upload_store.get_status(token).filename);
+}
+
+TEST_F(UploadStoreTest, too_many_uploads) {
+    UploadStoreOptions options;
+    options.max_uploads = 2;
+    UploadStore upload_store(directory, nullptr, options);
+    UploadToken token = upload_store.begin("first", 100).token;
+    upload_store.begin("second", 100);
+    ASSERT_THROW(upload_store.begin("third", 100), TooManyUploadsException);
+
+    // A finished upload makes room for another
+    vector<uint8_t> content = make_content(100);
+    write_part(upload_store, token, content, 0, 100);
+    finish(upload_store, token);
+    upload_store.begin("third", 100);
+    ASSERT_EQ(2, upload_store.get_num_uploads());
+}
+
+TEST_F(UploadStoreTest, expired_uploads_are_removed) {
+    UploadStoreOptions options;
+    options.expiry = std::chrono::hours(1);
+    UploadToken token;
+    UploadToken written_token;
+    {
+        UploadStore upload_store(directory, nullptr, options);
+        token = upload_store.begin("abandoned", 100).token;
+        written_token = upload_store.begin("written", 100).token;
+        ASSERT_EQ(0, upload_store.remove_expired());
+    }
+    // Abandoned two hours ago, going by its journal
+    bfs::path journal = directory / (std::to_string(token) + ".journal");
+    bfs::last_write_time(journal, bfs::last_write_time(journal) - 2 * 60 * 60);
+
+    UploadStore upload_store(directory, nullptr, options);
+    ASSERT_EQ(1, upload_store.get_num_uploads());
+    ASSERT_THROW(upload_store.get_status(token), UploadNotFoundException);
+    ASSERT_FALSE(bfs::exists(journal));
+    ASSERT_FALSE(bfs::exists(directory / (std::to_string(token) + ".part")));
+    ASSERT_EQ("written", upload_store.get_status(written_token).filename);
+}
+
+TEST_F(UploadStoreTest, torn_header) {
+    UploadToken token;
+    {
+        UploadStore upload_store(directory);
+        token = upload_store.begin("torn", 100).token;
+    }
+    bfs::resize_file(directory / (std::to_string(token) + ".journal"), 10);
+
+    UploadStore upload_store(directory);
+    ASSERT_EQ(0, upload_store.get_num_uploads());
+    ASSERT_TRUE(bfs::is_empty(directory));
+}
+
+TEST_F(UploadStoreTest, failed_commit) {
+    UploadStore upload_store(directory);
+    vector<uint8_t> content = make_content(100);
+    UploadToken token = upload_store.begin("file", content.size()).token;
+    write_part(upload_store, token, content, 0, 100);
+    ASSERT_THROW(upload_store.finish(token, [](const UploadStatus&, int, const bfs::path&) { throw std::runtime_error("failed"); }), std::runtime_error);
+
+    // Kept, so it can be finished again
+    ASSERT_TRUE(upload_store.get_status(token).is_complete());
+    ASSERT_EQ(content, finish(upload_store, token));
+}
@@ -2,31 +2,35 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <boost/filesystem.hpp>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "Maman14/Server/storage_backend.h"
+#include "Maman14/Server/tests/coroutine_test_utils.h"
+
 namespace bfs = boost::filesystem;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
 class UserBackupDirectoryTest : public ::testing::Test {
 protected:
     UserBackupDirectoryTest() : filename("coolfile"), filename2("supercoolfile.jpeg") {
-        directory = bfs::temp_directory_path();
+        // The tests list the directory, so it only holds what they backed up
+        directory = bfs::temp_directory_path() / bfs::unique_path();
     }
 
-    void SetUp() override {
-        bfs::remove_all(directory / filename);
-        bfs::remove_all(directory / filename2);
-    }
+    void SetUp() override { bfs::create_directories(directory); }
 
-    void TearDown() override {
-        bfs::remove_all(directory / filename);
-        bfs::remove_all(directory / filename2);
-    }
+    void TearDown() override { bfs::remove_all(directory); }
 
 public:
     string filename;
@@ -110,3 +114,606 @@ TEST_F(UserBackupDirectoryTest, test_file_not_found) {
         },
         FileNotFoundException);
 }
+
+TEST_F(UserBackupDirectoryTest, test_backup_in_chunks) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup(filename)};
+    writer->write(payload.data(), 4);
+    writer->write(payload.data() + 4, payload.size() - 4);
+    // Nothing is visible until the backup is committed
+    ASSERT_FALSE(bfs::exists(directory / filename));
+
+    writer->commit();
+    ASSERT_EQ(payload, read_file(directory / filename));
+}
+
+TEST_F(UserBackupDirectoryTest, test_uncommitted_backup_discarded) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+
+    {
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup(filename)};
+        writer->write(payload.data(), payload.size());
+    }
+
+    ASSERT_FALSE(bfs::exists(directory / filename));
+    vector<string> expected{};
+    ASSERT_EQ(expected, backup_directory.get_backup_filenames());
+}
+
+TEST_F(UserBackupDirectoryTest, test_begin_backup_existing_throws) {
+    UserBackupDirectory backup_directory(directory);
+    backup_directory.backup_file(filename, get_payload());
+
+    EXPECT_THROW(backup_directory.begin_backup(filename), FileAlreadyExistsException);
+}
+
+TEST_F(UserBackupDirectoryTest, test_invalid_filename_throws) {
+    UserBackupDirectory backup_directory(directory);
+    EXPECT_THROW(backup_directory.backup_file("../" + filename, get_payload()), InvalidFilenameException);
+    EXPECT_THROW(backup_directory.begin_backup(".."), InvalidFilenameException);
+    EXPECT_THROW(backup_directory.begin_upload("", 1), InvalidFilenameException);
+    ASSERT_EQ(BatchResult::FAILED, backup_directory.backup_files({".manifests/" + filename}, {get_payload()})[0]);
+    // The directory's own entries, whether they exist yet or not
+    for (const char* reserved : {".incoming", ".manifests", ".uploads", ".packs"}) {
+        EXPECT_THROW(backup_directory.begin_backup(reserved), InvalidFilenameException);
+        EXPECT_THROW(backup_directory.begin_upload(reserved, 1), InvalidFilenameException);
+        ASSERT_EQ(BatchResult::FAILED, backup_directory.backup_files({reserved}, {get_payload()})[0]);
+    }
+}
+
+TEST_F(UserBackupDirectoryTest, test_open_backup_file) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    backup_directory.backup_file(filename, payload);
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file(filename)};
+    ASSERT_EQ(payload.size(), reader->size());
+
+    // The open file can still be restored after the backup is deleted
+    backup_directory.delete_file(filename);
+    ASSERT_EQ(payload, reader->read_all());
+}
+
+TEST_F(UserBackupDirectoryTest, test_big_file_stored_segments_fit_frames) {
+    // Sparse, so it takes no space
+    std::ofstream((directory / filename).string()).close();
+    uint64_t size{2 * BackupFileReader::MAX_STORED_SEGMENT_SIZE + 10};
+    bfs::resize_file(directory / filename, size);
+
+    PlainBackupFileReader reader(directory / filename);
+    ASSERT_EQ(3, reader.get_num_stored_segments());
+    ASSERT_EQ(size, reader.get_stored_size());
+    StoredSegment last{reader.get_stored_segment(2)};
+    ASSERT_EQ(10, last.size);
+    ASSERT_EQ(2 * BackupFileReader::MAX_STORED_SEGMENT_SIZE, last.stored.offset);
+    ASSERT_EQ(BackupFileReader::MAX_STORED_SEGMENT_SIZE, reader.get_stored_segment(0).stored.size);
+}
+
+TEST_F(UserBackupDirectoryTest, test_open_missing_backup_file_throws) {
+    UserBackupDirectory backup_directory(directory);
+    EXPECT_THROW(backup_directory.open_backup_file(filename), FileNotFoundException);
+}
+
+TEST_F(UserBackupDirectoryTest, test_async_backup) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup(filename)};
+    run_awaitable(writer->async_write(*storage, payload.data(), payload.size()));
+    ASSERT_FALSE(bfs::exists(directory / filename));
+
+    run_awaitable(writer->async_commit(*storage));
+    ASSERT_EQ(payload, read_file(directory / filename));
+}
+
+TEST_F(UserBackupDirectoryTest, test_async_commit_existing_throws) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+
+    // Both uploads start before either of them is committed, so only the commit can tell
+    unique_ptr<BackupFileWriter> first{backup_directory.begin_backup(filename)};
+    unique_ptr<BackupFileWriter> second{backup_directory.begin_backup(filename)};
+    run_awaitable(first->async_commit(*storage));
+    EXPECT_THROW(run_awaitable(second->async_commit(*storage)), FileAlreadyExistsException);
+}
+
+TEST_F(UserBackupDirectoryTest, test_upload_renamed_into_place) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    UploadStatus status = backup_directory.begin_upload(filename, payload.size());
+    backup_directory.write_upload_part(status.token, 0, payload.data(), payload.size());
+    ASSERT_TRUE(backup_directory.finish_upload(status.token).is_complete());
+
+    ASSERT_EQ(payload, read_file(directory / filename));
+    ASSERT_EQ(payload.size(), backup_directory.get_index().find(filename)->size);
+    ASSERT_EQ(0, backup_directory.get_upload_store().get_num_uploads());
+    ASSERT_FALSE(bfs::exists(directory / ".uploads" / (std::to_string(status.token) + ".part")));
+    EXPECT_THROW(backup_directory.write_upload_part(status.token, 0, payload.data(), payload.size()), UploadNotFoundException);
+}
+
+TEST_F(UserBackupDirectoryTest, test_replace) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    vector<uint8_t> new_payload{'n', 'e', 'w'};
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    EXPECT_THROW(backup_directory.begin_replace(filename), FileNotFoundException);
+    backup_directory.backup_file(filename, payload);
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file(filename)};
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace(filename)};
+    run_awaitable(writer->async_write(*storage, new_payload.data(), new_payload.size()));
+    ASSERT_EQ(payload, read_file(directory / filename));
+
+    run_awaitable(writer->async_commit(*storage));
+    ASSERT_EQ(new_payload, backup_directory.get_backup_file_content(filename));
+    ASSERT_EQ(new_payload.size(), backup_directory.get_index().find(filename)->size);
+    // A restore that started before the replace still gets the old version
+    ASSERT_EQ(payload, reader->read_all());
+}
+
+TEST_F(UserBackupDirectoryTest, test_concurrent_restores_and_delete) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    backup_directory.backup_file(filename, payload);
+    backup_directory.backup_file(filename2, payload);
+
+    vector<std::thread> restorers;
+    for (size_t i = 0; i < 8; i++) {
+        restorers.emplace_back([&]() {
+            for (size_t j = 0; j < 100; j++) {
+                ASSERT_EQ(payload, backup_directory.get_backup_file_content(filename));
+            }
+        });
+    }
+    // Deleting another file doesn't get in the way of the restores
+    backup_directory.delete_file(filename2);
+    for (auto& restorer : restorers) {
+        restorer.join();
+    }
+
+    // The directory is the test's own, so it only lists the file that wasn't deleted
+    vector<string> expected{filename};
+    ASSERT_EQ(expected, backup_directory.get_backup_filenames());
+    ASSERT_TRUE(bfs::exists(directory / filename));
+    ASSERT_FALSE(bfs::exists(directory / filename2));
+}
+
+TEST_F(UserBackupDirectoryTest, test_index_updated) {
+    UserBackupDirectory backup_directory(directory);
+    vector<uint8_t> payload = get_payload();
+    backup_directory.backup_file(filename, payload);
+
+    auto entry = backup_directory.get_index().find(filename);
+    ASSERT_TRUE(entry.has_value());
+    ASSERT_EQ(payload.size(), entry->size);
+
+    backup_directory.delete_file(filename);
+    ASSERT_FALSE(backup_directory.get_index().contains(filename));
+}
+
+TEST_F(UserBackupDirectoryTest, test_existing_files_indexed) {
+    vector<uint8_t> payload = get_payload();
+    {
+        UserBackupDirectory backup_directory(directory);
+        backup_directory.backup_file(filename, payload);
+    }
+
+    // A new instance finds the file that's already on disk
+    UserBackupDirectory backup_directory(directory);
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content(filename));
+    EXPECT_THROW(backup_directory.begin_backup(filename), FileAlreadyExistsException);
+}
+
+class DeduplicatedBackupDirectoryTest : public ::testing::Test {
+protected:
+    DeduplicatedBackupDirectoryTest()
+        : directory(bfs::temp_directory_path() / "deduplicated_backup_directory_test"),
+          chunks_directory(bfs::temp_directory_path() / "deduplicated_backup_directory_test_chunks"),
+          // Small chunks, so the payload is split into a few of them
+          options{ChunkingMethod::FIXED_SIZE, 4} {
+        // The chunks are raw, so their segments are in the chunk files
+        options.compression = false;
+    }
+
+    void SetUp() override {
+        TearDown();
+        bfs::create_directory(directory);
+    }
+
+    void TearDown() override {
+        bfs::remove_all(directory);
+        bfs::remove_all(chunks_directory);
+    }
+
+    bfs::path directory;
+    bfs::path chunks_directory;
+    ChunkStoreOptions options;
+};
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_same_content_stored_once) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload = get_payload();
+    backup_directory.backup_file("first", payload);
+    backup_directory.backup_file("second", payload);
+
+    ChunkStoreStatistics statistics = chunk_store.get_statistics();
+    ASSERT_EQ(3, statistics.num_chunks);
+    ASSERT_EQ(payload.size(), statistics.stored_bytes);
+    ASSERT_DOUBLE_EQ(2, statistics.get_dedup_ratio());
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content("first"));
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content("second"));
+    // The index describes the content, not the manifest
+    ASSERT_EQ(payload.size(), backup_directory.get_index().find("first")->size);
+
+    backup_directory.delete_file("first");
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content("second"));
+    backup_directory.delete_file("second");
+    ASSERT_EQ(0, chunk_store.get_statistics().num_chunks);
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_async_backup) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload = get_payload();
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("file")};
+    run_awaitable(writer->async_write(*storage, payload.data(), 5));
+    run_awaitable(writer->async_write(*storage, payload.data() + 5, payload.size() - 5));
+    run_awaitable(writer->async_commit(*storage));
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("file")};
+    ASSERT_EQ(payload.size(), reader->size());
+    // Each segment is the rest of a single chunk
+    FileSegment segment = reader->get_segment(5);
+    ASSERT_EQ(1, segment.offset);
+    ASSERT_EQ(3, segment.size);
+    ASSERT_EQ(payload, reader->read_all());
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_uncommitted_backup_releases_chunks) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload = get_payload();
+    {
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("file")};
+        writer->write(payload.data(), payload.size());
+    }
+    ASSERT_EQ(0, chunk_store.get_statistics().num_chunks);
+    ASSERT_FALSE(backup_directory.get_index().contains("file"));
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_restore_outlives_delete) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload = get_payload();
+    backup_directory.backup_file("file", payload);
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("file")};
+    backup_directory.delete_file("file");
+    ASSERT_EQ(payload, reader->read_all());
+    reader.reset();
+    ASSERT_EQ(0, chunk_store.get_statistics().num_chunks);
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_existing_manifests_referenced) {
+    vector<uint8_t> payload = get_payload();
+    {
+        ChunkStore chunk_store(chunks_directory, options);
+        UserBackupDirectory backup_directory(directory, &chunk_store);
+        backup_directory.backup_file("file", payload);
+    }
+    // A file that was backed up before deduplication was enabled
+    std::ofstream((directory / "plain").string()) << "plain";
+
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    ASSERT_EQ(0, chunk_store.collect_garbage());
+    ASSERT_EQ(payload.size(), chunk_store.get_statistics().referenced_bytes);
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content("file"));
+    ASSERT_EQ(5, backup_directory.get_backup_file_content("plain").size());
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_plain_file_like_manifest_is_plain) {
+    vector<uint8_t> payload = get_payload();
+    {
+        ChunkStore chunk_store(chunks_directory, options);
+        UserBackupDirectory backup_directory(directory, &chunk_store);
+        backup_directory.backup_file("file", payload);
+    }
+    // A file backed up before deduplication was enabled, whose content is a manifest of chunks it doesn't own
+    vector<uint8_t> manifest = read_file(directory / ".manifests" / "file");
+    std::ofstream((directory / "forged").string(), std::ios::binary).write(reinterpret_cast<const char*>(manifest.data()),
+                                                                          manifest.size());
+
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    ASSERT_EQ(manifest, backup_directory.get_backup_file_content("forged"));
+    ASSERT_EQ(manifest.size(), backup_directory.get_index().find("forged")->size);
+    ASSERT_EQ(payload.size(), chunk_store.get_statistics().referenced_bytes);
+    // Deleting it doesn't release the chunks of the real manifest
+    backup_directory.delete_file("forged");
+    ASSERT_EQ(payload, backup_directory.get_backup_file_content("file"));
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_replace_releases_old_chunks) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload = get_payload();
+    vector<uint8_t> new_payload(payload.begin(), payload.begin() + 4);
+    backup_directory.backup_file("file", payload);
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+    writer->write(new_payload.data(), new_payload.size());
+    writer->commit();
+
+    ASSERT_EQ(new_payload, backup_directory.get_backup_file_content("file"));
+    ASSERT_EQ(1, chunk_store.get_statistics().num_chunks);
+    ASSERT_EQ(new_payload.size(), chunk_store.get_statistics().referenced_bytes);
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_compressed_chunks) {
+    options.compression = true;
+    options.chunk_size = 64 * 1024;
+    string line = "a line that repeats, like the lines of a log file do\n";
+    vector<uint8_t> payload;
+    while (payload.size() < 300 * 1024) {
+        payload.insert(payload.end(), line.begin(), line.end());
+    }
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    {
+        ChunkStore chunk_store(chunks_directory, options);
+        UserBackupDirectory backup_directory(directory, &chunk_store);
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("file")};
+        run_awaitable(writer->async_write(*storage, payload.data(), payload.size()));
+        run_awaitable(writer->async_commit(*storage));
+        ASSERT_LT(chunk_store.get_statistics().disk_bytes * 10, chunk_store.get_statistics().stored_bytes);
+    }
+
+    // The chunks are found to be compressed after a restart
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    chunk_store.collect_garbage();
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("file")};
+    ASSERT_EQ(payload, reader->read_all());
+
+    // Restores decompress the chunks into memory, a window at a time
+    FileSegment segment = reader->get_segment(100);
+    ASSERT_NE(nullptr, segment.data);
+    ASSERT_EQ(std::min(options.chunk_size, ChunkedBackupFileReader::DECOMPRESSION_WINDOW_SIZE) - 100, segment.size);
+    ASSERT_EQ(0, std::memcmp(payload.data() + 100, segment.data, segment.size));
+
+    // Or send them as they're stored
+    uint64_t stored_size = 0;
+    for (size_t i = 0; i < reader->get_num_stored_segments(); i++) {
+        StoredSegment stored = reader->get_stored_segment(i);
+        ASSERT_EQ(ChunkEncoding::DEFLATE, stored.encoding);
+        stored_size += stored.stored.size;
+    }
+    ASSERT_EQ(5, reader->get_num_stored_segments());
+    ASSERT_EQ(reader->get_stored_size(), stored_size);
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_random_content_stored_raw) {
+    options.compression = true;
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload(64 * 1024);
+    std::mt19937 generator(1);
+    std::generate(payload.begin(), payload.end(), [&]() { return static_cast<uint8_t>(generator()); });
+    backup_directory.backup_file("file", payload);
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("file")};
+    ASSERT_EQ(ChunkEncoding::RAW, reader->get_stored_segment(0).encoding);
+    ASSERT_EQ(nullptr, reader->get_segment(0).data);
+    ASSERT_EQ(payload.size(), chunk_store.get_statistics().disk_bytes);
+}
+
+TEST_F(DeduplicatedBackupDirectoryTest, test_compression_chosen_from_sample_of_small_writes) {
+    options.compression = true;
+    options.chunk_size = 64 * 1024;
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store);
+    vector<uint8_t> payload(128 * 1024);
+    std::mt19937 generator(1);
+    std::generate(payload.begin(), payload.end(), [&]() { return static_cast<uint8_t>(generator()); });
+
+    // A few random bytes look compressible on their own, like the first read of a streamed backup may be
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("file")};
+    run_awaitable(writer->async_write(*storage, payload.data(), 4));
+    run_awaitable(writer->async_write(*storage, payload.data() + 4, payload.size() - 4));
+    run_awaitable(writer->async_commit(*storage));
+
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("file")};
+    ASSERT_EQ(ChunkEncoding::RAW, reader->get_stored_segment(0).encoding);
+    ASSERT_EQ(payload, reader->read_all());
+    ASSERT_EQ(payload.size(), chunk_store.get_statistics().disk_bytes);
+}
+
+class PackedBackupDirectoryTest : public DeduplicatedBackupDirectoryTest {
+protected:
+    PackedBackupDirectoryTest() {
+        packing.max_packed_size = 100;
+    }
+
+    PackStoreOptions packing;
+};
+
+TEST_F(PackedBackupDirectoryTest, test_small_files_packed) {
+    ChunkStore chunk_store(chunks_directory, options);
+    vector<uint8_t> big(packing.max_packed_size + 1, 'b');
+    vector<uint8_t> payload = get_payload();
+    {
+        UserBackupDirectory backup_directory(directory, &chunk_store, packing);
+        backup_directory.backup_file("small", payload);
+        // Written in pieces, and only turns out to be too big to pack at the end
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("big")};
+        writer->write(big.data(), big.size() - 1);
+        writer->write(big.data() + big.size() - 1, 1);
+        writer->commit();
+        EXPECT_THROW(backup_directory.backup_file("small", payload), FileAlreadyExistsException);
+
+        // The small file takes no file of its own
+        ASSERT_FALSE(bfs::exists(directory / "small"));
+        ASSERT_TRUE(bfs::exists(directory / ".manifests" / "big"));
+        ASSERT_EQ(1, backup_directory.get_pack_store()->get_statistics().num_files);
+        ASSERT_EQ(payload, backup_directory.get_backup_file_content("small"));
+        ASSERT_EQ(big, backup_directory.get_backup_file_content("big"));
+        ASSERT_EQ(payload.size(), backup_directory.get_index().find("small")->size);
+        ASSERT_EQ((vector<string>{"big", "small"}), backup_directory.get_backup_filenames());
+    }
+
+    // Both are found after a restart
+    UserBackupDirectory backup_directory(directory, &chunk_store, packing);
+    ASSERT_EQ((vector<string>{"big", "small"}), backup_directory.get_backup_filenames());
+    unique_ptr<BackupFileReader> reader{backup_directory.open_backup_file("small")};
+    backup_directory.delete_file("small");
+    EXPECT_THROW(backup_directory.delete_file("small"), FileNotFoundException);
+    // A restore that opened the file before it was deleted still reads it
+    ASSERT_EQ(payload, reader->read_all());
+    ASSERT_EQ(vector<string>{"big"}, backup_directory.get_backup_filenames());
+}
+
+TEST_F(PackedBackupDirectoryTest, test_replace_between_packed_and_file) {
+    ChunkStore chunk_store(chunks_directory, options);
+    UserBackupDirectory backup_directory(directory, &chunk_store, packing);
+    vector<uint8_t> small = get_payload();
+    vector<uint8_t> big(packing.max_packed_size * 2, 'b');
+    backup_directory.backup_file("file", small);
+
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+    run_awaitable(writer->async_write(*storage, big.data(), big.size()));
+    run_awaitable(writer->async_commit(*storage));
+    ASSERT_EQ(big, backup_directory.get_backup_file_content("file"));
+    ASSERT_FALSE(backup_directory.get_pack_store()->contains("file"));
+
+    writer = backup_directory.begin_replace("file");
+    writer->write(small.data(), small.size());
+    writer->commit();
+    ASSERT_EQ(small, backup_directory.get_backup_file_content("file"));
+    ASSERT_FALSE(bfs::exists(directory / ".manifests" / "file"));
+    // The chunks of the big version were released
+    ASSERT_EQ(0, chunk_store.get_statistics().num_chunks);
+}
+
+TEST_F(PackedBackupDirectoryTest, test_big_backup_after_packed_backup_of_same_name) {
+    ChunkStore chunk_store(chunks_directory, options);
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    vector<uint8_t> small = get_payload();
+    vector<uint8_t> big(packing.max_packed_size * 2, 'b');
+    // Plain files and manifests, committed both ways
+    for (ChunkStore* store : {static_cast<ChunkStore*>(nullptr), &chunk_store}) {
+        bfs::remove_all(directory);
+        bfs::create_directories(directory);
+        UserBackupDirectory backup_directory(directory, store, packing);
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("file")};
+        writer->write(big.data(), big.size());
+        unique_ptr<BackupFileWriter> async_writer{backup_directory.begin_backup("async")};
+        run_awaitable(async_writer->async_write(*storage, big.data(), big.size()));
+
+        // The packed backups have no file of their own for the renames to fail on
+        backup_directory.backup_file("file", small);
+        backup_directory.backup_file("async", small);
+        ASSERT_THROW(writer->commit(), FileAlreadyExistsException);
+        ASSERT_THROW(run_awaitable(async_writer->async_commit(*storage)), FileAlreadyExistsException);
+        ASSERT_EQ(small, backup_directory.get_backup_file_content("file"));
+        ASSERT_EQ(small, backup_directory.get_backup_file_content("async"));
+        ASSERT_FALSE(bfs::exists(directory / "file"));
+        ASSERT_FALSE(bfs::exists(directory / ".manifests" / "file"));
+    }
+}
+
+TEST_F(PackedBackupDirectoryTest, test_group_commit) {
+    ChunkStore chunk_store(chunks_directory, options);
+    GroupCommitOptions group_commit;
+    group_commit.max_delay = std::chrono::milliseconds(1);
+    GroupCommitter committer(group_commit);
+    unique_ptr<StorageBackend> storage{make_storage_backend(StorageBackendType::THREAD_POOL, 1, 1)};
+    vector<uint8_t> small = get_payload();
+    vector<uint8_t> big(packing.max_packed_size * 2, 'b');
+    {
+        UserBackupDirectory backup_directory(directory, &chunk_store, packing, &committer);
+        // Packed and deduplicated files, committed both ways, from several threads
+        vector<std::thread> threads;
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&, i]() {
+                backup_directory.backup_file("small" + std::to_string(i), small);
+                unique_ptr<BackupFileWriter> writer{backup_directory.begin_backup("big" + std::to_string(i))};
+                run_awaitable(writer->async_write(*storage, big.data(), big.size()));
+                run_awaitable(writer->async_commit(*storage));
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("small0")};
+        run_awaitable(writer->async_write(*storage, big.data(), 1));
+        run_awaitable(writer->async_commit(*storage));
+        ASSERT_EQ(vector<uint8_t>(1, 'b'), backup_directory.get_backup_file_content("small0"));
+    }
+    // Every sync went through the committer: a manifest and its directory for each big file, a pack for each
+    // small file and the replace, and the chunks of the big files, which are shared unless they were written together
+    ASSERT_LE(4 * 2 + 4 + 1 + 1, committer.get_statistics().syncs);
+
+    UserBackupDirectory backup_directory(directory, &chunk_store, packing, &committer);
+    ASSERT_EQ(8, backup_directory.get_backup_filenames().size());
+    ASSERT_EQ(small, backup_directory.get_backup_file_content("small3"));
+    ASSERT_EQ(big, backup_directory.get_backup_file_content("big3"));
+}
+
+TEST_F(PackedBackupDirectoryTest, test_group_commit_replace_of_file_syncs_pack_first) {
+    ChunkStore chunk_store(chunks_directory, options);
+    GroupCommitter committer;
+    UserBackupDirectory backup_directory(directory, &chunk_store, packing, &committer);
+    vector<uint8_t> small = get_payload();
+    vector<uint8_t> big(packing.max_packed_size * 2, 'b');
+    backup_directory.backup_file("file", big);
+    uint64_t syncs = committer.get_statistics().syncs;
+
+    unique_ptr<BackupFileWriter> writer{backup_directory.begin_replace("file")};
+    writer->write(small.data(), small.size());
+    writer->commit();
+    // The pack was synced under the file's lock, before the manifest of the big version was removed
+    ASSERT_EQ(syncs, committer.get_statistics().syncs);
+    ASSERT_FALSE(bfs::exists(directory / ".manifests" / "file"));
+    ASSERT_EQ(small, backup_directory.get_backup_file_content("file"));
+}
+
+TEST_F(PackedBackupDirectoryTest, test_batch) {
+    ChunkStore chunk_store(chunks_directory, options);
+    GroupCommitter committer;
+    UserBackupDirectory backup_directory(directory, &chunk_store, packing, &committer);
+    vector<uint8_t> small = get_payload();
+    vector<uint8_t> big(packing.max_packed_size * 2, 'b');
+    backup_directory.backup_file("existing", small);
+    uint64_t syncs = committer.get_statistics().syncs;
+
+    vector<BatchResult> results = backup_directory.backup_files({"small0", "big", "existing", "small1", "small0"},
+                                                                {small, big, small, small, small});
+    ASSERT_EQ((vector<BatchResult>{BatchResult::DONE, BatchResult::DONE, BatchResult::ALREADY_EXISTS, BatchResult::DONE,
+                                   BatchResult::ALREADY_EXISTS}),
+              results);
+    ASSERT_EQ(small, backup_directory.get_backup_file_content("small1"));
+    ASSERT_EQ(big, backup_directory.get_backup_file_content("big"));
+    // Both of the packed files were synced in a single batch
+    ASSERT_LE(syncs + 2, committer.get_statistics().syncs);
+
+    // Small files of a batch share their segment, which is synced once for all of them
+    syncs = committer.get_statistics().syncs;
+    results = backup_directory.backup_files({"small2", "small3", "small4"}, {small, small, small});
+    ASSERT_EQ(vector<BatchResult>(3, BatchResult::DONE), results);
+    ASSERT_EQ(syncs + 1, committer.get_statistics().syncs);
+
+    results = backup_directory.delete_files({"small0", "missing", "big", "small0"});
+    ASSERT_EQ((vector<BatchResult>{BatchResult::DONE, BatchResult::NOT_FOUND, BatchResult::DONE, BatchResult::NOT_FOUND}),
+              results);
+    ASSERT_EQ((vector<string>{"existing", "small1", "small2", "small3", "small4"}), backup_directory.get_backup_filenames());
+}
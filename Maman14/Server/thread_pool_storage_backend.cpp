@@ -0,0 +1,72 @@
+#include "thread_pool_storage_backend.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cerrno>
+
+using boost::system::error_code;
+using boost::system::system_error;
+
+// Retries system calls that were interrupted, and throws if they failed
+template <typename SystemCall>
+static auto check_system_call(SystemCall system_call) {
+    for (;;) {
+        auto result = system_call();
+        if (result >= 0) {
+            return result;
+        }
+        if (errno != EINTR) {
+            throw system_error(error_code(errno, boost::system::system_category()));
+        }
+    }
+}
+
+ThreadPoolStorageBackend::ThreadPoolStorageBackend(size_t num_threads)
+    : pool_(std::max<size_t>(num_threads, 1)) {}
+
+ThreadPoolStorageBackend::~ThreadPoolStorageBackend() {
+    pool_.join();
+}
+
+awaitable<size_t> ThreadPoolStorageBackend::write(int fd, const uint8_t* data, size_t size, uint64_t offset) {
+    co_return co_await boost::asio::co_spawn(
+        pool_, [=]() -> awaitable<size_t> {
+            co_return check_system_call([&]() { return ::pwrite(fd, data, size, static_cast<off_t>(offset)); });
+        },
+        boost::asio::use_awaitable);
+}
+
+awaitable<size_t> ThreadPoolStorageBackend::read(int fd, uint8_t* data, size_t size, uint64_t offset) {
+    co_return co_await boost::asio::co_spawn(
+        pool_, [=]() -> awaitable<size_t> {
+            co_return check_system_call([&]() { return ::pread(fd, data, size, static_cast<off_t>(offset)); });
+        },
+        boost::asio::use_awaitable);
+}
+
+awaitable<void> ThreadPoolStorageBackend::fsync(int fd) {
+    co_await boost::asio::co_spawn(
+        pool_, [=]() -> awaitable<void> {
+            check_system_call([&]() { return ::fsync(fd); });
+            co_return;
+        },
+        boost::asio::use_awaitable);
+}
+
+awaitable<void> ThreadPoolStorageBackend::rename_no_replace(const bfs::path& from, const bfs::path& to) {
+    // The paths live in our frame, which outlives the spawned coroutine
+    const string from_path = from.string();
+    const string to_path = to.string();
+    co_await boost::asio::co_spawn(
+        pool_, [&from_path, &to_path]() -> awaitable<void> {
+            check_system_call([&]() {
+                return ::renameat2(AT_FDCWD, from_path.c_str(), AT_FDCWD, to_path.c_str(), RENAME_NOREPLACE);
+            });
+            co_return;
+        },
+        boost::asio::use_awaitable);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <boost/asio/thread_pool.hpp>
+
+#include "storage_backend.h"
+
+/**
+ * @brief The portable storage backend, that does the blocking system calls on a small pool of threads
+ *
+ */
+class ThreadPoolStorageBackend : public StorageBackend {
+public:
+    ThreadPoolStorageBackend(size_t num_threads);
+    ~ThreadPoolStorageBackend();
+
+    virtual awaitable<size_t> write(int fd, const uint8_t* data, size_t size, uint64_t offset) override;
+    virtual awaitable<size_t> read(int fd, uint8_t* data, size_t size, uint64_t offset) override;
+    virtual awaitable<void> fsync(int fd) override;
+    virtual awaitable<void> rename_no_replace(const bfs::path& from, const bfs::path& to) override;
+    virtual const char* name() const override { return "thread pool"; };
+
+private:
+    boost::asio::thread_pool pool_;
+};
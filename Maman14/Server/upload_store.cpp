@@ -0,0 +1,408 @@
+#include "upload_store.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+// The journal of an upload, in the host's byte order like the pack store's segments:
+//   header: magic (8) size (8) name length (2) name
+//   record of each synced part: offset (8) size (8)
+// A record that was torn by a crash is cut off, or reads as zeros, which is an empty part
+static const char JOURNAL_MAGIC[8] = {'B', 'K', 'U', 'P', 'L', 'O', 'A', 'D'};
+static const size_t JOURNAL_HEADER_SIZE = 8 + 8 + 2;
+static const size_t JOURNAL_RECORD_SIZE = 8 + 8;
+static const char* DATA_EXTENSION = ".part";
+static const char* JOURNAL_EXTENSION = ".journal";
+
+template <typename T>
+static void append_value(vector<uint8_t>& buffer, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+template <typename T>
+static T read_value(const uint8_t* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static void pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset, const bfs::path& path) {
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw UploadStoreException("Failed to write: " + path.string());
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+static void write_all(int fd, const vector<uint8_t>& data, const bfs::path& path) {
+    size_t total = 0;
+    while (total < data.size()) {
+        ssize_t written = ::write(fd, data.data() + total, data.size() - total);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw UploadStoreException("Failed to write: " + path.string());
+        }
+        total += written;
+    }
+}
+
+static vector<uint8_t> read_file(const bfs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw UploadStoreException("Failed to open: " + path.string());
+    }
+    vector<uint8_t> content;
+    uint8_t buffer[4096];
+    for (;;) {
+        ssize_t bytes_read = ::read(fd, buffer, sizeof(buffer));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            ::close(fd);
+            throw UploadStoreException("Failed to read: " + path.string());
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        content.insert(content.end(), buffer, buffer + bytes_read);
+    }
+    ::close(fd);
+    return content;
+}
+
+UploadNotFoundException::UploadNotFoundException(UploadToken token)
+    : runtime_error("Upload not found: " + std::to_string(token)), token(token) {}
+
+UploadPartOutOfRangeException::UploadPartOutOfRangeException(UploadToken token, uint64_t offset, uint64_t size)
+    : UploadStoreException("Part at " + std::to_string(offset) + " of " + std::to_string(size) +
+                           " bytes is out of upload " + std::to_string(token)) {}
+
+TooManyUploadsException::TooManyUploadsException(size_t max_uploads)
+    : UploadStoreException("There are already " + std::to_string(max_uploads) + " uploads") {}
+
+uint64_t UploadStatus::get_committed_size() const {
+    uint64_t committed_size = 0;
+    for (const auto& range : committed) {
+        committed_size += range.size;
+    }
+    return committed_size;
+}
+
+bool UploadStatus::is_complete() const {
+    return get_committed_size() == size;
+}
+
+UploadStore::Upload::~Upload() {
+    if (data_fd >= 0) {
+        ::close(data_fd);
+    }
+    if (journal_fd >= 0) {
+        ::close(journal_fd);
+    }
+}
+
+UploadStore::UploadStore(bfs::path directory, GroupCommitter* group_committer, UploadStoreOptions options)
+    : directory_(std::move(directory)), group_committer_(group_committer), options_(options), random_(std::random_device()()) {
+    load();
+    remove_expired();
+}
+
+UploadStore::~UploadStore() = default;
+
+bfs::path UploadStore::get_data_path(UploadToken token) const {
+    return directory_ / (std::to_string(token) + DATA_EXTENSION);
+}
+
+bfs::path UploadStore::get_journal_path(UploadToken token) const {
+    return directory_ / (std::to_string(token) + JOURNAL_EXTENSION);
+}
+
+void UploadStore::load() {
+    boost::system::error_code error;
+    bfs::directory_iterator it(directory_, error);
+    if (error) {
+        // No upload was ever started
+        return;
+    }
+    vector<UploadToken> tokens;
+    for (; it != bfs::directory_iterator(); it++) {
+        if (it->path().extension() != JOURNAL_EXTENSION) {
+            continue;
+        }
+        // Journals are named after their tokens, anything else isn't ours
+        string stem = it->path().stem().string();
+        UploadToken token;
+        auto [end, parse_error] = std::from_chars(stem.data(), stem.data() + stem.size(), token);
+        if (parse_error == std::errc() && end == stem.data() + stem.size()) {
+            tokens.push_back(token);
+        }
+    }
+    for (UploadToken token : tokens) {
+        shared_ptr<Upload> upload = load_upload(token);
+        if (upload) {
+            uploads_.emplace(token, std::move(upload));
+        } else {
+            // Torn while it was started, so it was never acknowledged
+            remove_files(token);
+        }
+    }
+}
+
+shared_ptr<UploadStore::Upload> UploadStore::load_upload(UploadToken token) const {
+    vector<uint8_t> journal = read_file(get_journal_path(token));
+    if (journal.size() < JOURNAL_HEADER_SIZE || std::memcmp(journal.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        return nullptr;
+    }
+    auto upload = std::make_shared<Upload>();
+    upload->status.token = token;
+    upload->status.size = read_value<uint64_t>(journal.data() + 8);
+    uint16_t name_length = read_value<uint16_t>(journal.data() + 16);
+    if (journal.size() < JOURNAL_HEADER_SIZE + name_length) {
+        return nullptr;
+    }
+    upload->status.filename.assign(reinterpret_cast<const char*>(journal.data() + JOURNAL_HEADER_SIZE), name_length);
+    size_t end = JOURNAL_HEADER_SIZE + name_length;
+    for (; end + JOURNAL_RECORD_SIZE <= journal.size(); end += JOURNAL_RECORD_SIZE) {
+        UploadRange range{read_value<uint64_t>(journal.data() + end), read_value<uint64_t>(journal.data() + end + 8)};
+        if (range.offset > upload->status.size || range.size > upload->status.size - range.offset) {
+            // Torn, along with everything after it
+            break;
+        }
+        add_range(upload->status.committed, range);
+    }
+
+    upload->data_fd = ::open(get_data_path(token).c_str(), O_RDWR | O_CLOEXEC);
+    upload->journal_fd = ::open(get_journal_path(token).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat journal_stat;
+    if (upload->data_fd < 0 || upload->journal_fd < 0 || ::fstat(upload->journal_fd, &journal_stat) != 0) {
+        return nullptr;
+    }
+    // A part's record is appended to the journal, so it was last modified when the last part was written
+    upload->last_written = std::chrono::system_clock::from_time_t(journal_stat.st_mtime);
+    // The records that are appended after a torn one have to start where it did
+    if (end != journal.size() && ::ftruncate(upload->journal_fd, static_cast<off_t>(end)) != 0) {
+        return nullptr;
+    }
+    return upload;
+}
+
+void UploadStore::remove_files(UploadToken token) const {
+    boost::system::error_code error;
+    bfs::remove(get_journal_path(token), error);
+    bfs::remove(get_data_path(token), error);
+}
+
+void UploadStore::add_range(vector<UploadRange>& ranges, UploadRange range) {
+    if (range.size == 0) {
+        return;
+    }
+    auto it = std::lower_bound(ranges.begin(), ranges.end(), range,
+                               [](const UploadRange& a, const UploadRange& b) { return a.offset < b.offset; });
+    it = ranges.insert(it, range);
+    // Merge with the range before it, and then with every range after it that it reaches
+    if (it != ranges.begin() && std::prev(it)->offset + std::prev(it)->size >= it->offset) {
+        auto previous = std::prev(it);
+        previous->size = std::max(previous->offset + previous->size, it->offset + it->size) - previous->offset;
+        it = std::prev(ranges.erase(it));
+    }
+    auto next = std::next(it);
+    while (next != ranges.end() && it->offset + it->size >= next->offset) {
+        it->size = std::max(it->offset + it->size, next->offset + next->size) - it->offset;
+        next = ranges.erase(next);
+    }
+}
+
+void UploadStore::sync(int fd, const bfs::path& path) const {
+    if (group_committer_ == nullptr) {
+        if (::fdatasync(fd) != 0) {
+            throw UploadStoreException("Failed to sync: " + path.string());
+        }
+        return;
+    }
+    try {
+        group_committer_->sync(fd);
+    } catch (const boost::system::system_error& e) {
+        throw UploadStoreException("Failed to sync: " + path.string());
+    }
+}
+
+UploadStatus UploadStore::begin(const string& filename, uint64_t size) {
+    if (filename.size() > std::numeric_limits<uint16_t>::max()) {
+        throw UploadStoreException("Filename is too long: " + filename);
+    }
+    bfs::create_directories(directory_);
+    remove_expired();
+    auto upload = std::make_shared<Upload>();
+    upload->status.filename = filename;
+    upload->status.size = size;
+    upload->last_written = std::chrono::system_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (uploads_.size() >= options_.max_uploads) {
+            throw TooManyUploadsException(options_.max_uploads);
+        }
+        do {
+            upload->status.token = random_();
+        } while (upload->status.token == 0 || uploads_.count(upload->status.token) > 0);
+        // The upload takes its place right away, so concurrent uploads can't get the same token or go over the
+        // limit. Its token isn't handed out yet, so nothing else can use it meanwhile
+        uploads_.emplace(upload->status.token, upload);
+    }
+    UploadToken token = upload->status.token;
+
+    upload->data_fd = ::open(get_data_path(token).c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    upload->journal_fd = ::open(get_journal_path(token).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    try {
+        if (upload->data_fd < 0 || upload->journal_fd < 0) {
+            throw UploadStoreException("Failed to create upload: " + get_journal_path(token).string());
+        }
+        // The parts are written where they belong, and the holes are never read before they're filled
+        if (::ftruncate(upload->data_fd, static_cast<off_t>(size)) != 0) {
+            throw UploadStoreException("Failed to allocate upload: " + get_data_path(token).string());
+        }
+        vector<uint8_t> header(JOURNAL_MAGIC, JOURNAL_MAGIC + sizeof(JOURNAL_MAGIC));
+        append_value(header, size);
+        append_value(header, static_cast<uint16_t>(filename.size()));
+        header.insert(header.end(), filename.begin(), filename.end());
+        write_all(upload->journal_fd, header, get_journal_path(token));
+        sync(upload->data_fd, get_data_path(token));
+        sync(upload->journal_fd, get_journal_path(token));
+
+        // The token is only handed out once the upload would be found after a restart
+        int directory_fd = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directory_fd < 0 || ::fsync(directory_fd) != 0) {
+            if (directory_fd >= 0) {
+                ::close(directory_fd);
+            }
+            throw UploadStoreException("Failed to sync: " + directory_.string());
+        }
+        ::close(directory_fd);
+    } catch (const UploadStoreException& e) {
+        remove_files(token);
+        std::lock_guard<std::mutex> lock(mutex_);
+        uploads_.erase(token);
+        throw;
+    }
+    return upload->status;
+}
+
+shared_ptr<UploadStore::Upload> UploadStore::get_upload(UploadToken token) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = uploads_.find(token);
+    if (it == uploads_.end()) {
+        throw UploadNotFoundException(token);
+    }
+    return it->second;
+}
+
+UploadStatus UploadStore::write_part(UploadToken token, uint64_t offset, const uint8_t* data, size_t size) {
+    shared_ptr<Upload> upload = get_upload(token);
+    // The size of an upload never changes, so it can be read without the upload's lock
+    if (offset > upload->status.size || size > upload->status.size - offset) {
+        throw UploadPartOutOfRangeException(token, offset, size);
+    }
+    // Parts are written without the upload's lock, so the parts sent over several connections are written together
+    std::shared_lock<std::shared_mutex> writing(upload->writing);
+    if (upload->finished) {
+        throw UploadNotFoundException(token);
+    }
+    pwrite_all(upload->data_fd, data, size, offset, get_data_path(token));
+    sync(upload->data_fd, get_data_path(token));
+
+    std::lock_guard<std::mutex> lock(upload->mutex);
+    if (upload->finished) {
+        throw UploadNotFoundException(token);
+    }
+    vector<uint8_t> record;
+    append_value(record, offset);
+    append_value(record, static_cast<uint64_t>(size));
+    write_all(upload->journal_fd, record, get_journal_path(token));
+    sync(upload->journal_fd, get_journal_path(token));
+    add_range(upload->status.committed, UploadRange{offset, size});
+    upload->last_written = std::chrono::system_clock::now();
+    return upload->status;
+}
+
+UploadStatus UploadStore::get_status(UploadToken token) const {
+    shared_ptr<Upload> upload = get_upload(token);
+    std::lock_guard<std::mutex> lock(upload->mutex);
+    if (upload->finished) {
+        throw UploadNotFoundException(token);
+    }
+    return upload->status;
+}
+
+UploadStatus UploadStore::finish(UploadToken token, const std::function<void(const UploadStatus&, int, const bfs::path&)>& commit) {
+    shared_ptr<Upload> upload = get_upload(token);
+    std::unique_lock<std::shared_mutex> writing(upload->writing);
+    std::lock_guard<std::mutex> lock(upload->mutex);
+    if (upload->finished) {
+        throw UploadNotFoundException(token);
+    }
+    if (!upload->status.is_complete()) {
+        return upload->status;
+    }
+    commit(upload->status, upload->data_fd, get_data_path(token));
+    upload->finished = true;
+    remove_files(token);
+    {
+        std::lock_guard<std::mutex> uploads_lock(mutex_);
+        uploads_.erase(token);
+    }
+    return upload->status;
+}
+
+size_t UploadStore::get_num_uploads() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return uploads_.size();
+}
+
+size_t UploadStore::remove_expired() {
+    auto expired_before = std::chrono::system_clock::now() - options_.expiry;
+    vector<shared_ptr<Upload>> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [token, upload] : uploads_) {
+            candidates.push_back(upload);
+        }
+    }
+    size_t removed = 0;
+    for (const auto& upload : candidates) {
+        {
+            // Most uploads aren't expired, and this doesn't wait for the parts that are being written to them
+            std::lock_guard<std::mutex> upload_lock(upload->mutex);
+            if (upload->finished || upload->last_written >= expired_before) {
+                continue;
+            }
+        }
+        // Locked like finish, so a part that's being written either lands before the upload is removed or fails
+        std::unique_lock<std::shared_mutex> writing(upload->writing);
+        std::lock_guard<std::mutex> upload_lock(upload->mutex);
+        if (upload->finished || upload->last_written >= expired_before) {
+            continue;
+        }
+        upload->finished = true;
+        remove_files(upload->status.token);
+        std::lock_guard<std::mutex> lock(mutex_);
+        uploads_.erase(upload->status.token);
+        removed++;
+    }
+    return removed;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "group_commit.h"
+
+namespace bfs = boost::filesystem;
+using std::runtime_error;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+typedef uint64_t UploadToken;
+
+class UploadNotFoundException : public runtime_error {
+public:
+    UploadNotFoundException(UploadToken token);
+
+    UploadToken token;
+};
+
+class UploadStoreException : public runtime_error {
+public:
+    UploadStoreException(const string& what) : runtime_error(what) {}
+};
+
+class UploadPartOutOfRangeException : public UploadStoreException {
+public:
+    UploadPartOutOfRangeException(UploadToken token, uint64_t offset, uint64_t size);
+};
+
+class TooManyUploadsException : public UploadStoreException {
+public:
+    TooManyUploadsException(size_t max_uploads);
+};
+
+struct UploadStoreOptions {
+    // The most uploads that may be outstanding at once, each of them holds a file of its full size
+    size_t max_uploads = 64;
+
+    // An upload that no part was written to for this long is abandoned, and removed with its files
+    std::chrono::system_clock::duration expiry = std::chrono::hours(24 * 7);
+};
+
+/**
+ * @brief A piece of an upload that the server has, durably
+ *
+ */
+struct UploadRange {
+    uint64_t offset;
+    uint64_t size;
+
+    bool operator==(const UploadRange& other) const { return offset == other.offset && size == other.size; };
+};
+
+struct UploadStatus {
+    UploadToken token;
+    string filename;
+    uint64_t size;
+    // Sorted, and the ranges that touch are merged
+    vector<UploadRange> committed;
+
+    uint64_t get_committed_size() const;
+    bool is_complete() const;
+};
+
+/**
+ * @brief The uploads of a user's directory that are sent in parts, so an upload that was cut off can be resumed
+ * from where it stopped instead of starting over. Each upload is written at the offsets of its parts into a file
+ * of its own, and once a part is synced its range is appended to the upload's journal. The server only
+ * acknowledges the parts in the journal, and loads the journals on startup, so the uploads survive a restart too.
+ * The parts of an upload may be written concurrently, e.g. from several connections.
+ * Uploads that are abandoned are removed once they expire, when the next upload begins or on startup
+ *
+ */
+class UploadStore {
+public:
+    UploadStore(bfs::path directory, GroupCommitter* group_committer = nullptr, UploadStoreOptions options = UploadStoreOptions());
+    ~UploadStore();
+    UploadStore(const UploadStore&) = delete;
+    UploadStore& operator=(const UploadStore&) = delete;
+
+    /**
+     * @brief Start an upload of a file of the given size.
+     * Throws TooManyUploadsException if there are as many uploads as the options allow, after the expired ones
+     * are removed
+     *
+     * @return UploadStatus With the new upload's token, and nothing committed
+     */
+    UploadStatus begin(const string& filename, uint64_t size);
+
+    /**
+     * @brief Write a part of an upload and sync it. The part may overlap parts that were written already.
+     * Throws UploadPartOutOfRangeException if the part doesn't fit in the upload's size
+     *
+     * @return UploadStatus The upload's status with the part committed
+     */
+    UploadStatus write_part(UploadToken token, uint64_t offset, const uint8_t* data, size_t size);
+    UploadStatus get_status(UploadToken token) const;
+
+    /**
+     * @brief Hand a complete upload to commit, and remove it once commit returns. The upload's parts can't be written
+     * meanwhile, or after. If the upload isn't complete, or commit throws, the upload is left as it was
+     *
+     * @param commit Called with the upload's status, an fd of its content and the path of its file,
+     * which commit may rename to where it belongs instead of copying it
+     * @return UploadStatus The upload's status, which is only complete if it was committed
+     */
+    UploadStatus finish(UploadToken token, const std::function<void(const UploadStatus&, int, const bfs::path&)>& commit);
+
+    size_t get_num_uploads() const;
+
+    /**
+     * @brief Remove the uploads that expired, and their files
+     *
+     * @return size_t How many were removed
+     */
+    size_t remove_expired();
+
+private:
+    struct Upload {
+        ~Upload();
+
+        UploadStatus status;
+        int data_fd = -1;
+        int journal_fd = -1;
+        bool finished = false;
+        // When the upload began or its last part was written, or its journal was, for an upload that was loaded
+        std::chrono::system_clock::time_point last_written;
+        std::mutex mutex;
+        // Held shared while a part is written to the data file, and exclusively to finish,
+        // so no part is written to the file once it's committed
+        std::shared_mutex writing;
+    };
+
+    bfs::path get_data_path(UploadToken token) const;
+    bfs::path get_journal_path(UploadToken token) const;
+    shared_ptr<Upload> get_upload(UploadToken token) const;
+    void sync(int fd, const bfs::path& path) const;
+    void load();
+
+    /**
+     * @brief Read an upload back from its journal, or nothing if the journal is torn before its header ends
+     *
+     */
+    shared_ptr<Upload> load_upload(UploadToken token) const;
+    void remove_files(UploadToken token) const;
+    static void add_range(vector<UploadRange>& ranges, UploadRange range);
+
+    bfs::path directory_;
+    GroupCommitter* group_committer_;
+    UploadStoreOptions options_;
+    std::unordered_map<UploadToken, shared_ptr<Upload>> uploads_;
+    std::mt19937_64 random_;
+    mutable std::mutex mutex_;
+};
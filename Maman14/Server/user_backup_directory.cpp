@@ -1,75 +1,1255 @@
 #include "user_backup_directory.h"
 
-#include <fstream>
-#include <iostream>
-#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-using std::lock_guard;
+#include <algorithm>
+#include <array>
+#include <boost/make_unique.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
 
 FilePathException::FilePathException(string what, bfs::path full_path)
     : runtime_error(std::move(what)), filename_(full_path.filename().string()), full_path_(std::move(full_path)) {}
 
+// The path is copied and not moved, since the order in which the arguments are evaluated is unspecified
 FileAlreadyExistsException::FileAlreadyExistsException(bfs::path full_path)
-    : FilePathException("Filename: " + full_path.string() + " already exists", std::move(full_path)) {}
+    : FilePathException("Filename: " + full_path.string() + " already exists", full_path) {}
 
 FileNotFoundException::FileNotFoundException(bfs::path full_path)
-    : FilePathException("Filename: " + full_path.string() + " not found", std::move(full_path)) {}
+    : FilePathException("Filename: " + full_path.string() + " not found", full_path) {}
 
 FailedToDeleteFileException::FailedToDeleteFileException(bfs::path full_path)
-    : FilePathException("Failed to delete: " + full_path.string(), std::move(full_path)) {}
+    : FilePathException("Failed to delete: " + full_path.string(), full_path) {}
 
-UserBackupDirectory::UserBackupDirectory(bfs::path directory)
-    : directory_(std::move(directory)) {}
+FailedToWriteFileException::FailedToWriteFileException(bfs::path full_path)
+    : FilePathException("Failed to write: " + full_path.string(), full_path) {}
 
-static void write_to_file(const bfs::path file, const vector<uint8_t>& payload) {
-    std::ofstream ofs(file.string(), std::ios::binary | std::ios::out);
-    for (const auto& c : payload) {
-        ofs << c;
-    }
+InvalidFilenameException::InvalidFilenameException(bfs::path full_path)
+    : FilePathException("Invalid filename: " + full_path.string(), full_path) {}
+
+FailedToReadFileException::FailedToReadFileException(bfs::path full_path)
+    : FilePathException("Failed to read: " + full_path.string(), full_path) {}
+
+size_t BackupFileReader::get_num_raw_segments() const {
+    return static_cast<size_t>((size_ + MAX_STORED_SEGMENT_SIZE - 1) / MAX_STORED_SEGMENT_SIZE);
 }
 
-static const vector<uint8_t> read_from_file(const bfs::path file) {
-    std::ifstream ifs(file.string(), std::ios::binary | std::ios::in);
-    vector<unsigned char> content(std::istreambuf_iterator<char>(ifs), {});
+StoredSegment BackupFileReader::get_raw_segment(size_t index, int fd, uint64_t offset, const uint8_t* data) const {
+    uint64_t start{index * MAX_STORED_SEGMENT_SIZE};
+    uint64_t size{std::min(MAX_STORED_SEGMENT_SIZE, size_ - start)};
+    return StoredSegment{ChunkEncoding::RAW, size, FileSegment{fd, offset + start, size, data != nullptr ? data + start : nullptr}};
+}
+
+vector<uint8_t> BackupFileReader::read_all() const {
+    vector<uint8_t> content(size_);
+    uint64_t offset = 0;
+    while (offset < size_) {
+        size_t bytes_read = read(offset, content.data() + offset, size_ - offset);
+        if (bytes_read == 0) {
+            // The file was truncated under us
+            content.resize(offset);
+            break;
+        }
+        offset += bytes_read;
+    }
     return content;
 }
 
+static size_t pread_all(int fd, uint8_t* data, size_t size, uint64_t offset, const bfs::path& path) {
+    for (;;) {
+        ssize_t bytes_read = ::pread(fd, data, size, static_cast<off_t>(offset));
+        if (bytes_read >= 0) {
+            return static_cast<size_t>(bytes_read);
+        }
+        if (errno != EINTR) {
+            throw FailedToReadFileException(path);
+        }
+    }
+}
+
+static void pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset, const bfs::path& path) {
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw FailedToWriteFileException(path);
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+static awaitable<void> async_write_all(StorageBackend& storage, int fd, const uint8_t* data, size_t size, uint64_t offset,
+                                       const bfs::path& path) {
+    while (size > 0) {
+        size_t written = co_await storage.write(fd, data, size, offset);
+        if (written == 0) {
+            throw FailedToWriteFileException(path);
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+// Syncs a file through the group committer when there is one, so it shares a flush with the other backups
+static void sync_file(GroupCommitter* group_committer, int fd, const bfs::path& path) {
+    if (group_committer == nullptr) {
+        if (::fsync(fd) != 0) {
+            throw FailedToWriteFileException(path);
+        }
+        return;
+    }
+    try {
+        group_committer->sync(fd);
+    } catch (const boost::system::system_error& e) {
+        throw FailedToWriteFileException(path);
+    }
+}
+
+static awaitable<void> async_sync_file(GroupCommitter* group_committer, StorageBackend& storage, int fd) {
+    if (group_committer == nullptr) {
+        co_await storage.fsync(fd);
+        co_return;
+    }
+    co_await group_committer->async_sync(fd);
+}
+
+/**
+ * @brief Closes an fd that's synced, also when a coroutine that waits for the sync is destroyed
+ *
+ */
+class FileDescriptor {
+public:
+    FileDescriptor(int fd) : fd_(fd) {}
+    ~FileDescriptor() { ::close(fd_); }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+static int open_directory(const bfs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw FailedToWriteFileException(path);
+    }
+    return fd;
+}
+
+static uint64_t get_file_size(int fd, const bfs::path& path) {
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0) {
+        ::close(fd);
+        throw FailedToReadFileException(path);
+    }
+    return static_cast<uint64_t>(file_stat.st_size);
+}
+
+static int open_for_reading(const bfs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            throw FileNotFoundException(path);
+        }
+        throw FailedToReadFileException(path);
+    }
+    return fd;
+}
+
+PlainBackupFileReader::PlainBackupFileReader(bfs::path path) : BackupFileReader(std::move(path), 0), fd_(open_for_reading(path_)) {
+    size_ = get_file_size(fd_, path_);
+}
+
+PlainBackupFileReader::~PlainBackupFileReader() {
+    ::close(fd_);
+}
+
+size_t PlainBackupFileReader::read(uint64_t offset, uint8_t* data, size_t size) const {
+    return pread_all(fd_, data, size, offset, path_);
+}
+
+FileSegment PlainBackupFileReader::get_segment(uint64_t offset) const {
+    return FileSegment{fd_, offset, offset < size_ ? size_ - offset : 0};
+}
+
+StoredSegment PlainBackupFileReader::get_stored_segment(size_t index) const {
+    return get_raw_segment(index, fd_, 0);
+}
+
+PackedBackupFileReader::PackedBackupFileReader(PackedFileHandle handle)
+    : BackupFileReader(std::move(handle.segment_path), handle.size), fd_(handle.fd), offset_(handle.offset) {}
+
+PackedBackupFileReader::~PackedBackupFileReader() {
+    ::close(fd_);
+}
+
+size_t PackedBackupFileReader::read(uint64_t offset, uint8_t* data, size_t size) const {
+    if (offset >= size_) {
+        return 0;
+    }
+    return pread_all(fd_, data, std::min<uint64_t>(size, size_ - offset), offset_ + offset, path_);
+}
+
+FileSegment PackedBackupFileReader::get_segment(uint64_t offset) const {
+    return FileSegment{fd_, offset_ + offset, offset < size_ ? size_ - offset : 0};
+}
+
+StoredSegment PackedBackupFileReader::get_stored_segment(size_t index) const {
+    return get_raw_segment(index, fd_, offset_);
+}
+
+ChunkedBackupFileReader::ChunkedBackupFileReader(bfs::path path, Manifest manifest, ChunkStore& chunk_store)
+    : BackupFileReader(std::move(path), manifest.size),
+      manifest_(std::move(manifest)),
+      chunk_store_(chunk_store),
+      stored_size_(0),
+      chunk_fds_(manifest_.chunks.size(), -1),
+      window_start_(0),
+      decompressed_chunk_(std::numeric_limits<size_t>::max()),
+      window_offset_(0),
+      compressed_input_(nullptr),
+      compressed_input_size_(0),
+      compressed_offset_(0) {
+    chunk_offsets_.reserve(manifest_.chunks.size());
+    uint64_t offset = 0;
+    for (const auto& chunk : manifest_.chunks) {
+        chunk_offsets_.push_back(offset);
+        offset += chunk.size;
+    }
+
+    try {
+        chunk_store_.acquire(manifest_);
+    } catch (const ChunkNotFoundException& e) {
+        // The backup lost a chunk, so its content can't be restored
+        throw FailedToReadFileException(path_);
+    }
+    // The chunks can't change how they're stored while we reference them
+    stored_chunks_.reserve(manifest_.chunks.size());
+    for (const auto& chunk : manifest_.chunks) {
+        stored_chunks_.push_back(chunk_store_.get_stored_chunk(chunk.hash));
+        stored_size_ += stored_chunks_.back().stored_size;
+    }
+}
+
+ChunkedBackupFileReader::~ChunkedBackupFileReader() {
+    for (int fd : chunk_fds_) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    chunk_store_.release(manifest_);
+}
+
+size_t ChunkedBackupFileReader::find_chunk(uint64_t offset) const {
+    return std::upper_bound(chunk_offsets_.begin(), chunk_offsets_.end(), offset) - chunk_offsets_.begin() - 1;
+}
+
+int ChunkedBackupFileReader::open_chunk(size_t index) const {
+    if (index != window_start_) {
+        // Close the chunks that fell out of the window
+        for (size_t i = window_start_; i < std::min(window_start_ + READ_AHEAD_CHUNKS, chunk_fds_.size()); i++) {
+            if ((i < index || i >= index + READ_AHEAD_CHUNKS) && chunk_fds_[i] >= 0) {
+                ::close(chunk_fds_[i]);
+                chunk_fds_[i] = -1;
+            }
+        }
+        window_start_ = index;
+    }
+
+    for (size_t i = index; i < std::min(index + READ_AHEAD_CHUNKS, chunk_fds_.size()); i++) {
+        if (chunk_fds_[i] >= 0) {
+            continue;
+        }
+        bfs::path chunk_path = chunk_store_.get_chunk_path(manifest_.chunks[i].hash, stored_chunks_[i].encoding);
+        chunk_fds_[i] = ::open(chunk_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (chunk_fds_[i] < 0) {
+            if (i == index) {
+                throw FailedToReadFileException(chunk_path);
+            }
+            // Only read ahead, so it fails again when it's actually needed
+            continue;
+        }
+        ::posix_fadvise(chunk_fds_[i], 0, 0, POSIX_FADV_WILLNEED);
+    }
+    return chunk_fds_[index];
+}
+
+size_t ChunkedBackupFileReader::read(uint64_t offset, uint8_t* data, size_t size) const {
+    FileSegment segment = get_segment(offset);
+    size_t to_read = static_cast<size_t>(std::min<uint64_t>(size, segment.size));
+    if (segment.data != nullptr) {
+        std::memcpy(data, segment.data, to_read);
+        return to_read;
+    }
+    size_t bytes_read = pread_all(segment.fd, data, to_read, segment.offset, path_);
+    if (bytes_read == 0 && to_read > 0) {
+        // The chunk is shorter than the manifest says
+        throw FailedToReadFileException(path_);
+    }
+    return bytes_read;
+}
+
+FileSegment ChunkedBackupFileReader::get_segment(uint64_t offset) const {
+    if (offset >= size_) {
+        return FileSegment{-1, 0, 0};
+    }
+    size_t index = find_chunk(offset);
+    uint64_t chunk_offset = offset - chunk_offsets_[index];
+    if (stored_chunks_[index].encoding == ChunkEncoding::DEFLATE) {
+        return decompress_segment(index, chunk_offset);
+    }
+    return FileSegment{open_chunk(index), chunk_offset, manifest_.chunks[index].size - chunk_offset};
+}
+
+StoredSegment ChunkedBackupFileReader::get_stored_segment(size_t index) const {
+    return StoredSegment{stored_chunks_[index].encoding, manifest_.chunks[index].size,
+                         FileSegment{open_chunk(index), 0, stored_chunks_[index].stored_size}};
+}
+
+FileSegment ChunkedBackupFileReader::decompress_segment(size_t index, uint64_t chunk_offset) const {
+    if (decompressor_ == nullptr) {
+        decompressor_ = boost::make_unique<DeflateDecompressor>();
+        compressed_.resize(DECOMPRESSION_WINDOW_SIZE);
+    }
+    if (index != decompressed_chunk_ || chunk_offset < window_offset_) {
+        decompressor_->reset();
+        decompressed_chunk_ = index;
+        window_offset_ = 0;
+        window_.clear();
+        compressed_input_size_ = 0;
+        compressed_offset_ = 0;
+    }
+    while (chunk_offset >= window_offset_ + window_.size()) {
+        decompress_next_window(index);
+    }
+    return FileSegment{-1, 0, window_offset_ + window_.size() - chunk_offset, window_.data() + (chunk_offset - window_offset_)};
+}
+
+void ChunkedBackupFileReader::decompress_next_window(size_t index) const {
+    window_offset_ += window_.size();
+    size_t window_size = static_cast<size_t>(std::min<uint64_t>(DECOMPRESSION_WINDOW_SIZE, manifest_.chunks[index].size - window_offset_));
+    window_.resize(window_size);
+    size_t decompressed = 0;
+    try {
+        while (decompressed < window_size) {
+            if (decompressor_->finished()) {
+                // The chunk is shorter than the manifest says
+                throw FailedToReadFileException(path_);
+            }
+            if (compressed_input_size_ == 0) {
+                size_t to_read = static_cast<size_t>(std::min<uint64_t>(compressed_.size(), stored_chunks_[index].stored_size - compressed_offset_));
+                compressed_input_size_ = pread_all(open_chunk(index), compressed_.data(), to_read, compressed_offset_, path_);
+                if (compressed_input_size_ == 0) {
+                    throw FailedToReadFileException(path_);
+                }
+                compressed_input_ = compressed_.data();
+                compressed_offset_ += compressed_input_size_;
+            }
+            decompressed += decompressor_->decompress(compressed_input_, compressed_input_size_, window_.data() + decompressed,
+                                                      window_size - decompressed);
+        }
+    } catch (const CompressionException& e) {
+        throw FailedToReadFileException(path_);
+    }
+}
+
+PlainBackupFileWriter::PlainBackupFileWriter(UserBackupDirectory& directory, string filename, bfs::path temp_path, bool replace,
+                                             bool manifest)
+    : directory_(directory),
+      filename_(std::move(filename)),
+      temp_path_(std::move(temp_path)),
+      backup_file_(manifest ? directory_.get_manifest_path(filename_) : directory_.get_backup_path(filename_)),
+      fd_(::open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)),
+      offset_(0),
+      replace_(replace),
+      committed_(false) {
+    if (fd_ < 0) {
+        throw FailedToWriteFileException(temp_path_);
+    }
+}
+
+PlainBackupFileWriter::~PlainBackupFileWriter() {
+    close();
+    if (!committed_) {
+        boost::system::error_code ignored;
+        bfs::remove(temp_path_, ignored);
+    }
+}
+
+void PlainBackupFileWriter::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+void PlainBackupFileWriter::write(const uint8_t* data, size_t size) {
+    pwrite_all(fd_, data, size, offset_, temp_path_);
+    offset_ += size;
+}
+
+void PlainBackupFileWriter::describe_content(uint64_t size, const ContentHash& content_hash) {
+    described_content_.emplace(size, content_hash);
+}
+
+FileIndexEntry PlainBackupFileWriter::stat_entry() const {
+    struct stat file_stat;
+    if (::fstat(fd_, &file_stat) != 0) {
+        throw FailedToWriteFileException(temp_path_);
+    }
+    FileIndexEntry entry = FileIndexEntry::from_stat(file_stat);
+    if (described_content_) {
+        entry.size = described_content_->first;
+        entry.content_hash = described_content_->second;
+    }
+    return entry;
+}
+
+void PlainBackupFileWriter::commit() {
+    sync_file(directory_.group_committer_, fd_, temp_path_);
+    FileIndexEntry entry = stat_entry();
+    close();
+    if (replace_) {
+        directory_.replace_backup(filename_, temp_path_, backup_file_, entry);
+        committed_ = true;
+        directory_.sync_directory(backup_file_.parent_path());
+        return;
+    }
+
+    // Someone else might have backed up the same filename while we were writing
+    directory_.rename_new_backup(filename_, temp_path_, backup_file_, entry);
+    committed_ = true;
+    // The backup is only acknowledged once the rename is durable
+    directory_.sync_directory(backup_file_.parent_path());
+}
+
+awaitable<void> PlainBackupFileWriter::async_write(StorageBackend& storage, const uint8_t* data, size_t size) {
+    co_await async_write_all(storage, fd_, data, size, offset_, temp_path_);
+    offset_ += size;
+}
+
+awaitable<void> PlainBackupFileWriter::async_commit(StorageBackend& storage) {
+    co_await async_sync_file(directory_.group_committer_, storage, fd_);
+    FileIndexEntry entry = stat_entry();
+    close();
+    if (replace_) {
+        // The rename has to happen under the file's lock, which can't be held across a suspension
+        directory_.replace_backup(filename_, temp_path_, backup_file_, entry);
+        committed_ = true;
+        co_await directory_.async_sync_directory(storage, backup_file_.parent_path());
+        co_return;
+    }
+
+    // Like a replace, the rename has to happen under the file's lock
+    directory_.rename_new_backup(filename_, temp_path_, backup_file_, entry);
+    committed_ = true;
+    co_await directory_.async_sync_directory(storage, backup_file_.parent_path());
+}
+
+// How much of the first data of a backup is sampled to decide how to compress it
+static const size_t COMPRESSION_SAMPLE_SIZE = 64 * 1024;
+
+ChunkedBackupFileWriter::ChunkedBackupFileWriter(ChunkStore& chunk_store, unique_ptr<PlainBackupFileWriter> manifest_writer,
+                                                 GroupCommitter* group_committer)
+    : chunk_store_(chunk_store),
+      manifest_writer_(std::move(manifest_writer)),
+      group_committer_(group_committer),
+      chunker_(chunk_store.make_chunker()),
+      chunk_fd_(-1),
+      chunk_size_(0),
+      chunk_stored_size_(0),
+      committed_(false),
+      elapsed_(0) {}
+
+ChunkedBackupFileWriter::~ChunkedBackupFileWriter() {
+    discard_chunk();
+    if (!committed_) {
+        chunk_store_.release(manifest_);
+    }
+}
+
+size_t ChunkedBackupFileWriter::take(const uint8_t* data, size_t size, bool& cut) {
+    if (chunk_fd_ < 0) {
+        chunk_path_ = chunk_store_.make_incoming_path();
+        chunk_fd_ = ::open(chunk_path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (chunk_fd_ < 0) {
+            chunk_path_.clear();
+            throw FailedToWriteFileException(chunk_store_.get_directory());
+        }
+        chunk_size_ = 0;
+        chunk_stored_size_ = 0;
+        chunk_hash_.reset();
+    }
+
+    size_t cut_size = chunker_->find_cut(data, size);
+    cut = cut_size != 0;
+    size_t taken = cut ? cut_size : size;
+    chunk_hash_.update(data, taken);
+    return taken;
+}
+
+size_t ChunkedBackupFileWriter::sample(const uint8_t* data, size_t size, bool end) {
+    size_t sampled = std::min(size, COMPRESSION_SAMPLE_SIZE - sample_.size());
+    sample_.insert(sample_.end(), data, data + sampled);
+    if (sample_.size() < COMPRESSION_SAMPLE_SIZE && !end) {
+        return sampled;
+    }
+    compression_ = chunk_store_.choose_compression(sample_.data(), sample_.size());
+    if (compression_->encoding == ChunkEncoding::DEFLATE) {
+        compressor_ = boost::make_unique<DeflateCompressor>(*compression_);
+    }
+    return sampled;
+}
+
+bool ChunkedBackupFileWriter::end_chunk() {
+    last_chunk_hash_ = chunk_hash_.finish();
+    if (!chunk_store_.add_reference(last_chunk_hash_)) {
+        return true;
+    }
+    // The store already has this chunk, so ours doesn't even need to reach the disk
+    manifest_.add_chunk(last_chunk_hash_, chunk_size_);
+    discard_chunk();
+    return false;
+}
+
+std::pair<const uint8_t*, size_t> ChunkedBackupFileWriter::encode(const uint8_t* data, size_t size, bool end) {
+    if (compressor_ == nullptr) {
+        return {data, size};
+    }
+    compressed_.clear();
+    compressor_->compress(data, size, compressed_);
+    if (end) {
+        compressor_->finish(compressed_);
+    }
+    if (chunk_stored_size_ + compressed_.size() > std::numeric_limits<uint32_t>::max()) {
+        throw FailedToWriteFileException(chunk_path_);
+    }
+    return {compressed_.data(), compressed_.size()};
+}
+
+void ChunkedBackupFileWriter::publish_chunk() {
+    ::close(chunk_fd_);
+    chunk_fd_ = -1;
+    vector<bfs::path> directories = chunk_store_.publish(chunk_path_, last_chunk_hash_, chunk_size_,
+                                                         compressor_ ? std::make_optional(chunk_stored_size_) : std::nullopt);
+    unsynced_directories_.insert(directories.begin(), directories.end());
+    manifest_.add_chunk(last_chunk_hash_, chunk_size_);
+    chunk_path_.clear();
+}
+
+void ChunkedBackupFileWriter::discard_chunk() {
+    if (chunk_fd_ >= 0) {
+        ::close(chunk_fd_);
+        chunk_fd_ = -1;
+    }
+    if (!chunk_path_.empty()) {
+        ::unlink(chunk_path_.c_str());
+        chunk_path_.clear();
+    }
+}
+
+void ChunkedBackupFileWriter::sync_chunk_directories() {
+    for (const auto& directory : unsynced_directories_) {
+        FileDescriptor directory_fd(open_directory(directory));
+        sync_file(group_committer_, directory_fd.get(), directory);
+    }
+    unsynced_directories_.clear();
+}
+
+awaitable<void> ChunkedBackupFileWriter::async_sync_chunk_directories(StorageBackend& storage) {
+    for (const auto& directory : unsynced_directories_) {
+        FileDescriptor directory_fd(open_directory(directory));
+        co_await async_sync_file(group_committer_, storage, directory_fd.get());
+    }
+    unsynced_directories_.clear();
+}
+
+void ChunkedBackupFileWriter::on_committed() {
+    committed_ = true;
+    chunk_store_.on_ingested(manifest_.size, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed_));
+}
+
+void ChunkedBackupFileWriter::write(const uint8_t* data, size_t size) {
+    auto start = std::chrono::steady_clock::now();
+    if (!compression_) {
+        size_t sampled = sample(data, size, false);
+        data += sampled;
+        size -= sampled;
+        if (compression_) {
+            write_chunks(sample_.data(), sample_.size());
+            vector<uint8_t>().swap(sample_);
+        }
+    }
+    write_chunks(data, size);
+    elapsed_ += std::chrono::steady_clock::now() - start;
+}
+
+void ChunkedBackupFileWriter::write_chunks(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        bool cut;
+        size_t taken = take(data, size, cut);
+        auto [stored, stored_size] = encode(data, taken, cut);
+        pwrite_all(chunk_fd_, stored, stored_size, chunk_stored_size_, chunk_path_);
+        chunk_size_ += taken;
+        chunk_stored_size_ += stored_size;
+        if (cut && end_chunk()) {
+            sync_file(group_committer_, chunk_fd_, chunk_path_);
+            publish_chunk();
+        }
+        data += taken;
+        size -= taken;
+    }
+}
+
+void ChunkedBackupFileWriter::commit() {
+    auto start = std::chrono::steady_clock::now();
+    if (!compression_ && !sample_.empty()) {
+        // The whole backup is smaller than a sample
+        sample(nullptr, 0, true);
+        write_chunks(sample_.data(), sample_.size());
+        vector<uint8_t>().swap(sample_);
+    }
+    if (chunk_size_ > 0 && chunk_fd_ >= 0) {
+        auto [stored, stored_size] = encode(nullptr, 0, true);
+        pwrite_all(chunk_fd_, stored, stored_size, chunk_stored_size_, chunk_path_);
+        chunk_stored_size_ += stored_size;
+    }
+    if (chunk_size_ > 0 && chunk_fd_ >= 0 && end_chunk()) {
+        sync_file(group_committer_, chunk_fd_, chunk_path_);
+        publish_chunk();
+    }
+    discard_chunk();
+    sync_chunk_directories();
+
+    vector<uint8_t> manifest = manifest_.serialize();
+    manifest_writer_->write(manifest.data(), manifest.size());
+    manifest_writer_->describe_content(manifest_.size, manifest_.get_content_hash());
+    manifest_writer_->commit();
+    elapsed_ += std::chrono::steady_clock::now() - start;
+    on_committed();
+}
+
+awaitable<void> ChunkedBackupFileWriter::async_write(StorageBackend& storage, const uint8_t* data, size_t size) {
+    auto start = std::chrono::steady_clock::now();
+    if (!compression_) {
+        size_t sampled = sample(data, size, false);
+        data += sampled;
+        size -= sampled;
+        if (compression_) {
+            co_await async_write_chunks(storage, sample_.data(), sample_.size());
+            vector<uint8_t>().swap(sample_);
+        }
+    }
+    co_await async_write_chunks(storage, data, size);
+    elapsed_ += std::chrono::steady_clock::now() - start;
+}
+
+awaitable<void> ChunkedBackupFileWriter::async_write_chunks(StorageBackend& storage, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        bool cut;
+        size_t taken = take(data, size, cut);
+        auto [stored, stored_size] = encode(data, taken, cut);
+        co_await async_write_all(storage, chunk_fd_, stored, stored_size, chunk_stored_size_, chunk_path_);
+        chunk_size_ += taken;
+        chunk_stored_size_ += stored_size;
+        if (cut && end_chunk()) {
+            co_await async_sync_file(group_committer_, storage, chunk_fd_);
+            publish_chunk();
+        }
+        data += taken;
+        size -= taken;
+    }
+}
+
+awaitable<void> ChunkedBackupFileWriter::async_commit(StorageBackend& storage) {
+    auto start = std::chrono::steady_clock::now();
+    if (!compression_ && !sample_.empty()) {
+        sample(nullptr, 0, true);
+        co_await async_write_chunks(storage, sample_.data(), sample_.size());
+        vector<uint8_t>().swap(sample_);
+    }
+    if (chunk_size_ > 0 && chunk_fd_ >= 0) {
+        auto [stored, stored_size] = encode(nullptr, 0, true);
+        co_await async_write_all(storage, chunk_fd_, stored, stored_size, chunk_stored_size_, chunk_path_);
+        chunk_stored_size_ += stored_size;
+    }
+    if (chunk_size_ > 0 && chunk_fd_ >= 0 && end_chunk()) {
+        co_await async_sync_file(group_committer_, storage, chunk_fd_);
+        publish_chunk();
+    }
+    discard_chunk();
+    co_await async_sync_chunk_directories(storage);
+
+    vector<uint8_t> manifest = manifest_.serialize();
+    co_await manifest_writer_->async_write(storage, manifest.data(), manifest.size());
+    manifest_writer_->describe_content(manifest_.size, manifest_.get_content_hash());
+    co_await manifest_writer_->async_commit(storage);
+    elapsed_ += std::chrono::steady_clock::now() - start;
+    on_committed();
+}
+
+PackedBackupFileWriter::PackedBackupFileWriter(UserBackupDirectory& directory, string filename, bool replace)
+    : directory_(directory), filename_(std::move(filename)), replace_(replace) {}
+
+bool PackedBackupFileWriter::should_spill(size_t size) const {
+    return !spilled_ && !directory_.pack_store_->fits(content_.size() + size);
+}
+
+void PackedBackupFileWriter::make_spilled_writer() {
+    spilled_ = directory_.make_file_writer(filename_, replace_);
+}
+
+void PackedBackupFileWriter::write(const uint8_t* data, size_t size) {
+    if (should_spill(size)) {
+        make_spilled_writer();
+        spilled_->write(content_.data(), content_.size());
+        vector<uint8_t>().swap(content_);
+    }
+    if (spilled_) {
+        spilled_->write(data, size);
+        return;
+    }
+    content_.insert(content_.end(), data, data + size);
+}
+
+void PackedBackupFileWriter::commit() {
+    if (spilled_) {
+        spilled_->commit();
+        return;
+    }
+    directory_.commit_packed(filename_, content_, replace_);
+}
+
+awaitable<void> PackedBackupFileWriter::async_write(StorageBackend& storage, const uint8_t* data, size_t size) {
+    if (should_spill(size)) {
+        make_spilled_writer();
+        co_await spilled_->async_write(storage, content_.data(), content_.size());
+        vector<uint8_t>().swap(content_);
+    }
+    if (spilled_) {
+        co_await spilled_->async_write(storage, data, size);
+        co_return;
+    }
+    content_.insert(content_.end(), data, data + size);
+}
+
+awaitable<void> PackedBackupFileWriter::async_commit(StorageBackend& storage) {
+    if (spilled_) {
+        co_await spilled_->async_commit(storage);
+        co_return;
+    }
+    // A small file takes a single append, which isn't worth a round trip through the storage backend.
+    // With group commit its sync is awaited, without it the append is synced right away
+    co_await directory_.async_commit_packed(filename_, content_, replace_);
+}
+
+UserBackupDirectory::UserBackupDirectory(bfs::path directory, ChunkStore* chunk_store, std::optional<PackStoreOptions> packing,
+                                         GroupCommitter* group_committer)
+    : directory_(std::move(directory)),
+      incoming_directory_(directory_ / ".incoming"),
+      manifest_directory_(directory_ / MANIFEST_DIRECTORY_NAME),
+      chunk_store_(chunk_store),
+      group_committer_(group_committer),
+      upload_store_(boost::make_unique<UploadStore>(directory_ / ".uploads", group_committer)) {
+    if (packing) {
+        pack_store_ = boost::make_unique<PackStore>(directory_ / ".packs", *packing);
+    }
+    scan_directory();
+    merge_packed_files();
+}
+
+UserBackupDirectory::UserBackupDirectory(bfs::path directory, const vector<std::pair<string, FileIndexEntry>>& index_entries,
+                                         ChunkStore* chunk_store, std::optional<PackStoreOptions> packing,
+                                         GroupCommitter* group_committer)
+    : directory_(std::move(directory)),
+      incoming_directory_(directory_ / ".incoming"),
+      manifest_directory_(directory_ / MANIFEST_DIRECTORY_NAME),
+      chunk_store_(chunk_store),
+      group_committer_(group_committer),
+      upload_store_(boost::make_unique<UploadStore>(directory_ / ".uploads", group_committer)) {
+    if (packing) {
+        // The packed files are in the snapshot's entries already, but the pack store still needs to find where they are
+        pack_store_ = boost::make_unique<PackStore>(directory_ / ".packs", *packing);
+    }
+    for (const auto& [filename, entry] : index_entries) {
+        index_.insert(filename, entry);
+    }
+}
+
+void UserBackupDirectory::scan_directory() {
+    boost::system::error_code error;
+    bfs::directory_iterator it(directory_, error);
+    if (error) {
+        // A new user, whose directory doesn't exist yet
+        return;
+    }
+    for (; it != bfs::directory_iterator(); it++) {
+        struct stat file_stat;
+        // Skip the incoming directory, the manifests are scanned next
+        if (::stat(it->path().c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+        index_.insert(it->path().filename().string(), FileIndexEntry::from_stat(file_stat));
+    }
+    scan_manifests();
+}
+
+void UserBackupDirectory::scan_manifests() {
+    if (chunk_store_ == nullptr) {
+        return;
+    }
+    boost::system::error_code error;
+    bfs::directory_iterator it(manifest_directory_, error);
+    if (error) {
+        // Nothing was deduplicated yet
+        return;
+    }
+    for (; it != bfs::directory_iterator(); it++) {
+        struct stat file_stat;
+        if (::stat(it->path().c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+        std::optional<Manifest> manifest;
+        try {
+            manifest = Manifest::read(it->path());
+        } catch (const InvalidManifestException& e) {
+            // It can't be restored, so it isn't listed either
+            continue;
+        }
+        string filename = it->path().filename().string();
+        FileIndexEntry entry = FileIndexEntry::from_stat(file_stat);
+        std::optional<FileIndexEntry> plain_entry = index_.find(filename);
+        if (plain_entry && plain_entry->mtime_ns > entry.mtime_ns) {
+            bfs::remove(it->path());
+            continue;
+        }
+        if (plain_entry) {
+            bfs::remove(get_backup_path(filename));
+        }
+        // The index describes the file's content, not its manifest
+        entry.size = manifest->size;
+        entry.content_hash = manifest->get_content_hash();
+        chunk_store_->restore_references(*manifest);
+        index_.insert(filename, entry);
+    }
+}
+
+void UserBackupDirectory::merge_packed_files() {
+    if (!pack_store_) {
+        return;
+    }
+    for (const auto& [filename, entry] : pack_store_->get_entries()) {
+        std::optional<FileIndexEntry> file_entry = index_.find(filename);
+        if (file_entry && file_entry->mtime_ns > entry.mtime_ns) {
+            pack_store_->remove(filename);
+            continue;
+        }
+        if (file_entry) {
+            remove_file(filename);
+        }
+        index_.insert(filename, entry);
+    }
+}
+
+void UserBackupDirectory::restore_chunk_references() const {
+    if (chunk_store_ == nullptr) {
+        return;
+    }
+    for (const auto& filename : index_.get_filenames()) {
+        if (auto manifest = read_manifest(filename)) {
+            chunk_store_->restore_references(*manifest);
+        }
+    }
+}
+
+std::optional<Manifest> UserBackupDirectory::read_manifest(const string& filename) const {
+    if (chunk_store_ == nullptr) {
+        return std::nullopt;
+    }
+    bfs::path manifest_file = get_manifest_path(filename);
+    if (::access(manifest_file.c_str(), F_OK) != 0) {
+        // A plain file, or packed
+        return std::nullopt;
+    }
+    return Manifest::read(manifest_file);
+}
+
+// A filename is joined to the directory's path, so it mustn't lead anywhere else, like into the manifests
+// The directory's own entries, which a backup mustn't take the place of
+static const std::array<const char*, 4> RESERVED_FILENAMES{".incoming", UserBackupDirectory::MANIFEST_DIRECTORY_NAME, ".uploads", ".packs"};
+
+static void check_filename(const bfs::path& directory, const string& filename) {
+    if (filename.empty() || filename == "." || filename == ".." || filename.find_first_of(string("/\0", 2)) != string::npos) {
+        throw InvalidFilenameException(directory / filename);
+    }
+    if (std::find(RESERVED_FILENAMES.begin(), RESERVED_FILENAMES.end(), filename) != RESERVED_FILENAMES.end()) {
+        throw InvalidFilenameException(directory / filename);
+    }
+}
+
 void UserBackupDirectory::backup_file(const string& filename, const vector<uint8_t>& payload) {
-    lock_guard<mutex> lock(mutex_);
-    bfs::path backup_file = directory_ / filename;
-    if (bfs::exists(backup_file)) {
+    unique_ptr<BackupFileWriter> writer{begin_backup(filename)};
+    writer->write(payload.data(), payload.size());
+    writer->commit();
+}
+
+vector<BatchResult> UserBackupDirectory::backup_files(const vector<string>& filenames, const vector<vector<uint8_t>>& payloads) {
+    vector<BatchResult> results(filenames.size(), BatchResult::FAILED);
+    // An fd of each segment that files were packed into, and which of the files were packed and as what
+    std::map<uint64_t, int> segment_fds;
+    vector<size_t> unsynced_files;
+    vector<FileIndexEntry> unsynced_entries;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        try {
+            check_filename(directory_, filenames[i]);
+            if (index_.contains(filenames[i])) {
+                results[i] = BatchResult::ALREADY_EXISTS;
+                continue;
+            }
+            if (pack_store_ && pack_store_->fits(payloads[i].size())) {
+                UnsyncedPut put = pack(filenames[i], payloads[i], false, true);
+                // The small files of a batch mostly go to the same segment, which is synced once for all of them
+                if (!segment_fds.emplace(put.segment, put.fd).second) {
+                    ::close(put.fd);
+                }
+                unsynced_files.push_back(i);
+                unsynced_entries.push_back(put.entry);
+            } else {
+                backup_file(filenames[i], payloads[i]);
+            }
+            results[i] = BatchResult::DONE;
+        } catch (const FileAlreadyExistsException& e) {
+            results[i] = BatchResult::ALREADY_EXISTS;
+        } catch (const std::exception& e) {
+            results[i] = BatchResult::FAILED;
+        }
+    }
+
+    vector<int> unsynced_fds;
+    for (const auto& [segment, fd] : segment_fds) {
+        unsynced_fds.push_back(fd);
+    }
+    try {
+        sync_packs(unsynced_fds);
+    } catch (const FailedToWriteFileException& e) {
+        // The packed files aren't durable, so they mustn't be restored or listed
+        for (size_t j = 0; j < unsynced_files.size(); j++) {
+            results[unsynced_files[j]] = BatchResult::FAILED;
+            unpack(filenames[unsynced_files[j]], unsynced_entries[j]);
+        }
+    }
+    for (int fd : unsynced_fds) {
+        ::close(fd);
+    }
+    return results;
+}
+
+// A finished upload is copied into its backup in pieces of this size
+static const size_t UPLOAD_COPY_CHUNK_SIZE = 1024 * 1024;
+
+UploadStatus UserBackupDirectory::begin_upload(const string& filename, uint64_t size) {
+    check_filename(directory_, filename);
+    if (index_.contains(filename)) {
+        throw FileAlreadyExistsException(directory_ / filename);
+    }
+    return upload_store_->begin(filename, size);
+}
+
+UploadStatus UserBackupDirectory::write_upload_part(UploadToken token, uint64_t offset, const uint8_t* data, size_t size) {
+    return upload_store_->write_part(token, offset, data, size);
+}
+
+UploadStatus UserBackupDirectory::get_upload_status(UploadToken token) const {
+    return upload_store_->get_status(token);
+}
+
+UploadStatus UserBackupDirectory::finish_upload(UploadToken token) {
+    return upload_store_->finish(token, [this](const UploadStatus& status, int fd, const bfs::path& data_path) {
+        if (chunk_store_ == nullptr && !(pack_store_ && pack_store_->fits(status.size))) {
+            // Stored as it is, so the upload's file is the backup, there's nothing to copy
+            commit_upload_file(status.filename, fd, data_path);
+            return;
+        }
+        // The upload is backed up like any other file, so it's deduplicated or packed like the rest
+        unique_ptr<BackupFileWriter> writer{begin_backup(status.filename)};
+        vector<uint8_t> chunk(static_cast<size_t>(std::min<uint64_t>(UPLOAD_COPY_CHUNK_SIZE, status.size)));
+        for (uint64_t offset = 0; offset < status.size;) {
+            ssize_t bytes_read = ::pread(fd, chunk.data(), static_cast<size_t>(std::min<uint64_t>(chunk.size(), status.size - offset)),
+                                         static_cast<off_t>(offset));
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                throw FailedToReadFileException(directory_ / ".uploads" / std::to_string(status.token));
+            }
+            writer->write(chunk.data(), static_cast<size_t>(bytes_read));
+            offset += bytes_read;
+        }
+        writer->commit();
+    });
+}
+
+void UserBackupDirectory::commit_upload_file(const string& filename, int fd, const bfs::path& data_path) {
+    bfs::path backup_file = get_backup_path(filename);
+    if (index_.contains(filename)) {
         throw FileAlreadyExistsException(backup_file);
     }
+    // The same steps as committing a backup that was written to a temporary file
+    sync_file(group_committer_, fd, data_path);
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0) {
+        throw FailedToWriteFileException(data_path);
+    }
+    rename_new_backup(filename, data_path, backup_file, FileIndexEntry::from_stat(file_stat));
+    sync_directory(directory_);
+}
+
+unique_ptr<BackupFileWriter> UserBackupDirectory::begin_backup(const string& filename) {
+    check_filename(directory_, filename);
+    if (index_.contains(filename)) {
+        throw FileAlreadyExistsException(directory_ / filename);
+    }
+    return make_writer(filename, false);
+}
+
+unique_ptr<BackupFileWriter> UserBackupDirectory::begin_replace(const string& filename) {
+    if (!index_.contains(filename)) {
+        throw FileNotFoundException(directory_ / filename);
+    }
+    return make_writer(filename, true);
+}
+
+unique_ptr<BackupFileWriter> UserBackupDirectory::make_writer(const string& filename, bool replace) {
+    if (pack_store_) {
+        return boost::make_unique<PackedBackupFileWriter>(*this, filename, replace);
+    }
+    return make_file_writer(filename, replace);
+}
+
+unique_ptr<BackupFileWriter> UserBackupDirectory::make_file_writer(const string& filename, bool replace) {
+    bfs::create_directory(incoming_directory_);
+    bfs::path temp_path = incoming_directory_ / bfs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+    if (chunk_store_ == nullptr) {
+        return unique_ptr<PlainBackupFileWriter>(new PlainBackupFileWriter(*this, filename, std::move(temp_path), replace));
+    }
+    if (bfs::create_directory(manifest_directory_)) {
+        sync_directory(directory_);
+    }
+    // The manifest is what's committed to the directory
+    unique_ptr<PlainBackupFileWriter> manifest_writer(new PlainBackupFileWriter(*this, filename, std::move(temp_path), replace, true));
+    return boost::make_unique<ChunkedBackupFileWriter>(*chunk_store_, std::move(manifest_writer), group_committer_);
+}
+
+void UserBackupDirectory::sync_directory(const bfs::path& directory) const {
+    FileDescriptor directory_fd(open_directory(directory));
+    sync_file(group_committer_, directory_fd.get(), directory);
+}
+
+awaitable<void> UserBackupDirectory::async_sync_directory(StorageBackend& storage, const bfs::path& directory) const {
+    FileDescriptor directory_fd(open_directory(directory));
+    co_await async_sync_file(group_committer_, storage, directory_fd.get());
+}
+
+void UserBackupDirectory::replace_backup(const string& filename, const bfs::path& temp_path, const bfs::path& backup_file,
+                                         const FileIndexEntry& entry) {
+    auto lock = file_locks_.lock_exclusive(filename);
+    std::optional<Manifest> old_manifest = read_manifest(filename);
+    if (::rename(temp_path.c_str(), backup_file.c_str()) != 0) {
+        throw FailedToWriteFileException(backup_file);
+    }
+    // The old version may have been the other kind. If it isn't removed, the next scan keeps the newer of the two
+    bfs::path other_file = backup_file == get_manifest_path(filename) ? get_backup_path(filename) : get_manifest_path(filename);
+    ::unlink(other_file.c_str());
+    index_.insert(filename, entry);
+    if (old_manifest) {
+        chunk_store_->release(*old_manifest);
+    }
+    if (pack_store_) {
+        // The old version may have been packed
+        pack_store_->remove(filename);
+    }
+}
+
+void UserBackupDirectory::rename_new_backup(const string& filename, const bfs::path& temp_path, const bfs::path& backup_file,
+                                            const FileIndexEntry& entry) {
+    auto lock = file_locks_.lock_exclusive(filename);
+    if (index_.contains(filename)) {
+        throw FileAlreadyExistsException(get_backup_path(filename));
+    }
+    if (::renameat2(AT_FDCWD, temp_path.c_str(), AT_FDCWD, backup_file.c_str(), RENAME_NOREPLACE) != 0) {
+        if (errno == EEXIST) {
+            throw FileAlreadyExistsException(get_backup_path(filename));
+        }
+        throw FailedToWriteFileException(backup_file);
+    }
+    index_.insert(filename, entry);
+}
+
+UnsyncedPut UserBackupDirectory::pack(const string& filename, const vector<uint8_t>& content, bool replace, bool defer_sync) {
+    auto lock = file_locks_.lock_exclusive(filename);
+    if (!replace && index_.contains(filename)) {
+        throw FileAlreadyExistsException(directory_ / filename);
+    }
+    bool was_packed = pack_store_->contains(filename);
+    // The file of its own that's replaced is removed right away, so the pack has to be durable before that
+    bool replaces_file = replace && !was_packed && index_.contains(filename);
+    UnsyncedPut put{};
+    put.fd = -1;
+    if ((group_committer_ == nullptr && !defer_sync) || replaces_file) {
+        put.entry = pack_store_->put(filename, content.data(), content.size());
+    } else {
+        put = pack_store_->put_unsynced(filename, content.data(), content.size());
+    }
+    if (replace && !was_packed) {
+        // The old version was a file of its own
+        remove_file(filename);
+    }
+    index_.insert(filename, put.entry);
+    return put;
+}
+
+void UserBackupDirectory::unpack(const string& filename, const FileIndexEntry& entry) {
+    auto lock = file_locks_.lock_exclusive(filename);
+    std::optional<FileIndexEntry> current = index_.find(filename);
+    if (!current || current->mtime_ns != entry.mtime_ns || current->size != entry.size) {
+        // Deleted or replaced since it was packed
+        return;
+    }
+    index_.erase(filename);
+    try {
+        pack_store_->remove(filename);
+    } catch (const PackStoreException& e) {
+        // The pack store can't record the removal either. It's out of the index, so it isn't served until a restart
+    }
+}
+
+void UserBackupDirectory::sync_packs(const vector<int>& fds) const {
+    if (group_committer_ == nullptr) {
+        for (int fd : fds) {
+            int result;
+            do {
+                result = ::fdatasync(fd);
+            } while (result != 0 && errno == EINTR);
+            if (result != 0) {
+                throw FailedToWriteFileException(directory_ / ".packs");
+            }
+        }
+        return;
+    }
+    try {
+        group_committer_->sync(fds);
+    } catch (const boost::system::system_error& e) {
+        throw FailedToWriteFileException(directory_ / ".packs");
+    }
+}
+
+void UserBackupDirectory::commit_packed(const string& filename, const vector<uint8_t>& content, bool replace) {
+    UnsyncedPut put = pack(filename, content, replace);
+    if (put.fd >= 0) {
+        FileDescriptor segment(put.fd);
+        try {
+            sync_file(group_committer_, segment.get(), directory_ / filename);
+        } catch (const FailedToWriteFileException& e) {
+            unpack(filename, put.entry);
+            throw;
+        }
+    }
+}
 
-    write_to_file(backup_file, payload);
+awaitable<void> UserBackupDirectory::async_commit_packed(const string& filename, const vector<uint8_t>& content, bool replace) {
+    UnsyncedPut put = pack(filename, content, replace);
+    if (put.fd >= 0) {
+        FileDescriptor segment(put.fd);
+        try {
+            co_await group_committer_->async_sync(segment.get());
+        } catch (const boost::system::system_error& e) {
+            unpack(filename, put.entry);
+            throw;
+        }
+    }
 }
 
 const vector<uint8_t> UserBackupDirectory::get_backup_file_content(const string& filename) const {
-    lock_guard<mutex> lock(mutex_);
+    return open_backup_file(filename)->read_all();
+}
+
+unique_ptr<BackupFileReader> UserBackupDirectory::open_backup_file(const string& filename) const {
+    // Once the file is open, or its chunks are referenced, it can be read even if it's deleted, so the lock isn't needed anymore
+    auto lock = file_locks_.lock_shared(filename);
     bfs::path backup_file = directory_ / filename;
-    if (!bfs::exists(backup_file)) {
+    if (!index_.contains(filename)) {
         throw FileNotFoundException(backup_file);
     }
-    return read_from_file(backup_file);
+    if (pack_store_) {
+        if (auto handle = pack_store_->open(filename)) {
+            return boost::make_unique<PackedBackupFileReader>(std::move(*handle));
+        }
+    }
+    if (auto manifest = read_manifest(filename)) {
+        return boost::make_unique<ChunkedBackupFileReader>(get_manifest_path(filename), std::move(*manifest), *chunk_store_);
+    }
+    return boost::make_unique<PlainBackupFileReader>(std::move(backup_file));
 }
 
 const vector<string> UserBackupDirectory::get_backup_filenames() const {
-    lock_guard<mutex> lock(mutex_);
-    vector<string> filenames;
-    for (const auto& entry : bfs::directory_iterator(directory_)) {
-        filenames.push_back(entry.path().filename().string());
-    }
-    return filenames;
+    return index_.get_filenames();
 }
 
 void UserBackupDirectory::delete_file(const string& filename) {
-    lock_guard<mutex> lock(mutex_);
+    auto lock = file_locks_.lock_exclusive(filename);
     bfs::path backup_file = directory_ / filename;
-    if (!bfs::exists(backup_file)) {
+    if (!index_.contains(filename)) {
         throw FileNotFoundException(backup_file);
     }
-    bool success = bfs::remove(backup_file);
-    if (!success) {
-        throw FailedToDeleteFileException(backup_file);
+    if ((pack_store_ && pack_store_->remove(filename)) || remove_file(filename)) {
+        index_.erase(filename);
+        return;
+    }
+    // Someone removed it behind our back, so the index was wrong about it
+    index_.erase(filename);
+    throw FileNotFoundException(backup_file);
+}
+
+vector<BatchResult> UserBackupDirectory::delete_files(const vector<string>& filenames) {
+    vector<BatchResult> results;
+    results.reserve(filenames.size());
+    for (const auto& filename : filenames) {
+        try {
+            delete_file(filename);
+            results.push_back(BatchResult::DONE);
+        } catch (const FileNotFoundException& e) {
+            results.push_back(BatchResult::NOT_FOUND);
+        } catch (const std::exception& e) {
+            results.push_back(BatchResult::FAILED);
+        }
+    }
+    return results;
+}
+
+bool UserBackupDirectory::remove_file(const string& filename) {
+    std::optional<Manifest> manifest = read_manifest(filename);
+    bfs::path backup_file = manifest ? get_manifest_path(filename) : get_backup_path(filename);
+    if (::unlink(backup_file.c_str()) != 0) {
+        if (errno != ENOENT) {
+            throw FailedToDeleteFileException(backup_file);
+        }
+        return false;
+    }
+    if (manifest) {
+        chunk_store_->release(*manifest);
     }
+    return true;
 }
@@ -1,15 +1,31 @@
 #pragma once
 
+#include <boost/asio/awaitable.hpp>
 #include <boost/filesystem.hpp>
+#include <chrono>
 #include <exception>
-#include <mutex>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "chunk_store.h"
+#include "file_index.h"
+#include "file_lock_table.h"
+#include "group_commit.h"
+#include "manifest.h"
+#include "pack_store.h"
+#include "sha256.h"
+#include "storage_backend.h"
+#include "upload_store.h"
+
 namespace bfs = boost::filesystem;
-using std::mutex;
 using std::runtime_error;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
 /**
@@ -43,21 +59,646 @@ public:
     FailedToDeleteFileException(bfs::path full_path);
 };
 
+class FailedToWriteFileException : public FilePathException {
+public:
+    FailedToWriteFileException(bfs::path full_path);
+};
+
+class FailedToReadFileException : public FilePathException {
+public:
+    FailedToReadFileException(bfs::path full_path);
+};
+
+/**
+ * @brief A filename has to name a file right in the user's directory: it can't have a '/', or be "." or ".."
+ *
+ */
+class InvalidFilenameException : public FilePathException {
+public:
+    InvalidFilenameException(bfs::path full_path);
+};
+
+class UserBackupDirectory;
+
+/**
+ * @brief A piece of a backup file that lies contiguously in a file on disk,
+ * or in memory if it had to be decompressed
+ *
+ */
+struct FileSegment {
+    int fd;
+    uint64_t offset;
+    uint64_t size;
+    // Set when the segment is in memory, and then the fd isn't
+    const uint8_t* data = nullptr;
+};
+
+/**
+ * @brief A piece of a backup file as it's stored on disk, which may be compressed
+ *
+ */
+struct StoredSegment {
+    ChunkEncoding encoding;
+    // The size of the piece once it's decoded
+    uint64_t size;
+    // Where the stored bytes are
+    FileSegment stored;
+};
+
+/**
+ * @brief An open backup file to restore. Its content stays readable through the reader
+ * even if the backup is deleted in the meantime.
+ * The file is exposed as segments of open files, which can be given to the kernel to copy them straight to a socket.
+ *
+ */
+class BackupFileReader {
+public:
+    virtual ~BackupFileReader() = default;
+    BackupFileReader(const BackupFileReader&) = delete;
+    BackupFileReader& operator=(const BackupFileReader&) = delete;
+
+    /**
+     * @brief Read up to size bytes from the offset in the file
+     *
+     * @return size_t The number of bytes read, 0 at the end of the file
+     */
+    virtual size_t read(uint64_t offset, uint8_t* data, size_t size) const = 0;
+    vector<uint8_t> read_all() const;
+
+    /**
+     * @brief Get the segment of the file that starts at the offset. The segment's fd is only valid
+     * until the next call to the reader
+     *
+     */
+    virtual FileSegment get_segment(uint64_t offset) const = 0;
+
+    // The pieces are sent in frames whose sizes are u32, so a file that's stored raw is split into pieces that fit
+    static constexpr uint64_t MAX_STORED_SEGMENT_SIZE = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * @brief Get the pieces of the file as they're stored, to send them without decompressing them.
+     * Like segments, their fds are only valid until the next call to the reader
+     *
+     */
+    virtual size_t get_num_stored_segments() const = 0;
+    virtual StoredSegment get_stored_segment(size_t index) const = 0;
+    // The size of all of the stored segments together
+    virtual uint64_t get_stored_size() const = 0;
+
+    uint64_t size() const { return size_; };
+    const bfs::path& get_path() const { return path_; };
+
+protected:
+    BackupFileReader(bfs::path path, uint64_t size) : path_(std::move(path)), size_(size) {}
+
+    // The pieces of a file that's stored raw, whose content starts at the offset of the fd, or at the data
+    size_t get_num_raw_segments() const;
+    StoredSegment get_raw_segment(size_t index, int fd, uint64_t offset, const uint8_t* data = nullptr) const;
+
+    bfs::path path_;
+    uint64_t size_;
+};
+
+/**
+ * @brief Reads a backup file that's stored as is. Since the file is held open, it can be read after it's deleted
+ *
+ */
+class PlainBackupFileReader : public BackupFileReader {
+public:
+    PlainBackupFileReader(bfs::path path);
+    virtual ~PlainBackupFileReader() override;
+
+    virtual size_t read(uint64_t offset, uint8_t* data, size_t size) const override;
+    virtual FileSegment get_segment(uint64_t offset) const override;
+    virtual size_t get_num_stored_segments() const override { return get_num_raw_segments(); };
+    virtual StoredSegment get_stored_segment(size_t index) const override;
+    virtual uint64_t get_stored_size() const override { return size_; };
+
+    int native_handle() const { return fd_; };
+
+private:
+    int fd_;
+};
+
+/**
+ * @brief Reads a deduplicated backup file from its chunks in the chunk store.
+ * The reader holds a reference to each of the chunks, so they aren't deleted until it's destroyed.
+ * The next few chunks are opened ahead of the one that's read, and the kernel is told to read them ahead too.
+ * Compressed chunks are decompressed a window at a time as they're read in order, and their segments are
+ * in the reader's memory.
+ * A reader may only be used by one thread at a time.
+ *
+ */
+class ChunkedBackupFileReader : public BackupFileReader {
+public:
+    static const size_t READ_AHEAD_CHUNKS = 4;
+    static constexpr size_t DECOMPRESSION_WINDOW_SIZE = 256 * 1024;
+
+    ChunkedBackupFileReader(bfs::path path, Manifest manifest, ChunkStore& chunk_store);
+    virtual ~ChunkedBackupFileReader() override;
+
+    virtual size_t read(uint64_t offset, uint8_t* data, size_t size) const override;
+    virtual FileSegment get_segment(uint64_t offset) const override;
+    virtual size_t get_num_stored_segments() const override { return manifest_.chunks.size(); };
+    virtual StoredSegment get_stored_segment(size_t index) const override;
+    virtual uint64_t get_stored_size() const override { return stored_size_; };
+
+private:
+    size_t find_chunk(uint64_t offset) const;
+    int open_chunk(size_t index) const;
+
+    /**
+     * @brief Get the segment of a compressed chunk that starts at the offset in it.
+     * Reading on from the last window continues to decompress the chunk, anything else starts over
+     *
+     */
+    FileSegment decompress_segment(size_t index, uint64_t chunk_offset) const;
+    void decompress_next_window(size_t index) const;
+
+    Manifest manifest_;
+    ChunkStore& chunk_store_;
+    vector<StoredChunk> stored_chunks_;
+    uint64_t stored_size_;
+    // Where each chunk starts in the file
+    vector<uint64_t> chunk_offsets_;
+    // The fds of the open chunks, -1 for those that aren't open
+    mutable vector<int> chunk_fds_;
+    // The first chunk of the read ahead window, whose chunks are the only ones open
+    mutable size_t window_start_;
+
+    // The compressed chunk that's being decompressed, and its window that was decompressed last
+    mutable unique_ptr<DeflateDecompressor> decompressor_;
+    mutable size_t decompressed_chunk_;
+    mutable uint64_t window_offset_;
+    mutable vector<uint8_t> window_;
+    // Read from the chunk's file, and not decompressed yet
+    mutable vector<uint8_t> compressed_;
+    mutable const uint8_t* compressed_input_;
+    mutable size_t compressed_input_size_;
+    mutable uint64_t compressed_offset_;
+};
+
+/**
+ * @brief Reads a backup file that's packed in a segment of the directory's pack store.
+ * The segment is held open, so the file can be read after it's deleted or its segment is compacted
+ *
+ */
+class PackedBackupFileReader : public BackupFileReader {
+public:
+    PackedBackupFileReader(PackedFileHandle handle);
+    virtual ~PackedBackupFileReader() override;
+
+    virtual size_t read(uint64_t offset, uint8_t* data, size_t size) const override;
+    virtual FileSegment get_segment(uint64_t offset) const override;
+    virtual size_t get_num_stored_segments() const override { return get_num_raw_segments(); };
+    virtual StoredSegment get_stored_segment(size_t index) const override;
+    virtual uint64_t get_stored_size() const override { return size_; };
+
+private:
+    int fd_;
+    // Where the file's content starts in the segment
+    uint64_t offset_;
+};
+
+/**
+ * @brief Writes a new backup file. Nothing is visible in the backup directory until the writer is committed,
+ * and if the writer is destroyed without committing, whatever it wrote is removed.
+ * The async methods do the I/O through a StorageBackend instead of blocking.
+ *
+ */
+class BackupFileWriter {
+public:
+    virtual ~BackupFileWriter() = default;
+    BackupFileWriter(const BackupFileWriter&) = delete;
+    BackupFileWriter& operator=(const BackupFileWriter&) = delete;
+
+    virtual void write(const uint8_t* data, size_t size) = 0;
+    virtual void commit() = 0;
+
+    virtual awaitable<void> async_write(StorageBackend& storage, const uint8_t* data, size_t size) = 0;
+    virtual awaitable<void> async_commit(StorageBackend& storage) = 0;
+
+protected:
+    BackupFileWriter() = default;
+};
+
+/**
+ * @brief Writes a new backup file into a temporary file, and atomically renames it
+ * into the backup directory on commit, so a backup is only visible once it's complete.
+ * The file is synced before the rename and the directory after it, so a committed backup survives a crash.
+ * A writer that replaces a backup renames over the existing file instead of failing when it exists.
+ *
+ */
+class PlainBackupFileWriter : public BackupFileWriter {
+public:
+    /**
+     * @param manifest Whether the file is the manifest of a deduplicated file, which is committed to the directory's
+     * manifests and not with the plain files
+     */
+    PlainBackupFileWriter(UserBackupDirectory& directory, string filename, bfs::path temp_path, bool replace = false,
+                          bool manifest = false);
+    virtual ~PlainBackupFileWriter() override;
+
+    virtual void write(const uint8_t* data, size_t size) override;
+    virtual void commit() override;
+
+    virtual awaitable<void> async_write(StorageBackend& storage, const uint8_t* data, size_t size) override;
+    virtual awaitable<void> async_commit(StorageBackend& storage) override;
+
+    /**
+     * @brief Have the directory's index describe the file as the given content instead of what was written,
+     * for a manifest that stands for the content of a deduplicated file
+     *
+     */
+    void describe_content(uint64_t size, const ContentHash& content_hash);
+
+private:
+    void close();
+    // Called right before closing the file, to know what to put in the directory's index
+    FileIndexEntry stat_entry() const;
+
+    UserBackupDirectory& directory_;
+    string filename_;
+    bfs::path temp_path_;
+    // Where the file is committed to
+    bfs::path backup_file_;
+    int fd_;
+    uint64_t offset_;
+    bool replace_;
+    bool committed_;
+    std::optional<std::pair<uint64_t, ContentHash>> described_content_;
+};
+
+/**
+ * @brief Writes a new deduplicated backup file. The content is split into chunks as it's written,
+ * and each chunk that the chunk store doesn't have yet is written to it. On commit, the manifest
+ * of the chunks is committed as the backup file, once the renames of the new chunks into the store are durable.
+ * How the chunks are compressed is decided by a sample of the start of the backup, which is kept until it's
+ * big enough, or until the commit if the whole backup is smaller than that.
+ * If the writer is destroyed without committing, its references to the chunks are released.
+ *
+ */
+class ChunkedBackupFileWriter : public BackupFileWriter {
+public:
+    ChunkedBackupFileWriter(ChunkStore& chunk_store, unique_ptr<PlainBackupFileWriter> manifest_writer,
+                            GroupCommitter* group_committer = nullptr);
+    virtual ~ChunkedBackupFileWriter() override;
+
+    virtual void write(const uint8_t* data, size_t size) override;
+    virtual void commit() override;
+
+    virtual awaitable<void> async_write(StorageBackend& storage, const uint8_t* data, size_t size) override;
+    virtual awaitable<void> async_commit(StorageBackend& storage) override;
+
+private:
+    /**
+     * @brief Add the start of the data to the sample, and choose how to compress the chunks once the sample
+     * is big enough, or if end is set
+     *
+     * @return size_t How much of the data was added to the sample
+     */
+    size_t sample(const uint8_t* data, size_t size, bool end);
+
+    // Split the data into chunks, and write and publish the new ones. The compression was chosen already
+    void write_chunks(const uint8_t* data, size_t size);
+    awaitable<void> async_write_chunks(StorageBackend& storage, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Find how much of the data belongs to the current chunk, and add it to the chunk's hash.
+     * Opens a new chunk if there is no current one
+     *
+     * @param cut Set to whether the data ends the current chunk
+     * @return size_t How many bytes to write to the current chunk
+     */
+    size_t take(const uint8_t* data, size_t size, bool& cut);
+
+    /**
+     * @brief Add the current chunk to the manifest. If the chunk store already has it, its file is dropped
+     *
+     * @return bool Whether the chunk is new, and should be synced and published
+     */
+    bool end_chunk();
+
+    /**
+     * @brief Get what to write to the chunk's file for data of the chunk, which is the data itself
+     * unless the chunks are compressed
+     *
+     * @param end Whether the data ends the chunk
+     */
+    std::pair<const uint8_t*, size_t> encode(const uint8_t* data, size_t size, bool end);
+    void publish_chunk();
+    void discard_chunk();
+
+    // Sync the directories that the published chunks were renamed into, before the manifest references them
+    void sync_chunk_directories();
+    awaitable<void> async_sync_chunk_directories(StorageBackend& storage);
+    void on_committed();
+
+    ChunkStore& chunk_store_;
+    unique_ptr<PlainBackupFileWriter> manifest_writer_;
+    GroupCommitter* group_committer_;
+    unique_ptr<Chunker> chunker_;
+    utils::Sha256 chunk_hash_;
+    bfs::path chunk_path_;
+    int chunk_fd_;
+    uint32_t chunk_size_;
+    // How much was written to the chunk's file
+    uint32_t chunk_stored_size_;
+    // The start of the backup, which is kept until the compression is chosen from it
+    vector<uint8_t> sample_;
+    std::optional<CompressionLevel> compression_;
+    unique_ptr<DeflateCompressor> compressor_;
+    vector<uint8_t> compressed_;
+    ContentHash last_chunk_hash_;
+    // The chunk store's directories whose entries the published chunks changed, and that aren't synced yet
+    std::set<bfs::path> unsynced_directories_;
+    Manifest manifest_;
+    bool committed_;
+    std::chrono::steady_clock::duration elapsed_;
+};
+
+/**
+ * @brief Writes a new backup file that's packed if it turns out to be small. The content is kept in memory
+ * until it's bigger than what the pack store takes, and from then on it's written by a writer of a file of its own
+ *
+ */
+class PackedBackupFileWriter : public BackupFileWriter {
+public:
+    PackedBackupFileWriter(UserBackupDirectory& directory, string filename, bool replace);
+
+    virtual void write(const uint8_t* data, size_t size) override;
+    virtual void commit() override;
+
+    virtual awaitable<void> async_write(StorageBackend& storage, const uint8_t* data, size_t size) override;
+    virtual awaitable<void> async_commit(StorageBackend& storage) override;
+
+private:
+    // Whether the content so far and the data should go to a file of its own
+    bool should_spill(size_t size) const;
+    void make_spilled_writer();
+
+    UserBackupDirectory& directory_;
+    string filename_;
+    bool replace_;
+    vector<uint8_t> content_;
+    unique_ptr<BackupFileWriter> spilled_;
+};
+
+/**
+ * @brief What happened to a file of a batch of files
+ *
+ */
+enum class BatchResult {
+    DONE,
+    NOT_FOUND,
+    ALREADY_EXISTS,
+    FAILED,
+    // Left out of a batch of restores that would be too big with it
+    TOO_BIG,
+};
+
 /**
  * @brief A class representing a single user's backup directory.
  * Allows a single user to backup, delete and restore files.
+ * The directory is scanned once when it's created, and from then on an in-memory index answers
+ * which files exist, so listing and checking for files don't touch the disk.
+ * Operations lock only the file they work on, so different files of the same user are handled in parallel,
+ * and restores of the same file too. A backup is committed with an atomic rename that never replaces a file,
+ * so it needs no lock while it's being written.
+ * When the directory is given a chunk store, new backups are deduplicated: their chunks are kept in the store,
+ * and the directory only holds their manifests, in a subdirectory of their own. What's a manifest is decided by
+ * where it is and never by its content, so a plain file that looks like a manifest is restored as it is.
+ * Files that were backed up before are still restored as they are.
+ * With packing, small files are appended to the segments of the directory's pack store instead of each taking
+ * a file of its own, and only the bigger ones are stored as files (or manifests).
+ * With a group committer, the syncs of concurrent backups are flushed together instead of each on its own.
  */
 class UserBackupDirectory {
 public:
-    UserBackupDirectory(bfs::path directory);
+    // The subdirectory of the manifests of the deduplicated files
+    static constexpr const char* MANIFEST_DIRECTORY_NAME = ".manifests";
+
+    UserBackupDirectory(bfs::path directory, ChunkStore* chunk_store = nullptr,
+                        std::optional<PackStoreOptions> packing = std::nullopt, GroupCommitter* group_committer = nullptr);
+
+    /**
+     * @brief Create the directory's object with an index that's already known, instead of scanning the directory.
+     * The references of the manifests to the chunk store aren't counted, see restore_chunk_references
+     *
+     */
+    UserBackupDirectory(bfs::path directory, const vector<std::pair<string, FileIndexEntry>>& index_entries,
+                        ChunkStore* chunk_store = nullptr, std::optional<PackStoreOptions> packing = std::nullopt,
+                        GroupCommitter* group_committer = nullptr);
 
     void backup_file(const string& filename, const vector<uint8_t>& payload);
+
+    /**
+     * @brief Back up many files. The files that are small enough to pack are appended first,
+     * and then all of them are synced together, the bigger ones are backed up one by one.
+     * A file that fails doesn't fail the rest of the batch
+     *
+     * @return vector<BatchResult> What happened to each of the files, in order
+     */
+    vector<BatchResult> backup_files(const vector<string>& filenames, const vector<vector<uint8_t>>& payloads);
+
+    /**
+     * @brief Start backing up a file whose content will be written in chunks.
+     * Throws FileAlreadyExistsException right away if the file is already backed up,
+     * and InvalidFilenameException if it can't be
+     *
+     * @param filename The name of the file to backup
+     * @return unique_ptr<BackupFileWriter> Write the content to it and then commit
+     */
+    unique_ptr<BackupFileWriter> begin_backup(const string& filename);
+
+    /**
+     * @brief Start writing a new version of a backed up file, which atomically replaces it on commit.
+     * Restores that already opened the old version keep reading it.
+     * Throws FileNotFoundException if the file isn't backed up
+     *
+     */
+    unique_ptr<BackupFileWriter> begin_replace(const string& filename);
     const vector<uint8_t> get_backup_file_content(const string& filename) const;
+
+    /**
+     * @brief Start an upload of a file that's sent in parts, which can be resumed if it's cut off.
+     * See UploadStore. Throws FileAlreadyExistsException if the file is already backed up,
+     * and InvalidFilenameException if it can't be
+     *
+     */
+    UploadStatus begin_upload(const string& filename, uint64_t size);
+    UploadStatus write_upload_part(UploadToken token, uint64_t offset, const uint8_t* data, size_t size);
+    UploadStatus get_upload_status(UploadToken token) const;
+
+    /**
+     * @brief Back up the file of a complete upload, like any other backup. An upload that isn't complete
+     * is left as it is, and so is one whose file was backed up meanwhile (FileAlreadyExistsException).
+     * A file that's stored as it is, neither deduplicated nor packed, is renamed into place instead of copied
+     *
+     * @return UploadStatus The upload's status, which says which parts are missing if it isn't complete
+     */
+    UploadStatus finish_upload(UploadToken token);
+    const UploadStore& get_upload_store() const { return *upload_store_; };
+
+    /**
+     * @brief Open a backup file for restoring it without reading it all into memory.
+     * Throws FileNotFoundException if there is no such backup file
+     *
+     */
+    unique_ptr<BackupFileReader> open_backup_file(const string& filename) const;
     const vector<string> get_backup_filenames() const;
     void delete_file(const string& filename);
 
+    /**
+     * @brief Delete many files. A file that fails doesn't fail the rest of the batch
+     *
+     * @return vector<BatchResult> What happened to each of the files, in order
+     */
+    vector<BatchResult> delete_files(const vector<string>& filenames);
+
+    /**
+     * @brief Count the references of the directory's manifests in the chunk store.
+     * Needed on startup when the index wasn't scanned, unless the chunk store's counts were loaded as well
+     *
+     */
+    void restore_chunk_references() const;
+
+    const FileIndex& get_index() const { return index_; };
+
+    /**
+     * @brief Keep the directory's filenames in a membership filter. See FileIndex::set_filter
+     *
+     */
+    void set_lookup_filter(MembershipFilter* filter, uint64_t seed) { index_.set_filter(filter, seed); };
+
+    /**
+     * @brief The store of the directory's small files, or nullptr without packing
+     *
+     */
+    const PackStore* get_pack_store() const { return pack_store_.get(); };
+
+    /**
+     * @brief Compact the segments of the pack store that are mostly deleted
+     *
+     * @return size_t How many segments were compacted
+     */
+    size_t compact_packs() { return pack_store_ ? pack_store_->compact() : 0; };
+
 private:
+    friend class PlainBackupFileWriter;
+    friend class PackedBackupFileWriter;
+    bfs::path get_backup_path(const string& filename) const { return directory_ / filename; };
+    bfs::path get_manifest_path(const string& filename) const { return manifest_directory_ / filename; };
+
+    /**
+     * @brief Rename a new version of a file over the backed up one, and release the chunks of the old version.
+     * The old version is removed even if it's a plain file and the new one is a manifest, or the other way around
+     *
+     * @param backup_file Where the new version goes, the file's plain path or its manifest path
+     */
+    void replace_backup(const string& filename, const bfs::path& temp_path, const bfs::path& backup_file,
+                        const FileIndexEntry& entry);
+
+    /**
+     * @brief Rename a new backup into place and add it to the index, under the file's lock. A packed file has no
+     * file of its own that the rename would fail on, so the index is checked under the lock too
+     *
+     * @param backup_file Where the backup goes, the file's plain path or its manifest path
+     */
+    void rename_new_backup(const string& filename, const bfs::path& temp_path, const bfs::path& backup_file,
+                           const FileIndexEntry& entry);
+
+    /**
+     * @brief Sync the entries of the directory, or of its manifests, after a backup was renamed into it
+     *
+     */
+    void sync_directory(const bfs::path& directory) const;
+
+    /**
+     * @brief Commit the file of a finished upload as the backup file, by renaming it into the directory
+     *
+     */
+    void commit_upload_file(const string& filename, int fd, const bfs::path& data_path);
+    awaitable<void> async_sync_directory(StorageBackend& storage, const bfs::path& directory) const;
+    unique_ptr<BackupFileWriter> make_writer(const string& filename, bool replace);
+
+    /**
+     * @brief Make a writer of a file of its own, which is deduplicated if there's a chunk store
+     *
+     */
+    unique_ptr<BackupFileWriter> make_file_writer(const string& filename, bool replace);
+
+    /**
+     * @brief Pack a small file, replacing the backed up file of the same name if replace is set.
+     * With group commit, the pack is synced once the file's lock is released, unless it replaces a file of its own,
+     * which is only removed once the pack is synced
+     *
+     */
+    void commit_packed(const string& filename, const vector<uint8_t>& content, bool replace);
+    awaitable<void> async_commit_packed(const string& filename, const vector<uint8_t>& content, bool replace);
+
+    /**
+     * @brief Append a small file to the pack store and add it to the index, under the file's lock
+     *
+     * @param defer_sync Leave the sync to the caller even without group commit. A replace of a file of its own
+     * is always synced here
+     * @return UnsyncedPut The file's entry in the index, and an fd of the segment that should still be synced,
+     * or -1 if the pack was synced already
+     */
+    UnsyncedPut pack(const string& filename, const vector<uint8_t>& content, bool replace, bool defer_sync = false);
+
+    /**
+     * @brief Take a file whose pack failed to sync back out of the pack store and the index,
+     * unless it was deleted or replaced since it was packed as entry
+     *
+     */
+    void unpack(const string& filename, const FileIndexEntry& entry);
+
+    /**
+     * @brief Sync the segments of packs whose sync was deferred, together. Each segment should be given once,
+     * however many files were packed into it
+     *
+     */
+    void sync_packs(const vector<int>& fds) const;
+
+    /**
+     * @brief Remove the file of a backup that isn't packed, and release its chunks. Called with the file's lock held
+     *
+     * @return bool Whether there was such a file
+     */
+    bool remove_file(const string& filename);
+
+    /**
+     * @brief Index the plain files and the manifests. Only the manifests are read, the plain files are only listed.
+     * If a crash left a file both as a plain file and as a manifest, the newer of the two is kept
+     *
+     */
+    void scan_directory();
+    void scan_manifests();
+
+    /**
+     * @brief Add the packed files to the index after a scan. If a crash left a file both packed and
+     * as a file of its own, the newer of the two is kept
+     *
+     */
+    void merge_packed_files();
+
+    /**
+     * @brief Read the manifest of a backed up file. Returns nothing if the file isn't deduplicated
+     *
+     */
+    std::optional<Manifest> read_manifest(const string& filename) const;
+
     bfs::path directory_;
-    // Operations on the directory should be synchronized
-    mutable mutex mutex_;
+    // Uploads in progress are written here, so they don't show up as backup files
+    bfs::path incoming_directory_;
+    // The manifests of the deduplicated files, named as the files are
+    bfs::path manifest_directory_;
+    ChunkStore* chunk_store_;
+    // Syncs the backups, or nullptr to sync each of them on its own
+    GroupCommitter* group_committer_;
+    unique_ptr<PackStore> pack_store_;
+    unique_ptr<UploadStore> upload_store_;
+    FileIndex index_;
+    mutable FileLockTable file_locks_;
 };